@@ -1,13 +1,45 @@
 // free bitmap for OS file systems assignment
 
 #include "bitmap.h"
+#include "sfs_stats.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 
+/*
+ * Free bitmap of a volume
+ * free_bit_map     one bit per block, set when the block is free
+ * len              size of the bitmap in bytes
+ * free_blocks      free blocks
+ * first_free       first byte that may hold a free bit
+ * changed_first    first byte changed since bitmap_take_changed, past changed_last if none
+ * changed_last     last byte changed since bitmap_take_changed
+ * chunk_loaded     one flag per part of the bitmap read from the disk, see bitmap_defer
+ * chunk_shift      log2 of the size of a part
+ * loader           reads a part
+ */
+struct bitmap {
+    uint8_t *free_bit_map;
+    uint32_t len;
+    uint32_t free_blocks;
+    uint32_t first_free;
+    uint32_t changed_first;
+    uint32_t changed_last;
+    uint8_t *chunk_loaded;
+    int chunk_shift;
+    bitmap_loader_t loader;
+};
+
+#define BITMAP_EMPTY { NULL, 0, 0, 0, UINT32_MAX, 0, NULL, 0, NULL }
+
+
 /* globals */
-uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
+static bitmap_t default_bitmap = BITMAP_EMPTY;
+
+// bitmap of the volume the calling thread works on
+static __thread bitmap_t *bm = &default_bitmap;
 
 /* macros */
 #define FREE_BIT(_data, _which_bit) \
@@ -16,6 +48,82 @@ uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
 #define USE_BIT(_data, _which_bit) \
     _data = _data & ~(1 << _which_bit)
 
+#define IS_FREE(_data, _which_bit) \
+    (((_data) >> (_which_bit)) & 1)
+
+
+
+/**
+ * @brief Make sure the chunk holding a byte of the bitmap is in memory
+ * @param uint32_t Index of the byte
+ * @retval int Return zero if the byte can be used
+ */
+static int load_chunk(uint32_t i) {
+    uint32_t chunk = i >> bm->chunk_shift;
+
+    if (bm->chunk_loaded == NULL || bm->chunk_loaded[chunk]) {
+        return 0;
+    }
+    if (bm->loader(chunk << bm->chunk_shift, 1u << bm->chunk_shift) != 0) {
+        printf("SFS > Could not read the free bitmap!\n");
+        return -1;
+    }
+    bm->chunk_loaded[chunk] = 1;
+    return 0;
+}
+
+
+
+static void changed(uint32_t i) {
+    if (i < bm->changed_first) {
+        bm->changed_first = i;
+    }
+    if (i > bm->changed_last) {
+        bm->changed_last = i;
+    }
+}
+
+
+
+void bitmap_init(uint32_t num_blocks, uint32_t len) {
+    free(bm->free_bit_map);
+    free(bm->chunk_loaded);
+    bm->chunk_loaded = NULL;
+    bm->loader = NULL;
+    bm->free_bit_map = malloc(len);
+    if (bm->free_bit_map == NULL) {
+        printf("SFS > Out of memory!\n");
+        exit(-1);
+    }
+    bm->len = len;
+    memset(bm->free_bit_map, UINT8_MAX, len);
+    bm->free_blocks = (uint32_t) len * 8;
+    bm->first_free = 0;
+
+    // the bits past the end of the disk are never free
+    uint32_t i;
+    for (i = num_blocks; i < len * 8; i++) {
+        force_set_index(i);
+    }
+    bm->changed_first = UINT32_MAX;
+    bm->changed_last = 0;
+}
+
+
+
+int bitmap_defer(uint32_t chunk, bitmap_loader_t load, uint32_t free_count, uint32_t first_free_byte) {
+    free(bm->chunk_loaded);
+    bm->chunk_loaded = calloc(bm->len / chunk, 1);
+    if (bm->chunk_loaded == NULL) {
+        return -1;
+    }
+    bm->chunk_shift = __builtin_ctz(chunk);
+    bm->loader = load;
+    bm->free_blocks = free_count;
+    bm->first_free = first_free_byte;
+    return 0;
+}
+
 
 
 void force_set_index(uint32_t index) {
@@ -26,26 +134,52 @@ void force_set_index(uint32_t index) {
     // get which bit to free
     uint8_t bit = index % 8;
 
+    if (load_chunk(i) != 0 || !IS_FREE(bm->free_bit_map[i], bit)) {
+        return;
+    }
+
     // Use bit
-    USE_BIT(free_bit_map[i], bit);
+    USE_BIT(bm->free_bit_map[i], bit);
+    bm->free_blocks--;
+    changed(i);
 }
 
 
 
 uint32_t get_index() {
-    uint32_t i = 0;
+    uint32_t i = bm->first_free;
 
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) {
-        i++; }
+    if (bm->free_blocks == 0) {
+        return NO_BLOCK;
+    }
+
+    // find the first section with a free bit, no byte before first_free has one
+    while (i < bm->len) {
+        if (load_chunk(i) != 0) {
+            i = bm->len;
+            break;
+        }
+        if (bm->free_bit_map[i] != 0) {
+            break;
+        }
+        i++;
+    }
+    if (i == bm->len) {
+        stats_bitmap_scan(i - bm->first_free);
+        return NO_BLOCK;
+    }
 
     // now, find the first free bit
     // ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+    uint8_t bit = ffs(bm->free_bit_map[i]) - 1;
+
+    stats_bitmap_scan(i - bm->first_free + 1);
+    bm->first_free = i;
 
     // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+    USE_BIT(bm->free_bit_map[i], bit);
+    bm->free_blocks--;
+    changed(i);
 
     //return which bit we used
     return i*8 + bit;
@@ -53,6 +187,56 @@ uint32_t get_index() {
 
 
 
+uint32_t get_run(uint32_t want, uint32_t *len) {
+    uint32_t i, start = 0, run = 0, best = 0, best_len = 0;
+    uint8_t bit;
+
+    *len = 0;
+    if (bm->free_blocks == 0) {
+        return NO_BLOCK;
+    }
+
+    for (i = bm->first_free; i < bm->len && best_len < want; i++) {
+        if (load_chunk(i) != 0) {
+            break;
+        }
+
+        // a full byte ends the run at once
+        if (bm->free_bit_map[i] == 0) {
+            run = 0;
+            continue;
+        }
+        for (bit = 0; bit < 8 && best_len < want; bit++) {
+            if (!IS_FREE(bm->free_bit_map[i], bit)) {
+                run = 0;
+                continue;
+            }
+            if (run++ == 0) {
+                start = i * 8 + bit;
+            }
+            if (run > best_len) {
+                best = start;
+                best_len = run;
+            }
+        }
+    }
+    stats_bitmap_scan(i - bm->first_free);
+    if (best_len == 0) {
+        return NO_BLOCK;
+    }
+
+    // set the bits to used
+    for (i = best; i < best + best_len; i++) {
+        USE_BIT(bm->free_bit_map[i / 8], i % 8);
+        changed(i / 8);
+    }
+    bm->free_blocks -= best_len;
+    *len = best_len;
+    return best;
+}
+
+
+
 void rm_index(uint32_t index) {
 
     // get index in array of which bit to free
@@ -61,12 +245,114 @@ void rm_index(uint32_t index) {
     // get which bit to free
     uint8_t bit = index % 8;
 
+    if (load_chunk(i) != 0 || IS_FREE(bm->free_bit_map[i], bit)) {
+        return;
+    }
+
     // free bit
-    FREE_BIT(free_bit_map[i], bit);
+    FREE_BIT(bm->free_bit_map[i], bit);
+    bm->free_blocks++;
+    if (i < bm->first_free) {
+        bm->first_free = i;
+    }
+    changed(i);
 }
 
 
 
 uint8_t* get_bitmap(void) {
-    return free_bit_map;
+    return bm->free_bit_map;
+}
+
+
+
+uint32_t get_bitmap_len(void) {
+    return bm->len;
+}
+
+
+
+int bitmap_load_all(void) {
+    uint32_t i;
+
+    for (i = 0; bm->chunk_loaded != NULL && i < bm->len; i += 1u << bm->chunk_shift) {
+        if (load_chunk(i) != 0) {
+            return -1;
+        }
+    }
+    free(bm->chunk_loaded);
+    bm->chunk_loaded = NULL;
+    return 0;
+}
+
+
+
+void bitmap_recount(void) {
+    uint32_t i;
+
+    bm->free_blocks = 0;
+    bm->first_free = bm->len;
+    for (i = bm->len; i-- > 0; ) {
+        bm->free_blocks += __builtin_popcount(bm->free_bit_map[i]);
+        if (bm->free_bit_map[i] != 0) {
+            bm->first_free = i;
+        }
+    }
+    if (bm->first_free == bm->len) {
+        bm->first_free = 0;
+    }
+}
+
+
+
+uint32_t bitmap_free(void) {
+    return bm->free_blocks;
+}
+
+
+
+uint32_t bitmap_first_free(void) {
+    return bm->first_free;
+}
+
+
+
+int bitmap_take_changed(uint32_t *first, uint32_t *last) {
+    if (bm->changed_first > bm->changed_last) {
+        return 0;
+    }
+    *first = bm->changed_first;
+    *last = bm->changed_last;
+    bm->changed_first = UINT32_MAX;
+    bm->changed_last = 0;
+    return 1;
+}
+
+
+
+bitmap_t *bitmap_new(void) {
+    bitmap_t *b = malloc(sizeof(bitmap_t));
+    bitmap_t empty = BITMAP_EMPTY;
+
+    if (b != NULL) {
+        *b = empty;
+    }
+    return b;
+}
+
+
+
+void bitmap_destroy(bitmap_t *b) {
+    if (b == NULL || b == &default_bitmap) {
+        return;
+    }
+    free(b->free_bit_map);
+    free(b->chunk_loaded);
+    free(b);
+}
+
+
+
+void bitmap_use(bitmap_t *b) {
+    bm = b != NULL ? b : &default_bitmap;
 }
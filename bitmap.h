@@ -4,7 +4,56 @@
 #include <stdint.h>
 #include "sfs_api.h"
 
-#define SIZE (NUM_BLOCKS/8)
+/*
+ * @short read part of the bitmap from the disk into get_bitmap()
+ * @param first first byte to read
+ * @param len   number of bytes
+ * @return 0 on success, -1 if the disk failed
+ */
+typedef int (*bitmap_loader_t)(uint32_t first, uint32_t len);
+
+/* free bitmap of a volume, see sfs_new */
+typedef struct bitmap bitmap_t;
+
+/*
+ * @short make the free bitmap of a new volume, sized by bitmap_init
+ * @return the bitmap, NULL if out of memory
+ */
+bitmap_t *bitmap_new(void);
+
+/*
+ * @short free the bitmap of a volume, no thread may still use it
+ */
+void bitmap_destroy(bitmap_t *b);
+
+/*
+ * @short make the calling thread work on the bitmap of a volume
+ * @long Every thread starts on the bitmap of the default volume, NULL goes
+ *       back to it. The other calls work on the bitmap of the thread.
+ */
+void bitmap_use(bitmap_t *b);
+
+/*
+ * @short size the bitmap for a disk, every block starts free
+ * @param num_blocks number of blocks on the disk
+ * @param len size of the bitmap in bytes, at least num_blocks / 8 rounded up
+ */
+void bitmap_init(uint32_t num_blocks, uint32_t len);
+
+/*
+ * @short leave the bitmap on the disk until it is used
+ * @long Call it after bitmap_init. Each chunk of the bitmap is read with
+ *       load the first time a bit in it is looked at or changed. The free
+ *       block count and the first byte holding a free bit come from the
+ *       last checkpoint, so that get_index skips the full chunks.
+ *
+ * @param chunk            size of a chunk in bytes, a power of two dividing the bitmap
+ * @param load             reads a chunk
+ * @param free_count       number of free blocks
+ * @param first_free_byte  no byte before it holds a free bit
+ * @return 0 on success, -1 if out of memory
+ */
+int bitmap_defer(uint32_t chunk, bitmap_loader_t load, uint32_t free_count, uint32_t first_free_byte);
 
 /*
  * @short force an index to be set.
@@ -18,10 +67,21 @@ void force_set_index(uint32_t index);
 
 /*
  * @short find the first free data block
- * @return index of data block to use
+ * @return index of data block to use, NO_BLOCK if the disk is full
  */
 uint32_t get_index();
 
+/*
+ * @short take a run of free blocks that follow each other on disk
+ * @long The first run of want free blocks is taken, or the longest one
+ *       there is if none is that long.
+ *
+ * @param want  number of blocks wanted, at least one
+ * @param len   set to the number of blocks taken
+ * @return first block of the run, NO_BLOCK if the disk is full
+ */
+uint32_t get_run(uint32_t want, uint32_t *len);
+
 /*
  * @short frees an index
  * @param index the index to free
@@ -30,6 +90,40 @@ void rm_index(uint32_t index);
 
 uint8_t* get_bitmap(void);
 
+/*
+ * @short size of the bitmap in bytes
+ */
+uint32_t get_bitmap_len(void);
+
+/*
+ * @short read every chunk bitmap_defer left on the disk
+ * @return 0 on success, -1 if the disk failed
+ */
+int bitmap_load_all(void);
+
+/*
+ * @short count the free blocks again, after get_bitmap() was filled by hand
+ */
+void bitmap_recount(void);
+
+/*
+ * @short number of free blocks
+ */
+uint32_t bitmap_free(void);
+
+/*
+ * @short first byte of the bitmap that may hold a free bit
+ */
+uint32_t bitmap_first_free(void);
+
+/*
+ * @short bytes of the bitmap changed since the last call
+ * @param first  set to the first changed byte
+ * @param last   set to the last changed byte
+ * @return 1 if some byte changed, 0 otherwise
+ */
+int bitmap_take_changed(uint32_t *first, uint32_t *last);
+
 #endif //_INCLUDE_BITMAP_H_
 
 
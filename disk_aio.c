@@ -0,0 +1,1122 @@
+
+// asynchronous block I/O engine for disk_emu, with an elevator in front of the backends
+
+#include "disk_aio.h"
+#include "disk_emu.h"
+#include "sfs_stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+
+typedef enum {
+    AIO_NONE,
+    AIO_SYNC,
+    AIO_THREADS,
+    AIO_URING
+} aio_kind_t;
+
+typedef enum {
+    REQ_READ,
+    REQ_WRITE,
+    REQ_FLUSH
+} req_op_t;
+
+/*
+ * op       what to do
+ * start    first block
+ * nblocks  number of blocks
+ * buf      data of the request
+ * cb       completion callback
+ * arg      argument of cb
+ * result   see aio_callback_t
+ * st       when the request was submitted
+ * next     next request of the same I/O
+ */
+typedef struct aio_req {
+    req_op_t op;
+    int start;
+    int nblocks;
+    void *buf;
+    aio_callback_t cb;
+    void *arg;
+    int result;
+    stats_ctx_t st;
+    struct aio_req *next;
+} aio_req_t;
+
+/*
+ * What a backend runs: one request, or requests next to each other on the
+ * disk merged into a single vectored read or write.
+ *
+ * op       what to do
+ * sync     if someone waits for it, it then goes before the background I/O
+ * start    first block of the whole I/O
+ * nblocks  number of blocks of the whole I/O
+ * reqs     requests in block order, linked by their next field
+ * last     last request of reqs
+ * nreqs    number of requests
+ * iov      one buffer per request, when there are several
+ * result   bytes moved, or a negative errno
+ * ready    when the emulated device completes it, its completion is held until then
+ * next     next I/O in a queue
+ */
+typedef struct aio_io {
+    req_op_t op;
+    int sync;
+    int start;
+    int nblocks;
+    aio_req_t *reqs;
+    aio_req_t *last;
+    int nreqs;
+    struct iovec *iov;
+    int result;
+    uint64_t ready;
+    struct aio_io *next;
+} aio_io_t;
+
+/*
+ * FIFO of I/Os
+ */
+typedef struct {
+    aio_io_t *head;
+    aio_io_t *tail;
+} io_queue_t;
+
+/*
+ * io_uring rings, mapped from the kernel
+ */
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} uring_t;
+
+/* maximum number of threads of the thread pool */
+#define AIO_MAX_THREADS 16
+
+/* most requests and blocks merged into one I/O */
+#define AIO_MAX_MERGE 64
+#define AIO_MAX_MERGE_BYTES (1024 * 1024)
+
+
+/*
+ * Engine of a volume
+ * kind                 running backend
+ * depth                most requests in flight at once
+ * inflight             requests submitted and not completed
+ * batching             aio_batch_begin calls not ended yet, requests are not dispatched
+ * fd                   image
+ * block_size           size of a block of the image
+ * disk                 disk of the volume, the I/O threads charge its device model
+ * queued               I/Os waiting in the scheduler
+ * dispatched           I/Os handed to the backend
+ * dispatched_async     of which from the async queue
+ * elevator_pos         block after the last I/O dispatched from the async queue
+ * lock                 held to change the queues
+ * work_cond            signalled when an I/O is pending for the threads
+ * done_cond            signalled when a thread finished an I/O
+ * pending              I/Os for the threads
+ * done                 I/Os finished, not completed yet
+ * sync_queue           reads someone waits for, in FIFO order
+ * async_queue          the rest, sorted by block
+ * threads              thread pool of the threads backend
+ * nthreads             number of threads
+ * stopping             tells the threads to exit
+ * ring                 rings of the uring backend
+ */
+struct aio_engine {
+    aio_kind_t kind;
+    int depth;
+    int inflight;
+    int batching;
+    int fd;
+    int block_size;
+    disk_t *disk;
+    int queued;
+    int dispatched;
+    int dispatched_async;
+    int elevator_pos;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    io_queue_t pending;
+    io_queue_t done;
+    io_queue_t sync_queue;
+    io_queue_t async_queue;
+    pthread_t threads[AIO_MAX_THREADS];
+    int nthreads;
+    int stopping;
+    uring_t ring;
+};
+
+#define AIO_ENGINE_EMPTY { AIO_NONE, 0, 0, 0, -1, 0, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, \
+                           PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+
+/* globals */
+static aio_engine_t default_engine = AIO_ENGINE_EMPTY;
+
+// engine of the volume the calling thread works on
+static __thread aio_engine_t *eng = &default_engine;
+
+
+
+static void queue_push(io_queue_t *q, aio_io_t *io) {
+    io->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = io;
+    } else {
+        q->head = io;
+    }
+    q->tail = io;
+}
+
+
+
+static aio_io_t *queue_pop(io_queue_t *q) {
+    aio_io_t *io = q->head;
+    if (io != NULL) {
+        q->head = io->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return io;
+}
+
+
+
+/**
+ * @brief Run an I/O with a blocking system call
+ * @param aio_io_t* I/O to run, its result is set
+ * @retval None
+ */
+static void run_io(aio_io_t *io) {
+    size_t len = (size_t) io->nblocks * eng->block_size;
+    off_t off = (off_t) io->start * eng->block_size;
+    ssize_t n;
+
+    // the emulated device may give up on the request
+    if (io->op != REQ_FLUSH && disk_delay(io->start, io->nblocks) != 0) {
+        io->result = -EIO;
+        return;
+    }
+
+    switch (io->op) {
+        case REQ_READ:
+            n = io->iov != NULL ? preadv(eng->fd, io->iov, io->nreqs, off)
+                                : pread(eng->fd, io->reqs->buf, len, off);
+            break;
+        case REQ_WRITE:
+            n = io->iov != NULL ? pwritev(eng->fd, io->iov, io->nreqs, off)
+                                : pwrite(eng->fd, io->reqs->buf, len, off);
+            break;
+        default:
+            n = fdatasync(eng->fd);
+            break;
+    }
+    io->result = n < 0 ? -errno : (int) n;
+}
+
+
+
+/**
+ * @brief Turn the byte count of a finished request into its result, and account for it
+ * @param aio_req_t* Finished request
+ * @retval None
+ */
+static void finish_request(aio_req_t *req) {
+    if (req->op == REQ_FLUSH || req->result < 0) {
+        if (req->op != REQ_FLUSH) {
+            stats_end(req->op == REQ_READ ? STAT_READ_BLOCKS : STAT_WRITE_BLOCKS, &req->st,
+                      -1, 0);
+        }
+        return;
+    }
+
+    int bytes = req->result;
+    size_t len = (size_t) req->nblocks * eng->block_size;
+
+    // the image may be shorter than the disk, the missing blocks read as zeros
+    if (req->op == REQ_READ && (size_t) bytes < len) {
+        memset((char *) req->buf + bytes, 0, len - bytes);
+        bytes = (int) len;
+    }
+
+    req->result = bytes / eng->block_size;
+    stats_blocks(req->result);
+    stats_end(req->op == REQ_READ ? STAT_READ_BLOCKS : STAT_WRITE_BLOCKS, &req->st, 0,
+              (uint64_t) req->result * eng->block_size);
+}
+
+
+
+static void *worker(void *arg) {
+    eng = arg;
+    disk_use(eng->disk);
+
+    pthread_mutex_lock(&eng->lock);
+    while (1) {
+        aio_io_t *io;
+        while ((io = queue_pop(&eng->pending)) == NULL && !eng->stopping) {
+            pthread_cond_wait(&eng->work_cond, &eng->lock);
+        }
+        if (io == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&eng->lock);
+
+        run_io(io);
+
+        pthread_mutex_lock(&eng->lock);
+        queue_push(&eng->done, io);
+        pthread_cond_broadcast(&eng->done_cond);
+    }
+    pthread_mutex_unlock(&eng->lock);
+    return NULL;
+}
+
+
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    uring_t *ring = &eng->ring;
+    return (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+
+/**
+ * @brief Set up the io_uring rings
+ * @param unsigned Number of submission queue entries
+ * @retval int Return zero on success
+ */
+static int uring_setup(unsigned entries) {
+    uring_t *ring = &eng->ring;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings at once
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+
+
+static void uring_teardown(void) {
+    uring_t *ring = &eng->ring;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+
+
+/**
+ * @brief Put an I/O on the submission ring, the lock is held
+ * @param aio_io_t* I/O to queue
+ * @retval None
+ */
+static void uring_queue(aio_io_t *io) {
+    uring_t *ring = &eng->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = eng->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) io;
+    switch (io->op) {
+        case REQ_READ:
+            sqe->opcode = io->iov != NULL ? IORING_OP_READV : IORING_OP_READ;
+            break;
+        case REQ_WRITE:
+            sqe->opcode = io->iov != NULL ? IORING_OP_WRITEV : IORING_OP_WRITE;
+            break;
+        default:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+    }
+    if (io->op != REQ_FLUSH) {
+        if (io->iov != NULL) {
+            sqe->addr = (uint64_t) (uintptr_t) io->iov;
+            sqe->len = (uint32_t) io->nreqs;
+        } else {
+            sqe->addr = (uint64_t) (uintptr_t) io->reqs->buf;
+            sqe->len = (uint32_t) ((size_t) io->nblocks * eng->block_size);
+        }
+        sqe->off = (uint64_t) io->start * eng->block_size;
+    }
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+
+
+/**
+ * @brief Hand the queued requests to the kernel, the lock is held
+ * @retval None
+ */
+static void uring_submit(void) {
+    uring_t *ring = &eng->ring;
+    while (ring->to_submit > 0) {
+        int n = uring_enter(ring->to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            printf("SFS > io_uring_enter failed: %s\n", strerror(errno));
+            return;
+        }
+        ring->to_submit -= n;
+    }
+}
+
+
+
+/**
+ * @brief Move the completed requests of the completion ring to the done queue, the lock is held
+ * @retval None
+ */
+static void uring_reap(void) {
+    uring_t *ring = &eng->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        aio_io_t *io = (aio_io_t *) (uintptr_t) cqe->user_data;
+        io->result = cqe->res;
+        queue_push(&eng->done, io);
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+
+static void stop_threads(void) {
+    int i;
+
+    pthread_mutex_lock(&eng->lock);
+    eng->stopping = 1;
+    pthread_cond_broadcast(&eng->work_cond);
+    pthread_mutex_unlock(&eng->lock);
+
+    for (i = 0; i < eng->nthreads; i++) {
+        pthread_join(eng->threads[i], NULL);
+    }
+    eng->nthreads = 0;
+    eng->stopping = 0;
+}
+
+
+
+int aio_init(const char *backend, int queue_depth) {
+    int i;
+
+    aio_shutdown();
+
+    eng->fd = disk_fd();
+    eng->block_size = disk_block_size();
+    eng->disk = disk_current();
+    eng->depth = queue_depth > 0 ? queue_depth : AIO_DEFAULT_DEPTH;
+    eng->elevator_pos = 0;
+    if (eng->fd < 0) {
+        return -1;
+    }
+
+    if (backend == NULL || strcmp(backend, "auto") == 0 || strcmp(backend, "uring") == 0) {
+        if (uring_setup(eng->depth) == 0) {
+            eng->kind = AIO_URING;
+            return 0;
+        }
+        if (backend != NULL && strcmp(backend, "uring") == 0) {
+            printf("SFS > io_uring is not available: %s\n", strerror(errno));
+            return -1;
+        }
+        backend = "threads";
+    }
+
+    if (strcmp(backend, "threads") == 0) {
+        int want = eng->depth < AIO_MAX_THREADS ? eng->depth : AIO_MAX_THREADS;
+        for (i = 0; i < want; i++) {
+            if (pthread_create(&eng->threads[eng->nthreads], NULL, worker, eng) != 0) {
+                break;
+            }
+            eng->nthreads++;
+        }
+        if (eng->nthreads == 0) {
+            printf("SFS > Could not start the I/O threads\n");
+            return -1;
+        }
+        eng->kind = AIO_THREADS;
+        return 0;
+    }
+
+    if (strcmp(backend, "sync") == 0) {
+        eng->kind = AIO_SYNC;
+        return 0;
+    }
+
+    printf("SFS > Unknown I/O backend %s\n", backend);
+    return -1;
+}
+
+
+
+void aio_shutdown(void) {
+    if (eng->kind == AIO_NONE) {
+        return;
+    }
+
+    aio_drain();
+
+    if (eng->kind == AIO_THREADS) {
+        stop_threads();
+    } else if (eng->kind == AIO_URING) {
+        uring_teardown();
+    }
+    eng->kind = AIO_NONE;
+    eng->batching = 0;
+}
+
+
+
+const char *aio_backend(void) {
+    switch (eng->kind) {
+        case AIO_SYNC: return "sync";
+        case AIO_THREADS: return "threads";
+        case AIO_URING: return "uring";
+        default: return "none";
+    }
+}
+
+
+
+static aio_io_t *new_io(aio_req_t *req, int sync) {
+    aio_io_t *io = malloc(sizeof(aio_io_t));
+    if (io == NULL) {
+        return NULL;
+    }
+    io->op = req->op;
+    io->sync = sync;
+    io->start = req->start;
+    io->nblocks = req->nblocks;
+    io->reqs = io->last = req;
+    io->nreqs = 1;
+    io->iov = NULL;
+    io->result = 0;
+    io->ready = 0;
+    io->next = NULL;
+    req->next = NULL;
+    return io;
+}
+
+
+
+/**
+ * @brief Tell if a request can join an I/O waiting in the scheduler
+ * @param aio_io_t* I/O
+ * @param aio_req_t* Request
+ * @retval int Return 1 if the request goes right after the I/O, -1 if right before, 0 if neither
+ */
+static int can_merge(const aio_io_t *io, const aio_req_t *req) {
+    if (io->op != req->op || io->op == REQ_FLUSH || io->nreqs >= AIO_MAX_MERGE
+        || (size_t) (io->nblocks + req->nblocks) * eng->block_size > AIO_MAX_MERGE_BYTES) {
+        return 0;
+    }
+    if (io->start + io->nblocks == req->start) {
+        return 1;
+    }
+    if (req->start + req->nblocks == io->start) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+static void merge(aio_io_t *io, aio_req_t *req, int where) {
+    if (where > 0) {
+        req->next = NULL;
+        io->last->next = req;
+        io->last = req;
+    } else {
+        req->next = io->reqs;
+        io->reqs = req;
+        io->start = req->start;
+    }
+    io->nblocks += req->nblocks;
+    io->nreqs++;
+}
+
+
+
+/**
+ * @brief Join an I/O of the async queue with the next one when a merge made them touch
+ * @param aio_io_t* I/O, it absorbs the next one
+ * @retval None
+ */
+static void join_next(aio_io_t *io) {
+    aio_io_t *next = io->next;
+
+    if (next == NULL || next->op != io->op || io->op == REQ_FLUSH
+        || io->start + io->nblocks != next->start || io->nreqs + next->nreqs > AIO_MAX_MERGE
+        || (size_t) (io->nblocks + next->nblocks) * eng->block_size > AIO_MAX_MERGE_BYTES) {
+        return;
+    }
+
+    io->last->next = next->reqs;
+    io->last = next->last;
+    io->nblocks += next->nblocks;
+    io->nreqs += next->nreqs;
+    io->next = next->next;
+    if (eng->async_queue.tail == next) {
+        eng->async_queue.tail = io;
+    }
+    free(next);
+    eng->queued--;
+}
+
+
+
+/**
+ * @brief Put a request in a scheduler queue, merged with its neighbours when possible, the lock is held
+ * @long Reads someone waits for go to the sync queue in FIFO order, writes and
+ *       readahead go to the async queue sorted by block.
+ * @param aio_req_t* Request
+ * @param int Boolean, the request is a read someone waits for
+ * @retval int Return zero on success
+ */
+static int sched_insert(aio_req_t *req, int sync) {
+    aio_io_t *io, *prev = NULL;
+    int where;
+
+    if (sync) {
+        io = eng->sync_queue.tail;
+        if (io != NULL && (where = can_merge(io, req)) > 0) {
+            merge(io, req, where);
+            return 0;
+        }
+        if ((io = new_io(req, 1)) == NULL) {
+            return -1;
+        }
+        queue_push(&eng->sync_queue, io);
+        eng->queued++;
+        return 0;
+    }
+
+    // first I/O starting after the request
+    for (io = eng->async_queue.head; io != NULL && io->start <= req->start; io = io->next) {
+        prev = io;
+    }
+
+    if (prev != NULL && (where = can_merge(prev, req)) > 0) {
+        merge(prev, req, where);
+        join_next(prev);
+        return 0;
+    }
+    if (io != NULL && (where = can_merge(io, req)) < 0) {
+        merge(io, req, where);
+        if (prev != NULL) {
+            join_next(prev);
+        }
+        return 0;
+    }
+
+    aio_io_t *added = new_io(req, 0);
+    if (added == NULL) {
+        return -1;
+    }
+    added->next = io;
+    if (prev != NULL) {
+        prev->next = added;
+    } else {
+        eng->async_queue.head = added;
+    }
+    if (io == NULL) {
+        eng->async_queue.tail = added;
+    }
+    eng->queued++;
+    return 0;
+}
+
+
+
+/**
+ * @brief Take the next I/O of the async queue, sweeping the disk in one direction
+ * @retval aio_io_t* First I/O at or after the previous one, or the lowest one when past the end
+ */
+static aio_io_t *elevator_pop(void) {
+    aio_io_t *io, *prev = NULL;
+
+    for (io = eng->async_queue.head; io != NULL && io->start < eng->elevator_pos; io = io->next) {
+        prev = io;
+    }
+    if (io == NULL) {
+        prev = NULL;
+        io = eng->async_queue.head;
+    }
+
+    if (prev != NULL) {
+        prev->next = io->next;
+    } else {
+        eng->async_queue.head = io->next;
+    }
+    if (eng->async_queue.tail == io) {
+        eng->async_queue.tail = prev;
+    }
+    io->next = NULL;
+    eng->elevator_pos = io->start + io->nblocks;
+    return io;
+}
+
+
+
+/**
+ * @brief Hand an I/O to the running backend, the lock is held
+ * @param aio_io_t* I/O
+ * @retval None
+ */
+static void backend_run(aio_io_t *io) {
+    eng->dispatched++;
+    if (!io->sync) {
+        eng->dispatched_async++;
+    }
+
+    if (io->nreqs > 1) {
+        io->iov = malloc(io->nreqs * sizeof(struct iovec));
+        if (io->iov == NULL) {
+            io->result = -ENOMEM;
+            queue_push(&eng->done, io);
+            return;
+        }
+        aio_req_t *req;
+        int i = 0;
+        for (req = io->reqs; req != NULL; req = req->next, i++) {
+            io->iov[i].iov_base = req->buf;
+            io->iov[i].iov_len = (size_t) req->nblocks * eng->block_size;
+        }
+    }
+
+    switch (eng->kind) {
+        case AIO_URING:
+            // the kernel runs it at once, the emulated device decides when it completes
+            if (io->op != REQ_FLUSH && disk_service(io->start, io->nblocks, &io->ready) != 0) {
+                io->result = -EIO;
+                queue_push(&eng->done, io);
+                break;
+            }
+            uring_queue(io);
+            break;
+        case AIO_THREADS:
+            queue_push(&eng->pending, io);
+            pthread_cond_signal(&eng->work_cond);
+            break;
+        default:
+            run_io(io);
+            queue_push(&eng->done, io);
+            break;
+    }
+}
+
+
+
+/**
+ * @brief Move I/Os from the scheduler queues to the backend while there is room, the lock is held
+ * @long The sync queue goes first. The async queue may only fill three
+ *       quarters of the queue depth, so that a read never waits behind a full
+ *       queue of background writes, and the sync queue leaves it a slot.
+ * @retval None
+ */
+static void dispatch(void) {
+    int async_limit = eng->depth * 3 / 4 > 0 ? eng->depth * 3 / 4 : 1;
+
+    while (eng->dispatched < eng->depth) {
+        aio_io_t *io;
+        if (eng->sync_queue.head != NULL
+            && (eng->async_queue.head == NULL || eng->dispatched_async > 0
+                || eng->dispatched < eng->depth - 1)) {
+            io = queue_pop(&eng->sync_queue);
+        } else if (eng->async_queue.head != NULL && eng->dispatched_async < async_limit) {
+            io = elevator_pop();
+        } else {
+            break;
+        }
+        eng->queued--;
+        backend_run(io);
+    }
+
+    if (eng->kind == AIO_URING) {
+        uring_submit();
+    }
+}
+
+
+
+/**
+ * @brief Queue a request in the scheduler
+ * @param aio_req_t* Request, freed once its callback ran
+ * @param int Boolean, the request is a read someone waits for
+ * @retval int Return zero on success
+ */
+static int submit(aio_req_t *req, int sync) {
+    req->st = stats_begin();
+
+    // a flush covers the writes queued before it, let them complete first
+    if (req->op == REQ_FLUSH) {
+        aio_drain();
+    }
+
+    // bound the requests waiting in the scheduler
+    while (aio_queued() >= eng->depth * 4) {
+        aio_poll(1);
+    }
+
+    pthread_mutex_lock(&eng->lock);
+    if (sched_insert(req, sync) != 0) {
+        pthread_mutex_unlock(&eng->lock);
+        free(req);
+        return -1;
+    }
+    eng->inflight++;
+    if (!eng->batching) {
+        dispatch();
+    }
+    pthread_mutex_unlock(&eng->lock);
+    return 0;
+}
+
+
+
+static int new_request(req_op_t op, int start_address, int nblocks, const void *buffer,
+                       aio_callback_t cb, void *arg, int sync) {
+    if (eng->kind == AIO_NONE) {
+        return -1;
+    }
+    if (op != REQ_FLUSH && (start_address < 0 || nblocks <= 0
+                            || start_address + nblocks > disk_num_blocks())) {
+        printf("out of bound error while queueing %d\n", start_address);
+        return -1;
+    }
+
+    aio_req_t *req = malloc(sizeof(aio_req_t));
+    if (req == NULL) {
+        return -1;
+    }
+    req->op = op;
+    req->start = start_address;
+    req->nblocks = nblocks;
+    req->buf = (void *) buffer;
+    req->cb = cb;
+    req->arg = arg;
+    req->result = 0;
+    return submit(req, sync);
+}
+
+
+
+int aio_submit_read(int start_address, int nblocks, void *buffer, aio_callback_t cb, void *arg) {
+    return new_request(REQ_READ, start_address, nblocks, buffer, cb, arg, 1);
+}
+
+
+
+int aio_submit_readahead(int start_address, int nblocks, void *buffer,
+                         aio_callback_t cb, void *arg) {
+    return new_request(REQ_READ, start_address, nblocks, buffer, cb, arg, 0);
+}
+
+
+
+int aio_submit_write(int start_address, int nblocks, const void *buffer,
+                     aio_callback_t cb, void *arg) {
+    return new_request(REQ_WRITE, start_address, nblocks, buffer, cb, arg, 0);
+}
+
+
+
+int aio_submit_flush(aio_callback_t cb, void *arg) {
+    return new_request(REQ_FLUSH, 0, 0, NULL, cb, arg, 0);
+}
+
+
+
+void aio_batch_begin(void) {
+    pthread_mutex_lock(&eng->lock);
+    eng->batching++;
+    pthread_mutex_unlock(&eng->lock);
+}
+
+
+
+void aio_batch_end(void) {
+    pthread_mutex_lock(&eng->lock);
+    if (eng->batching > 0 && --eng->batching == 0 && eng->kind != AIO_NONE) {
+        dispatch();
+    }
+    pthread_mutex_unlock(&eng->lock);
+}
+
+
+
+/**
+ * @brief Hand its share of a finished I/O to every request, and run their callbacks
+ * @param aio_io_t* Finished I/O, freed with its requests
+ * @retval int Number of requests completed
+ */
+static int complete_io(aio_io_t *io) {
+    aio_req_t *req = io->reqs;
+    int64_t offset = 0;
+    int count = 0;
+
+    while (req != NULL) {
+        aio_req_t *next = req->next;
+        int64_t len = (int64_t) req->nblocks * eng->block_size;
+
+        // a short transfer only covers the first requests
+        if (io->result < 0 || io->op == REQ_FLUSH) {
+            req->result = io->result;
+        } else if (io->result - offset >= len) {
+            req->result = (int) len;
+        } else {
+            req->result = io->result > offset ? (int) (io->result - offset) : 0;
+        }
+        offset += len;
+
+        finish_request(req);
+        if (req->cb != NULL) {
+            req->cb(req->arg, req->result);
+        }
+        free(req);
+        count++;
+        req = next;
+    }
+
+    free(io->iov);
+    free(io);
+    return count;
+}
+
+
+
+/**
+ * @brief Move the completed I/Os the emulated device is done with out of the done queue, the lock is held
+ * @param io_queue_t* Where the I/Os go
+ * @param uint64_t* Set to when the next I/O held back is ready, zero if there is none
+ * @retval None
+ */
+static void take_ready(io_queue_t *finished, uint64_t *next_ready) {
+    uint64_t now = stats_now();
+    io_queue_t held = { NULL, NULL };
+    aio_io_t *io;
+
+    *next_ready = 0;
+    while ((io = queue_pop(&eng->done)) != NULL) {
+        if (io->ready > now) {
+            if (*next_ready == 0 || io->ready < *next_ready) {
+                *next_ready = io->ready;
+            }
+            queue_push(&held, io);
+            continue;
+        }
+        eng->dispatched--;
+        if (!io->sync) {
+            eng->dispatched_async--;
+        }
+        eng->inflight -= io->nreqs;
+        queue_push(finished, io);
+    }
+    eng->done = held;
+}
+
+
+
+int aio_poll(int wait) {
+    io_queue_t finished = { NULL, NULL };
+    uint64_t next_ready;
+    int count = 0;
+
+    pthread_mutex_lock(&eng->lock);
+    if (eng->kind == AIO_URING) {
+        uring_reap();
+    }
+    dispatch();
+
+    while (1) {
+        take_ready(&finished, &next_ready);
+        if (!wait || finished.head != NULL || eng->dispatched == 0) {
+            break;
+        }
+        if (next_ready != 0) {
+            pthread_mutex_unlock(&eng->lock);
+            disk_wait_until(next_ready);
+            pthread_mutex_lock(&eng->lock);
+        } else if (eng->kind == AIO_URING) {
+            pthread_mutex_unlock(&eng->lock);
+            if (uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                printf("SFS > io_uring_enter failed: %s\n", strerror(errno));
+            }
+            pthread_mutex_lock(&eng->lock);
+        } else {
+            pthread_cond_wait(&eng->done_cond, &eng->lock);
+        }
+        if (eng->kind == AIO_URING) {
+            uring_reap();
+        }
+    }
+
+    // the slots freed go to the I/Os waiting in the scheduler
+    dispatch();
+    pthread_mutex_unlock(&eng->lock);
+
+    // the callbacks may queue more requests
+    aio_io_t *io;
+    while ((io = queue_pop(&finished)) != NULL) {
+        count += complete_io(io);
+    }
+    return count;
+}
+
+
+
+void aio_drain(void) {
+    while (aio_inflight() > 0) {
+        aio_poll(1);
+    }
+}
+
+
+
+int aio_inflight(void) {
+    pthread_mutex_lock(&eng->lock);
+    int n = eng->inflight;
+    pthread_mutex_unlock(&eng->lock);
+    return n;
+}
+
+
+
+int aio_queued(void) {
+    pthread_mutex_lock(&eng->lock);
+    int n = eng->queued;
+    pthread_mutex_unlock(&eng->lock);
+    return n;
+}
+
+
+
+aio_engine_t *aio_new(void) {
+    aio_engine_t *e = malloc(sizeof(aio_engine_t));
+    aio_engine_t empty = AIO_ENGINE_EMPTY;
+
+    if (e != NULL) {
+        *e = empty;
+        pthread_mutex_init(&e->lock, NULL);
+        pthread_cond_init(&e->work_cond, NULL);
+        pthread_cond_init(&e->done_cond, NULL);
+    }
+    return e;
+}
+
+
+
+void aio_destroy(aio_engine_t *e) {
+    if (e == NULL || e == &default_engine) {
+        return;
+    }
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->work_cond);
+    pthread_cond_destroy(&e->done_cond);
+    free(e);
+}
+
+
+
+void aio_use(aio_engine_t *e) {
+    eng = e != NULL ? e : &default_engine;
+}
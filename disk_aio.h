@@ -0,0 +1,141 @@
+#ifndef _INCLUDE_DISK_AIO_H_
+#define _INCLUDE_DISK_AIO_H_
+
+/* default number of requests in flight at once */
+#define AIO_DEFAULT_DEPTH 32
+
+/* name of the backend picked by default: io_uring, or threads without it */
+#define AIO_DEFAULT_BACKEND "auto"
+
+/*
+ * @short called when a request completes
+ * @param arg     argument given with the request
+ * @param result  blocks moved for a read or a write, 0 for a flush,
+ *                or a negative errno on failure
+ */
+typedef void (*aio_callback_t)(void *arg, int result);
+
+/* asynchronous I/O engine of a volume, see sfs_new */
+typedef struct aio_engine aio_engine_t;
+
+/*
+ * @short make the engine of a new volume, stopped
+ * @return the engine, NULL if out of memory
+ */
+aio_engine_t *aio_new(void);
+
+/*
+ * @short free the engine of a volume, stopped with aio_shutdown first
+ */
+void aio_destroy(aio_engine_t *e);
+
+/*
+ * @short make the calling thread work on the engine of a volume
+ * @long Every thread starts on the engine of the default volume, NULL goes
+ *       back to it. The other calls work on the engine of the thread, and
+ *       aio_init takes the disk of the thread.
+ */
+void aio_use(aio_engine_t *e);
+
+/*
+ * @short start the asynchronous I/O engine on the open disk
+ * @long Requests are queued against the image file opened by init_disk or
+ *       init_fresh_disk, and run in parallel by one of the backends:
+ *
+ *       uring     io_uring, set up with raw system calls
+ *       threads   a pool of threads doing pread and pwrite
+ *       sync      every request runs when it is submitted
+ *       auto      uring if the kernel has it, threads otherwise
+ *
+ *       Requests first wait in a scheduler. Reads go to a sync queue served
+ *       first and in order. Writes and readahead go to an async queue sorted
+ *       by block and served in one direction across the disk, like an
+ *       elevator, in at most three quarters of the queue depth. Requests of
+ *       a queue that follow each other on the disk are merged into a single
+ *       vectored read or write.
+ *
+ * @param backend      name of the backend
+ * @param queue_depth  most requests in flight at once
+ * @return 0 on success, -1 if the backend is unknown or cannot start
+ */
+int aio_init(const char *backend, int queue_depth);
+
+/*
+ * @short wait for every request in flight and stop the engine
+ */
+void aio_shutdown(void);
+
+/*
+ * @short name of the running backend, "none" when the engine is stopped
+ */
+const char *aio_backend(void);
+
+/*
+ * @short queue a read of blocks of the disk
+ * @long The buffer must stay valid until the callback runs. When the queue
+ *       is full, completions are reaped until there is room.
+ *
+ * @param start_address  first block
+ * @param nblocks        number of blocks
+ * @param buffer         where the blocks go
+ * @param cb             called on completion, may be NULL
+ * @param arg            handed to cb
+ * @return 0 if the request was queued, -1 otherwise
+ */
+int aio_submit_read(int start_address, int nblocks, void *buffer, aio_callback_t cb, void *arg);
+
+/*
+ * @short queue a read nobody waits for yet, see aio_submit_read
+ * @long It goes to the async queue, behind the reads someone waits for.
+ */
+int aio_submit_readahead(int start_address, int nblocks, void *buffer,
+                         aio_callback_t cb, void *arg);
+
+/*
+ * @short queue a write of blocks of the disk, see aio_submit_read
+ */
+int aio_submit_write(int start_address, int nblocks, const void *buffer,
+                     aio_callback_t cb, void *arg);
+
+/*
+ * @short queue a flush of the image file to stable storage
+ * @long Waits for the requests queued before it, so that the flush covers them.
+ */
+int aio_submit_flush(aio_callback_t cb, void *arg);
+
+/*
+ * @short hold back the requests queued until aio_batch_end
+ * @long The requests of a batch are sorted and merged by the scheduler
+ *       before any of them starts, and with io_uring they reach the kernel
+ *       with a single system call.
+ */
+void aio_batch_begin(void);
+
+/*
+ * @short hand every request queued since aio_batch_begin to the backend
+ */
+void aio_batch_end(void);
+
+/*
+ * @short run the callbacks of the completed requests
+ * @param wait  if non zero, block until at least one request completes
+ * @return number of completed requests
+ */
+int aio_poll(int wait);
+
+/*
+ * @short wait for every request in flight and run their callbacks
+ */
+void aio_drain(void);
+
+/*
+ * @short number of requests queued or in flight
+ */
+int aio_inflight(void);
+
+/*
+ * @short number of I/Os waiting in the scheduler, merged requests count once
+ */
+int aio_queued(void);
+
+#endif //_INCLUDE_DISK_AIO_H_
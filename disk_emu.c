@@ -3,22 +3,52 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "disk_emu.h"
+#include "sfs_stats.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+/*State of the disk of a volume: the image, its geometry, the device model,
+  the block under the head and when every channel and the bus become free*/
+struct disk {
+    FILE* fp;
+    double L, p;
+    int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+    disk_model_t model;
+    int head;
+    uint64_t channel_free[DISK_MAX_CHANNELS];
+    uint64_t bus_free;
+    unsigned int fail_seed;
+    pthread_mutex_t device_lock;
+};
+
+/*Device model, see disk_set_model, and the profiles disk_set_profile knows*/
+const disk_model_t profiles[] = {
+    /*name        request_us byte_ns settle_us seek_us bandwidth channels fail_p retries*/
+    { "none",     0,         0,      0,        0,      0,        1,       0,     3 },
+    { "hdd",      50,        6.7,    4500,     8000,   150,      1,       0,     3 },
+    { "sata_ssd", 60,        2.5,    0,        0,      520,      4,       0,     3 },
+    { "nvme",     15,        0.5,    0,        0,      3000,     32,      0,     3 },
+};
+
+#define DISK_EMPTY { NULL, 0, 0, 0, 0, 0, { "none", 0, 0, 0, 0, 0, 1, 0, 3 }, 0, { 0 }, 0, 1, \
+                     PTHREAD_MUTEX_INITIALIZER }
+
+static disk_t default_disk = DISK_EMPTY;
+
+/*Disk of the volume the calling thread works on*/
+static __thread disk_t *dsk = &default_disk;
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    if(NULL != dsk->fp)
     {
-        fclose(fp);
+        fclose(dsk->fp);
+        dsk->fp = NULL;
     }
     return 0;
 }
@@ -28,36 +58,30 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    /*Set up latency, failures and retries from the device model*/
+    dsk->L = dsk->model.request_us;
+    dsk->p = dsk->model.fail_p;
+    dsk->MAX_RETRY = dsk->model.max_retry;
+
+    dsk->BLOCK_SIZE = block_size;
+    dsk->MAX_BLOCK = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    dsk->fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (dsk->fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Grows the file to its given size, the new blocks read back as 0's*/
+    if (ftruncate(fileno(dsk->fp), (off_t) dsk->MAX_BLOCK * dsk->BLOCK_SIZE) != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not grow disk file %s\n\n", filename);
+        return -1;
     }
     return 0;
 }
@@ -66,23 +90,21 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    /*Set up latency, failures and retries from the device model*/
+    dsk->L = dsk->model.request_us;
+    dsk->p = dsk->model.fail_p;
+    dsk->MAX_RETRY = dsk->model.max_retry;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    dsk->BLOCK_SIZE = block_size;
+    dsk->MAX_BLOCK = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     
     /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    dsk->fp = fopen (filename, "r+b");
 
-    if (fp == NULL)
+    if (dsk->fp == NULL)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
@@ -95,40 +117,35 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
+    int e, s;
     e = 0;
     s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    stats_ctx_t st = stats_begin();
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > dsk->MAX_BLOCK)
     {
         printf("out of bound error while reading %d\n", start_address);
+        stats_end(STAT_READ_BLOCKS, &st, -1, 0);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the device served the request, or gave up on it*/
+    e = disk_delay(start_address, nblocks);
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    /*Reads every block requested at once, straight into the buffer*/
+    if (e == 0)
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
+        ssize_t n = pread(fileno(dsk->fp), buffer, (size_t) nblocks * dsk->BLOCK_SIZE,
+                          (off_t) start_address * dsk->BLOCK_SIZE);
+        if (n < 0)
+            e = -1;
+        else
+            s = n / dsk->BLOCK_SIZE;
     }
 
-    free(blockRead);
-
+    stats_blocks(s);
+    stats_end(STAT_READ_BLOCKS, &st, e, (uint64_t) s * dsk->BLOCK_SIZE);
 
     /*If no failure return the number of blocks read, else return the negative number of failures*/
     if (e == 0)
@@ -142,35 +159,35 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, e, s;
+    int e, s;
     e = 0;
     s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    stats_ctx_t st = stats_begin();
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > dsk->MAX_BLOCK)
     {
         printf("out of bound error while writing %d\n", start_address);
+        stats_end(STAT_WRITE_BLOCKS, &st, -1, 0);
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the device served the request, or gave up on it*/
+    e = disk_delay(start_address, nblocks);
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    /*Writes every block requested at once, straight from the buffer*/
+    if (e == 0)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+        ssize_t n = pwrite(fileno(dsk->fp), buffer, (size_t) nblocks * dsk->BLOCK_SIZE,
+                           (off_t) start_address * dsk->BLOCK_SIZE);
+        if (n < 0)
+            e = -1;
+        else
+            s = n / dsk->BLOCK_SIZE;
     }
-    free(blockWrite);
+
+    stats_blocks(s);
+    stats_end(STAT_WRITE_BLOCKS, &st, e, (uint64_t) s * dsk->BLOCK_SIZE);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
@@ -178,3 +195,180 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     else
         return e;
 }
+
+/*------------------------------------------------------------------*/
+/*Geometry and file descriptor of the open disk, for async I/O       */
+/*------------------------------------------------------------------*/
+int disk_fd()
+{
+    return NULL != dsk->fp ? fileno(dsk->fp) : -1;
+}
+
+int disk_block_size()
+{
+    return dsk->BLOCK_SIZE;
+}
+
+int disk_num_blocks()
+{
+    return dsk->MAX_BLOCK;
+}
+
+/*------------------------------------------------------------------*/
+/*Device model                                                      */
+/*------------------------------------------------------------------*/
+int disk_set_model(const disk_model_t *m)
+{
+    if (m->request_us < 0 || m->byte_ns < 0 || m->settle_us < 0 || m->seek_us < 0
+        || m->bandwidth_mbps < 0 || m->channels < 1 || m->channels > DISK_MAX_CHANNELS
+        || m->fail_p < 0 || m->fail_p >= 1 || m->max_retry < 0)
+    {
+        printf("Wrong device model %s\n", m->name != NULL ? m->name : "");
+        return -1;
+    }
+
+    pthread_mutex_lock(&dsk->device_lock);
+    dsk->model = *m;
+    dsk->L = dsk->model.request_us;
+    dsk->p = dsk->model.fail_p;
+    dsk->MAX_RETRY = dsk->model.max_retry;
+    memset(dsk->channel_free, 0, sizeof(dsk->channel_free));
+    dsk->bus_free = 0;
+    dsk->fail_seed = (unsigned int) time(0);
+    pthread_mutex_unlock(&dsk->device_lock);
+    return 0;
+}
+
+int disk_set_profile(const char *name)
+{
+    size_t i;
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (strcmp(profiles[i].name, name) == 0)
+            return disk_set_model(&profiles[i]);
+    }
+    printf("Unknown device profile %s\n", name);
+    return -1;
+}
+
+const disk_model_t *disk_get_model()
+{
+    return &dsk->model;
+}
+
+/*Book the device for a request, see disk_emu.h*/
+int disk_service(int start_address, int nblocks, uint64_t *done_ns)
+{
+    uint64_t now = stats_now();
+    double bytes = (double) nblocks * dsk->BLOCK_SIZE;
+    int failures = 0;
+    int c, i;
+
+    *done_ns = now;
+    if (dsk->model.request_us == 0 && dsk->model.byte_ns == 0 && dsk->model.settle_us == 0
+        && dsk->model.seek_us == 0 && dsk->model.bandwidth_mbps == 0 && dsk->model.fail_p == 0)
+        return 0;
+
+    pthread_mutex_lock(&dsk->device_lock);
+
+    /*The request waits for the channel that frees up first*/
+    c = 0;
+    for (i = 1; i < dsk->model.channels; i++)
+    {
+        if (dsk->channel_free[i] < dsk->channel_free[c])
+            c = i;
+    }
+    uint64_t t = dsk->channel_free[c] > now ? dsk->channel_free[c] : now;
+
+    /*A failed attempt costs as much as a good one, then the request is retried*/
+    for (i = 0; i <= dsk->MAX_RETRY; i++)
+    {
+        int distance = start_address > dsk->head ? start_address - dsk->head : dsk->head - start_address;
+        double us = dsk->model.request_us + dsk->model.byte_ns * bytes / 1000;
+        /*Moving the head costs a settle time plus the distance travelled*/
+        if (distance > 0 && dsk->MAX_BLOCK > 0 && (dsk->model.settle_us > 0 || dsk->model.seek_us > 0))
+            us += dsk->model.settle_us + dsk->model.seek_us * distance / dsk->MAX_BLOCK;
+        dsk->head = start_address + nblocks;
+        stats_seek(distance);
+        t += (uint64_t) (us * 1000);
+
+        /*The bus moves the data of every channel, at most bandwidth_mbps MB per second*/
+        if (dsk->model.bandwidth_mbps > 0)
+        {
+            uint64_t transfer = (uint64_t) (bytes * 1000 / dsk->model.bandwidth_mbps);
+            dsk->bus_free = (dsk->bus_free > t - transfer ? dsk->bus_free : t - transfer) + transfer;
+            if (dsk->bus_free > t)
+                t = dsk->bus_free;
+        }
+
+        if (dsk->p <= 0 || (double) rand_r(&dsk->fail_seed) / RAND_MAX >= dsk->p)
+            break;
+        failures++;
+    }
+    stats_disk_failures(failures, failures > dsk->MAX_RETRY);
+
+    dsk->channel_free[c] = t;
+    pthread_mutex_unlock(&dsk->device_lock);
+
+    *done_ns = t;
+    return failures > dsk->MAX_RETRY ? -failures : 0;
+}
+
+void disk_wait_until(uint64_t ns)
+{
+    /*Sleeps overshoot by the timer slack, spin through the last part of the wait*/
+    const uint64_t spin = 100000;
+    if (ns > spin && stats_now() < ns - spin)
+    {
+        struct timespec ts;
+        ts.tv_sec = (ns - spin) / 1000000000ULL;
+        ts.tv_nsec = (ns - spin) % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while (stats_now() < ns)
+        ;
+}
+
+int disk_delay(int start_address, int nblocks)
+{
+    uint64_t done_ns;
+    int e = disk_service(start_address, nblocks, &done_ns);
+    disk_wait_until(done_ns);
+    return e;
+}
+
+/*------------------------------------------------------------------*/
+/*Disks of several volumes, see disk_emu.h                          */
+/*------------------------------------------------------------------*/
+disk_t *disk_new()
+{
+    disk_t *d = malloc(sizeof(disk_t));
+    disk_t empty = DISK_EMPTY;
+    if (d != NULL)
+    {
+        *d = empty;
+        pthread_mutex_init(&d->device_lock, NULL);
+    }
+    return d;
+}
+
+void disk_destroy(disk_t *d)
+{
+    if (d == NULL || d == &default_disk)
+        return;
+    if (NULL != d->fp)
+        fclose(d->fp);
+    pthread_mutex_destroy(&d->device_lock);
+    free(d);
+}
+
+void disk_use(disk_t *d)
+{
+    dsk = d != NULL ? d : &default_disk;
+}
+
+disk_t *disk_current()
+{
+    return dsk;
+}
@@ -1,5 +1,60 @@
+#include <stdint.h>
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int disk_fd();
+int disk_block_size();
+int disk_num_blocks();
+
+/*Most requests the emulated device serves at once*/
+#define DISK_MAX_CHANNELS 64
+
+/*
+ * Emulated device, every request read_blocks, write_blocks or the
+ * asynchronous engine sends to the image is charged:
+ *
+ * request_us      fixed cost of a request, in microseconds (L)
+ * byte_ns         transfer time of a byte, in nanoseconds
+ * settle_us       cost of moving the head at all, rotation included
+ * seek_us         extra cost of moving the head across the whole disk,
+ *                 proportional to the distance in blocks
+ * bandwidth_mbps  MB per second the device moves at most, shared by the
+ *                 channels, 0 for no cap
+ * channels        requests served in parallel
+ * fail_p          probability that an attempt fails transiently (p)
+ * max_retry       retries before a request fails (MAX_RETRY)
+ */
+typedef struct {
+    const char *name;
+    double request_us;
+    double byte_ns;
+    double settle_us;
+    double seek_us;
+    double bandwidth_mbps;
+    int channels;
+    double fail_p;
+    int max_retry;
+} disk_model_t;
+
+int disk_set_model(const disk_model_t *m);
+int disk_set_profile(const char *name);
+const disk_model_t *disk_get_model();
+
+/*Book the device for a request: done_ns is when it completes on the monotonic
+  clock, returns 0, or the negative number of failed attempts if it gave up*/
+int disk_service(int start_address, int nblocks, uint64_t *done_ns);
+void disk_wait_until(uint64_t ns);
+/*disk_service, then wait for the completion*/
+int disk_delay(int start_address, int nblocks);
+
+/*Disk of a volume: its image and device model, see sfs_new. Every thread
+  starts on the disk of the default volume, disk_use(NULL) goes back to it,
+  and the calls above work on the disk of the calling thread*/
+typedef struct disk disk_t;
+disk_t *disk_new();
+void disk_destroy(disk_t *d);
+void disk_use(disk_t *d);
+disk_t *disk_current();
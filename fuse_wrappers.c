@@ -9,25 +9,93 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <stddef.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
+#include "sfs_stats.h"
+#include "sfs_cache.h"
+#include "disk_aio.h"
 
-static int fuse_getattr(const char *path, struct stat *stbuf)
+/* entries fuse_readdir asks for at once */
+#define READDIR_BATCH 64
+
+/* opens of each sfs file ID, the ID is shared by every open of a file, changed under sfs_lock */
+static int *open_refs = NULL;
+static int open_refs_len = 0;
+
+/* an sfs file is opened once per open of the kernel and kept until its release,
+ * so that a stream of writes does not store its chunks at every call */
+static int open_file(const char *path)
+{
+    char filename[PATH_MAX];
+    int *grown;
+    int fd;
+    
+    strcpy(filename, path);
+    
+    sfs_lock();
+    fd = sfs_fopen(filename);
+    if (fd == -1) {
+        sfs_unlock();
+        return -1;
+    }
+    if (fd >= open_refs_len) {
+        grown = realloc(open_refs, (size_t) (fd + 1) * sizeof(int));
+        if (grown == NULL) {
+            sfs_fclose(fd);
+            sfs_unlock();
+            return -1;
+        }
+        memset(grown + open_refs_len, 0, (size_t) (fd + 1 - open_refs_len) * sizeof(int));
+        open_refs = grown;
+        open_refs_len = fd + 1;
+    }
+    open_refs[fd]++;
+    sfs_unlock();
+    return fd;
+}
+
+static int close_file(int fd)
 {
-    printf("fuse_getattr\n");
     int res = 0;
-    int size;
     
+    sfs_lock();
+    if (--open_refs[fd] == 0)
+        res = sfs_fclose(fd);
+    sfs_unlock();
+    return res;
+}
+
+static void fill_stat(const sfs_stat_t *attr, struct stat *stbuf)
+{
     memset(stbuf, 0, sizeof(struct stat));
-    
-    if (strcmp(path, "/") == 0) {
+    if (attr->dir) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_getfilesize(path)) != -1) {
+    } else {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
+        stbuf->st_size = attr->size;
+    }
+    stbuf->st_ino = attr->inode + 1;
+}
+
+static int fuse_getattr(const char *path, struct stat *stbuf)
+{
+    printf("fuse_getattr\n");
+    int res = 0;
+    sfs_stat_t attr;
+    
+    memset(stbuf, 0, sizeof(struct stat));
+    
+    if (strcmp(path, SFS_STATS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = stats_render(NULL, 0);
+    } else if (sfs_stat(path, &attr) == 0) {
+        fill_stat(&attr, stbuf);
     } else
         res = -ENOENT;
     
@@ -38,18 +106,50 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
     printf("fuse_readdir\n");
-    char file_name[MAXFILENAME];
-    
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
+    sfs_dirent_t ents[READDIR_BATCH];
+    struct stat st;
+    int cursor = 0;
+    int res, i;
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
-    while(sfs_getnextfilename(file_name)) {
-        printf("%s\n", file_name);
-        filler(buf, &file_name[1], NULL, 0);
+    /* hand the attributes over with the names, so that ls -l needs no getattr per file */
+    while ((res = sfs_readdirplus(path, &cursor, ents, READDIR_BATCH)) > 0) {
+        for (i = 0; i < res; i++) {
+            fill_stat(&ents[i].attr, &st);
+            filler(buf, ents[i].name, &st, 0);
+        }
     }
+    if (res == -1)
+        return -ENOTDIR;
+    
+    return 0;
+}
+
+static int fuse_mkdir(const char *path, mode_t mode)
+{
+    printf("fuse_mkdir\n");
+    int res;
+    
+    sfs_lock();
+    res = sfs_mkdir(path) == -1 ? -sfs_create_error(path) : 0;
+    sfs_unlock();
+    
+    return res;
+}
+
+static int fuse_rmdir(const char *path)
+{
+    printf("fuse_rmdir\n");
+    sfs_stat_t attr;
+    
+    if (sfs_stat(path, &attr) == -1)
+        return -ENOENT;
+    if (!attr.dir)
+        return -ENOTDIR;
+    if (sfs_rmdir(path) == -1)
+        return -ENOTEMPTY;
     
     return 0;
 }
@@ -58,7 +158,7 @@ static int fuse_unlink(const char *path)
 {
     printf("fuse_unlink\n");
     int res;
-    char filename[MAXFILENAME];
+    char filename[PATH_MAX];
     
     strcpy(filename, path);
     res = sfs_remove(filename);
@@ -71,42 +171,85 @@ static int fuse_unlink(const char *path)
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     printf("fuse_open\n");
-    int res;
-    char filename[MAXFILENAME];
+    int fd;
     
-    strcpy(filename, path);
+    if (strcmp(path, SFS_STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        /* the report changes size between reads, bypass the page cache */
+        fi->direct_io = 1;
+        return 0;
+    }
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    fd = open_file(path);
+    if (fd == -1)
+        return -ENOENT;
     
-    sfs_fclose(res);
+    fi->fh = fd;
     return 0;
 }
 
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    printf("fuse_release\n");
+    
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return 0;
+    
+    /* what the last open wrote to a compressed file is stored now */
+    if (close_file((int) fi->fh) == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_read_stats(char *buf, size_t size, off_t offset)
+{
+    int len = stats_render(NULL, 0);
+    /* the counters keep moving, leave some room for them to grow */
+    size_t room = len + 4096;
+    char *report = malloc(room);
+    
+    if (report == NULL)
+        return -ENOMEM;
+    
+    len = stats_render(report, room);
+    if (len > (int) room - 1)
+        len = (int) room - 1;
+    
+    if (offset >= len) {
+        free(report);
+        return 0;
+    }
+    if (offset + size > len)
+        size = len - offset;
+    
+    memcpy(buf, report + offset, size);
+    free(report);
+    return size;
+}
+
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
     printf("fuse_read\n");
-    int fd;
+    int fd = (int) fi->fh;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return fuse_read_stats(buf, size, offset);
     
+    /* the read write pointer is shared by every open of the file, sfs sets no errno */
+    sfs_lock();
+    if(sfs_fseek(fd, offset) == -1) {
+        sfs_unlock();
+        return -EINVAL;
+    }
     res = sfs_fread(fd, buf, size);
+    sfs_unlock();
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
@@ -114,42 +257,65 @@ static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
     printf("fuse_write\n");
-    int fd;
+    int fd = (int) fi->fh;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
+    sfs_lock();
+    if(sfs_fseek(fd, offset) == -1) {
+        sfs_unlock();
+        return -EINVAL;
+    }
     res = sfs_fwrite(fd, buf, size);
+    sfs_unlock();
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
     printf("fuse_truncate\n");
-    char filename[MAXFILENAME];
     int fd;
+    int res;
     
-    strcpy(filename, path);
+    if (sfs_getfilesize(path) == -1)
+        return -ENOENT;
+    if (size < 0 || size > INT32_MAX)
+        return -EFBIG;
     
-    fd = sfs_remove(filename);
+    fd = open_file(path);
     if (fd == -1)
-        return -errno;
+        return -ENOENT;
+    
+    /* the file keeps its inode and the blocks below the new size */
+    res = sfs_ftruncate(fd, (int) size);
+    close_file(fd);
+    if (res == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_fallocate(const char *path, int mode, off_t offset, off_t len,
+        struct fuse_file_info *fi)
+{
+    printf("fuse_fallocate\n");
+    int fd = (int) fi->fh;
+    int res;
+    
+    /* only plain preallocation, no FALLOC_FL_KEEP_SIZE or hole punching */
+    if (mode != 0)
+        return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0)
+        return -EINVAL;
+    if (offset + len > INT32_MAX)
+        return -EFBIG;
+    
+    res = sfs_fallocate(fd, (int) offset, (int) len);
+    if (res == -1)
+        return -ENOSPC;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -168,13 +334,34 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
     printf("fuse_create\n");
-    char filename[MAXFILENAME];
     int fd;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    sfs_lock();
+    fd = open_file(path);
+    if (fd == -1) {
+        int res = -sfs_create_error(path);
+        sfs_unlock();
+        /* a file that exists and still failed to open */
+        return res == -EEXIST ? -EIO : res;
+    }
+    sfs_unlock();
+    
+    fp->fh = fd;
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    printf("fuse_fsync\n");
+    int res;
+    
+    if (strcmp(path, SFS_STATS_PATH) == 0)
+        return 0;
+    
+    res = sfs_fsync((int) fi->fh);
+    if (res == -1)
+        return -EIO;
     
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -183,17 +370,170 @@ static struct fuse_operations xmp_oper = {
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
+    .mkdir = fuse_mkdir,
+    .rmdir = fuse_rmdir,
     .truncate = fuse_truncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .fallocate = fuse_fallocate,
+};
+
+/*
+ * image        path of the disk image
+ * format       make a new file system even if the image holds one
+ * cache_kb     size of the block cache in KB, -1 for the default
+ * backend      I/O backend
+ * queue_depth  most disk requests in flight
+ * readahead_kb how far to read ahead of sequential reads
+ * dirty_background_pct, dirty_pct, dirty_expire_ms
+ *              when the block cache writes dirty blocks back
+ * block_size   geometry of a new file system
+ * num_blocks
+ * num_inodes
+ * compress     compress the files created
+ * dedup        deduplicate the blocks written
+ * sparse       make holes of the blocks of zeros written
+ * help         print the sfs options
+ */
+struct sfs_options {
+    char *image;
+    int format;
+    int cache_kb;
+    char *backend;
+    int queue_depth;
+    int readahead_kb;
+    int dirty_background_pct;
+    int dirty_pct;
+    int dirty_expire_ms;
+    int block_size;
+    int num_blocks;
+    int num_inodes;
+    int compress;
+    int dedup;
+    int sparse;
+    int help;
 };
 
+#define SFS_OPT(t, p) { t, offsetof(struct sfs_options, p), 1 }
+
+static const struct fuse_opt sfs_opts[] = {
+    SFS_OPT("image=%s", image),
+    SFS_OPT("format", format),
+    SFS_OPT("cache_kb=%d", cache_kb),
+    SFS_OPT("backend=%s", backend),
+    SFS_OPT("queue_depth=%d", queue_depth),
+    SFS_OPT("readahead_kb=%d", readahead_kb),
+    SFS_OPT("dirty_background_pct=%d", dirty_background_pct),
+    SFS_OPT("dirty_pct=%d", dirty_pct),
+    SFS_OPT("dirty_expire_ms=%d", dirty_expire_ms),
+    SFS_OPT("block_size=%d", block_size),
+    SFS_OPT("num_blocks=%d", num_blocks),
+    SFS_OPT("num_inodes=%d", num_inodes),
+    SFS_OPT("compress", compress),
+    SFS_OPT("dedup", dedup),
+    SFS_OPT("sparse", sparse),
+    SFS_OPT("-h", help),
+    SFS_OPT("--help", help),
+    FUSE_OPT_END
+};
+
+static void sfs_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s mountpoint [options]\n"
+            "\n"
+            "sfs options:\n"
+            "    -o image=PATH          disk image (default: " DEFAULT_DISK_FILE ")\n"
+            "    -o format              make a new file system on the image\n"
+            "    -o cache_kb=N          block cache size in KB (default: %d)\n"
+            "    -o backend=NAME        I/O backend: uring, threads, sync or auto\n"
+            "                           (default: %s)\n"
+            "    -o queue_depth=N       disk requests in flight (default: %d)\n"
+            "    -o readahead_kb=N      readahead of sequential reads (default: %d)\n"
+            "    -o dirty_background_pct=N\n"
+            "                           dirty cache share written back in the\n"
+            "                           background (default: %d)\n"
+            "    -o dirty_pct=N         dirty cache share at which writers wait,\n"
+            "                           0 writes through (default: %d)\n"
+            "    -o dirty_expire_ms=N   age at which dirty blocks are written\n"
+            "                           back (default: %d)\n"
+            "    -o block_size=N        block size of a new file system (default: %d)\n"
+            "    -o num_blocks=N        blocks of a new file system (default: %d)\n"
+            "    -o num_inodes=N        inodes of a new file system (default: %d)\n"
+            "    -o compress            compress the files created from now on\n"
+            "    -o dedup               share the blocks written with those holding\n"
+            "                           the same data\n"
+            "    -o sparse              make holes of the blocks of zeros written\n"
+            "\n"
+            "An existing file system on the image is mounted as it is, a new one\n"
+            "is made only with -o format or when the image is missing or empty.\n"
+            "\n",
+            prog, CACHE_DEFAULT_SIZE / 1024, AIO_DEFAULT_BACKEND, AIO_DEFAULT_DEPTH,
+            DEFAULT_READAHEAD_KB, CACHE_DIRTY_BACKGROUND_PCT, CACHE_DIRTY_PCT,
+            CACHE_DIRTY_EXPIRE_MS, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS,
+            DEFAULT_NUM_INODES);
+}
+
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct sfs_options options = {
+        NULL, 0, -1, NULL, AIO_DEFAULT_DEPTH, DEFAULT_READAHEAD_KB,
+        CACHE_DIRTY_BACKGROUND_PCT, CACHE_DIRTY_PCT, CACHE_DIRTY_EXPIRE_MS,
+        DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES, 0, 0, 0, 0
+    };
     
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    if (fuse_opt_parse(&args, &options, sfs_opts, NULL) == -1)
+        return 1;
+    
+    if (options.help) {
+        sfs_usage(argv[0]);
+        fuse_opt_add_arg(&args, "-ho");
+        return fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    }
+    
+    if (sfs_set_geometry(options.block_size, options.num_blocks, options.num_inodes) != 0)
+        return 1;
+    if (options.cache_kb >= 0)
+        sfs_set_cache_size((uint64_t) options.cache_kb * 1024);
+    if (sfs_set_io(options.backend != NULL ? options.backend : AIO_DEFAULT_BACKEND,
+                   options.queue_depth, options.readahead_kb) != 0)
+        return 1;
+    if (sfs_set_writeback(options.dirty_background_pct, options.dirty_pct,
+                          options.dirty_expire_ms) != 0)
+        return 1;
+    sfs_set_image(options.image);
+    sfs_set_compression(options.compress);
+    sfs_set_dedup(options.dedup);
+    sfs_set_sparse(options.sparse);
+    
+    /* keep the data of the image unless asked to start over: a new file
+     * system is made only on an image that holds nothing, one that fails
+     * to mount is left as it is */
+    if (options.format || sfs_image_blank()) {
+        mksfs(1);
+    } else {
+        mksfs(0);
+        if (!sfs_is_mounted()) {
+            fprintf(stderr, "SFS > Cannot mount %s, use -o format to make a new "
+                    "file system on it\n",
+                    options.image != NULL ? options.image : DEFAULT_DISK_FILE);
+            return 1;
+        }
+    }
+    
+    /* let the kernel remember missing names for a second, -o negative_timeout
+     * given on the command line comes later and wins */
+    fuse_opt_insert_arg(&args, 1, "-onegative_timeout=1");
+    
+    int res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    free(options.image);
+    free(options.backend);
+    return res;
 }
@@ -3,876 +3,3740 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "disk_emu.h"
 #include "bitmap.h"
+#include "sfs_stats.h"
+#include "sfs_trace.h"
+#include "sfs_cache.h"
+#include "disk_aio.h"
+#include "sfs_check.h"
+#include "sfs_pack.h"
+#include "sfs_lz.h"
+#include "sfs_dedup.h"
+#include "sfs_dcache.h"
+#include "sfs_async.h"
+
+#define DISK_FILE (fs->disk_file != NULL ? fs->disk_file : DEFAULT_DISK_FILE)
+
+// sfs_check copies the tables this many times before it keeps the lock throughout
+#define CHECK_ATTEMPTS 3
+
+// geometry of the mounted file system, read from the super block
+#define BLOCK_SZ ((int) fs->sb.block_size)
+#define NUM_BLOCKS_FS ((int) fs->sb.num_blocks)
+#define NUM_INODES_FS ((int) fs->sb.num_inodes)
+#define NUM_ENTRIES (NUM_INODES_FS - 1)
+#define NUM_DIR_BLOCKS ((int) fs->sb.dir_table_len)
+#define BITMAP_START (NUM_BLOCKS_FS - (int) fs->sb.bitmap_len)
+#define CSUM_START (BITMAP_START - (int) fs->sb.csum_len)
+#define REFS_START (CSUM_START - (int) fs->sb.refs_len)
+#define PTRS_PER_BLOCK ((int) (fs->sb.block_size / sizeof(unsigned int)))
+#define MAX_FILE_BLOCKS (12 + PTRS_PER_BLOCK)
+#define MAX_RWPTR ((int64_t) MAX_FILE_BLOCKS * BLOCK_SZ)
+
+// number of blocks needed to hold some bytes
+#define BLOCKS_FOR(_bytes, _block_size) (((_bytes) + (_block_size) - 1) / (_block_size))
+
+// bytes of a chunk of a compressed file
+#define CHUNK_SZ (SFS_CHUNK_BLOCKS * BLOCK_SZ)
+
+// most chunks of compressed files compressed at once
+#define CHUNK_BATCH 16
+
+// start an sfs_* function, taking the API lock, timing it and recording it in the trace
+#define API_BEGIN(_op, _name, _fd, _offset, _length) \
+    sfs_lock(); \
+    stats_ctx_t st = stats_begin(); \
+    trace_ctx_t tr = trace_begin(_op, _name, _fd, _offset, _length)
+
+// return from an sfs_* function, accounting for the call
+#define API_RETURN(_op, _ret) \
+    do { int _r = (_ret); stats_end(_op, &st, _r, 0); trace_end(&tr, _r); sfs_unlock(); return _r; } while (0)
+
+// same as API_RETURN, for functions returning a number of bytes moved
+#define API_RETURN_BYTES(_op, _ret) \
+    do { \
+        int _r = (_ret); \
+        stats_end(_op, &st, _r, _r > 0 ? _r : 0); \
+        trace_end(&tr, _r); \
+        sfs_unlock(); \
+        return _r; \
+    } while (0)
+
+/*
+ * A table of the file system that a clean mount leaves on the disk,
+ * its blocks are read the first time they are used
+ * data     in memory copy of the table
+ * start    first block of the table on the disk
+ * loaded   one flag per block of the table, NULL once every block is in memory
+ * missing  blocks not read yet
+ */
+typedef struct {
+    char *data;
+    int start;
+    uint8_t *loaded;
+    int missing;
+} lazy_table_t;
+
+
+
+/*
+ * A volume: the file system mounted from a disk image, and the settings of the next mksfs
+ * sb                   super block
+ * inode_table          inode table, see lazy_inodes
+ * directory_table      directory table, see lazy_entries
+ * directory_table_index where sfs_getnextfilename is in the root directory
+ * fdt                  open files
+ * api_lock             every sfs_* call holds it, so that the API can be used from several threads
+ * block_shift          block sizes are powers of two, the data path shifts and masks
+ * block_mask           instead of dividing
+ * next_block_size      geometry of the next file system made by mksfs(1)
+ * next_num_blocks
+ * next_num_inodes
+ * disk_file            disk image, block cache and I/O engine used by the next mksfs
+ * cache_size
+ * io_backend
+ * io_depth
+ * readahead_kb_cfg
+ * compress_new_files   files created from now on are compressed, see sfs_set_compression
+ * dedup_writes         whole blocks written are looked up among those already on the
+ *                      disk, see sfs_set_dedup
+ * sparse_writes        whole blocks of zeros written become holes, see sfs_set_sparse
+ * unmount_at_exit      the volume is unmounted when the program exits, set by mksfs
+ * meta_gen             bumped by every change of the metadata, tells sfs_check if its
+ *                      copy is still current
+ * mount_gen            bumped by every unmount, tells sfs_check if the same file system
+ *                      is still mounted
+ * lazy_inodes          blocks of the inode table not read yet
+ * lazy_entries         blocks of the directory table not read yet
+ * bitmap ... async     state of the other modules, NULL for the default volume
+ * next                 next volume made by sfs_new
+ */
+struct sfs {
+    superblock_t sb;
+    inode_t *inode_table;
+    entry_t *directory_table;
+    int directory_table_index;
+    file_descriptor *fdt;
+    pthread_mutex_t api_lock;
+    int block_shift;
+    uint64_t block_mask;
+    int next_block_size;
+    int next_num_blocks;
+    int next_num_inodes;
+    char *disk_file;
+    uint64_t cache_size;
+    char io_backend[16];
+    int io_depth;
+    int readahead_kb_cfg;
+    int compress_new_files;
+    int dedup_writes;
+    int sparse_writes;
+    int unmount_at_exit;
+    uint64_t meta_gen;
+    uint64_t mount_gen;
+    lazy_table_t lazy_inodes;
+    lazy_table_t lazy_entries;
+    bitmap_t *bitmap;
+    disk_t *disk;
+    aio_engine_t *aio;
+    cache_t *cache;
+    pack_state_t *pack;
+    dedup_state_t *dedup;
+    dcache_t *dcache;
+    async_state_t *async;
+    struct sfs *next;
+};
+
+#define SFS_EMPTY { .directory_table_index = -1, .next_block_size = DEFAULT_BLOCK_SIZE, \
+                    .next_num_blocks = DEFAULT_NUM_BLOCKS, .next_num_inodes = DEFAULT_NUM_INODES, \
+                    .cache_size = CACHE_DEFAULT_SIZE, .io_backend = AIO_DEFAULT_BACKEND, \
+                    .io_depth = AIO_DEFAULT_DEPTH, .readahead_kb_cfg = DEFAULT_READAHEAD_KB }
+
+
+/* globals */
+static sfs_t default_fs = SFS_EMPTY;
+static pthread_once_t default_lock_once = PTHREAD_ONCE_INIT;
+
+// volume the calling thread works on, see sfs_use
+static __thread sfs_t *fs = &default_fs;
+
+// volumes made by sfs_new, unmounted at exit with the default one
+static sfs_t *volumes = NULL;
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * n            inode of the file
+ * ptrs         content of the indirect block, NULL until it is needed
+ * loaded       if ptrs holds the indirect block
+ * dirty        if ptrs changed since it was read
+ * allocated    if a block was taken from the bitmap or given back to it, or a pointer lost
+ *              its unwritten flag: the bitmap and the inode must be written
+ * failed       if the indirect block could not be read, its pointers are unknown
+ */
+typedef struct {
+    inode_t *n;
+    unsigned int *ptrs;
+    int loaded;
+    int dirty;
+    int allocated;
+    int failed;
+} block_map_t;
+
+
+
+/*
+ * Where a path leads, see walk
+ * dir      inode of the directory holding the last name of the path
+ * entry    entry of the last name, -1 if the directory has none
+ * name     last name of the path, empty for the root directory
+ */
+typedef struct {
+    uint32_t dir;
+    int entry;
+    char name[MAXFILENAME + 1];
+} path_t;
+
+
+
+/*
+ * A chunk of a compressed file on its way to the disk
+ * inode        inode of the file
+ * chunk        which chunk of the file
+ * data         the chunk, CHUNK_SZ bytes
+ * len          bytes of the chunk within the file
+ * packed       its compressed form behind room for a chunk_header_t, NULL if none
+ * packed_len   bytes of compressed data, zero if the chunk is stored as is
+ */
+typedef struct {
+    int inode;
+    uint64_t chunk;
+    char *data;
+    int len;
+    char *packed;
+    int packed_len;
+} chunk_write_t;
+
+/*
+ * Chunks compressed together
+ */
+typedef struct {
+    chunk_write_t w[CHUNK_BATCH];
+    int count;
+} chunk_batch_t;
+
+// the chunk buffers of open compressed files outlive the calls, the mount and the flusher store them
+int store_chunks(int fileID, uint64_t dirtied_before);
+void drop_chunks(int inode);
+void writeback_chunks(uint64_t dirtied_before);
+
+
+
+/**
+ * @brief Choose the geometry of the next file system made by mksfs(1)
+ * @param int Size of a block in bytes, a power of two
+ * @param int Number of blocks on the disk
+ * @param int Number of inodes, including the root directory
+ * @retval int Return zero if the geometry is supported
+ */
+int sfs_set_geometry(int block_size, int num_blocks, int num_inodes) {
+
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE
+        || (block_size & (block_size - 1)) != 0) {
+        printf("SFS > Block size %i is not a power of two between %i and %i!\n",
+               block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
 
-#define JITS_DISK "sfs_disk.disk"
-#define BLOCK_SZ 1024
+    if (num_inodes < 2 || num_inodes > INT16_MAX || num_blocks <= 0
+        || (uint32_t) num_blocks > SFS_BLOCK_UNWRITTEN) {
+        printf("SFS > Wrong number of blocks or inodes!\n");
+        return -1;
+    }
 
-#define NUM_INODE_BLOCKS (sizeof(inode_t) * NUM_INODES / BLOCK_SZ + 1) 
-#define NUM_DIR_BLOCKS (sizeof(entry_t) * NUM_INODES / BLOCK_SZ + 1) 
-#define MAX_RWPTR ((12*BLOCK_SZ) + (BLOCK_SZ/4)*BLOCK_SZ)
+    // the metadata must leave room for some data
+    uint64_t meta = 1 + BLOCKS_FOR((uint64_t) sizeof(inode_t) * num_inodes, block_size)
+                    + BLOCKS_FOR((uint64_t) sizeof(entry_t) * (num_inodes - 1), block_size)
+                    + BLOCKS_FOR(((uint64_t) num_blocks + 7) / 8, block_size)
+                    + BLOCKS_FOR((uint64_t) num_blocks * sizeof(uint32_t), block_size)
+                    + BLOCKS_FOR((uint64_t) num_blocks, block_size);
+    if (meta >= (uint64_t) num_blocks) {
+        printf("SFS > %i blocks cannot hold the metadata of %i inodes!\n", num_blocks, num_inodes);
+        return -1;
+    }
 
-superblock_t sb;
-inode_t inode_table[NUM_INODES];
-entry_t directory_table[NUM_INODES-1];
-int directory_table_index = -1;
-file_descriptor fdt[NUM_INODES];
+    fs->next_block_size = block_size;
+    fs->next_num_blocks = num_blocks;
+    fs->next_num_inodes = num_inodes;
+    return 0;
+}
 
 
 
 /**
- * @brief Append a character to a string
- * @param char* String to which we want to append
- * @param char Character to be appended
- * @param int Length of the string
+ * @brief Choose the disk image used by the next mksfs
+ * @param const char* Path of the image, NULL for the default one
  * @retval None
  */
-char* appendCharToCharArray(char* array, char a, int len)
-{
-    char* ret = malloc((len+2)*sizeof(char));
+void sfs_set_image(const char *path) {
+    free(fs->disk_file);
+    fs->disk_file = path != NULL ? strdup(path) : NULL;
+}
 
-    int i;
-    for(i = 0; i < len; i++) {
-        ret[i] = array[i];
+
+
+/**
+ * @brief Choose the size of the block cache of the next mksfs
+ * @param uint64_t Size of the cache in bytes, zero disables it
+ * @retval None
+ */
+void sfs_set_cache_size(uint64_t bytes) {
+    fs->cache_size = bytes;
+}
+
+
+
+/**
+ * @brief Choose the I/O engine of the next mksfs
+ * @param const char* Backend: "uring", "threads", "sync" or "auto"
+ * @param int Most disk requests in flight at once
+ * @param int How far to read ahead of sequential reads, in KB, zero disables it
+ * @retval int Return zero if the settings are valid
+ */
+int sfs_set_io(const char *backend, int queue_depth, int readahead_kb) {
+    if (strcmp(backend, "uring") != 0 && strcmp(backend, "threads") != 0
+        && strcmp(backend, "sync") != 0 && strcmp(backend, "auto") != 0) {
+        printf("SFS > Unknown I/O backend %s!\n", backend);
+        return -1;
+    }
+    if (queue_depth <= 0 || readahead_kb < 0) {
+        printf("SFS > Wrong queue depth or readahead!\n");
+        return -1;
     }
-    ret[len] = a;
-    ret[len+1] = '\0';
 
-    return ret;
+    strcpy(fs->io_backend, backend);
+    fs->io_depth = queue_depth;
+    fs->readahead_kb_cfg = readahead_kb;
+    return 0;
 }
 
 
 
 /**
- * @brief Initialize the super block
+ * @brief Choose when the block cache writes dirty blocks back, from the next mksfs on
+ * @param int Dirty blocks, in percent of the cache, the flusher lets accumulate
+ * @param int Dirty blocks, in percent of the cache, at which writers are throttled,
+ *            zero writes through to the disk
+ * @param int Age in milliseconds after which a dirty block is written back
+ * @retval int Return zero if the settings are valid
+ */
+int sfs_set_writeback(int background_pct, int dirty_pct, int expire_ms) {
+    if (background_pct < 0 || background_pct > dirty_pct || dirty_pct > 90 || expire_ms < 0) {
+        printf("SFS > Wrong writeback thresholds!\n");
+        return -1;
+    }
+
+    cache_set_writeback(background_pct, dirty_pct, expire_ms);
+    return 0;
+}
+
+
+
+/**
+ * @brief Choose if the files created from now on are compressed
+ * @long Their blocks are compressed SFS_CHUNK_BLOCKS at a time, see sfs_lz.h.
+ *       Files keep what they were created with.
+ * @param int Boolean, compress new files
  * @retval None
  */
-void init_superblock() {
-    sb.magic = 0xACBD0005;
-    sb.block_size = BLOCK_SZ;
-    sb.fs_size = NUM_BLOCKS * BLOCK_SZ;
-    sb.inode_table_len = NUM_INODE_BLOCKS;
-    sb.root_dir_inode = 0;
+void sfs_set_compression(int on) {
+    fs->compress_new_files = on;
 }
 
 
 
 /**
- * @brief Initialize the root directory
+ * @brief Choose if whole blocks written from now on are deduplicated
+ * @long A block holding the same bytes as one already on the disk points to
+ *       it instead of taking a block of its own, see sfs_dedup.h. Blocks
+ *       shared this way are copied before they change, whatever the choice.
+ * @param int Boolean, deduplicate the blocks written
  * @retval None
  */
-void init_root_directory() {
+void sfs_set_dedup(int on) {
+    fs->dedup_writes = on;
+}
 
-    // inode
-    inode_t rd;
-    rd.used = 1;
-    rd.mode = 777;
-    rd.link_cnt = 1;
-    rd.uid = 0;
-    rd.gid = 0;
-    rd.size = 0;
 
-    inode_table[0] = rd;
 
-    // directory
-    int i;
-    for(i = 0; i < sizeof(directory_table)/ sizeof(directory_table[0]); i++){
-        directory_table[i].used = 0;
+/**
+ * @brief Choose if whole blocks of zeros written from now on become holes
+ * @long The block they overwrite is freed, and they read back as zeros
+ *       without taking any block. Blocks never written are holes anyway.
+ * @param int Boolean, punch holes for blocks of zeros
+ * @retval None
+ */
+void sfs_set_sparse(int on) {
+    fs->sparse_writes = on;
+}
+
+
+
+static void api_lock_init(pthread_mutex_t *lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+
+static void default_lock_init(void) {
+    api_lock_init(&default_fs.api_lock);
+}
+
+
+
+/**
+ * @brief Take the lock serializing the sfs_* calls, it can be taken again by the holder
+ * @retval None
+ */
+void sfs_lock(void) {
+    if (fs == &default_fs) {
+        pthread_once(&default_lock_once, default_lock_init);
     }
+    pthread_mutex_lock(&fs->api_lock);
 }
 
 
 
 /**
- * @brief Initialize the inode table
+ * @brief Release the lock taken with sfs_lock
  * @retval None
  */
-void init_inode_table() {
-    int i;
-    for(i = 1; i < sizeof(inode_table)/ sizeof(inode_table[0]); i++){
-        inode_table[i].used = 0;
+void sfs_unlock(void) {
+    pthread_mutex_unlock(&fs->api_lock);
+}
+
+
+
+/**
+ * @brief Tell if the last mksfs left a usable file system
+ * @retval int Return one if a file system is mounted
+ */
+int sfs_is_mounted(void) {
+    return fs->sb.magic == SFS_MAGIC;
+}
+
+
+
+/**
+ * @brief Tell if the image chosen for the next mksfs is missing or empty
+ * @long Only such an image can be formatted without losing data: one that
+ *       fails to mount may be corrupted, unreadable or of an older format.
+ * @retval int Return one if the image holds nothing
+ */
+int sfs_image_blank(void) {
+    struct stat st;
+
+    if (stat(DISK_FILE, &st) != 0) {
+        return errno == ENOENT;
     }
+    return st.st_size == 0;
 }
 
 
 
 /**
- * @brief Initialize the file descriptor table
+ * @brief Initialize the super block
  * @retval None
  */
-void init_file_descriptor() {
-    int i;
-    for(i = 0; i < sizeof(fdt)/ sizeof(fdt); i++){
-        fdt[i].used = 0;
+void init_superblock() {
+    fs->sb.magic = SFS_MAGIC;
+    fs->sb.block_size = fs->next_block_size;
+    fs->sb.fs_size = (uint64_t) fs->next_num_blocks * fs->next_block_size;
+    fs->sb.inode_table_len = BLOCKS_FOR(sizeof(inode_t) * fs->next_num_inodes, fs->sb.block_size);
+    fs->sb.root_dir_inode = 0;
+    fs->sb.num_blocks = fs->next_num_blocks;
+    fs->sb.num_inodes = fs->next_num_inodes;
+    fs->sb.dir_table_len = BLOCKS_FOR(sizeof(entry_t) * (fs->next_num_inodes - 1), fs->sb.block_size);
+    fs->sb.bitmap_len = BLOCKS_FOR((fs->sb.num_blocks + 7) / 8, fs->sb.block_size);
+    fs->sb.csum_len = BLOCKS_FOR(fs->sb.num_blocks * sizeof(uint32_t), fs->sb.block_size);
+    fs->sb.refs_len = BLOCKS_FOR(fs->sb.num_blocks, fs->sb.block_size);
+    fs->sb.state = SFS_STATE_DIRTY;
+    fs->sb.free_inodes = fs->next_num_inodes - 1;
+}
+
+
+
+/**
+ * @brief Check that the super block read from the disk describes a file system
+ * @long Its tables must fit the disk without overlapping, see check_geometry.
+ * @retval int Return zero if the super block is valid
+ */
+int check_superblock() {
+    int ret = check_geometry(&fs->sb);
+    if (ret == -1) {
+        printf("SFS > No file system found on %s!\n", DISK_FILE);
+    } else if (ret != 0) {
+        printf("SFS > The super block of %s is corrupted!\n", DISK_FILE);
     }
+    return ret != 0 ? -1 : 0;
 }
 
 
 
 /**
- * @brief Make or open a file system
- * @param int Boolean deciding on making a new file or openning an existing one
+ * @brief Tell if the checkpoint of the super block can be trusted
+ * @retval int Return one if the volume was unmounted cleanly
+ */
+int checkpoint_valid() {
+    return fs->sb.state == SFS_STATE_CLEAN
+        && fs->sb.free_blocks <= fs->sb.num_blocks
+        && fs->sb.free_inodes < fs->sb.num_inodes
+        && fs->sb.first_free_byte < fs->sb.bitmap_len * fs->sb.block_size;
+}
+
+
+
+/**
+ * @brief Allocate the in memory tables for the geometry of the super block
+ * @long The inode and directory tables are rounded up to whole blocks so
+ *       that they can be moved with read_blocks and write_blocks.
  * @retval None
  */
-void mksfs(int fresh) {
+void alloc_tables() {
+    free(fs->inode_table);
+    free(fs->directory_table);
+    free(fs->fdt);
+    free(fs->lazy_inodes.loaded);
+    free(fs->lazy_entries.loaded);
+    fs->lazy_inodes.loaded = NULL;
+    fs->lazy_entries.loaded = NULL;
+
+    fs->block_shift = __builtin_ctz(fs->sb.block_size);
+    fs->block_mask = fs->sb.block_size - 1;
+
+    fs->inode_table = calloc(fs->sb.inode_table_len, fs->sb.block_size);
+    fs->directory_table = calloc(fs->sb.dir_table_len, fs->sb.block_size);
+    fs->fdt = calloc(fs->sb.num_inodes, sizeof(file_descriptor));
+
+    if (fs->inode_table == NULL || fs->directory_table == NULL || fs->fdt == NULL) {
+        printf("SFS > Out of memory!\n");
+        exit(-1);
+    }
+    fs->lazy_inodes.data = (char*) fs->inode_table;
+    fs->lazy_inodes.start = 1;
+    fs->lazy_entries.data = (char*) fs->directory_table;
+    fs->lazy_entries.start = 1 + (int) fs->sb.inode_table_len;
+
+    bitmap_init(fs->sb.num_blocks, fs->sb.bitmap_len * fs->sb.block_size);
+    pack_reset(BLOCK_SZ);
+    dedup_reset(REFS_START, (int) fs->sb.refs_len, (uint32_t) fs->sb.num_blocks, BLOCK_SZ);
+    dcache_reset((uint32_t) NUM_ENTRIES);
+
+    if (cache_init((int) (fs->cache_size / fs->sb.block_size), BLOCK_SZ) != 0) {
+        printf("SFS > Not enough memory for the block cache, running without it\n");
+    }
+}
 
-	//Implement mksfs here
-    if (fresh) {
-        printf("SFS > Making new file system\n");
 
-        // create super block
-        init_superblock();
 
-        init_inode_table();
+/**
+ * @brief Start the asynchronous I/O engine on the open disk
+ * @retval None
+ */
+void start_io() {
+    if (aio_init(fs->io_backend, fs->io_depth) != 0) {
+        printf("SFS > Falling back to synchronous I/O\n");
+        aio_init("sync", fs->io_depth);
+    }
+}
 
-        //create rot directory
-        init_root_directory();
 
-        init_fresh_disk(JITS_DISK, BLOCK_SZ, NUM_BLOCKS);
 
-        // write free block list
-        //super block bitmap
-        force_set_index(0);
+/**
+ * @brief Check the blocks read from the disk against their checksum table
+ * @param int Boolean, the table on the disk is up to date
+ * @retval None
+ */
+void attach_sums(int trusted) {
+    if (cache_sums_attach(CSUM_START, (int) fs->sb.csum_len, trusted) != 0) {
+        printf("SFS > Not enough memory for the checksums, running without them\n");
+    }
+}
 
-        // inode table bitmap
-        int i;
-        for(i = 1; i <= sb.inode_table_len; i++){
-            force_set_index(i);
-        }
 
-        // force the bit for the directory table
-        // and assign the data pointer in the directory i node
-        int j = 0;
-        for(i = (int) sb.inode_table_len +1; i <= sb.inode_table_len + NUM_DIR_BLOCKS +1; i++){
-            force_set_index(i);
-            inode_table[0].data_ptrs[j] = (unsigned) i;
-            j++;
+
+/**
+ * @brief Leave a table on the disk until its blocks are used
+ * @param lazy_table_t* Table
+ * @param int Number of blocks of the table
+ * @retval int Return zero on success, -1 if out of memory
+ */
+int defer_table(lazy_table_t *t, int nblocks) {
+    t->loaded = calloc(nblocks, 1);
+    t->missing = nblocks;
+    return t->loaded != NULL ? 0 : -1;
+}
+
+
+
+/**
+ * @brief Read the blocks of a table holding some bytes, if they are not in memory yet
+ * @long The runs of missing blocks are read in parallel.
+ * @param lazy_table_t* Table
+ * @param uint64_t Offset of the first byte in the table
+ * @param uint64_t Number of bytes
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int fault_in(lazy_table_t *t, uint64_t first, uint64_t len) {
+    if (t->loaded == NULL || len == 0) {
+        return 0;
+    }
+
+    int lo = (int) (first >> fs->block_shift);
+    int hi = (int) ((first + len - 1) >> fs->block_shift);
+    int err = 0;
+    int nblocks = 0;
+    int b = lo;
+    while (b <= hi) {
+        if (t->loaded[b]) {
+            b++;
+            continue;
         }
+        int run = 1;
+        while (b + run <= hi && !t->loaded[b + run]) {
+            run++;
+        }
+        if (cache_read_submit(t->start + b, run, t->data + ((uint64_t) b << fs->block_shift)) != 0) {
+            err = -1;
+        }
+        nblocks += run;
+        b += run;
+    }
+    if (nblocks == 0) {
+        return 0;
+    }
+    if (cache_wait() != 0 || err != 0) {
+        printf("SFS > Could not read the file system from the disk!\n");
+        return -1;
+    }
+    stats_metadata_faults(nblocks);
 
-        // init the other unassigned data pointer
-        while(j< 12){
-            inode_table[0].data_ptrs[j] = -1;
-            j++;
+    for (b = lo; b <= hi; b++) {
+        if (!t->loaded[b]) {
+            t->loaded[b] = 1;
+            t->missing--;
         }
-        inode_table[0].indirect_ptrs = -1;
+    }
+    if (t->missing == 0) {
+        free(t->loaded);
+        t->loaded = NULL;
+    }
+    return 0;
+}
 
-        // bitmap bitmap
-        //uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
 
-        uint8_t* free_bit_map = get_bitmap();
-        force_set_index(NUM_BLOCKS-1);
-        write_blocks(NUM_BLOCKS - 1, 1, (void*) free_bit_map);
-        
-        /* write super block
-         * write to first block, and only take up one block of space
-         * pass in sb as a pointer
-         */
-        write_blocks(0, 1, (void*) &sb);
 
-        // write inode table
-        write_blocks(1, (int) sb.inode_table_len, (void*) inode_table);
+/**
+ * @brief Make sure some inodes are in memory
+ * @param int Index of the first inode
+ * @param int Number of inodes
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int load_inodes(int first, int count) {
+    return fault_in(&fs->lazy_inodes, (uint64_t) first * sizeof(inode_t),
+                    (uint64_t) count * sizeof(inode_t));
+}
 
-        //write directory table
-        write_blocks((int) sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) directory_table);
 
-    } else {
-        printf("SFS > Reopening file system\n");
-        // open super block
-        read_blocks(0, 1, &sb);
-        printf("SFS > Block Size is: %i \n", (int) sb.block_size);
 
-        // open inode table
-        read_blocks(1, (int) sb.inode_table_len, (void*) inode_table);
+/**
+ * @brief Make sure some directory entries are in memory
+ * @param int Index of the first entry
+ * @param int Number of entries
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int load_entries(int first, int count) {
+    return fault_in(&fs->lazy_entries, (uint64_t) first * sizeof(entry_t),
+                    (uint64_t) count * sizeof(entry_t));
+}
+
 
-        // open directory_table
-        read_blocks((int) sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) directory_table);
 
-        // open free block list
-        uint8_t* free_bit_map = get_bitmap();
-        read_blocks(NUM_BLOCKS - 1, 1, (void*) free_bit_map);
+/**
+ * @brief Read part of the free bitmap, for bitmap_defer
+ * @param uint32_t First byte, on a block boundary
+ * @param uint32_t Number of bytes, whole blocks
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int load_bitmap(uint32_t first, uint32_t len) {
+    int nblocks = (int) (len >> fs->block_shift);
+    if (cache_read(BITMAP_START + (int) (first >> fs->block_shift), nblocks, get_bitmap() + first) < 0) {
+        return -1;
     }
-	return;
+    stats_metadata_faults(nblocks);
+    return 0;
 }
 
 
 
 /**
- * @brief Get the name of the next file on the directory table
- * @param char* Name of the file
- * @retval int The amount of file left
+ * @brief Write the super block and wait for it
+ * @retval int Return zero on success, -1 if the disk failed
  */
-int sfs_getnextfilename(char *fname) {
+int write_superblock() {
+    char *block = calloc(1, BLOCK_SZ);
+    memcpy(block, &fs->sb, sizeof(fs->sb));
+    int ret = cache_write(0, 1, (void*) block);
+    free(block);
+    return ret < 0 ? -1 : 0;
+}
 
-    directory_table_index++;
-    int count = 1;
 
-    //check if you are at the end of the table
-    if(directory_table_index == sizeof(directory_table)/ sizeof(directory_table[0])) {
-        directory_table_index = -1;
-        return 0;
+
+/**
+ * @brief Mark the volume in use before the first write after a mount
+ * @long The super block reaches stable storage before anything else is
+ *       written, so that a crash leaves a volume the next mount checks.
+ *       Data writes count too: they change the checksum table.
+ * @retval None
+ */
+void volume_in_use() {
+    if (fs->sb.state != SFS_STATE_CLEAN) {
+        return;
+    }
+    fs->sb.state = SFS_STATE_DIRTY;
+    if (write_superblock() != 0 || cache_flush() != 0) {
+        printf("SFS > Could not mark the file system as in use!\n");
     }
+}
 
-    // find the next directory that is used
-    while(directory_table[directory_table_index].used == 0) {
-        directory_table_index++;
-        // check if you are at the end of the table
-        if(directory_table_index == sizeof(directory_table)/ sizeof(directory_table[0])){
-            directory_table_index = 0;
-            return 0;
-        }
 
-        // check if you have gone through all the table
-        if(count == sizeof(directory_table)/ sizeof(directory_table[0])) {
-            printf("SFS > There is no file in the directory.\n");
-            return 0;
-        }
-        count++;
+
+/**
+ * @brief Account for a change of the metadata about to be written
+ * @retval None
+ */
+void metadata_changed() {
+    fs->meta_gen++;
+    volume_in_use();
+}
+
+
+
+/**
+ * @brief Write the metadata back and mark the volume clean in the super block
+ * @long The super block then holds what a mount needs to skip the tables:
+ *       the free block and inode counts and where the free blocks start.
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int checkpoint() {
+    if (!sfs_is_mounted() || fs->sb.state == SFS_STATE_CLEAN) {
+        return 0;
     }
 
-    int i;
-    for (i = 0; i< strlen(directory_table[directory_table_index].name); i++){
-        fname[i] = (directory_table[directory_table_index].name)[i];
+    // everything else is on stable storage before the super block says so
+    if (cache_flush() != 0 || cache_sums_flush() != 0) {
+        printf("SFS > Could not write the file system back to the disk!\n");
+        return -1;
+    }
+    fs->sb.state = SFS_STATE_CLEAN;
+    fs->sb.free_blocks = bitmap_free();
+    fs->sb.first_free_byte = bitmap_first_free();
+    if (write_superblock() != 0 || cache_flush() != 0) {
+        fs->sb.state = SFS_STATE_DIRTY;
+        printf("SFS > Could not write the super block!\n");
+        return -1;
     }
-    fname[i] = '\0';
+    return 0;
+}
 
 
-	// return how many entry there is left in the directory
-    return sizeof(directory_table)/ sizeof(directory_table[0]) - directory_table_index -1;
+
+/**
+ * @brief Checkpoint the mounted file system and close its disk
+ * @retval None
+ */
+void unmount() {
+    if (sfs_is_mounted()) {
+        store_chunks(-1, UINT64_MAX);
+    }
+    drop_chunks(-1);
+    fs->meta_gen++;
+    fs->mount_gen++;
+    checkpoint();
+    cache_invalidate();
+    aio_shutdown();
+    close_disk();
+    memset(&fs->sb, 0, sizeof(fs->sb));
 }
 
 
 
 /**
- * @brief Get the size of a file
- * @param cont char* Name of the file
- * @retval int Size of the file
+ * @brief Write the block(s) of the inode table holding an inode
+ * @long Like write_entry and write_bitmap, the write is only queued,
+ *       the caller waits for it with cache_wait.
+ * @param int Index of the inode
+ * @retval None
  */
-int sfs_getfilesize(const char* path) {
+void write_inode(int inode) {
+    metadata_changed();
+    uint64_t first = ((uint64_t) inode * sizeof(inode_t)) >> fs->block_shift;
+    uint64_t last = ((uint64_t) (inode + 1) * sizeof(inode_t) - 1) >> fs->block_shift;
+    cache_write_submit(1 + (int) first, (int) (last - first + 1),
+                 (char*) fs->inode_table + (first << fs->block_shift));
+}
 
-    int i;
-	for(i = 0; i < sizeof(directory_table)/ sizeof(directory_table[0]); i++) {
-        if(directory_table[i].used == 1) {
-            if (strcmp(directory_table[i].name, path) == 0) {
-                return inode_table[directory_table[i].inode].size;
-            }
-        }
-    }
 
-    printf("SFS > File %s not found when getting size!\n", path);
-	return 0;
+
+/**
+ * @brief Write the block(s) of the directory table holding an entry
+ * @param int Index of the entry
+ * @retval None
+ */
+void write_entry(int entry) {
+    metadata_changed();
+    uint64_t first = ((uint64_t) entry * sizeof(entry_t)) >> fs->block_shift;
+    uint64_t last = ((uint64_t) (entry + 1) * sizeof(entry_t) - 1) >> fs->block_shift;
+    cache_write_submit(1 + (int) fs->sb.inode_table_len + (int) first, (int) (last - first + 1),
+                 (char*) fs->directory_table + (first << fs->block_shift));
 }
 
 
 
 /**
- * @brief Open a file, if it does not exit a new file is created
- * @param char Name of the file to open
- * @retval int The file ID
+ * @brief Write the free bitmap to the end of the disk
+ * @param int Boolean deciding on writing all of it or only the blocks that changed
+ * @retval None
  */
-int sfs_fopen(char *name) {
+void write_bitmap(int all) {
+    uint32_t first, last;
 
+    // share counts change along with the bitmap
+    dedup_write();
+    if (!bitmap_take_changed(&first, &last) && !all) {
+        return;
+    }
+    metadata_changed();
+    if (all) {
+        cache_write_submit(BITMAP_START, (int) fs->sb.bitmap_len, (void*) get_bitmap());
+        return;
+    }
+    first >>= fs->block_shift;
+    last >>= fs->block_shift;
+    cache_write_submit(BITMAP_START + (int) first, (int) (last - first + 1),
+                 (void*) (get_bitmap() + ((uint64_t) first << fs->block_shift)));
+}
+
+
+
+/**
+ * @brief Initialize the root directory
+ * @retval None
+ */
+void init_root_directory() {
+
+    // inode
+    inode_t rd;
+    rd.used = 1;
+    rd.mode = 777;
+    rd.link_cnt = 1;
+    rd.uid = 0;
+    rd.gid = 0;
+    rd.size = 0;
+    rd.flags = SFS_INODE_DIR | SFS_INODE_INLINE;
+    memset(rd.inline_data, 0, SFS_INLINE_MAX);
+
+    fs->inode_table[0] = rd;
+
+    // directory
+    int i;
+    for(i = 0; i < NUM_ENTRIES; i++){
+        fs->directory_table[i].used = 0;
+    }
+}
+
+
+
+/**
+ * @brief Initialize the inode table
+ * @retval None
+ */
+void init_inode_table() {
+    int i;
+    for(i = 1; i < NUM_INODES_FS; i++){
+        fs->inode_table[i].used = 0;
+    }
+}
+
+
+
+/**
+ * @brief Initialize the file descriptor table
+ * @retval None
+ */
+void init_file_descriptor() {
+    int i;
+    for(i = 0; i < NUM_INODES_FS; i++){
+        fs->fdt[i].used = 0;
+        fs->fdt[i].inode = -1;
+    }
+    fs->directory_table_index = -1;
+}
+
+
+
+/**
+ * @brief Read the super block and open the disk with the geometry it describes
+ * @retval int Return zero if a valid file system was found
+ */
+int open_superblock() {
+    char probe[MIN_BLOCK_SIZE];
+
+    // the super block fits in the smallest block, whatever the block size is
+    if (init_disk(DISK_FILE, MIN_BLOCK_SIZE, 1) != 0) {
+        return -1;
+    }
+    int ret = read_blocks(0, 1, probe);
+    close_disk();
+    if (ret != 1) {
+        return -1;
+    }
+    memcpy(&fs->sb, probe, sizeof(fs->sb));
+
+    if (check_superblock() != 0) {
+        return -1;
+    }
+
+    return init_disk(DISK_FILE, BLOCK_SZ, NUM_BLOCKS_FS);
+}
+
+
+
+/**
+ * @brief Make the repairs of a check on the mounted file system
+ * @long The tables checked are the mounted ones, or a copy of them taken
+ *       while the metadata did not change since.
+ * @param check_volume_t* Volume checked with repairs
+ * @retval None
+ */
+void apply_repairs(check_volume_t *v) {
+    int i;
+    check_fix_t *fix;
+
+    for (i = 0; i < NUM_INODES_FS; i++) {
+        if (v->inode_changed[i] & CHECK_INODE_CHANGED) {
+            if (v->inodes != fs->inode_table) {
+                fs->inode_table[i] = v->inodes[i];
+            }
+            write_inode(i);
+        }
+    }
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        if (v->entry_changed[i]) {
+            if (v->entries != fs->directory_table) {
+                fs->directory_table[i] = v->entries[i];
+            }
+            write_entry(i);
+        }
+    }
+    for (fix = v->fixes; fix != NULL; fix = fix->next) {
+        metadata_changed();
+        cache_write_submit((int) fix->block, 1, (void*) fix->ptrs);
+    }
+
+    // bring the bitmap to what the files use
+    uint8_t *bitmap = get_bitmap();
+    uint64_t k;
+    for (k = 0; k < fs->sb.bitmap_len * fs->sb.block_size; k++) {
+        uint8_t diff = bitmap[k] ^ v->expected[k];
+        while (diff != 0) {
+            int bit = __builtin_ctz(diff);
+            if ((v->expected[k] >> bit) & 1) {
+                rm_index((uint32_t) (k * 8 + bit));
+            } else {
+                force_set_index((uint32_t) (k * 8 + bit));
+            }
+            diff &= diff - 1;
+        }
+    }
+
+    // the index may know blocks the repairs gave back
+    if (v->refs_changed) {
+        uint8_t *refs = dedup_table();
+        if (refs != NULL && refs != v->refs) {
+            memcpy(refs, v->refs, fs->sb.refs_len * fs->sb.block_size);
+        }
+        dedup_table_changed();
+    }
+    write_bitmap(0);
+    cache_wait();
+
+    // entries may have been dropped
+    dcache_reset((uint32_t) NUM_ENTRIES);
+
+    // shared blocks may have been given back to the bitmap
+    pack_reset(BLOCK_SZ);
+
+    // chunks of compressed files read before the repairs may have changed, those written since are newer
+    for (i = 0; i < NUM_INODES_FS; i++) {
+        if (fs->fdt[i].zdirtied == 0) {
+            free(fs->fdt[i].zbuf);
+            fs->fdt[i].zbuf = NULL;
+        }
+    }
+
+    fs->sb.free_inodes = 0;
+    for (i = 1; i < NUM_INODES_FS; i++) {
+        fs->sb.free_inodes += fs->inode_table[i].used == 0;
+    }
+}
+
+
+
+/**
+ * @brief Check a volume that was not unmounted cleanly and repair it
+ * @long Its tables are all in memory, see check_run for what is repaired.
+ * @retval int Number of problems fixed
+ */
+int check_volume() {
+    sfs_check_opts_t opts = { 0, 0, 0, 1 };
+    sfs_check_report_t report;
+    check_volume_t v;
+
+    memset(&v, 0, sizeof(v));
+    v.sb = &fs->sb;
+    v.inodes = fs->inode_table;
+    v.entries = fs->directory_table;
+    v.bitmap = get_bitmap();
+    v.refs = dedup_table();
+    v.fd = disk_fd();
+    if (check_run(&v, &opts, &report) != 0) {
+        printf("SFS > Out of memory!\n");
+        exit(-1);
+    }
+    apply_repairs(&v);
+    check_release(&v);
+
+    stats_mount_check((int) check_problems(&report));
+    return (int) check_problems(&report);
+}
+
+
+
+static void sfs_exit(void);
+
+static void exit_init(void) {
+    atexit(sfs_exit);
+    cache_set_writeback_hook(writeback_chunks);
+}
+
+
+
+/**
+ * @brief Unmount at exit every volume a mksfs mounted
+ * @long The async worker and the flusher of each volume, the default one
+ *       included, are stopped first, so that they do not run on a volume
+ *       being unmounted.
+ * @retval None
+ */
+static void sfs_exit(void) {
+    sfs_t *v;
+
+    pthread_mutex_lock(&volumes_lock);
+    for (v = &default_fs; v != NULL; v = v == &default_fs ? volumes : v->next) {
+        sfs_use(v);
+        sfs_async_shutdown();
+        if (v->unmount_at_exit) {
+            cache_stop();
+            sfs_unmount();
+        }
+    }
+    pthread_mutex_unlock(&volumes_lock);
+}
+
+
+
+/**
+ * @brief Make or open a file system
+ * @param int Boolean deciding on making a new file or openning an existing one
+ * @retval None
+ */
+void mksfs(int fresh) {
+    API_BEGIN(STAT_MKSFS, NULL, -1, fresh, 0);
+
+	//Implement mksfs here
+    unmount();
+    pthread_once(&exit_once, exit_init);
+    fs->unmount_at_exit = 1;
+
+    if (fresh) {
+        printf("SFS > Making new file system\n");
+
+        // create super block, its tables must not overlap
+        init_superblock();
+        if (check_geometry(&fs->sb) != 0) {
+            printf("SFS > %i blocks cannot hold the metadata of %i inodes!\n",
+                   (int) fs->sb.num_blocks, (int) fs->sb.num_inodes);
+            memset(&fs->sb, 0, sizeof(fs->sb));
+            stats_end(STAT_MKSFS, &st, -1, 0);
+            trace_end(&tr, -1);
+            sfs_unlock();
+            return;
+        }
+        alloc_tables();
+
+        init_inode_table();
+
+        //create rot directory
+        init_root_directory();
+
+        init_fresh_disk(DISK_FILE, BLOCK_SZ, NUM_BLOCKS_FS);
+        start_io();
+
+        // write free block list
+        //super block bitmap
+        force_set_index(0);
+
+        // inode table bitmap
+        int i;
+        for(i = 1; i <= fs->sb.inode_table_len; i++){
+            force_set_index(i);
+        }
+
+        // force the bit for the directory table
+        // and assign the data pointer in the directory i node
+        int j = 0;
+        for(i = (int) fs->sb.inode_table_len +1; i <= fs->sb.inode_table_len + NUM_DIR_BLOCKS; i++){
+            force_set_index(i);
+            if (j < 12) {
+                fs->inode_table[0].data_ptrs[j] = (unsigned) i;
+                j++;
+            }
+        }
+
+        // init the other unassigned data pointer
+        while(j< 12){
+            fs->inode_table[0].data_ptrs[j] = NO_BLOCK;
+            j++;
+        }
+        fs->inode_table[0].indirect_ptrs = NO_BLOCK;
+
+        // share count table, checksum table and bitmap bitmap
+        for(i = REFS_START; i < NUM_BLOCKS_FS; i++){
+            force_set_index(i);
+        }
+
+        // the new disk reads back as zeros: every checksum is unknown
+        attach_sums(1);
+        write_bitmap(1);
+
+        /* write super block
+         * write to first block, and only take up one block of space
+         * a new volume is clean: its tables match the checkpoint
+         */
+        fs->sb.state = SFS_STATE_CLEAN;
+        fs->sb.free_blocks = bitmap_free();
+        fs->sb.first_free_byte = bitmap_first_free();
+        char *block = calloc(1, BLOCK_SZ);
+        memcpy(block, &fs->sb, sizeof(fs->sb));
+        cache_write_submit(0, 1, (void*) block);
+
+        // write inode table
+        cache_write_submit(1, (int) fs->sb.inode_table_len, (void*) fs->inode_table);
+
+        //write directory table
+        cache_write_submit((int) fs->sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) fs->directory_table);
+
+        cache_wait();
+        free(block);
+
+    } else {
+        printf("SFS > Reopening file system\n");
+        // open super block
+        if (open_superblock() != 0) {
+            // leave an empty file system behind, every call on it fails
+            memset(&fs->sb, 0, sizeof(fs->sb));
+            stats_end(STAT_MKSFS, &st, -1, 0);
+            trace_end(&tr, -1);
+            sfs_unlock();
+            return;
+        }
+        printf("SFS > Block Size is: %i \n", (int) fs->sb.block_size);
+        alloc_tables();
+        start_io();
+        attach_sums(checkpoint_valid());
+
+        // a clean volume is trusted, its tables are read when first used
+        if (checkpoint_valid()
+            && defer_table(&fs->lazy_inodes, (int) fs->sb.inode_table_len) == 0
+            && defer_table(&fs->lazy_entries, NUM_DIR_BLOCKS) == 0
+            && bitmap_defer(BLOCK_SZ, load_bitmap, (uint32_t) fs->sb.free_blocks,
+                            (uint32_t) fs->sb.first_free_byte) == 0) {
+            printf("SFS > Mounted a clean file system\n");
+
+        } else {
+            printf("SFS > The file system was not unmounted cleanly, checking it\n");
+            free(fs->lazy_inodes.loaded);
+            free(fs->lazy_entries.loaded);
+            fs->lazy_inodes.loaded = NULL;
+            fs->lazy_entries.loaded = NULL;
+
+            // open inode table
+            cache_read_submit(1, (int) fs->sb.inode_table_len, (void*) fs->inode_table);
+
+            // open directory_table
+            cache_read_submit((int) fs->sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) fs->directory_table);
+
+            // open free block list
+            cache_read_submit(BITMAP_START, (int) fs->sb.bitmap_len, (void*) get_bitmap());
+
+            cache_wait();
+            bitmap_recount();
+            fs->sb.state = SFS_STATE_DIRTY;
+            printf("SFS > %d repairs\n", check_volume());
+        }
+    }
+
+    // forget the files opened on the previous file system
+    init_file_descriptor();
+
+    stats_end(STAT_MKSFS, &st, 0, 0);
+    trace_end(&tr, 0);
+    sfs_unlock();
+	return;
+}
+
+
+
+/**
+ * @brief Write the mounted file system back and mark it clean
+ * @long The next mksfs(0) of a clean volume reads only the super block.
+ *       Called at exit as well.
+ * @retval None
+ */
+void sfs_unmount(void) {
+    sfs_lock();
+    unmount();
+    sfs_unlock();
+}
+
+
+
+/**
+ * @brief Make a volume, with its own file system, lock, block cache and I/O engine
+ * @long The calling thread works on it after sfs_use, and its first mksfs
+ *       mounts it from the image chosen with sfs_set_disk_file.
+ * @retval sfs_t* The volume, NULL if out of memory
+ */
+sfs_t *sfs_new(void) {
+    sfs_t empty = SFS_EMPTY;
+    sfs_t *v = malloc(sizeof(sfs_t));
+
+    if (v == NULL) {
+        return NULL;
+    }
+    *v = empty;
+    v->bitmap = bitmap_new();
+    v->disk = disk_new();
+    v->aio = aio_new();
+    v->cache = cache_new();
+    v->pack = pack_new();
+    v->dedup = dedup_new();
+    v->dcache = dcache_new();
+    v->async = async_new();
+    if (v->bitmap == NULL || v->disk == NULL || v->aio == NULL || v->cache == NULL
+        || v->pack == NULL || v->dedup == NULL || v->dcache == NULL || v->async == NULL) {
+        bitmap_destroy(v->bitmap);
+        disk_destroy(v->disk);
+        aio_destroy(v->aio);
+        cache_destroy(v->cache);
+        pack_destroy(v->pack);
+        dedup_destroy(v->dedup);
+        dcache_destroy(v->dcache);
+        async_destroy(v->async);
+        free(v);
+        return NULL;
+    }
+    api_lock_init(&v->api_lock);
+
+    pthread_mutex_lock(&volumes_lock);
+    v->next = volumes;
+    volumes = v;
+    pthread_mutex_unlock(&volumes_lock);
+    return v;
+}
+
+
+
+/**
+ * @brief Make the calling thread work on a volume
+ * @long Every sfs_* call of the thread goes to it from then on. Every
+ *       thread starts on the default volume, NULL goes back to it.
+ * @param sfs_t* The volume
+ * @retval None
+ */
+void sfs_use(sfs_t *vol) {
+    fs = vol != NULL ? vol : &default_fs;
+    bitmap_use(fs->bitmap);
+    disk_use(fs->disk);
+    aio_use(fs->aio);
+    cache_use(fs->cache);
+    pack_use(fs->pack);
+    dedup_use(fs->dedup);
+    dcache_use(fs->dcache);
+    async_use(fs->async);
+}
+
+
+
+/**
+ * @brief Volume the calling thread works on
+ * @retval sfs_t* The volume
+ */
+sfs_t *sfs_current(void) {
+    return fs;
+}
+
+
+
+/**
+ * @brief Unmount a volume made by sfs_new and free it
+ * @long No other thread may work on it. The calling thread goes back to
+ *       the default volume if it worked on this one.
+ * @param sfs_t* The volume, NULL and the default volume are ignored
+ * @retval None
+ */
+void sfs_free(sfs_t *vol) {
+    sfs_t *prev = fs;
+    sfs_t **p;
+    int i;
+
+    if (vol == NULL || vol == &default_fs) {
+        return;
+    }
+    sfs_use(vol);
+    sfs_async_shutdown();
+    cache_stop();
+    unmount();
+
+    pthread_mutex_lock(&volumes_lock);
+    for (p = &volumes; *p != NULL && *p != vol; p = &(*p)->next) {
+    }
+    if (*p != NULL) {
+        *p = vol->next;
+    }
+    pthread_mutex_unlock(&volumes_lock);
+
+    for (i = 0; vol->fdt != NULL && i < (int) vol->sb.num_inodes; i++) {
+        free(vol->fdt[i].zbuf);
+    }
+    free(vol->inode_table);
+    free(vol->directory_table);
+    free(vol->fdt);
+    free(vol->lazy_inodes.loaded);
+    free(vol->lazy_entries.loaded);
+    free(vol->disk_file);
+    bitmap_destroy(vol->bitmap);
+    disk_destroy(vol->disk);
+    aio_destroy(vol->aio);
+    cache_destroy(vol->cache);
+    pack_destroy(vol->pack);
+    dedup_destroy(vol->dedup);
+    dcache_destroy(vol->dcache);
+    async_destroy(vol->async);
+    pthread_mutex_destroy(&vol->api_lock);
+    free(vol);
+
+    sfs_use(prev == vol ? NULL : prev);
+}
+
+
+
+/**
+ * @brief Name of an entry
+ * @long Images made before subdirectories may hold names starting with the
+ *       '/' of the paths FUSE hands over, it is not part of the name.
+ * @param entry_t* Entry
+ * @retval const char* The name
+ */
+const char *entry_name(const entry_t *e) {
+    return e->name[0] == '/' ? e->name + 1 : e->name;
+}
+
+
+
+/**
+ * @brief Tell if an inode is a directory, its block of the inode table must be loaded
+ * @param uint64_t Inode
+ * @retval int 1 for a directory, 0 otherwise
+ */
+int is_dir(uint64_t inode) {
+    return inode == fs->sb.root_dir_inode || (fs->inode_table[inode].flags & SFS_INODE_DIR) != 0;
+}
+
+
+
+/**
+ * @brief Find a name in a directory, in the dentry cache first
+ * @param uint32_t Inode of the directory
+ * @param const char* Name, without '/'
+ * @retval int The entry of the name, -1 if the directory has none, -2 if the directory cannot be read
+ */
+int lookup(uint32_t dir, const char *name) {
+    int entry;
+    int i;
+
+    if (dcache_lookup(dir, name, &entry)) {
+        return entry;
+    }
+
+    // the whole directory is needed to tell that the name is missing
+    if (load_entries(0, NUM_ENTRIES) != 0) {
+        return -2;
+    }
+
+    // from now on, most names that are missing are told without a search
+    if (!dcache_filled()) {
+        for (i = 0; i < NUM_ENTRIES; i++) {
+            if (fs->directory_table[i].used == 1) {
+                dcache_add(fs->directory_table[i].parent, entry_name(&fs->directory_table[i]));
+            }
+        }
+        dcache_fill_done();
+        if (dcache_lookup(dir, name, &entry)) {
+            return entry;
+        }
+    }
+    entry = DCACHE_MISSING;
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        if (fs->directory_table[i].used == 1 && fs->directory_table[i].parent == dir
+            && strcmp(entry_name(&fs->directory_table[i]), name) == 0) {
+            entry = i;
+            break;
+        }
+    }
+    dcache_set(dir, name, entry);
+    return entry;
+}
+
+
+
+/**
+ * @brief Walk a path from the root directory
+ * @long Names are separated by '/' and empty names are skipped, so "a/b",
+ *       "/a/b" and "/a//b/" are the same path. Every name but the last must
+ *       be a directory.
+ * @param const char* Path
+ * @param path_t* Where the path leads
+ * @retval int Return zero if every directory on the way exists, -1 otherwise,
+ *         if a name is too long or if the disk failed
+ */
+int walk(const char *path, path_t *p) {
+    p->dir = (uint32_t) fs->sb.root_dir_inode;
+    p->entry = -1;
+    p->name[0] = '\0';
+
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return 0;
+        }
+        size_t len = strcspn(path, "/");
+        if (len > MAXFILENAME) {
+            return -1;
+        }
+
+        // the name before is a directory on the way
+        if (p->name[0] != '\0') {
+            if (p->entry < 0) {
+                return -1;
+            }
+            uint64_t inode = fs->directory_table[p->entry].inode;
+            if (load_inodes((int) inode, 1) != 0 || !is_dir(inode)) {
+                return -1;
+            }
+            p->dir = (uint32_t) inode;
+        }
+
+        memcpy(p->name, path, len);
+        p->name[len] = '\0';
+        p->entry = lookup(p->dir, p->name);
+        if (p->entry == -2) {
+            return -1;
+        }
+        path += len;
+    }
+}
+
+
+
+/**
+ * @brief Make a new file or directory at the end of a path that leads nowhere yet
+ * @param path_t* Where the path leads, from walk
+ * @param unsigned int SFS_INODE_DIR for a directory, zero for a file
+ * @retval int The inode of the new file, -1 if the inode table or the directory is full
+ */
+int create_entry(path_t *p, unsigned int flags) {
+
+    // find the first empty spot in the inode_table
+    // its blocks are read one at a time until one has a free inode
+    int new_inode_table_index = 0;
+    if (fs->sb.free_inodes == 0) {
+        printf("SFS > There is no more space in the inode table!\n");
+        return -1;
+    }
+    while(load_inodes(new_inode_table_index, 1) != 0
+          || fs->inode_table[ new_inode_table_index ].used == 1) {
+        new_inode_table_index++;
+
+        // if there is no more space in the table
+        if(new_inode_table_index == NUM_INODES_FS){
+            printf("SFS > There is no more space in the inode table!\n");
+            return -1;
+        }
+
+    }
+
+    // find the first empty spot in the directory_table
+    if (load_entries(0, NUM_ENTRIES) != 0) {
+        return -1;
+    }
+    int  new_entry_index = 0;
+    while(fs->directory_table[ new_entry_index ].used == 1) {
+        new_entry_index++;
+
+        // if there is no space in the table
+        if(new_entry_index == NUM_ENTRIES){
+            printf("SFS > No more space in the directory table! \n");
+            return -1;
+        }
+    }
+
+    // initialize the inode
+    inode_t new_inode;
+    new_inode.used = 1;
+    new_inode.mode = 777;
+    new_inode.link_cnt = 1;
+    new_inode.uid = 0;
+    new_inode.gid = 0;
+    new_inode.size = 0;
+
+    // a new file keeps its data in the inode until it outgrows it, a directory has none
+    new_inode.flags = SFS_INODE_INLINE | flags;
+    if (!(flags & SFS_INODE_DIR) && fs->compress_new_files) {
+        new_inode.flags |= SFS_INODE_COMPRESSED;
+    }
+    memset(new_inode.inline_data, 0, SFS_INLINE_MAX);
+
+    // update inode_table in memory
+    fs->inode_table[ new_inode_table_index ] = new_inode;
+    fs->sb.free_inodes--;
+
+    // initialize the new entry
+    entry_t new_entry;
+    memset(&new_entry, 0, sizeof(new_entry));
+    new_entry.used = 1;
+    new_entry.parent = p->dir;
+    new_entry.inode = new_inode_table_index;
+    strcpy(new_entry.name, p->name);
+
+    fs->directory_table[new_entry_index] = new_entry;
+    p->entry = new_entry_index;
+    dcache_set(p->dir, p->name, new_entry_index);
+
+    // update inode table on disk
+    write_inode(new_inode_table_index);
+
+    // update directory table on disk
+    write_entry(new_entry_index);
+    cache_wait();
+
+    return new_inode_table_index;
+}
+
+
+
+/**
+ * @brief Drop the entry and the inode of a file or an empty directory
+ * @long The caller gave the blocks of the file back first.
+ * @param path_t* Where the path leads, from walk, to an entry
+ * @retval None
+ */
+void remove_entry(path_t *p) {
+    int inode = (int) fs->directory_table[p->entry].inode;
+
+    // remove from directory_table
+    fs->directory_table[p->entry].used = 0;
+    dcache_set(p->dir, p->name, DCACHE_MISSING);
+
+    // remove from inode_table
+    fs->inode_table[inode].used = 0;
+    fs->sb.free_inodes++;
+
+    // update disk
+    write_bitmap(0);
+    write_inode(inode);
+    write_entry(p->entry);
+    cache_wait();
+}
+
+
+
+/**
+ * @brief Get the name of the next file of the root directory
+ * @long Every caller shares one place in the directory, sfs_readdir and
+ *       sfs_readdirplus let each listing keep its own.
+ * @param char* Name of the file
+ * @retval int The amount of file left
+ */
+int sfs_getnextfilename(char *fname) {
+    API_BEGIN(STAT_GETNEXTFILENAME, NULL, -1, 0, 0);
+
+    if (load_entries(0, NUM_ENTRIES) != 0) {
+        API_RETURN(STAT_GETNEXTFILENAME, 0);
+    }
+
+    fs->directory_table_index++;
+    int count = 1;
+
+    //check if you are at the end of the table
+    if(fs->directory_table_index >= NUM_ENTRIES) {
+        fs->directory_table_index = -1;
+        API_RETURN(STAT_GETNEXTFILENAME, 0);
+    }
+
+    // find the next file of the root directory
+    while(fs->directory_table[fs->directory_table_index].used == 0
+          || fs->directory_table[fs->directory_table_index].parent != fs->sb.root_dir_inode) {
+        fs->directory_table_index++;
+        // check if you are at the end of the table
+        if(fs->directory_table_index == NUM_ENTRIES){
+            fs->directory_table_index = 0;
+            API_RETURN(STAT_GETNEXTFILENAME, 0);
+        }
+
+        // check if you have gone through all the table
+        if(count == NUM_ENTRIES) {
+            printf("SFS > There is no file in the directory.\n");
+            API_RETURN(STAT_GETNEXTFILENAME, 0);
+        }
+        count++;
+    }
+
+    strcpy(fname, entry_name(&fs->directory_table[fs->directory_table_index]));
+
+
+	// return how many entry there is left in the directory
+    API_RETURN(STAT_GETNEXTFILENAME, NUM_ENTRIES - fs->directory_table_index -1);
+}
+
+
+
+/**
+ * @brief Get the size of a file
+ * @param cont char* Name of the file
+ * @retval int Size of the file, -1 if there is none
+ */
+int sfs_getfilesize(const char* path) {
+    API_BEGIN(STAT_GETFILESIZE, path, -1, 0, 0);
+
+    path_t p;
+    if (walk(path, &p) != 0) {
+        API_RETURN(STAT_GETFILESIZE, -1);
+    }
+    if (p.name[0] == '\0') {
+        API_RETURN(STAT_GETFILESIZE, 0);
+    }
+    if (p.entry >= 0) {
+        uint64_t inode = fs->directory_table[p.entry].inode;
+        if (load_inodes((int) inode, 1) != 0) {
+            API_RETURN(STAT_GETFILESIZE, -1);
+        }
+        API_RETURN(STAT_GETFILESIZE, fs->inode_table[inode].size);
+    }
+
+    // a name that does not exist is often looked up on purpose, it is not worth a message
+	API_RETURN(STAT_GETFILESIZE, -1);
+}
+
+
+
+/**
+ * @brief Open a file, if it does not exit a new file is created
+ * @param char Name of the file to open
+ * @retval int The file ID
+ */
+int sfs_fopen(char *name) {
+    API_BEGIN(STAT_FOPEN, name, -1, 0, 0);
+
+
+    if(strlen(name) == 0 || NUM_INODES_FS == 0){
+        API_RETURN(STAT_FOPEN, -1);
+    }
+
+    // every directory on the way must exist, and the last name must not be one
+    path_t p;
+    if (walk(name, &p) != 0 || p.name[0] == '\0') {
+        API_RETURN(STAT_FOPEN, -1);
+    }
+
+    uint64_t inode_table_index;
+    if (p.entry < 0) {
+
+        /* FILE DOES NOT EXIST */
+        int new_inode = create_entry(&p, 0);
+        if (new_inode == -1) {
+            API_RETURN(STAT_FOPEN, -1);
+        }
+        inode_table_index = new_inode;
+
+    } else {
+        inode_table_index = fs->directory_table[p.entry].inode;
+        if (load_inodes((int) inode_table_index, 1) != 0) {
+            API_RETURN(STAT_FOPEN, -1);
+        }
+        if (is_dir(inode_table_index)) {
+            printf("SFS > %s is a directory!\n", name);
+            API_RETURN(STAT_FOPEN, -1);
+        }
+    }
+
+    // check is the file is already open
+    int open_file_index;
+    for(open_file_index = 0; open_file_index < NUM_INODES_FS; open_file_index++){
+        if(fs->fdt[open_file_index].inode == inode_table_index){
+            API_RETURN(STAT_FOPEN, open_file_index);
+        }
+    }
+
+
+    // find a spot on the file descriptor table
+    int  new_fdt_index = 0;
+    while(fs->fdt[ new_fdt_index ].used == 1) {
+        new_fdt_index++;
+        if(new_fdt_index == NUM_INODES_FS) {
+            printf("SFS > There is no more space in the file descriptor table!\n");
+            API_RETURN(STAT_FOPEN, -1);
+        }
+    }
+
+    fs->fdt[new_fdt_index].used = 1;
+    fs->fdt[new_fdt_index].inode = inode_table_index;
+    fs->fdt[new_fdt_index].rwptr = fs->inode_table[inode_table_index].size;
+    fs->fdt[new_fdt_index].seq_end = 0;
+    fs->fdt[new_fdt_index].ra_end = 0;
+    fs->fdt[new_fdt_index].zbuf = NULL;
+    fs->fdt[new_fdt_index].zdirtied = 0;
+
+
+	API_RETURN(STAT_FOPEN, new_fdt_index);
+}
+
+
+
+/**
+ * @brief Close a file that was open
+ * @param int File ID of an open file
+ * @retval int Return zero on success
+ */
+int sfs_fclose(int fileID){
+    API_BEGIN(STAT_FCLOSE, NULL, fileID, 0, 0);
+	// check if the there is a file open
+    if(fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        printf("SFS > The file %i was not used! \n", fileID);
+        API_RETURN(STAT_FCLOSE, -1);
+    }
+
+    // what was written to a compressed file is stored before the file goes
+    int ret = store_chunks(fileID, UINT64_MAX);
+    free(fs->fdt[fileID].zbuf);
+    fs->fdt[fileID].zbuf = NULL;
+    fs->fdt[fileID].used = 0;
+    fs->fdt[fileID].inode = -1;
+
+	API_RETURN(STAT_FCLOSE, ret);
+}
+
+
+
+/**
+ * @brief Start mapping the blocks of a file
+ * @param block_map_t* Map to initialize
+ * @param inode_t* Inode of the file
+ * @retval None
+ */
+void map_init(block_map_t *map, inode_t *n) {
+    map->n = n;
+    map->ptrs = NULL;
+    map->loaded = 0;
+    map->dirty = 0;
+    map->allocated = 0;
+    map->failed = 0;
+}
+
+
+
+/**
+ * @brief Find the block pointer of a block of a file
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the block in the file
+ * @param int Boolean deciding on creating the indirect block if the pointer is in it
+ * @retval unsigned int* The pointer, in the inode or in the map, NULL if there is none
+ *         or the indirect block could not be read, see failed
+ */
+unsigned int *map_slot(block_map_t *map, uint64_t index, int allocate) {
+    inode_t *n = map->n;
+
+    // direct pointer
+    if (index < 12) {
+        return &n->data_ptrs[index];
+    }
+
+    // past the maximum file size
+    if (index >= MAX_FILE_BLOCKS || (n->indirect_ptrs == NO_BLOCK && !allocate)) {
+        return NULL;
+    }
+
+    // indirect pointer
+    if (map->ptrs == NULL && (map->ptrs = malloc(BLOCK_SZ)) == NULL) {
+        map->failed = 1;
+        return NULL;
+    }
+
+    if (n->indirect_ptrs == NO_BLOCK) {
+
+        // create the indirect block
+        uint32_t indirect = get_index();
+        if (indirect == NO_BLOCK) {
+            return NULL;
+        }
+        n->indirect_ptrs = indirect;
+        int i;
+        for (i = 0; i < PTRS_PER_BLOCK; i++) {
+            map->ptrs[i] = NO_BLOCK;
+        }
+        map->loaded = 1;
+        map->dirty = 1;
+        map->allocated = 1;
+
+    // the pointers of an indirect block that could not be read are not guessed
+    } else if (!map->loaded) {
+        if (cache_read(n->indirect_ptrs, 1, (void*) map->ptrs) < 0) {
+            map->failed = 1;
+            return NULL;
+        }
+        map->loaded = 1;
+    }
+
+    return &map->ptrs[index - 12];
+}
+
+
+
+/**
+ * @brief Take the unwritten flag off a block pointer, the block is about to be written
+ * @param block_map_t* Map of the file
+ * @param unsigned int* Pointer of the block, from map_slot
+ * @param uint64_t Index of the block in the file
+ * @retval None
+ */
+void map_written(block_map_t *map, unsigned int *slot, uint64_t index) {
+    *slot &= ~SFS_BLOCK_UNWRITTEN;
+    if (index >= 12) {
+        map->dirty = 1;
+    }
+    map->allocated = 1;
+}
+
+
+
+/**
+ * @brief Find the disk block holding a block of a file
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the block in the file
+ * @param int Boolean deciding on allocating the block if it does not exist
+ * @param int* Set to one if the block was just allocated, may be NULL
+ * @retval int The disk block, -1 if it does not exist or could not be allocated
+ */
+int map_block(block_map_t *map, uint64_t index, int allocate, int *fresh) {
+    unsigned int *slot = map_slot(map, index, allocate);
+
+    if (fresh != NULL) {
+        *fresh = 0;
+    }
+    if (slot == NULL) {
+        return -1;
+    }
+
+    if (*slot == NO_BLOCK) {
+        if (!allocate) {
+            return -1;
+        }
+
+        uint32_t block = get_index();
+        if (block == NO_BLOCK) {
+            return -1;
+        }
+        *slot = block;
+        map->allocated = 1;
+        if (index >= 12) {
+            map->dirty = 1;
+        }
+        if (fresh != NULL) {
+            *fresh = 1;
+        }
+
+    // a block reserved by sfs_fallocate reads as zeros until it is written
+    } else if (*slot & SFS_BLOCK_UNWRITTEN) {
+        if (!allocate) {
+            return -1;
+        }
+        map_written(map, slot, index);
+        if (fresh != NULL) {
+            *fresh = 1;
+        }
+    }
+
+    return (int) *slot;
+}
+
+
+
+/**
+ * @brief Count how many blocks of a file, from a given one, follow each other on disk
+ * @long Lets whole blocks move with a single read_blocks or write_blocks call.
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the first block in the file
+ * @param int Disk block of the first block
+ * @param int Maximum length of the run
+ * @param int Boolean deciding on allocating the blocks that do not exist
+ * @retval int Length of the run, at least one
+ */
+int map_run(block_map_t *map, uint64_t index, int block_ptr, int max, int allocate) {
+    int run = 1;
+    while (run < max && map_block(map, index + run, allocate, NULL) == block_ptr + run) {
+        run++;
+    }
+    return run;
+}
+
+
+
+/**
+ * @brief Queue the write of the indirect block of a file if it changed
+ * @long The map must not be released before cache_wait returns. An
+ *       indirect block left with no pointer is freed instead, the caller
+ *       writes the inode and the bitmap.
+ * @param block_map_t* Map of the file
+ * @retval None
+ */
+void map_flush(block_map_t *map) {
+    int i;
+
+    if (!map->dirty) {
+        return;
+    }
+    map->dirty = 0;
+    metadata_changed();
+    for (i = 0; i < PTRS_PER_BLOCK && map->ptrs[i] == NO_BLOCK; i++) {
+    }
+    if (i == PTRS_PER_BLOCK) {
+        rm_index(map->n->indirect_ptrs);
+        map->n->indirect_ptrs = NO_BLOCK;
+        map->loaded = 0;
+        map->allocated = 1;
+        return;
+    }
+    cache_write_submit(map->n->indirect_ptrs, 1, (void*) map->ptrs);
+}
+
+
+
+/**
+ * @brief Release a map
+ * @param block_map_t* Map of the file
+ * @retval None
+ */
+void map_release(block_map_t *map) {
+    free(map->ptrs);
+    map->ptrs = NULL;
+    map->loaded = 0;
+}
+
+
+
+/**
+ * @brief Point a block of a file to another disk block, letting go of the old one
+ * @param block_map_t* Map of the file
+ * @param unsigned int* Pointer of the block, from map_slot
+ * @param uint64_t Index of the block in the file
+ * @param uint32_t New disk block
+ * @retval None
+ */
+void map_repoint(block_map_t *map, unsigned int *slot, uint64_t index, uint32_t block) {
+    if (*slot != NO_BLOCK) {
+        dedup_put(*slot & ~SFS_BLOCK_FLAGS);
+    }
+    *slot = block;
+    map->allocated = 1;
+    if (index >= 12) {
+        map->dirty = 1;
+    }
+}
+
+
+
+/**
+ * @brief Make a hole of a block of a file, freeing the disk block it had
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the block in the file
+ * @retval None
+ */
+void map_punch(block_map_t *map, uint64_t index) {
+    unsigned int *slot = map_slot(map, index, 0);
+
+    if (slot == NULL || *slot == NO_BLOCK) {
+        return;
+    }
+    dedup_put(*slot & ~SFS_BLOCK_FLAGS);
+    *slot = NO_BLOCK;
+    map->allocated = 1;
+    if (index >= 12) {
+        map->dirty = 1;
+    }
+}
+
+
+
+/**
+ * @brief Make holes of the blocks of a file from a given one to the end
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the first block to free
+ * @retval None
+ */
+void map_cut(block_map_t *map, uint64_t first) {
+    uint64_t index;
+
+    for (index = first; index < 12; index++) {
+        map_punch(map, index);
+    }
+    if (map->n->indirect_ptrs == NO_BLOCK) {
+        return;
+    }
+    for (index = first > 12 ? first : 12; index < MAX_FILE_BLOCKS; index++) {
+        map_punch(map, index);
+    }
+}
+
+
+
+/**
+ * @brief Give a block of a file a disk block of its own before it changes, if it shares one
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the block in the file
+ * @param int Disk block of the block
+ * @retval int The disk block to write, -1 if the disk is full
+ */
+int map_unshare(block_map_t *map, uint64_t index, int block_ptr) {
+    if (!dedup_shared((uint32_t) block_ptr)) {
+        return block_ptr;
+    }
+    uint32_t block = get_index();
+    if (block == NO_BLOCK) {
+        return -1;
+    }
+    map_repoint(map, map_slot(map, index, 0), index, block);
+    return (int) block;
+}
+
+
+
+/**
+ * @brief Find where a whole block of a file goes, among the blocks already holding the same bytes first
+ * @long The block written in place is the old one if no other pointer
+ *       shares it, or a new one. The caller writes it, then dedup_insert
+ *       remembers it.
+ * @param block_map_t* Map of the file
+ * @param uint64_t Index of the block in the file
+ * @param const char* Data of the block
+ * @param int* Set to one if the disk block already holds the data
+ * @retval int The disk block, -1 if the file or the disk is full
+ */
+int map_dedup(block_map_t *map, uint64_t index, const char *data, int *found) {
+    unsigned int *slot = map_slot(map, index, 1);
+
+    *found = 0;
+    if (slot == NULL) {
+        return -1;
+    }
+    if (*slot != NO_BLOCK && (*slot & SFS_BLOCK_UNWRITTEN)) {
+        map_written(map, slot, index);
+    }
+
+    uint32_t block = dedup_find(data);
+    if (block != NO_BLOCK) {
+        *found = 1;
+        if (block == *slot) {
+            // the block already holds the data, it was counted twice
+            dedup_put(block);
+            return (int) block;
+        }
+    } else if (*slot != NO_BLOCK && !dedup_shared(*slot)) {
+        return (int) *slot;
+    } else if ((block = get_index()) == NO_BLOCK) {
+        return -1;
+    }
+    map_repoint(map, slot, index, block);
+    return (int) block;
+}
+
+
+
+/**
+ * @brief Read the whole data of a small file, kept in its inode or packed
+ * @param inode_t* Inode of the file
+ * @param char* Buffer for the data, at least PACK_MAX bytes
+ * @retval int Return zero on success, -1 if the disk failed
+ */
+int read_small(inode_t *n, char *data) {
+    if (n->flags & SFS_INODE_INLINE) {
+        memcpy(data, n->inline_data, n->size);
+        return 0;
+    }
+    return pack_read(n->data_ptrs[0], n->data_ptrs[1], 0, data, n->size);
+}
+
+
+
+/**
+ * @brief Write to a small file that stays at most PACK_MAX bytes long
+ * @long The data changes in place if it fits the inode or the fragments of
+ *       the file, otherwise the file moves to new fragments large enough.
+ *       The inode and the bitmap are written and waited for.
+ * @param int Inode of the file
+ * @param uint64_t Where in the file
+ * @param const char* Data
+ * @param int Length of the data
+ * @retval int Return zero on success, -1 if the disk is full or failed
+ */
+int write_small(int inode, uint64_t offset, const char *buf, int length) {
+    inode_t *n = &fs->inode_table[inode];
+    uint64_t end = offset + length;
+    unsigned int old_size = n->size;
+    int inode_changed = 0;
+    int ret = 0;
+
+    if ((n->flags & SFS_INODE_INLINE) && end <= SFS_INLINE_MAX) {
+        memcpy(n->inline_data + offset, buf, length);
+        inode_changed = 1;
+
+    } else if ((n->flags & SFS_INODE_PACKED) && end <= (uint64_t) n->data_ptrs[2] * PACK_FRAG_SIZE) {
+        ret = pack_write(n->data_ptrs[0], n->data_ptrs[1], (uint32_t) offset, buf, length);
+
+    } else {
+        char *data = calloc(1, PACK_MAX(BLOCK_SZ));
+        uint32_t size = end > n->size ? (uint32_t) end : n->size;
+        uint32_t block, first;
+        if (data == NULL || read_small(n, data) != 0) {
+            printf("SFS > Could not read from the disk!\n");
+            free(data);
+            return -1;
+        }
+        memcpy(data + offset, buf, length);
+
+        metadata_changed();
+        if (pack_alloc(data, size, &block, &first) != 0) {
+            printf("SFS > No more space on the disk!\n");
+            free(data);
+            write_bitmap(0);
+            cache_wait();
+            return -1;
+        }
+        free(data);
+        if ((n->flags & SFS_INODE_PACKED) && pack_free(n->data_ptrs[0], n->data_ptrs[1], n->data_ptrs[2]) != 0) {
+            ret = -1;
+        }
+
+        int j;
+        n->flags = (n->flags & ~SFS_INODE_INLINE) | SFS_INODE_PACKED;
+        for (j = 0; j < 12; j++) {
+            n->data_ptrs[j] = NO_BLOCK;
+        }
+        n->indirect_ptrs = NO_BLOCK;
+        n->data_ptrs[0] = block;
+        n->data_ptrs[1] = first;
+        n->data_ptrs[2] = PACK_FRAGS_FOR(size);
+        write_bitmap(0);
+        inode_changed = 1;
+    }
+
+    if (end > n->size) {
+        n->size = (unsigned int) end;
+    }
+    if (inode_changed || n->size != old_size) {
+        write_inode(inode);
+    }
+    if (cache_wait() != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        printf("SFS > Could not write to the disk!\n");
+    }
+    return ret;
+}
+
+
+
+/**
+ * @brief Move the data of a small file to a data block of its own
+ * @long Called before the file grows past PACK_MAX. The inode and the
+ *       bitmap are left for the caller to write.
+ * @param inode_t* Inode of the file
+ * @retval int Return zero on success, -1 if the disk is full or failed
+ */
+int unpack(inode_t *n) {
+    char *block = calloc(1, BLOCK_SZ);
+    uint32_t block_ptr = NO_BLOCK;
+    int j;
+
+    if (block == NULL || (n->size > 0 && (block_ptr = get_index()) == NO_BLOCK)) {
+        printf("SFS > No more space on the disk!\n");
+        free(block);
+        return -1;
+    }
+    if (read_small(n, block) != 0) {
+        printf("SFS > Could not read from the disk!\n");
+        if (block_ptr != NO_BLOCK) {
+            rm_index(block_ptr);
+        }
+        free(block);
+        return -1;
+    }
+
+    int ret = 0;
+    if (n->flags & SFS_INODE_PACKED) {
+        metadata_changed();
+        ret = pack_free(n->data_ptrs[0], n->data_ptrs[1], n->data_ptrs[2]);
+    }
+    n->flags &= ~(SFS_INODE_INLINE | SFS_INODE_PACKED);
+    for (j = 0; j < 12; j++) {
+        n->data_ptrs[j] = NO_BLOCK;
+    }
+    n->indirect_ptrs = NO_BLOCK;
+    n->data_ptrs[0] = block_ptr;
+
+    if (block_ptr != NO_BLOCK && cache_write((int) block_ptr, 1, (void*) block) < 0) {
+        ret = -1;
+    }
+    free(block);
+    return ret;
+}
+
+
+
+/**
+ * @brief Tell if some bytes are all zeros
+ * @param const char* Data
+ * @param int Number of bytes
+ * @retval int Return one if they are
+ */
+int all_zeros(const char *data, int len) {
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+
+
+/**
+ * @brief Read a chunk of a compressed file
+ * @param inode_t* Inode of the file
+ * @param uint64_t Chunk
+ * @param char* Buffer for the chunk, CHUNK_SZ bytes, zeros past its data
+ * @retval int Return zero on success, -1 if the disk failed or the chunk is corrupt
+ */
+int load_chunk(inode_t *n, uint64_t chunk, char *data) {
+    uint64_t first = chunk * SFS_CHUNK_BLOCKS;
+    block_map_t map;
+    int i, err = 0;
+
+    memset(data, 0, CHUNK_SZ);
+    map_init(&map, n);
+    unsigned int *slot = map_slot(&map, first, 0);
+
+    // a chunk stored as is, its blocks are where they would be in any file
+    if (slot == NULL || !(*slot & SFS_CHUNK_COMPRESSED) || *slot == NO_BLOCK) {
+        for (i = 0; i < SFS_CHUNK_BLOCKS;) {
+            int block_ptr = map_block(&map, first + i, 0, NULL);
+            int run = 1;
+            if (block_ptr != -1) {
+                run = map_run(&map, first + i, block_ptr, SFS_CHUNK_BLOCKS - i, 0);
+                if (cache_read_submit(block_ptr, run, data + (uint64_t) i * BLOCK_SZ) != 0) {
+                    err = -1;
+                }
+            }
+            i += run;
+        }
+        if (cache_wait() != 0 || map.failed) {
+            err = -1;
+        }
+        map_release(&map);
+        return err;
+    }
+
+    // the compressed form takes the blocks of the first pointers of the chunk
+    char *packed = malloc(CHUNK_SZ);
+    int nblocks = 0;
+    while (packed != NULL && nblocks < SFS_CHUNK_BLOCKS
+           && (slot = map_slot(&map, first + nblocks, 0)) != NULL && *slot != NO_BLOCK) {
+        if (cache_read_submit((int) (*slot & ~SFS_CHUNK_COMPRESSED), 1,
+                              packed + (uint64_t) nblocks * BLOCK_SZ) != 0) {
+            err = -1;
+        }
+        nblocks++;
+    }
+    if (cache_wait() != 0 || packed == NULL || map.failed) {
+        err = -1;
+    }
+
+    chunk_header_t *h = (chunk_header_t*) packed;
+    if (err == 0 && (h->comp_len > (uint64_t) nblocks * BLOCK_SZ - sizeof(chunk_header_t)
+                     || h->raw_len > (uint32_t) CHUNK_SZ
+                     || lz_decompress(packed + sizeof(chunk_header_t), (int) h->comp_len,
+                                      data, (int) h->raw_len) != (int) h->raw_len)) {
+        printf("SFS > Chunk %" PRIu64 " of a compressed file is corrupt!\n", chunk);
+        err = -1;
+    }
+    map_release(&map);
+    free(packed);
+    return err;
+}
+
+
+
+/**
+ * @brief Write a chunk of a compressed file to the disk, in its compressed form if it has one
+ * @long The blocks of the old version of the chunk are freed first, the new
+ *       ones are likely to be the same. Blocks of zeros of a chunk stored as
+ *       is are left out, as holes. The writes are queued, the caller flushes
+ *       the map, writes the bitmap and the inode and waits.
+ * @param block_map_t* Map of the file
+ * @param chunk_write_t* The chunk
+ * @retval int Return zero on success, -1 if the disk is full
+ */
+int store_chunk(block_map_t *map, chunk_write_t *w) {
+    uint64_t first = w->chunk * SFS_CHUNK_BLOCKS;
+    int i;
+
+    for (i = 0; i < SFS_CHUNK_BLOCKS; i++) {
+        unsigned int *slot = map_slot(map, first + i, 0);
+        if (slot != NULL && *slot != NO_BLOCK) {
+            dedup_put(*slot & ~SFS_CHUNK_COMPRESSED);
+            *slot = NO_BLOCK;
+            map->allocated = 1;
+            map->dirty |= first + i >= 12;
+        }
+    }
+
+    if (w->packed_len > 0) {
+        int nblocks = (int) BLOCKS_FOR(w->packed_len + sizeof(chunk_header_t), (uint64_t) BLOCK_SZ);
+        chunk_header_t *h = (chunk_header_t*) w->packed;
+        h->raw_len = (uint32_t) w->len;
+        h->comp_len = (uint32_t) w->packed_len;
+        memset(w->packed + sizeof(chunk_header_t) + w->packed_len, 0,
+               (size_t) nblocks * BLOCK_SZ - sizeof(chunk_header_t) - w->packed_len);
+        for (i = 0; i < nblocks; i++) {
+            int block_ptr = map_block(map, first + i, 1, NULL);
+            if (block_ptr == -1) {
+                return -1;
+            }
+            cache_write_submit(block_ptr, 1, w->packed + (uint64_t) i * BLOCK_SZ);
+        }
+        *map_slot(map, first, 0) |= SFS_CHUNK_COMPRESSED;
+        stats_compression(w->len, (uint64_t) nblocks * BLOCK_SZ);
+        return 0;
+    }
+
+    int stored = 0;
+    for (i = 0; i < (int) BLOCKS_FOR(w->len, BLOCK_SZ); i++) {
+        char *block = w->data + (uint64_t) i * BLOCK_SZ;
+        if (all_zeros(block, BLOCK_SZ)) {
+            continue;
+        }
+        int found = 0;
+        int block_ptr = fs->dedup_writes ? map_dedup(map, first + i, block, &found)
+                                     : map_block(map, first + i, 1, NULL);
+        if (block_ptr == -1) {
+            return -1;
+        }
+        if (!fs->dedup_writes) {
+            cache_write_submit(block_ptr, 1, block);
+            stored++;
+        } else if (!found) {
+            // in the cache at once, where the next lookups read it
+            cache_write(block_ptr, 1, block);
+            dedup_insert(block, (uint32_t) block_ptr);
+            stored++;
+        }
+    }
+    stats_compression(w->len, (uint64_t) stored * BLOCK_SZ);
+    return 0;
+}
+
+
+
+/**
+ * @brief Compress the chunks of a batch together and store them
+ * @long The chunks are compressed on the worker threads of sfs_lz.h, a chunk
+ *       whose compressed form would not save a block is stored as is. The
+ *       chunks of a file follow each other in a batch and share one map.
+ *       The batch is empty afterwards.
+ * @param chunk_batch_t* Batch
+ * @retval int Return zero on success, -1 if the disk is full or failed
+ */
+int flush_batch(chunk_batch_t *b) {
+    lz_job_t jobs[CHUNK_BATCH];
+    block_map_t maps[CHUNK_BATCH];
+    int inodes[CHUNK_BATCH];
+    int i, njobs = 0, nmaps = 0, err = 0;
+
+    if (b->count == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < b->count; i++) {
+        chunk_write_t *w = &b->w[i];
+        int room = ((int) BLOCKS_FOR(w->len, BLOCK_SZ) - 1) * BLOCK_SZ - (int) sizeof(chunk_header_t);
+        w->packed = NULL;
+        w->packed_len = 0;
+        if (room <= 0 || all_zeros(w->data, w->len) || (w->packed = malloc(CHUNK_SZ)) == NULL) {
+            continue;
+        }
+        jobs[njobs].src = w->data;
+        jobs[njobs].len = w->len;
+        jobs[njobs].dst = w->packed + sizeof(chunk_header_t);
+        jobs[njobs].cap = room;
+        njobs++;
+    }
+    lz_compress_all(jobs, njobs);
+
+    for (i = 0, njobs = 0; i < b->count; i++) {
+        chunk_write_t *w = &b->w[i];
+        if (w->packed != NULL) {
+            w->packed_len = jobs[njobs++].out;
+            if (w->packed_len < 0) {
+                w->packed_len = 0;
+            }
+        }
+        if (nmaps == 0 || inodes[nmaps - 1] != w->inode) {
+            inodes[nmaps] = w->inode;
+            map_init(&maps[nmaps++], &fs->inode_table[w->inode]);
+        }
+        if (store_chunk(&maps[nmaps - 1], w) != 0) {
+            printf("SFS > No more space on the disk!\n");
+            err = -1;
+        }
+    }
+
+    // the data and the metadata reach the disk in parallel
+    for (i = 0; i < nmaps; i++) {
+        map_flush(&maps[i]);
+        write_inode(inodes[i]);
+    }
+    write_bitmap(0);
+    if (cache_wait() != 0) {
+        err = -1;
+    }
+
+    for (i = 0; i < nmaps; i++) {
+        map_release(&maps[i]);
+    }
+    for (i = 0; i < b->count; i++) {
+        free(b->w[i].data);
+        free(b->w[i].packed);
+    }
+    b->count = 0;
+    return err;
+}
+
+
+
+/**
+ * @brief Add the chunk buffer of an open compressed file to a batch if it changed
+ * @long The buffer stays, clean, the batch gets a copy of it.
+ * @param chunk_batch_t* Batch, flushed first if it is full
+ * @param file_descriptor* Open file
+ * @retval int Return zero on success, -1 if out of memory or the flush failed
+ */
+int queue_chunk(chunk_batch_t *b, file_descriptor *f) {
+    int err = 0;
+
+    if (f->zbuf == NULL || f->zdirtied == 0) {
+        return 0;
+    }
+    if (b->count == CHUNK_BATCH) {
+        err = flush_batch(b);
+    }
+
+    chunk_write_t *w = &b->w[b->count];
+    uint64_t start = f->zchunk * CHUNK_SZ;
+    uint64_t size = fs->inode_table[f->inode].size;
+    w->data = malloc(CHUNK_SZ);
+    if (w->data == NULL) {
+        return -1;
+    }
+    memcpy(w->data, f->zbuf, CHUNK_SZ);
+    w->inode = (int) f->inode;
+    w->chunk = f->zchunk;
+    w->len = size <= start ? 0 : size - start < (uint64_t) CHUNK_SZ ? (int) (size - start) : CHUNK_SZ;
+    b->count++;
+    f->zdirtied = 0;
+    return err;
+}
+
+
+
+/**
+ * @brief Bring a chunk of an open compressed file into its chunk buffer
+ * @long The chunk the buffer held goes to the batch first if it changed.
+ *       A chunk still in the batch is newer than on the disk, it is taken
+ *       from there.
+ * @param chunk_batch_t* Batch
+ * @param file_descriptor* Open file
+ * @param uint64_t Chunk
+ * @param int Boolean, read the chunk, otherwise it is about to be overwritten
+ * @retval int Return zero on success, -1 if the chunk could not be read
+ */
+int open_chunk(chunk_batch_t *b, file_descriptor *f, uint64_t chunk, int read) {
+    int i;
+
+    if (f->zbuf != NULL && f->zchunk == chunk) {
+        return 0;
+    }
+    if (queue_chunk(b, f) != 0) {
+        return -1;
+    }
+
+    if (f->zbuf == NULL && (f->zbuf = malloc(CHUNK_SZ)) == NULL) {
+        return -1;
+    }
+    f->zchunk = chunk;
+    if (!read) {
+        memset(f->zbuf, 0, CHUNK_SZ);
+        return 0;
+    }
+    for (i = b->count - 1; i >= 0; i--) {
+        if (b->w[i].inode == (int) f->inode && b->w[i].chunk == chunk) {
+            memcpy(f->zbuf, b->w[i].data, CHUNK_SZ);
+            return 0;
+        }
+    }
+    if (load_chunk(&fs->inode_table[f->inode], chunk, f->zbuf) != 0) {
+        free(f->zbuf);
+        f->zbuf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Read from a compressed file, a chunk at a time through its chunk buffer
+ * @param file_descriptor* Open file, its read write pointer moves
+ * @param char* Buffer for the data
+ * @param int Length of the data, within the file
+ * @retval int The number of bytes read, -1 if the disk failed
+ */
+int read_chunks(file_descriptor *f, char *buf, int length) {
+    chunk_batch_t batch;
+    int count = 0, err = 0;
+
+    batch.count = 0;
+    while (count < length) {
+        uint64_t chunk = f->rwptr / CHUNK_SZ;
+        int offset = (int) (f->rwptr % CHUNK_SZ);
+        int part = CHUNK_SZ - offset < length - count ? CHUNK_SZ - offset : length - count;
+        if (open_chunk(&batch, f, chunk, 1) != 0) {
+            err = -1;
+            break;
+        }
+        memcpy(buf + count, f->zbuf + offset, part);
+        count += part;
+        f->rwptr += part;
+    }
+
+    // the chunk the file was writing is stored once the file reads another
+    if (flush_batch(&batch) != 0) {
+        err = -1;
+    }
+    return err != 0 ? -1 : count;
+}
+
+
+
+/**
+ * @brief Write to a compressed file, a chunk at a time through its chunk buffer
+ * @long The chunks the write leaves behind are compressed together and
+ *       stored. The one it ends in stays in the buffer until the file moves
+ *       to another chunk or is closed or synced, or until the flusher finds
+ *       it expired, so that small appends do not compress it every time.
+ * @param file_descriptor* Open file, its read write pointer moves
+ * @param const char* Data
+ * @param int Length of the data
+ * @retval int The number of bytes written, -1 if the disk is full or failed
+ */
+int write_chunks(file_descriptor *f, const char *buf, int length) {
+    inode_t *n = &fs->inode_table[f->inode];
+    chunk_batch_t batch;
+    int count = 0, err = 0;
+
+    // stop when the file is full
+    if (f->rwptr + length > MAX_RWPTR) {
+        length = f->rwptr < MAX_RWPTR ? (int) (MAX_RWPTR - f->rwptr) : 0;
+    }
+
+    batch.count = 0;
+    while (count < length) {
+        uint64_t chunk = f->rwptr / CHUNK_SZ;
+        int offset = (int) (f->rwptr % CHUNK_SZ);
+        int part = CHUNK_SZ - offset < length - count ? CHUNK_SZ - offset : length - count;
+        if (open_chunk(&batch, f, chunk, part < CHUNK_SZ) != 0) {
+            err = -1;
+            break;
+        }
+        memcpy(f->zbuf + offset, buf + count, part);
+        if (f->zdirtied == 0) {
+            f->zdirtied = stats_now();
+        }
+        count += part;
+        f->rwptr += part;
+        if (f->rwptr > n->size) {
+            n->size = f->rwptr;
+        }
+    }
+
+    if (flush_batch(&batch) != 0) {
+        err = -1;
+    }
+    return err != 0 ? -1 : count;
+}
+
+
+
+/**
+ * @brief Store the chunk buffers of open compressed files that changed
+ * @param int File ID, -1 for every open file
+ * @param uint64_t Only the buffers that changed first before this time, UINT64_MAX for all
+ * @retval int Return zero on success, -1 if the disk is full or failed
+ */
+int store_chunks(int fileID, uint64_t dirtied_before) {
+    chunk_batch_t batch;
+    int i, err = 0;
+
+    batch.count = 0;
+    for (i = 0; i < NUM_INODES_FS && fs->fdt != NULL; i++) {
+        file_descriptor *f = &fs->fdt[i];
+        if (f->used && (fileID == -1 || fileID == i) && f->zdirtied != 0 && f->zdirtied < dirtied_before
+            && queue_chunk(&batch, f) != 0) {
+            err = -1;
+        }
+    }
+    if (flush_batch(&batch) != 0) {
+        err = -1;
+    }
+    return err;
+}
+
+
+
+/**
+ * @brief Free the chunk buffers of open files, what they hold is lost
+ * @param int Inode of the file, -1 for every file
+ * @retval None
+ */
+void drop_chunks(int inode) {
+    int i;
+
+    for (i = 0; i < NUM_INODES_FS && fs->fdt != NULL; i++) {
+        if (inode == -1 || (fs->fdt[i].used && fs->fdt[i].inode == (uint64_t) inode)) {
+            free(fs->fdt[i].zbuf);
+            fs->fdt[i].zbuf = NULL;
+            fs->fdt[i].zdirtied = 0;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Shrink a compressed file, the chunk it now ends in is stored again without its tail
+ * @long The blocks of the chunks past the end are left for the caller to free.
+ * @param file_descriptor* Open file
+ * @param uint64_t New size, smaller than the size of the file
+ * @retval int Return zero on success, -1 if the disk is full or failed
+ */
+int truncate_chunks(file_descriptor *f, uint64_t size) {
+    inode_t *n = &fs->inode_table[f->inode];
+    chunk_batch_t batch;
+    int err = 0;
+
+    batch.count = 0;
+    if (size % CHUNK_SZ != 0) {
+        if (open_chunk(&batch, f, size / CHUNK_SZ, 1) != 0) {
+            err = -1;
+        } else {
+            memset(f->zbuf + size % CHUNK_SZ, 0, CHUNK_SZ - size % CHUNK_SZ);
+            if (f->zdirtied == 0) {
+                f->zdirtied = stats_now();
+            }
+        }
+    }
+
+    // a chunk past the end is dropped, the one the file ends in is stored with its new length
+    if (f->zbuf != NULL && f->zchunk >= BLOCKS_FOR(size, (uint64_t) CHUNK_SZ)) {
+        free(f->zbuf);
+        f->zbuf = NULL;
+        f->zdirtied = 0;
+    }
+    n->size = (unsigned int) size;
+    if (queue_chunk(&batch, f) != 0 || flush_batch(&batch) != 0) {
+        err = -1;
+    }
+    return err;
+}
+
+
+
+/**
+ * @brief Write the expired chunk buffers back, run by the flusher of the block cache
+ * @param uint64_t Buffers that changed first before this time are expired
+ * @retval None
+ */
+void writeback_chunks(uint64_t dirtied_before) {
+    if (sfs_is_mounted() && store_chunks(-1, dirtied_before) != 0) {
+        printf("SFS > Could not write compressed data back to the disk!\n");
+    }
+}
+
+
+
+/**
+ * @brief Get the read write pointer of a file, for the trace
+ * @param int File ID
+ * @retval uint64_t The read write pointer, zero if the file is not open
+ */
+uint64_t fd_rwptr(int fileID) {
+    if (fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        return 0;
+    }
+    return fs->fdt[fileID].rwptr;
+}
+
+
+
+/**
+ * @brief Prefetch the blocks following the read write pointer of a file
+ * @long The window moves ahead by half of its size at a time, so that the
+ *       reads of the caller do not wait for it.
+ * @param block_map_t* Map of the file
+ * @param file_descriptor* Open file, its ra_end moves
+ * @param inode_t* Inode of the file
+ * @retval None
+ */
+void readahead(block_map_t *map, file_descriptor *f, inode_t *n) {
+    uint64_t window = ((uint64_t) fs->readahead_kb_cfg * 1024) >> fs->block_shift;
+    uint64_t first = (f->rwptr + fs->block_mask) >> fs->block_shift;
+    uint64_t last = (n->size + fs->block_mask) >> fs->block_shift;
+
+    if (window == 0 || f->ra_end > first + window / 2) {
+        return;
+    }
+    if (f->ra_end > first) {
+        first = f->ra_end;
+    }
+    if (last > first + window) {
+        last = first + window;
+    }
+
+    // queue the blocks that lie together on disk at once
+    uint64_t index = first;
+    while (index < last) {
+        int block_ptr = map_block(map, index, 0, NULL);
+        if (block_ptr == -1) {
+            index++;
+            continue;
+        }
+        int run = map_run(map, index, block_ptr, (int) (last - index), 0);
+        cache_prefetch(block_ptr, run);
+        index += run;
+    }
+    f->ra_end = last;
+}
+
+
+
+/**
+ * @brief Read some data to the a file
+ * @param int File ID of an open file
+ * @param const char Buffer for the data read
+ * @oaram int Length of the data
+ * @retval int The number of bytes read
+ */
+int sfs_fread(int fileID, char *buf, int length) {
+    API_BEGIN(STAT_FREAD, NULL, fileID, fd_rwptr(fileID), length);
+
+    // make sure this is an open file
+    if (fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        API_RETURN_BYTES(STAT_FREAD, 0);
+    }
+
+    // the the file descriptor and the inode of the file
+    file_descriptor *f = &fs->fdt[fileID];
+    inode_t *n = &fs->inode_table[f->inode];
+
+    //make sure you dont read pass the end of file
+    if (f->rwptr >= n->size || length <= 0) {
+        API_RETURN_BYTES(STAT_FREAD, 0);
+    }
+    if (f->rwptr + length > n->size){
+        length = n->size - f->rwptr;
+    }
+
+    // small files are read from their inode or from their fragments of a shared block
+    if (n->flags & SFS_INODE_INLINE) {
+        memcpy(buf, n->inline_data + f->rwptr, length);
+        f->rwptr += length;
+        API_RETURN_BYTES(STAT_FREAD, length);
+    }
+    if (n->flags & SFS_INODE_PACKED) {
+        if (pack_read(n->data_ptrs[0], n->data_ptrs[1], (uint32_t) f->rwptr, buf, length) != 0) {
+            printf("SFS > Could not read from the disk!\n");
+            API_RETURN_BYTES(STAT_FREAD, -1);
+        }
+        f->rwptr += length;
+        API_RETURN_BYTES(STAT_FREAD, length);
+    }
+
+    // compressed files are read a chunk at a time
+    if (n->flags & SFS_INODE_COMPRESSED) {
+        int got = read_chunks(f, buf, length);
+        if (got < 0) {
+            printf("SFS > Could not read from the disk!\n");
+        }
+        API_RETURN_BYTES(STAT_FREAD, got);
+    }
+
+    block_map_t map;
+    map_init(&map, n);
+    char *block = NULL;
+    int count = 0;
+    int err = 0;
+
+    while (count < length) {
+        uint64_t index = f->rwptr >> fs->block_shift;
+        int offset = f->rwptr & fs->block_mask;
+        int chunk = BLOCK_SZ - offset;
+        if (chunk > length - count) {
+            chunk = length - count;
+        }
+
+        int block_ptr = map_block(&map, index, 0, NULL);
+
+        // a block that was never written reads back as zeros
+        if (block_ptr == -1 && map.failed) {
+            err = -1;
+            break;
+        } else if (block_ptr == -1) {
+            memset(buf + count, 0, chunk);
+
+        // whole blocks go straight to the caller, as many at once as lie together on disk
+        // the runs are read in parallel
+        } else if (chunk == BLOCK_SZ) {
+            int run = map_run(&map, index, block_ptr, (length - count) >> fs->block_shift, 0);
+            if (cache_read_submit(block_ptr, run, buf + count) != 0) {
+                err = -1;
+            }
+            chunk = run << fs->block_shift;
+
+        } else {
+            if (block == NULL && (block = malloc(BLOCK_SZ)) == NULL) {
+                err = -1;
+                break;
+            }
+            if (cache_read(block_ptr, 1, block) < 0) {
+                err = -1;
+                break;
+            }
+            memcpy(buf + count, block + offset, chunk);
+        }
+
+        count += chunk;
+        f->rwptr += chunk;
+    }
+
+    if (cache_wait() != 0) {
+        err = -1;
+    }
+
+    // sequential reads fetch the following blocks in the background
+    if (fs->readahead_kb_cfg > 0 && f->rwptr - count == f->seq_end) {
+        readahead(&map, f, n);
+    }
+    f->seq_end = f->rwptr;
+
+    map_release(&map);
+    free(block);
+
+    // the disk failed to return some of the data
+    if (err != 0) {
+        printf("SFS > Could not read from the disk!\n");
+        API_RETURN_BYTES(STAT_FREAD, -1);
+    }
+	API_RETURN_BYTES(STAT_FREAD, count);
+}
+
+
+
+/**
+ * @brief Write some data to the a file
+ * @param int File ID of an open file
+ * @param const char Data that need to be written
+ * @oaram int Length of the data
+ * @retval int The number of bytes written
+ */
+int sfs_fwrite(int fileID, const char *buf, int length){
+    API_BEGIN(STAT_FWRITE, NULL, fileID, fd_rwptr(fileID), length);
+
+    // make sure this is an open file
+    if (fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        API_RETURN_BYTES(STAT_FWRITE, -1);
+    }
 
-    if(strlen(name) > MAXFILENAME || strlen(name) == 0){
-        return -1;
+    // even a write in place changes the checksums
+    if (length > 0) {
+        volume_in_use();
     }
 
-    // try to find the file
-    uint64_t inode_table_index = -1;
-    int i;
-    for(i = 0; i < sizeof(directory_table)/ sizeof(directory_table[0]); i++) {
-        if(directory_table[i].used == 1) {
-            if (strcmp(directory_table[i].name, name) == 0) {
-                inode_table_index = (int) directory_table[i].inode;
+	// get the file descritor and the inode of the file
+    file_descriptor* f = &fs->fdt[fileID];
+    inode_t* n = &fs->inode_table[f->inode];
+    int moved = 0;
+
+    // small files are written to their inode or packed with others, until they outgrow it
+    if (n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED)) {
+        if (length <= 0) {
+            API_RETURN_BYTES(STAT_FWRITE, 0);
+        }
+        if (f->rwptr + length <= PACK_MAX(BLOCK_SZ)) {
+            if (write_small(f->inode, f->rwptr, buf, length) != 0) {
+                API_RETURN_BYTES(STAT_FWRITE, -1);
             }
+            f->rwptr += length;
+            API_RETURN_BYTES(STAT_FWRITE, length);
+        }
+        if (unpack(n) != 0) {
+            API_RETURN_BYTES(STAT_FWRITE, -1);
+        }
+        moved = 1;
+    }
+
+    // compressed files are written a chunk at a time
+    if (n->flags & SFS_INODE_COMPRESSED) {
+        if (moved) {
+            write_bitmap(0);
+            write_inode(f->inode);
         }
+        int put = write_chunks(f, buf, length);
+        if (put < 0) {
+            printf("SFS > Could not write to the disk!\n");
+        }
+        API_RETURN_BYTES(STAT_FWRITE, put);
     }
 
-	/* FILE DOES NOT EXIST */
-    if(inode_table_index == -1) {
+    block_map_t map;
+    map_init(&map, n);
+    char *block = NULL;
+    int count = 0;
+    int err = 0;
+    unsigned int old_size = n->size;
+
+    while (count < length) {
+        uint64_t index = f->rwptr >> fs->block_shift;
+        int offset = f->rwptr & fs->block_mask;
+        int chunk = BLOCK_SZ - offset;
+        if (chunk > length - count) {
+            chunk = length - count;
+        }
 
-        // find the first empty spot in the inode_table
-        uint64_t new_inode_table_index = 0;
-        while(inode_table[ new_inode_table_index ].used == 1 && new_inode_table_index < sizeof(inode_table)/ sizeof(inode_table[0])) {
-            new_inode_table_index++;
+        int fresh = 0;
+        int block_ptr;
 
-            // if there is no more space in the table
-            if(new_inode_table_index == sizeof(inode_table)/ sizeof(inode_table[0])){
-                printf("SFS > There is no more space in the inode table!\n");
-                return -1;
+        // whole blocks of zeros become holes
+        if (chunk == BLOCK_SZ && fs->sparse_writes && all_zeros(buf + count, BLOCK_SZ)) {
+            if (index >= MAX_FILE_BLOCKS) {
+                break;
             }
+            map_punch(&map, index);
 
-        }
+        // whole blocks holding the same bytes as a block on the disk point to it
+        } else if (chunk == BLOCK_SZ && fs->dedup_writes) {
+            int found;
+            if ((block_ptr = map_dedup(&map, index, buf + count, &found)) == -1) {
+                break;
+            }
+            if (!found) {
+                if (cache_write(block_ptr, 1, (void*) (buf + count)) < 0) {
+                    err = -1;
+                }
+                dedup_insert(buf + count, (uint32_t) block_ptr);
+            }
 
-        // find the first empty spot in the directory_table
-        int  new_entry_index = 0;
-        while(directory_table[ new_entry_index ].used == 1 && new_entry_index < sizeof(directory_table)/ sizeof(directory_table[0])) {
-            new_entry_index++;
+        // stop when the file or the disk is full
+        } else if ((block_ptr = map_block(&map, index, 1, &fresh)) == -1) {
+            break;
 
-            // if there is no space in the table
-            if(new_entry_index == sizeof(directory_table)/ sizeof(directory_table[0])){
-                printf("SFS > No more space in the directory table! \n");
-                return -1;
+        // whole blocks come straight from the caller, as many at once as lie together on disk,
+        // up to the first one shared with other files, which gets a copy of its own, or the
+        // first one to become a hole
+        } else if (chunk == BLOCK_SZ) {
+            if (!fresh && (block_ptr = map_unshare(&map, index, block_ptr)) == -1) {
+                break;
             }
-        }
+            int run = map_run(&map, index, block_ptr, (length - count) >> fs->block_shift, 1);
+            int i;
+            for (i = 1; i < run; i++) {
+                if (dedup_shared((uint32_t) (block_ptr + i))
+                    || (fs->sparse_writes && all_zeros(buf + count + ((uint64_t) i << fs->block_shift), BLOCK_SZ))) {
+                    run = i;
+                }
+            }
+            if (cache_write_submit(block_ptr, run, (void*) (buf + count)) != 0) {
+                err = -1;
+            }
+            chunk = run << fs->block_shift;
 
-        // initialize the inode
-        inode_t new_inode;
-        new_inode.used = 1;
-        new_inode.mode = 777;
-        new_inode.link_cnt = 1;
-        new_inode.uid = 0;
-        new_inode.gid = 0;
-        new_inode.size = 0;
-        int j;
-        for(j = 0; j< 12; j++) {
-            new_inode.data_ptrs[j] = -1;
+        // if only part of the block changes, keep the rest of it
+        } else {
+            // nothing is written around the new bytes if the old ones could not be read
+            if (block == NULL && (block = malloc(BLOCK_SZ)) == NULL) {
+                err = -1;
+                break;
+            }
+            if (fresh) {
+                memset(block, 0, BLOCK_SZ);
+            } else if (cache_read(block_ptr, 1, block) < 0) {
+                err = -1;
+                break;
+            }
+            if (!fresh && (block_ptr = map_unshare(&map, index, block_ptr)) == -1) {
+                break;
+            }
+            memcpy(block + offset, buf + count, chunk);
+            if (cache_write(block_ptr, 1, block) < 0) {
+                err = -1;
+            }
         }
-        new_inode.indirect_ptrs = -1;
-
-        // update inode_table in memory
-        inode_table[ new_inode_table_index ] = new_inode;
 
-        // initialize the new entry
-        entry_t new_entry;
-        new_entry.used = 1;
-        new_entry.inode = new_inode_table_index;
-        new_entry.name = malloc(sizeof(char)*(strlen(name)+1));
-        int w;
-        for (w = 0; w< strlen(name) +1 ; w++){
-            new_entry.name[w] = name[w];
+        count += chunk;
+        f->rwptr += chunk;
+        if (f->rwptr > n->size) {
+            n->size = f->rwptr;
         }
-        new_entry.name[w] = '\0';
-
-        directory_table[new_entry_index] = new_entry;
-
-        // update inode table on disk
-        write_blocks(1, (int) sb.inode_table_len, (void*) inode_table);
-
-        // update directory table on disk
-        write_blocks((int) sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) directory_table);
-
-        inode_table_index = new_inode_table_index;
     }
 
-    // check is the file is already open
-    int open_file_index;
-    for(open_file_index = 0; open_file_index < sizeof(fdt)/ sizeof(fdt[0]); open_file_index++){
-        if(fdt[open_file_index].inode == inode_table_index){
-            return open_file_index;
-        }
+    // the pointers of the file past its direct blocks could not be read
+    if (map.failed) {
+        err = -1;
     }
 
+    // the data and the metadata reach the disk in parallel
+    map_flush(&map);
 
-    // find a spot on the file descriptor table
-    int  new_fdt_index = 0;
-    while(fdt[ new_fdt_index ].used == 1) {
-        new_fdt_index++;
-        if(new_fdt_index == sizeof(fdt)/ sizeof(fdt[0])) {
-            printf("SFS > There is no more space in the file descriptor table!\n");
-            return -1;
-        }
+    // update bitmap
+    if (map.allocated || moved) {
+        write_bitmap(0);
     }
 
-    fdt[new_fdt_index].used = 1;
-    fdt[new_fdt_index].inode = inode_table_index;
-    fdt[new_fdt_index].rwptr = inode_table[inode_table_index].size;
+    // update inode
+    if (map.allocated || moved || n->size != old_size) {
+        write_inode(f->inode);
+    }
 
+    if (cache_wait() != 0) {
+        err = -1;
+    }
+    map_release(&map);
+    free(block);
 
-	return new_fdt_index;
+    // the disk failed to store some of the data
+    if (err != 0) {
+        printf("SFS > Could not write to the disk!\n");
+        API_RETURN_BYTES(STAT_FWRITE, -1);
+    }
+    API_RETURN_BYTES(STAT_FWRITE, count);
 }
 
 
 
 /**
- * @brief Close a file that was open
+ * @brief Move the read write pointer of a file to a particular position
  * @param int File ID of an open file
- * @retval int Return zero on success
+ * @param int Location where the pointer need to be relocated
+ * @retval int Return zero if successful
  */
-int sfs_fclose(int fileID){
-	// check if the there is a file open
-    if(fdt[fileID].used == 0) {
-        printf("SFS > The file %i was not used! \n", fileID);
-        return -1;
-    }
+int sfs_fseek(int fileID, int loc){
+    API_BEGIN(STAT_FSEEK, NULL, fileID, loc, 0);
 
-    fdt[fileID].used = 0;
-    fdt[fileID].inode = -1;
+    // error checking
+    if(fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0){
+        printf("SFS > The file %i is not open!\n", fileID);
+        API_RETURN(STAT_FSEEK, -1);
+    }
+    if(loc < 0 || loc > MAX_RWPTR){
+        printf("SFS > Wrong RW location!\n");
+        API_RETURN(STAT_FSEEK, -1);
+    }
 
-	return 0;
+    fs->fdt[fileID].rwptr = loc;
+	API_RETURN(STAT_FSEEK, 0);
 }
 
 
 
 /**
- * @brief Read some data to the a file
+ * @brief Change the size of an open file in place, see sfs_ftruncate
  * @param int File ID of an open file
- * @param const char Buffer for the data read
- * @oaram int Length of the data
- * @retval int The number of bytes read
+ * @param uint64_t New size of the file, at most MAX_RWPTR
+ * @retval int Return zero on success, -1 if the disk failed
  */
-int sfs_fread(int fileID, char *buf, int length) {
+int resize_file(int fileID, uint64_t size) {
+    file_descriptor *f = &fs->fdt[fileID];
+    inode_t *n = &fs->inode_table[f->inode];
+    uint64_t old_size = n->size;
+    int err = 0;
 
-    char *temp_buf = NULL;
-    int len_temp_buf = 0;
-
-    // make sure this is an open file
-    if (fdt[fileID].used == 0) {
+    if (size == old_size) {
         return 0;
     }
+    volume_in_use();
 
-
-    // the the file descriptor and the inode of the file
-    file_descriptor *f = &fdt[fileID];
-    inode_t *n = &inode_table[f->inode];
-
-    //make sure you dont read pass the edn of file
-    if (f->rwptr+length > n->size){
-        length = n->size - f->rwptr;
-    }
-
-    // how many blocks to read
-    int num_block_read = ((f->rwptr % BLOCK_SZ) + length) / BLOCK_SZ + 1;
-
-    char buffer[num_block_read][BLOCK_SZ];
-
-    // find in which block is the RWPTR
-    uint64_t data_ptr_index = f->rwptr / BLOCK_SZ;
-
-
-    /****************************************************************/
-    /********************** read the blocks *************************/
-    /****************************************************************/
-    int i;
-    for (i = 0; i < num_block_read; i++) {
-
-        // if the block to read is in the direct pointer
-        if (data_ptr_index < 12) {
-            read_blocks(n->data_ptrs[data_ptr_index], 1, buffer[i]);
+    // small files zero what they lose, and stay small as long as they fit
+    if ((n->flags & SFS_INODE_INLINE) && size <= SFS_INLINE_MAX) {
+        if (size < old_size) {
+            memset(n->inline_data + size, 0, old_size - size);
         }
-
-            // if the block to read is in the indirect pointer
-        else {
-            //if indirect pointer exist
-            if (n->indirect_ptrs != -1) {
-                indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-                read_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                read_blocks(indirect_pointer->data_ptr[data_ptr_index - 12], 1, buffer[i]);
-            } else {
-                printf("SFS > ERROR While reading the file");
+        n->size = size;
+        write_inode(f->inode);
+        return cache_wait() != 0 ? -1 : 0;
+    }
+    if ((n->flags & SFS_INODE_PACKED) && size <= n->data_ptrs[2] * PACK_FRAG_SIZE) {
+        if (size < old_size) {
+            char *zeros = calloc(1, old_size - size);
+            if (zeros == NULL || pack_write(n->data_ptrs[0], n->data_ptrs[1], (uint32_t) size, zeros,
+                                            (int) (old_size - size)) != 0) {
+                err = -1;
             }
+            free(zeros);
         }
-        data_ptr_index++;
+        n->size = size;
+        write_inode(f->inode);
+        return cache_wait() != 0 || err != 0 ? -1 : 0;
     }
-
-
-
-    /***************************************************************/
-    /******* put all the blocks in the output buffer ***************/
-    /***************************************************************/
-
-    int start_ptr = f->rwptr % BLOCK_SZ;
-    int end_ptr = (start_ptr + length) % BLOCK_SZ;
-
-    int j;
-
-    // one block
-    if (num_block_read == 1) {
-        for (j = start_ptr; j < end_ptr; j++) {
-            temp_buf = appendCharToCharArray(temp_buf, buffer[0][j], len_temp_buf);
-            len_temp_buf++;
+    if ((n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED)) && size <= PACK_MAX(BLOCK_SZ)) {
+        char *zeros = calloc(1, size - old_size);
+        err = zeros == NULL || write_small(f->inode, old_size, zeros, (int) (size - old_size)) != 0;
+        free(zeros);
+        return err ? -1 : 0;
+    }
+    if (n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED)) {
+        if (unpack(n) != 0) {
+            write_bitmap(0);
+            cache_wait();
+            return -1;
         }
+    }
 
+    block_map_t map;
+    map_init(&map, n);
 
-        // two blocks
-    } else if (num_block_read == 2) {
-        for (j = start_ptr; j < BLOCK_SZ; j++) {
-            temp_buf = appendCharToCharArray(temp_buf, buffer[0][j], len_temp_buf);
-            len_temp_buf++;
-        }
-        for (j = 0; j < end_ptr; j++) {
-            temp_buf = appendCharToCharArray(temp_buf, buffer[1][j], len_temp_buf);
-            len_temp_buf++;
-        }
-
+    if (size < old_size) {
+        uint64_t keep = BLOCKS_FOR(size, (uint64_t) BLOCK_SZ);
 
-        // more than two blocks
-    } else {
-        for (j = start_ptr; j < BLOCK_SZ; j++) {
-            temp_buf = appendCharToCharArray(temp_buf, buffer[0][j], len_temp_buf);
-            len_temp_buf++;
+        // the indirect block is read before any block is freed
+        if (n->indirect_ptrs != NO_BLOCK && map_slot(&map, 12, 0) == NULL) {
+            map_release(&map);
+            printf("SFS > Could not truncate the file!\n");
+            return -1;
         }
 
-        for (j = 1; j < num_block_read - 1; j++) {
-            int k;
-            for (k = 0; k < BLOCK_SZ; k++) {
-                temp_buf = appendCharToCharArray(temp_buf, buffer[j][k], len_temp_buf);
-                len_temp_buf++;
+        // compressed files keep whole chunks, the one the file ends in is stored again
+        if (n->flags & SFS_INODE_COMPRESSED) {
+            if (truncate_chunks(f, size) != 0) {
+                err = -1;
             }
+            keep = BLOCKS_FOR(size, (uint64_t) CHUNK_SZ) * SFS_CHUNK_BLOCKS;
         }
-
-        for (j = 0; j < end_ptr; j++) {
-            temp_buf = appendCharToCharArray(temp_buf, buffer[num_block_read - 1][j], len_temp_buf);
-            len_temp_buf++;
+        map_cut(&map, keep);
+
+        // the block the file now ends in must read back as zeros past the end
+        int tail = size & fs->block_mask;
+        int block_ptr;
+        if (!(n->flags & SFS_INODE_COMPRESSED) && tail != 0
+            && (block_ptr = map_block(&map, size >> fs->block_shift, 0, NULL)) != -1) {
+            char *block = malloc(BLOCK_SZ);
+            if (block == NULL || cache_read(block_ptr, 1, block) < 0
+                || (block_ptr = map_unshare(&map, size >> fs->block_shift, block_ptr)) == -1) {
+                err = -1;
+            } else {
+                memset(block + tail, 0, BLOCK_SZ - tail);
+                if (cache_write(block_ptr, 1, block) < 0) {
+                    err = -1;
+                }
+            }
+            free(block);
         }
     }
+    n->size = size;
 
-
-    f->rwptr += length;
-
-    for(i = 0; i < length; i++) {
-        buf[i] = temp_buf[i];
+    map_flush(&map);
+    write_bitmap(0);
+    write_inode(f->inode);
+    if (cache_wait() != 0) {
+        err = -1;
     }
-
-
-	return len_temp_buf;
+    map_release(&map);
+    if (err != 0) {
+        printf("SFS > Could not truncate the file!\n");
+    }
+    return err != 0 ? -1 : 0;
 }
 
 
 
 /**
- * @brief Write some data to the a file
+ * @brief Change the size of a file in place
+ * @long Blocks past the new size are freed, the indirect block too if none
+ *       is left, and the tail of the block the file now ends in is zeroed.
+ *       A file that grows gets a hole, see sfs_set_sparse. The read write
+ *       pointer does not move.
  * @param int File ID of an open file
- * @param const char Data that need to be written
- * @oaram int Length of the data
- * @retval int The number of bytes written
+ * @param int New size of the file
+ * @retval int Return zero on success, -1 if the file is not open or the disk failed
  */
-int sfs_fwrite(int fileID, const char *buf, int length){
+int sfs_ftruncate(int fileID, int size) {
+    API_BEGIN(STAT_FTRUNCATE, NULL, fileID, size, 0);
 
-    int count = 0;
-    int length_left = length;
+    if (fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        printf("SFS > The file %i is not open!\n", fileID);
+        API_RETURN(STAT_FTRUNCATE, -1);
+    }
+    if (size < 0 || size > MAX_RWPTR) {
+        printf("SFS > Wrong file size!\n");
+        API_RETURN(STAT_FTRUNCATE, -1);
+    }
 
+    API_RETURN(STAT_FTRUNCATE, resize_file(fileID, size));
+}
 
-	// get the file descritor and the inode of the file
-    file_descriptor* f = &fdt[fileID];
-    inode_t* n = &inode_table[f->inode];
 
 
-    /****************************************************************/
-    /****************** find empty data_prt *************************/
-    /****************************************************************/
+/**
+ * @brief Reserve the blocks of part of a file, so that writing them later cannot fail for want of space
+ * @long The blocks the file lacks are taken in runs that follow each other
+ *       on disk and marked unwritten: they read as zeros until they are
+ *       written. The file grows if the part ends past its end. Compressed
+ *       files only grow, their chunks take blocks when they are stored, and
+ *       small files stay in their inode or fragments while they fit.
+ * @param int File ID of an open file
+ * @param int First byte to reserve
+ * @param int Number of bytes to reserve, at least one
+ * @retval int Return zero on success, -1 if the file is not open or the disk is full
+ */
+int sfs_fallocate(int fileID, int offset, int length) {
+    API_BEGIN(STAT_FALLOCATE, NULL, fileID, offset, length);
 
-    // check if there is any empty direct pointer first
-    int ptr_index = 0;
-    while (n->data_ptrs[ptr_index] != -1 && ptr_index < 12) {
-        ptr_index++;
+    if (fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0) {
+        printf("SFS > The file %i is not open!\n", fileID);
+        API_RETURN(STAT_FALLOCATE, -1);
+    }
+    if (offset < 0 || length <= 0 || (uint64_t) offset + length > MAX_RWPTR) {
+        printf("SFS > Wrong range to allocate!\n");
+        API_RETURN(STAT_FALLOCATE, -1);
     }
-    int ind_ptr_index = 0;
-
-
-    // if no direct pointer is empty check the indirect pointer
-    // if indirect pointer exist
-    if (ptr_index == 12 && n->indirect_ptrs != -1) {
-        indirect_t *indirect_pointer = malloc(sizeof(indirect_t));
-        read_blocks(n->indirect_ptrs, 1, (void *) indirect_pointer);
 
-        while (indirect_pointer->data_ptr[ind_ptr_index] != -1) {
-            ind_ptr_index++;
-            if(ind_ptr_index == NUM_INDIRECT){
-                return 0;
-            }
-        }
+    file_descriptor *f = &fs->fdt[fileID];
+    inode_t *n = &fs->inode_table[f->inode];
+    uint64_t end = (uint64_t) offset + length;
+    int err = 0;
 
-        //if indirect pointer does not exist
-    } else if (ptr_index == 12) {
-        indirect_t *indirect_pointer = malloc(sizeof(indirect_t));
-        for (ind_ptr_index = 0; ind_ptr_index < NUM_INDIRECT; ind_ptr_index++) {
-            indirect_pointer->data_ptr[ind_ptr_index] = -1;
+    // small files and compressed files have no blocks to reserve
+    if ((n->flags & SFS_INODE_COMPRESSED)
+        || ((n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED)) && end <= PACK_MAX(BLOCK_SZ))) {
+        API_RETURN(STAT_FALLOCATE, end > n->size ? resize_file(fileID, end) : 0);
+    }
+    volume_in_use();
+    if (n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED)) {
+        if (unpack(n) != 0) {
+            write_bitmap(0);
+            cache_wait();
+            API_RETURN(STAT_FALLOCATE, -1);
         }
-        n->indirect_ptrs = get_index();
-        write_blocks(n->indirect_ptrs, 1, (void *) indirect_pointer);
-        ind_ptr_index = 0;
     }
 
+    block_map_t map;
+    map_init(&map, n);
+
+    uint64_t index = (uint64_t) offset >> fs->block_shift;
+    uint64_t last = BLOCKS_FOR(end, (uint64_t) BLOCK_SZ);
+    while (index < last) {
+        unsigned int *slot = map_slot(&map, index, 1);
+        if (slot == NULL) {
+            err = -1;
+            break;
+        }
+        if (*slot != NO_BLOCK) {
+            index++;
+            continue;
+        }
 
-    // if the pointer is in the middle of a block
-    // you need to read this block, fill it up, and write it back
-    if(f->rwptr%BLOCK_SZ != 0) {
+        // the hole goes on up to the next block the file has
+        uint32_t want = 1;
+        while (index + want < last && (slot = map_slot(&map, index + want, 1)) != NULL
+               && *slot == NO_BLOCK) {
+            want++;
+        }
 
-    /*****************************************************************/
-    /********* read_buffer to complete the last used block ***********/
-    /*****************************************************************/
+        uint32_t len;
+        uint32_t block = get_run(want, &len);
+        if (block == NO_BLOCK) {
+            err = -1;
+            break;
+        }
+        uint32_t i;
+        for (i = 0; i < len; i++) {
+            *map_slot(&map, index + i, 0) = (block + i) | SFS_BLOCK_UNWRITTEN;
+        }
+        map.allocated = 1;
+        if (index + len > 12) {
+            map.dirty = 1;
+        }
+        index += len;
+    }
 
-        char *read_buf = malloc(sizeof(char)*BLOCK_SZ);
+    // the file grows only if every block could be reserved
+    if (err == 0 && end > n->size) {
+        n->size = end;
+    }
 
-        uint64_t init_rwptr = f->rwptr;
+    map_flush(&map);
+    write_bitmap(0);
+    write_inode(f->inode);
+    if (cache_wait() != 0) {
+        err = -1;
+    }
+    map_release(&map);
+    if (err != 0) {
+        printf("SFS > Could not allocate the file!\n");
+    }
+    API_RETURN(STAT_FALLOCATE, err != 0 ? -1 : 0);
+}
 
-        sfs_fseek(fileID, (f->rwptr - (f->rwptr % BLOCK_SZ)));
 
 
-        // read the block to which we want to append
-        sfs_fread(fileID, read_buf, (init_rwptr % BLOCK_SZ));
+/**
+ * @brief Remove a file from the file system
+ * @param char Name of the file to be removed
+ * @retval int Return zero if successful
+ */
+int sfs_remove(char *file) {
+    API_BEGIN(STAT_REMOVE, file, -1, 0, 0);
 
-        int len_read_buf = (init_rwptr % BLOCK_SZ);
+    path_t p;
+    if (walk(file, &p) != 0 || p.entry < 0) {
+        printf("SFS > File not found!\n");
+        API_RETURN(STAT_REMOVE, -1);
+    }
+    int inode = (int) fs->directory_table[p.entry].inode;
+    if (load_inodes(inode, 1) != 0) {
+        API_RETURN(STAT_REMOVE, -1);
+    }
+    if (is_dir(inode)) {
+        printf("SFS > %s is a directory!\n", file);
+        API_RETURN(STAT_REMOVE, -1);
+    }
 
-        // complete the first block to be written with old and new stuff
-        int i;
+    // free bitmap
+    // a file can have holes, so look at every pointer
+    // a file kept in its inode has none, a packed file gives its fragments back
+    inode_t* n = &fs->inode_table[inode];
+    int small = n->flags & (SFS_INODE_INLINE | SFS_INODE_PACKED);
+    unsigned int *indirect_pointer = NULL;
+    int j;
 
-        if (length_left > BLOCK_SZ - (f->rwptr % BLOCK_SZ)) {
-            for (i = 0; i < BLOCK_SZ - (f->rwptr % BLOCK_SZ); i++) {
-                read_buf = appendCharToCharArray(read_buf, buf[i], len_read_buf);
-                len_read_buf++;
-                count++;
-            }
-        } else {
-            for (i = 0; i < length_left; i++) {
-                read_buf = appendCharToCharArray(read_buf, buf[i], len_read_buf);
-                len_read_buf++;
-                count++;
+    // nothing is freed unless every pointer of the file is known
+    if (!small && n->indirect_ptrs != NO_BLOCK) {
+        indirect_pointer = malloc(BLOCK_SZ);
+        if (indirect_pointer == NULL || cache_read(n->indirect_ptrs, 1, (void*) indirect_pointer) < 0) {
+            printf("SFS > Could not read the blocks of %s!\n", file);
+            free(indirect_pointer);
+            API_RETURN(STAT_REMOVE, -1);
+        }
+    }
+    drop_chunks(inode);
+    if (n->flags & SFS_INODE_PACKED) {
+        metadata_changed();
+        pack_free(n->data_ptrs[0], n->data_ptrs[1], n->data_ptrs[2]);
+    }
+    for(j = 0; j < 12 && !small; j++){
+        if(n->data_ptrs[j] != NO_BLOCK){
+            dedup_put(n->data_ptrs[j] & ~SFS_BLOCK_FLAGS);
+        }
+    }
+    if(indirect_pointer != NULL){
+        for(j = 0; j < PTRS_PER_BLOCK; j++){
+            if(indirect_pointer[j] != NO_BLOCK){
+                dedup_put(indirect_pointer[j] & ~SFS_BLOCK_FLAGS);
             }
         }
+        free(indirect_pointer);
+        rm_index(n->indirect_ptrs);
+    }
+    remove_entry(&p);
 
+	API_RETURN(STAT_REMOVE, 0);
+}
 
 
 
+/**
+ * @brief Make a directory
+ * @param const char* Path of the directory, every directory on the way must exist
+ * @retval int Return zero if successful, -1 if the path exists or leads nowhere
+ */
+int sfs_mkdir(const char *path) {
+    API_BEGIN(STAT_MKDIR, path, -1, 0, 0);
 
-        /****************************************************************/
-        /****************** write the first block ***********************/
-        /****************************************************************/
-
-        // if an direct pointer was found
-        if (ptr_index < 12) {
-            write_blocks(n->data_ptrs[ptr_index-1], 1, (void *) read_buf);
-        }
-        else if(ind_ptr_index == 0){
-            write_blocks(n->data_ptrs[ptr_index-1], 1, (void *) read_buf);
-        }
-
-        // if there was no empty direct pointer
-        else {
-            if(n->indirect_ptrs != -1) {
-                indirect_t *indirect_pointer = malloc(sizeof(indirect_t));
-                read_blocks(n->indirect_ptrs, 1, (void *) indirect_pointer);
-                write_blocks(indirect_pointer->data_ptr[ind_ptr_index-1], 1, (void *) read_buf);
-            }
-        }
-
-        // update how many bit are left to right
-        length_left -= BLOCK_SZ - (f->rwptr % BLOCK_SZ);
+    path_t p;
+    if (walk(path, &p) != 0 || p.name[0] == '\0' || p.entry >= 0) {
+        printf("SFS > Cannot make the directory %s!\n", path);
+        API_RETURN(STAT_MKDIR, -1);
     }
+    API_RETURN(STAT_MKDIR, create_entry(&p, SFS_INODE_DIR) == -1 ? -1 : 0);
+}
 
 
-    /****************************************************************/
-    /************ write all the other blocks needed *****************/
-    /****************************************************************/
 
-    int k;
-    char *write_buf;
-    int len_write_buf;
-    int num_block_left;
-    if(length_left > 0) {
-        num_block_left = (length_left - 1) / BLOCK_SZ + 1;
-    } else if (length_left == 1) {
-        num_block_left = 1;
-    } else {
-        num_block_left = 0;
+/**
+ * @brief Remove an empty directory
+ * @param const char* Path of the directory
+ * @retval int Return zero if successful, -1 if it is not an empty directory
+ */
+int sfs_rmdir(const char *path) {
+    API_BEGIN(STAT_RMDIR, path, -1, 0, 0);
+
+    path_t p;
+    if (walk(path, &p) != 0 || p.entry < 0) {
+        printf("SFS > Directory %s not found!\n", path);
+        API_RETURN(STAT_RMDIR, -1);
+    }
+    uint64_t inode = fs->directory_table[p.entry].inode;
+    if (load_inodes((int) inode, 1) != 0 || !is_dir(inode)) {
+        API_RETURN(STAT_RMDIR, -1);
     }
 
-    for(k = 0; k < num_block_left; k++) {
-        write_buf = "";
-        len_write_buf = 0;
+    // the walk loaded the whole directory
+    int i;
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        if (fs->directory_table[i].used == 1 && fs->directory_table[i].parent == inode) {
+            printf("SFS > Directory %s is not empty!\n", path);
+            API_RETURN(STAT_RMDIR, -1);
+        }
+    }
+    remove_entry(&p);
+    API_RETURN(STAT_RMDIR, 0);
+}
 
 
-        /********** if this is a middle block, ie. complete block **********/
-        if(length_left > BLOCK_SZ) {
 
-            //make the block
-            int w;
-            for(w = length - length_left; w < length - length_left + BLOCK_SZ; w++){
-                write_buf = appendCharToCharArray(write_buf, buf[w], len_write_buf);
-                len_write_buf++;
-                count++;
-            }
+/**
+ * @brief Tell what a path leads to
+ * @param const char* Path of a file or a directory, "/" for the root directory
+ * @param sfs_stat_t* Set to what the path leads to
+ * @retval int Return zero if successful, -1 if the path leads nowhere
+ */
+int sfs_stat(const char *path, sfs_stat_t *attr) {
+    API_BEGIN(STAT_STAT, path, -1, 0, 0);
 
+    path_t p;
+    if (walk(path, &p) != 0 || (p.name[0] != '\0' && p.entry < 0)) {
+        API_RETURN(STAT_STAT, -1);
+    }
+    uint64_t inode = p.name[0] == '\0' ? fs->sb.root_dir_inode : fs->directory_table[p.entry].inode;
+    if (load_inodes((int) inode, 1) != 0) {
+        API_RETURN(STAT_STAT, -1);
+    }
+    attr->inode = (uint32_t) inode;
+    attr->dir = is_dir(inode);
+    attr->size = attr->dir ? 0 : fs->inode_table[inode].size;
+    API_RETURN(STAT_STAT, 0);
+}
 
-            //write the block
-            // direct pointer
-            if(ptr_index < 12) {
-                n->data_ptrs[ptr_index] = get_index();
-                write_blocks(n->data_ptrs[ptr_index], 1, (void*) write_buf);
-                ptr_index++;
 
 
-            // indirect pointer
-            } else {
+/**
+ * @brief Tell why a file or a directory could not be made at a path
+ * @long For the front ends that report an errno: sfs_fopen and sfs_mkdir
+ *       only return -1.
+ * @param const char* Path that sfs_fopen or sfs_mkdir failed on
+ * @retval int EEXIST if the path exists, ENAMETOOLONG if its last name is too
+ *         long, ENOENT if a directory on the way is missing, ENOTDIR if one
+ *         is a file, ENOSPC otherwise
+ */
+int sfs_create_error(const char *path) {
+    const char *name = strrchr(path, '/');
+    sfs_stat_t attr;
 
-                //exist
-                if(n->indirect_ptrs != -1) {
-                    indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-                    read_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    indirect_pointer->data_ptr[ind_ptr_index] = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    write_blocks(indirect_pointer->data_ptr[ind_ptr_index], 1, (void*) write_buf);
-                    ind_ptr_index++;
-
-                //does not exit
-                } else{
-
-                    //create indirect pointer
-                    indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-                    for(ind_ptr_index = 0; ind_ptr_index < NUM_INDIRECT; ind_ptr_index++){
-                        indirect_pointer->data_ptr[ind_ptr_index] = -1;
-                    }
-                    n->indirect_ptrs = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    ind_ptr_index = 0;
-
-                    //save block
-                    indirect_pointer->data_ptr[ind_ptr_index] = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    write_blocks(indirect_pointer->data_ptr[ind_ptr_index], 1, (void*) write_buf);
-                    ind_ptr_index++;
-                }
-            }
+    name = name != NULL ? name + 1 : path;
+    if (strlen(name) > MAXFILENAME) {
+        return ENAMETOOLONG;
+    }
 
-            length_left -= BLOCK_SZ;
+    // every directory on the way, from the root down
+    char *dir = strdup(path);
+    if (dir == NULL) {
+        return ENOMEM;
+    }
+    char *end;
+    for (end = strchr(dir + 1, '/'); end != NULL; end = strchr(end + 1, '/')) {
+        *end = '\0';
+        int found = sfs_stat(dir, &attr) == 0;
+        *end = '/';
+        if (!found || !attr.dir) {
+            free(dir);
+            return found ? ENOTDIR : ENOENT;
         }
+    }
+    free(dir);
+    return sfs_stat(path, &attr) == 0 ? EEXIST : ENOSPC;
+}
 
 
 
-        /********** if this is the last block to be written **********/
-        else {
-            //make the block
-            int w;
-            for(w = length - length_left; w < length; w++){
-                write_buf = appendCharToCharArray(write_buf, buf[w], len_write_buf);
-                len_write_buf++;
-                count++;
-            }
+/**
+ * @brief Find the directory a path leads to and load the directory table
+ * @param const char* Path of the directory
+ * @param uint64_t* Set to the inode of the directory
+ * @retval int Return zero if successful, -1 if the path is not a directory
+ */
+static int open_dir(const char *path, uint64_t *dir) {
+    path_t p;
+    if (walk(path, &p) != 0 || (p.name[0] != '\0' && p.entry < 0)) {
+        return -1;
+    }
+    uint64_t inode = p.name[0] == '\0' ? fs->sb.root_dir_inode : fs->directory_table[p.entry].inode;
+    if (load_inodes((int) inode, 1) != 0 || !is_dir(inode) || load_entries(0, NUM_ENTRIES) != 0) {
+        return -1;
+    }
+    *dir = inode;
+    return 0;
+}
 
 
-            //write the block
-            //direct pointer
-            if(ptr_index < 12) {
-                n->data_ptrs[ptr_index] = get_index();
-                write_blocks(n->data_ptrs[ptr_index], 1, (void*) write_buf);
-                ptr_index++;
 
-                //indirect pointer
-            } else {
+/**
+ * @brief Get the name of the next file of a directory
+ * @long Unlike sfs_getnextfilename, the caller keeps where it is in the
+ *       directory, so that several listings can go on at once.
+ * @param const char* Path of the directory
+ * @param int* Where the listing is, zero to start, moves past the name returned
+ * @param char* Name of the file, at least MAXFILENAME + 1 bytes
+ * @retval int 1 if a name was returned, 0 at the end of the directory, -1 if the path is not a directory
+ */
+int sfs_readdir(const char *path, int *cursor, char *fname) {
+    API_BEGIN(STAT_READDIR, path, -1, *cursor, 0);
 
-                //exist
-                if(n->indirect_ptrs != -1) {
-                    indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-                    read_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    indirect_pointer->data_ptr[ind_ptr_index] = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    write_blocks(indirect_pointer->data_ptr[ind_ptr_index], 1, (void*) write_buf);
-                    ind_ptr_index++;
-                }
+    uint64_t dir;
+    if (open_dir(path, &dir) != 0) {
+        API_RETURN(STAT_READDIR, -1);
+    }
 
-                //does not exist
-                else{
-                    //create indirect pointer
-                    indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-                    for(ind_ptr_index = 0; ind_ptr_index < NUM_INDIRECT; ind_ptr_index++){
-                        indirect_pointer->data_ptr[ind_ptr_index] = -1;
-                    }
-                    n->indirect_ptrs = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    ind_ptr_index = 0;
-
-                    //save block
-                    indirect_pointer->data_ptr[ind_ptr_index] = get_index();
-                    write_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-                    write_blocks(indirect_pointer->data_ptr[ind_ptr_index], 1, (void*) write_buf);
-                    ind_ptr_index++;
-                }
-            }
+    int i;
+    for (i = *cursor < 0 ? 0 : *cursor; i < NUM_ENTRIES; i++) {
+        if (fs->directory_table[i].used == 1 && fs->directory_table[i].parent == dir) {
+            strcpy(fname, entry_name(&fs->directory_table[i]));
+            *cursor = i + 1;
+            API_RETURN(STAT_READDIR, 1);
         }
     }
+    *cursor = NUM_ENTRIES;
+    API_RETURN(STAT_READDIR, 0);
+}
 
 
-    // update file descriptor
-    f->rwptr += length;
 
-    // update bitmap
-    uint8_t* free_bit_map = get_bitmap();
-    write_blocks(NUM_BLOCKS - 1, 1, (void*) free_bit_map);
+/**
+ * @brief Get the next files of a directory with what each of them is
+ * @long A batch of sfs_readdir and sfs_stat in one call: the directory is
+ *       walked to once, and the inodes of the entries are read in the order
+ *       of the table, so listing a directory with its attributes costs one
+ *       pass instead of a lookup per name.
+ * @param const char* Path of the directory
+ * @param int* Where the listing is, zero to start, moves past the last entry returned
+ * @param sfs_dirent_t* Set to the entries
+ * @param int Room in the entries
+ * @retval int Number of entries returned, 0 at the end of the directory, -1 if the path is not a
+ *             directory or the inode of the next entry cannot be read
+ */
+int sfs_readdirplus(const char *path, int *cursor, sfs_dirent_t *ents, int max) {
+    API_BEGIN(STAT_READDIRPLUS, path, -1, *cursor, max);
 
-    // update inode
-    n->size += length;
-    write_blocks(1, (int) sb.inode_table_len, (void*) inode_table);
+    uint64_t dir;
+    if (max <= 0 || open_dir(path, &dir) != 0) {
+        API_RETURN(STAT_READDIRPLUS, -1);
+    }
 
-    return count;
+    int i, n = 0;
+    for (i = *cursor < 0 ? 0 : *cursor; i < NUM_ENTRIES && n < max; i++) {
+        entry_t *e = &fs->directory_table[i];
+        if (e->used != 1 || e->parent != dir) {
+            continue;
+        }
+        if (load_inodes((int) e->inode, 1) != 0) {
+            // hand over what was read, the next call starts at this entry
+            *cursor = i;
+            API_RETURN(STAT_READDIRPLUS, n > 0 ? n : -1);
+        }
+        strcpy(ents[n].name, entry_name(e));
+        ents[n].attr.inode = (uint32_t) e->inode;
+        ents[n].attr.dir = is_dir(e->inode);
+        ents[n].attr.size = ents[n].attr.dir ? 0 : fs->inode_table[e->inode].size;
+        n++;
+    }
+    *cursor = i;
+    API_RETURN(STAT_READDIRPLUS, n);
 }
 
 
 
 /**
- * @brief Move the read write pointer of a file to a particular position
+ * @brief Write the data of the file system held in memory to stable storage
+ * @long The block cache does not know which file a block belongs to, so
+ *       every dirty block is written back, not only those of the file.
  * @param int File ID of an open file
- * @param int Location where the pointer need to be relocated
- * @retval int Return zero if successful
+ * @retval int Return zero on success, -1 if the file is not open or a writeback failed
  */
-int sfs_fseek(int fileID, int loc){
+int sfs_fsync(int fileID) {
+    API_BEGIN(STAT_FSYNC, NULL, fileID, 0, 0);
 
-    // error checking 
-    if(loc < 0 || loc > MAX_RWPTR){
-        printf("SFS > Wrong RW location!\n");
+    if(fileID < 0 || fileID >= NUM_INODES_FS || fs->fdt[fileID].used == 0){
+        printf("SFS > The file %i is not open!\n", fileID);
+        API_RETURN(STAT_FSYNC, -1);
+    }
+
+    if (store_chunks(-1, UINT64_MAX) != 0 || cache_flush() != 0) {
+        printf("SFS > Could not write the file system back to the disk!\n");
+        API_RETURN(STAT_FSYNC, -1);
     }
-	
-    fdt[fileID].rwptr = loc;
-	return 0;
+    API_RETURN(STAT_FSYNC, 0);
 }
 
 
 
 /**
- * @brief Remove a file from the file system
- * @param char Name of the file to be removed
- * @retval int Return zero if successful
+ * @brief Check the mounted file system while it is in use, see sfs_check.h
+ * @param sfs_check_opts_t* How to check
+ * @param sfs_check_report_t* What was found
+ * @retval int Return zero on success
  */
-int sfs_remove(char *file) {
+int sfs_check(const sfs_check_opts_t *opts, sfs_check_report_t *report) {
+    int ret = -1;
+    int attempt;
 
-    // check if it is open
-    int inode = -1;
-    int i;
-    int directory_table_index;
-    for(i = 0; i < sizeof(directory_table)/sizeof(directory_table[0]); i++) {
-        if(directory_table[i].used == 1) {
-
-            if (strcmp(directory_table[i].name, file) == 0) {
-                inode = directory_table[i].inode;
-                directory_table_index = i;
-            }
-        }
-    }
-
-    if(inode == -1) {
-        printf("SFS > File not found!\n");
+    sfs_lock();
+    if (!sfs_is_mounted()) {
+        sfs_unlock();
         return -1;
     }
 
-    // free bitmap
-    inode_t* n = &inode_table[inode];
-    int j = 0;
-    while(n->data_ptrs[j] != -1 && j< 12){
-        rm_index(n->data_ptrs[j]);
-        j++;
-    }
-    j = 0;
-    if(n->indirect_ptrs != -1){
-        indirect_t* indirect_pointer = malloc(sizeof(indirect_t));
-        read_blocks(n->indirect_ptrs, 1, (void*) indirect_pointer);
-        while(indirect_pointer->data_ptr[j] != -1 && j< NUM_INDIRECT){
-            rm_index(indirect_pointer->data_ptr[j]);
-            j++;
+    size_t itable = fs->sb.inode_table_len * fs->sb.block_size;
+    size_t dtable = fs->sb.dir_table_len * fs->sb.block_size;
+    size_t bitmap_bytes = fs->sb.bitmap_len * fs->sb.block_size;
+    size_t refs_bytes = fs->sb.refs_len * fs->sb.block_size;
+    superblock_t copy_sb = fs->sb;
+    check_volume_t v;
+    memset(&v, 0, sizeof(v));
+    v.sb = &copy_sb;
+    v.inodes = malloc(itable);
+    v.entries = malloc(dtable);
+    uint8_t *bitmap = malloc(bitmap_bytes);
+    v.bitmap = bitmap;
+    v.refs = malloc(refs_bytes);
+    uint64_t mounted = fs->mount_gen;
+
+    // the image is read without the lock, another mksfs must not close it under the check
+    v.fd = dup(disk_fd());
+
+    for (attempt = 1; v.inodes != NULL && v.entries != NULL && bitmap != NULL && v.refs != NULL && v.fd >= 0;
+         attempt++) {
+        int keep_lock = attempt >= CHECK_ATTEMPTS;
+
+        // every table in memory and every block on the disk, then a copy of the tables
+        if (load_inodes(0, NUM_INODES_FS) != 0 || load_entries(0, NUM_ENTRIES) != 0
+            || bitmap_load_all() != 0 || dedup_table() == NULL || store_chunks(-1, UINT64_MAX) != 0
+            || cache_flush() != 0) {
+            break;
+        }
+        memcpy(v.inodes, fs->inode_table, itable);
+        memcpy(v.entries, fs->directory_table, dtable);
+        memcpy(bitmap, get_bitmap(), bitmap_bytes);
+        memcpy(v.refs, dedup_table(), refs_bytes);
+        uint64_t gen = fs->meta_gen;
+
+        if (!keep_lock) {
+            sfs_unlock();
+        }
+        int run = check_run(&v, opts, report);
+        if (!keep_lock) {
+            sfs_lock();
+        }
+        if (run != 0 || fs->mount_gen != mounted) {
+            check_release(&v);
+            break;
         }
-    }
-
-    // remove from directory_table
-    directory_table[directory_table_index].used = 0;
-
-    // remove from inode_table
-    inode_table[inode].used = 0;
 
-    // update disk
-    uint8_t* free_bit_map = get_bitmap();
-    write_blocks(NUM_BLOCKS - 1, 1, (void*) free_bit_map);
-    write_blocks(1, sb.inode_table_len, (void*) inode_table);
-    write_blocks(sb.inode_table_len + 1, NUM_DIR_BLOCKS, (void*) directory_table);
+        // the copy is still what is mounted
+        if (gen == fs->meta_gen) {
+            if (opts->repair) {
+                apply_repairs(&v);
+            }
+            check_release(&v);
+            ret = 0;
+            break;
+        }
+        check_release(&v);
+    }
+    sfs_unlock();
 
-	return 0;
+    if (v.fd >= 0) {
+        close(v.fd);
+    }
+    free(v.inodes);
+    free(v.entries);
+    free(bitmap);
+    free(v.refs);
+    return ret;
 }
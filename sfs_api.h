@@ -4,9 +4,60 @@
 #include <stdint.h>
 
 #define MAXFILENAME 20
-#define NUM_BLOCKS 100000
-#define NUM_INODES 50
-#define NUM_INDIRECT NUM_BLOCKS / sizeof(unsigned int)
+
+// geometry used by mksfs(1) until sfs_set_geometry changes it
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 100000
+#define DEFAULT_NUM_INODES 50
+
+// disk image used by mksfs until sfs_set_image changes it
+#define DEFAULT_DISK_FILE "sfs_disk.disk"
+
+// how far ahead of sequential reads to read by default, in KB
+#define DEFAULT_READAHEAD_KB 128
+
+// supported block sizes, powers of two in between
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+// value of a block pointer that does not point to any block
+#define NO_BLOCK ((unsigned int) -1)
+
+// magic number of the super block
+#define SFS_MAGIC 0xACBD0009
+
+// flags of an inode: the data of the file is kept in the inode, in place of its block pointers
+#define SFS_INODE_INLINE 1
+
+// flags of an inode: the data of the file is packed with other small files in a shared block
+#define SFS_INODE_PACKED 2
+
+// flags of an inode: the blocks of the file are compressed SFS_CHUNK_BLOCKS at a time
+#define SFS_INODE_COMPRESSED 4
+
+// flags of an inode: the inode is a directory, it has no data and the entries
+// of its files name it as their parent; the root directory may lack the flag
+#define SFS_INODE_DIR 8
+
+// bytes of data an inode can hold, the room of its block pointers
+#define SFS_INLINE_MAX 100
+
+// blocks of a compressed file that are compressed together, a chunk
+#define SFS_CHUNK_BLOCKS 8
+
+// set on the first block pointer of a chunk stored compressed, see chunk_header_t
+#define SFS_CHUNK_COMPRESSED 0x80000000u
+
+// set on a block pointer of a file that is not compressed when the block was reserved
+// by sfs_fallocate and never written since, it reads as zeros
+#define SFS_BLOCK_UNWRITTEN 0x40000000u
+
+// flags a block pointer may carry besides its block
+#define SFS_BLOCK_FLAGS (SFS_CHUNK_COMPRESSED | SFS_BLOCK_UNWRITTEN)
+
+// state of the super block, images made before it existed read as dirty
+#define SFS_STATE_DIRTY 0
+#define SFS_STATE_CLEAN 1
 
 
 /*
@@ -15,6 +66,19 @@
  * fs_size              Size of the file system
  * inode_table_len      Length of the inode table
  * root_dir_inode       pointer to the inode of the root
+ * num_blocks           Number of blocks on the disk
+ * num_inodes           Number of inodes, including the root directory
+ * dir_table_len        Length of the directory table
+ * bitmap_len           Length of the free bitmap, at the end of the disk
+ * state                SFS_STATE_CLEAN if the volume was unmounted cleanly
+ *                      and the checkpoint below is up to date
+ * free_blocks          checkpoint: number of free blocks
+ * free_inodes          checkpoint: number of free inodes
+ * first_free_byte      checkpoint: no byte of the bitmap before it has a free bit
+ * csum_len             Length of the checksum table, right before the bitmap:
+ *                      the CRC32C of every block, see sfs_csum.h
+ * refs_len             Length of the share count table, right before the checksum
+ *                      table: a byte per block, see sfs_dedup.h
  */
 typedef struct{
     uint64_t magic;
@@ -22,6 +86,16 @@ typedef struct{
     uint64_t fs_size;
     uint64_t inode_table_len;
     uint64_t root_dir_inode;
+    uint64_t num_blocks;
+    uint64_t num_inodes;
+    uint64_t dir_table_len;
+    uint64_t bitmap_len;
+    uint64_t state;
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+    uint64_t first_free_byte;
+    uint64_t csum_len;
+    uint64_t refs_len;
 } superblock_t;
 
 
@@ -33,8 +107,16 @@ typedef struct{
  * uid
  * gid
  * size             size of the file
- * data_ptrs        direct data pointer
+ * flags            SFS_INODE_* flags
+ * data_ptrs        direct data pointer, with SFS_INODE_PACKED the shared block,
+ *                  the first fragment and the number of fragments
+ *                  with SFS_INODE_COMPRESSED, the pointers of a chunk either map
+ *                  its blocks one to one, or they map its compressed form and
+ *                  the first one carries SFS_CHUNK_COMPRESSED
  * indirect_ptrs    pointer to the structure containing the indirect pointer
+ * inline_data      data of a file with SFS_INODE_INLINE, zero past its size
+ *
+ * Inodes take 128 bytes, so that none of them spans two blocks.
  */
 typedef struct {
     unsigned int used;
@@ -43,45 +125,112 @@ typedef struct {
     unsigned int uid;
     unsigned int gid;
     unsigned int size;
-    unsigned int data_ptrs[12];
-    unsigned int indirect_ptrs;
+    unsigned int flags;
+    union {
+        struct {
+            unsigned int data_ptrs[12];
+            unsigned int indirect_ptrs;
+        };
+        char inline_data[SFS_INLINE_MAX];
+    };
 } inode_t;
 
 
 
 /*
- * data_ptr     indirect pointer
+ * Start of the first block of a chunk stored compressed, the compressed data
+ * follows and goes on in the blocks of the next pointers of the chunk
+ * raw_len      bytes of the chunk once decompressed, zeros follow up to its end
+ * comp_len     bytes of compressed data, see sfs_lz.h
  */
 typedef struct {
-    unsigned  int data_ptr[ NUM_INDIRECT ];
-} indirect_t;
+    uint32_t raw_len;
+    uint32_t comp_len;
+} chunk_header_t;
 
 
 
 /*
  * used     if this entry is being used
+ * parent   inode of the directory holding the entry, the root directory is
+ *          inode zero, as in the images made before subdirectories
  * inode    which inode this entry describes
- * name     name of the file associated with the inode
+ * name     name of the file associated with the inode, without '/'
  */
 typedef struct {
-    uint64_t used;
+    uint32_t used;
+    uint32_t parent;
     uint64_t inode;
-    char* name;
+    char name[MAXFILENAME + 1];
 } entry_t;
 
 
 
+/*
+ * What sfs_stat tells about a path
+ * inode    inode of the file
+ * size     size of the file, zero for a directory
+ * dir      1 for a directory, 0 for a file
+ */
+typedef struct {
+    uint32_t inode;
+    uint32_t size;
+    uint32_t dir;
+} sfs_stat_t;
+
+/*
+ * An entry of a directory returned by sfs_readdirplus
+ * name     name of the entry
+ * attr     what the entry is, as sfs_stat tells
+ */
+typedef struct {
+    char name[MAXFILENAME + 1];
+    sfs_stat_t attr;
+} sfs_dirent_t;
+
+
+
 /*
  * inode    which inode this entry describes
  * rwptr    where in the file to start
+ * seq_end  where the last read ended, to spot sequential reads
+ * ra_end   where the readahead of the file ended
+ * zbuf     a chunk of a compressed file, decompressed, NULL if none
+ * zchunk   which chunk zbuf holds
+ * zdirtied when zbuf first changed since the chunk was stored, zero if it did not
  */
 typedef struct {
     uint64_t used;
     uint64_t inode;
     uint64_t rwptr;
+    uint64_t seq_end;
+    uint64_t ra_end;
+    char *zbuf;
+    uint64_t zchunk;
+    uint64_t zdirtied;
 } file_descriptor;
 
+/* a volume: a mounted file system with its own lock, block cache and I/O engine */
+typedef struct sfs sfs_t;
+
+sfs_t *sfs_new(void);
+void sfs_use(sfs_t *vol);
+sfs_t *sfs_current(void);
+void sfs_free(sfs_t *vol);
+int sfs_set_geometry(int block_size, int num_blocks, int num_inodes);
+void sfs_set_image(const char *path);
+void sfs_set_cache_size(uint64_t bytes);
+int sfs_set_io(const char *backend, int queue_depth, int readahead_kb);
+int sfs_set_writeback(int background_pct, int dirty_pct, int expire_ms);
+void sfs_set_compression(int on);
+void sfs_set_dedup(int on);
+void sfs_set_sparse(int on);
+int sfs_is_mounted(void);
+int sfs_image_blank(void);
+void sfs_lock(void);
+void sfs_unlock(void);
 void mksfs(int fresh);
+void sfs_unmount(void);
 int sfs_getnextfilename(char *fname);
 int sfs_getfilesize(const char* path);
 int sfs_fopen(char *name);
@@ -89,6 +238,15 @@ int sfs_fclose(int fileID);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
 int sfs_fseek(int fileID, int loc);
+int sfs_ftruncate(int fileID, int size);
+int sfs_fallocate(int fileID, int offset, int length);
 int sfs_remove(char *file);
+int sfs_mkdir(const char *path);
+int sfs_rmdir(const char *path);
+int sfs_stat(const char *path, sfs_stat_t *attr);
+int sfs_create_error(const char *path);
+int sfs_readdir(const char *path, int *cursor, char *fname);
+int sfs_readdirplus(const char *path, int *cursor, sfs_dirent_t *ents, int max);
+int sfs_fsync(int fileID);
 
 #endif //_INCLUDE_SFS_API_H_
@@ -0,0 +1,303 @@
+
+// asynchronous sfs_fread and sfs_fwrite with a completion queue
+
+#include "sfs_async.h"
+#include "sfs_api.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+/*
+ * done     the completion, filled when the operation ran
+ * buf      data of the operation
+ * length   bytes to move
+ * offset   where in the file, SFS_CUR_POS for the read write pointer
+ * next     next operation in its queue
+ */
+typedef struct async_req {
+    sfs_completion_t done;
+    char *buf;
+    int length;
+    int offset;
+    struct async_req *next;
+} async_req_t;
+
+/*
+ * FIFO of operations
+ */
+typedef struct {
+    async_req_t *head;
+    async_req_t *tail;
+} async_queue_t;
+
+
+/*
+ * Background operations of a volume
+ * lock             held to change the queues
+ * submit_cond      signalled when an operation is submitted
+ * complete_cond    signalled when an operation completes
+ * submitted        operations not run yet
+ * completed        operations run, not reaped yet
+ * worker           thread running them
+ * running          if the worker was started
+ * stopping         tells the worker to exit
+ * outstanding      operations submitted and not reaped yet
+ * max_outstanding  most of them
+ * event_fd         bumped by every completion
+ */
+struct async_state {
+    pthread_mutex_t lock;
+    pthread_cond_t submit_cond;
+    pthread_cond_t complete_cond;
+    async_queue_t submitted;
+    async_queue_t completed;
+    pthread_t worker;
+    int running;
+    int stopping;
+    int outstanding;
+    int max_outstanding;
+    int event_fd;
+};
+
+#define ASYNC_EMPTY { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+                      PTHREAD_COND_INITIALIZER, { NULL, NULL }, { NULL, NULL }, 0, 0, 0, 0, 0, -1 }
+
+
+/* globals */
+static async_state_t default_async = ASYNC_EMPTY;
+
+// state of the volume the calling thread works on
+static __thread async_state_t *aq = &default_async;
+
+
+
+static void push(async_queue_t *q, async_req_t *req) {
+    req->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = req;
+    } else {
+        q->head = req;
+    }
+    q->tail = req;
+}
+
+
+
+static async_req_t *pop(async_queue_t *q) {
+    async_req_t *req = q->head;
+    if (req != NULL) {
+        q->head = req->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return req;
+}
+
+
+
+/**
+ * @brief Run an operation with the synchronous API
+ * @param async_req_t* Operation, its result is set
+ * @retval None
+ */
+static void run(async_req_t *req) {
+    // the seek and the transfer must not be split by another thread
+    sfs_lock();
+    if (req->offset != SFS_CUR_POS && sfs_fseek(req->done.fileID, req->offset) != 0) {
+        req->done.result = -1;
+    } else if (req->done.op == SFS_ASYNC_READ) {
+        req->done.result = sfs_fread(req->done.fileID, req->buf, req->length);
+    } else {
+        req->done.result = sfs_fwrite(req->done.fileID, req->buf, req->length);
+    }
+    sfs_unlock();
+}
+
+
+
+static void *work(void *vol) {
+    uint64_t one = 1;
+
+    sfs_use(vol);
+
+    pthread_mutex_lock(&aq->lock);
+    while (1) {
+        async_req_t *req;
+        while ((req = pop(&aq->submitted)) == NULL && !aq->stopping) {
+            pthread_cond_wait(&aq->submit_cond, &aq->lock);
+        }
+        if (req == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&aq->lock);
+
+        run(req);
+
+        pthread_mutex_lock(&aq->lock);
+        push(&aq->completed, req);
+        pthread_cond_broadcast(&aq->complete_cond);
+        if (write(aq->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            printf("SFS > Could not signal a completion\n");
+        }
+    }
+    pthread_mutex_unlock(&aq->lock);
+    return NULL;
+}
+
+
+
+int sfs_async_init(int queue_size) {
+    sfs_async_shutdown();
+
+    aq->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aq->event_fd < 0) {
+        printf("SFS > Could not create the completion eventfd\n");
+        return -1;
+    }
+
+    aq->max_outstanding = queue_size > 0 ? queue_size : SFS_ASYNC_DEFAULT_QUEUE;
+    aq->stopping = 0;
+    if (pthread_create(&aq->worker, NULL, work, sfs_current()) != 0) {
+        printf("SFS > Could not start the async worker\n");
+        close(aq->event_fd);
+        aq->event_fd = -1;
+        return -1;
+    }
+    aq->running = 1;
+    return 0;
+}
+
+
+
+void sfs_async_shutdown(void) {
+    async_req_t *req;
+
+    if (!aq->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&aq->lock);
+    aq->stopping = 1;
+    pthread_cond_broadcast(&aq->submit_cond);
+    pthread_mutex_unlock(&aq->lock);
+    pthread_join(aq->worker, NULL);
+
+    while ((req = pop(&aq->completed)) != NULL) {
+        free(req);
+    }
+    aq->outstanding = 0;
+    aq->running = 0;
+    close(aq->event_fd);
+    aq->event_fd = -1;
+}
+
+
+
+int sfs_async_eventfd(void) {
+    return aq->event_fd;
+}
+
+
+
+static int submit(sfs_async_op_t op, int fileID, char *buf, int length, int offset,
+                  uint64_t user_data) {
+    if (!aq->running || (offset < 0 && offset != SFS_CUR_POS)) {
+        return -1;
+    }
+
+    async_req_t *req = malloc(sizeof(async_req_t));
+    if (req == NULL) {
+        return -1;
+    }
+    req->done.user_data = user_data;
+    req->done.op = op;
+    req->done.fileID = fileID;
+    req->done.result = 0;
+    req->buf = buf;
+    req->length = length;
+    req->offset = offset;
+
+    pthread_mutex_lock(&aq->lock);
+    if (aq->outstanding >= aq->max_outstanding) {
+        pthread_mutex_unlock(&aq->lock);
+        free(req);
+        return -1;
+    }
+    aq->outstanding++;
+    push(&aq->submitted, req);
+    pthread_cond_signal(&aq->submit_cond);
+    pthread_mutex_unlock(&aq->lock);
+    return 0;
+}
+
+
+
+int sfs_submit_read(int fileID, char *buf, int length, int offset, uint64_t user_data) {
+    return submit(SFS_ASYNC_READ, fileID, buf, length, offset, user_data);
+}
+
+
+
+int sfs_submit_write(int fileID, const char *buf, int length, int offset, uint64_t user_data) {
+    return submit(SFS_ASYNC_WRITE, fileID, (char *) buf, length, offset, user_data);
+}
+
+
+
+int sfs_reap(sfs_completion_t *out, int max, int wait) {
+    int count = 0;
+
+    pthread_mutex_lock(&aq->lock);
+    while (wait && aq->completed.head == NULL && aq->outstanding > 0) {
+        pthread_cond_wait(&aq->complete_cond, &aq->lock);
+    }
+
+    while (count < max) {
+        async_req_t *req = pop(&aq->completed);
+        if (req == NULL) {
+            break;
+        }
+        out[count++] = req->done;
+        aq->outstanding--;
+        free(req);
+    }
+    pthread_mutex_unlock(&aq->lock);
+    return count;
+}
+
+
+
+async_state_t *async_new(void) {
+    async_state_t *a = malloc(sizeof(async_state_t));
+    async_state_t empty = ASYNC_EMPTY;
+
+    if (a != NULL) {
+        *a = empty;
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->submit_cond, NULL);
+        pthread_cond_init(&a->complete_cond, NULL);
+    }
+    return a;
+}
+
+
+
+void async_destroy(async_state_t *a) {
+    if (a == NULL || a == &default_async) {
+        return;
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->submit_cond);
+    pthread_cond_destroy(&a->complete_cond);
+    free(a);
+}
+
+
+
+void async_use(async_state_t *a) {
+    aq = a != NULL ? a : &default_async;
+}
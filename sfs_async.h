@@ -0,0 +1,101 @@
+#ifndef _INCLUDE_SFS_ASYNC_H_
+#define _INCLUDE_SFS_ASYNC_H_
+
+#include <stdint.h>
+
+/* default number of operations submitted and not reaped yet */
+#define SFS_ASYNC_DEFAULT_QUEUE 256
+
+/* offset of sfs_submit_read and sfs_submit_write meaning the read write pointer */
+#define SFS_CUR_POS (-1)
+
+typedef enum {
+    SFS_ASYNC_READ,
+    SFS_ASYNC_WRITE
+} sfs_async_op_t;
+
+/*
+ * user_data    value given to sfs_submit_read or sfs_submit_write
+ * op           which operation completed
+ * fileID       file the operation worked on
+ * result       what sfs_fread or sfs_fwrite returned, -1 if the seek failed
+ */
+typedef struct {
+    uint64_t user_data;
+    sfs_async_op_t op;
+    int fileID;
+    int result;
+} sfs_completion_t;
+
+/* background operations of a volume, see sfs_new */
+typedef struct async_state async_state_t;
+
+/*
+ * @short make the state of a new volume, not started
+ * @return the state, NULL if out of memory
+ */
+async_state_t *async_new(void);
+
+/*
+ * @short free the state of a volume, stopped with sfs_async_shutdown first
+ */
+void async_destroy(async_state_t *a);
+
+/*
+ * @short make the calling thread work on the state of a volume
+ * @long Every thread starts on the state of the default volume, NULL goes
+ *       back to it. The calls below work on the volume of the thread, and
+ *       the worker runs its operations on it.
+ */
+void async_use(async_state_t *a);
+
+/*
+ * @short start running sfs operations in the background
+ * @long Operations submitted with sfs_submit_read and sfs_submit_write run in
+ *       submission order on a worker thread, and their completions are queued
+ *       until sfs_reap collects them. Every completion also bumps an eventfd
+ *       counter, so that the queue can be watched with poll, select or epoll.
+ *
+ * @param queue_size  most operations submitted and not reaped yet
+ * @return 0 on success, -1 if the worker or the eventfd cannot be created
+ */
+int sfs_async_init(int queue_size);
+
+/*
+ * @short wait for every submitted operation and stop the worker
+ * @long Completions not reaped yet are dropped.
+ */
+void sfs_async_shutdown(void);
+
+/*
+ * @short eventfd readable when completions are waiting, -1 if not started
+ * @long Read it to reset the counter before calling sfs_reap.
+ */
+int sfs_async_eventfd(void);
+
+/*
+ * @short queue a read of an open file, without waiting for it
+ * @param fileID     open file
+ * @param buf        where the data goes, must stay valid until reaped
+ * @param length     bytes to read
+ * @param offset     where to read, SFS_CUR_POS for the read write pointer
+ * @param user_data  handed back in the completion
+ * @return 0 if queued, -1 if the queue is full or async I/O is not started
+ */
+int sfs_submit_read(int fileID, char *buf, int length, int offset, uint64_t user_data);
+
+/*
+ * @short queue a write to an open file, see sfs_submit_read
+ */
+int sfs_submit_write(int fileID, const char *buf, int length, int offset, uint64_t user_data);
+
+/*
+ * @short collect completed operations
+ * @param out   where the completions go
+ * @param max   room in out
+ * @param wait  if non zero, block until at least one operation completes
+ * @return number of completions stored in out
+ */
+int sfs_reap(sfs_completion_t *out, int max, int wait);
+
+#endif //_INCLUDE_SFS_ASYNC_H_
@@ -0,0 +1,609 @@
+/* sfs_bench.c
+ *
+ * Throughput and metadata rate benchmark for the simple file system.
+ * Every test formats a fresh file system, then times each sfs_* call
+ * and reports the throughput with the p50 and p99 latencies.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "sfs_stats.h"
+#include "sfs_cache.h"
+#include "disk_aio.h"
+#include "sfs_async.h"
+
+/* I/O sizes used by the throughput tests */
+static const int io_sizes[] = { 64, 512, 1024, 4096, 16384, 65536 };
+#define NUM_IO_SIZES (sizeof(io_sizes) / sizeof(io_sizes[0]))
+
+/* entries the directory scan asks sfs_readdirplus for at once */
+#define BENCH_DIRENTS 64
+
+/*
+ * file_size    size of the file used by the throughput tests
+ * ops          number of random I/Os per I/O size
+ * rounds       rounds of the metadata tests
+ * seed         seed of the random offsets
+ * block_size   block size of the file systems made by the tests
+ * num_blocks   number of blocks of the file systems made by the tests
+ * num_inodes   number of inodes of the file systems made by the tests
+ * cache_kb     size of the block cache in KB
+ * backend      I/O backend
+ * queue_depth  most disk requests in flight
+ * readahead_kb how far to read ahead of sequential reads
+ * dirty_pct    dirty share of the cache at which writers wait, 0 writes through
+ * device       profile of the emulated disk
+ * request_us   cost of a disk request, in microseconds, -1 for the profile's
+ * seek_us      full stroke seek of the disk, in microseconds, -1 for the profile's
+ * fail_p       probability that a disk request fails transiently, -1 for the profile's
+ * compress     compress the files of the benchmark
+ * dedup        deduplicate the blocks of the benchmark
+ */
+typedef struct {
+    int file_size;
+    int ops;
+    int rounds;
+    unsigned int seed;
+    int block_size;
+    int num_blocks;
+    int num_inodes;
+    int cache_kb;
+    const char *backend;
+    int queue_depth;
+    int readahead_kb;
+    int dirty_pct;
+    const char *device;
+    double request_us;
+    double seek_us;
+    double fail_p;
+    int compress;
+    int dedup;
+} bench_opts_t;
+
+/*
+ * samples  latency of every call, in nanoseconds
+ * count    number of samples
+ * bytes    bytes moved by all the calls
+ * elapsed  wall clock time of the whole test, in nanoseconds
+ */
+typedef struct {
+    uint64_t *samples;
+    int count;
+    uint64_t bytes;
+    uint64_t elapsed;
+} bench_result_t;
+
+/* where the results go, the file system writes its messages to stdout */
+static FILE *report;
+
+
+
+/**
+ * @brief Compare two latency samples for qsort
+ */
+static int cmp_sample(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * @brief Allocate room for the samples of a test
+ * @param bench_result_t* Result to initialize
+ * @param int Maximum number of samples
+ * @retval None
+ */
+static void result_init(bench_result_t *r, int max_samples) {
+    r->samples = malloc(sizeof(uint64_t) * (max_samples > 0 ? max_samples : 1));
+    if (r->samples == NULL) {
+        fprintf(stderr, "ABORT: Out of memory!\n");
+        exit(-1);
+    }
+    r->count = 0;
+    r->bytes = 0;
+    r->elapsed = 0;
+}
+
+
+
+/**
+ * @brief Print one line of results and release the samples
+ * @param const char* Name of the test
+ * @param int I/O size of the test, zero for metadata tests
+ * @param bench_result_t* Result of the test
+ * @retval None
+ */
+static void result_print(const char *name, int io_size, bench_result_t *r) {
+    double seconds = r->elapsed / 1e9;
+    double p50 = 0, p99 = 0;
+
+    if (r->count > 0) {
+        qsort(r->samples, r->count, sizeof(uint64_t), cmp_sample);
+        p50 = r->samples[(r->count - 1) * 50 / 100] / 1e3;
+        p99 = r->samples[(r->count - 1) * 99 / 100] / 1e3;
+    }
+
+    fprintf(report, "%-16s %8d %8d %12.2f %12.1f %12.1f %12.1f\n", name, io_size, r->count,
+           seconds > 0 ? r->bytes / seconds / (1024 * 1024) : 0,
+           seconds > 0 ? r->count / seconds : 0, p50, p99);
+
+    free(r->samples);
+}
+
+
+
+/**
+ * @brief Fill a buffer with a pattern depending on the offset
+ */
+static void fill_pattern(char *buf, int len, int offset) {
+    int i;
+    for (i = 0; i < len; i++) {
+        buf[i] = (char) (offset + i);
+    }
+}
+
+
+
+/**
+ * @brief Time the formatting and the mounting of a file system
+ * @retval None
+ */
+static void bench_mount(const bench_opts_t *o) {
+    bench_result_t r;
+    uint64_t start;
+
+    result_init(&r, 1);
+    start = stats_now();
+    mksfs(1);
+    r.samples[r.count++] = stats_now() - start;
+    r.elapsed = r.samples[0];
+    result_print("mksfs_fresh", 0, &r);
+
+    result_init(&r, o->rounds);
+    uint64_t begin = stats_now();
+    int i;
+    for (i = 0; i < o->rounds; i++) {
+        start = stats_now();
+        mksfs(0);
+        r.samples[r.count++] = stats_now() - start;
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("mksfs_mount", 0, &r);
+}
+
+
+
+/**
+ * @brief Time sequential writes then sequential reads of a whole file
+ * @param bench_opts_t* Options of the benchmark
+ * @param int Size of every call
+ * @retval None
+ */
+static void bench_sequential(const bench_opts_t *o, int io_size) {
+    int calls = (o->file_size + io_size - 1) / io_size;
+    char *buf = malloc(io_size);
+    bench_result_t r;
+    uint64_t begin, start;
+    int i, ret;
+
+    mksfs(1);
+    int fd = sfs_fopen("/bench_seq");
+
+    // sequential write
+    result_init(&r, calls);
+    begin = stats_now();
+    for (i = 0; i < calls; i++) {
+        int len = o->file_size - i * io_size < io_size ? o->file_size - i * io_size : io_size;
+        fill_pattern(buf, len, i * io_size);
+        start = stats_now();
+        ret = sfs_fwrite(fd, buf, len);
+        r.samples[r.count++] = stats_now() - start;
+        if (ret != len) {
+            fprintf(stderr, "ERROR: Tried to write %d bytes, but wrote %d\n", len, ret);
+            break;
+        }
+        r.bytes += ret;
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("seq_write", io_size, &r);
+
+    // sequential read
+    sfs_fseek(fd, 0);
+    result_init(&r, calls);
+    begin = stats_now();
+    for (i = 0; i < calls; i++) {
+        start = stats_now();
+        ret = sfs_fread(fd, buf, io_size);
+        r.samples[r.count++] = stats_now() - start;
+        if (ret <= 0) {
+            fprintf(stderr, "ERROR: Requested %d bytes, read %d\n", io_size, ret);
+            break;
+        }
+        r.bytes += ret;
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("seq_read", io_size, &r);
+
+    sfs_fclose(fd);
+    free(buf);
+}
+
+
+
+/**
+ * @brief Time reads and overwrites at random offsets of a file
+ * @param bench_opts_t* Options of the benchmark
+ * @param int Size of every call
+ * @retval None
+ */
+static void bench_random(const bench_opts_t *o, int io_size) {
+    int slots = o->file_size / io_size;
+    char *buf = malloc(o->file_size > io_size ? o->file_size : io_size);
+    bench_result_t r;
+    uint64_t begin, start;
+    int i, ret;
+
+    if (slots == 0) {
+        free(buf);
+        return;
+    }
+
+    // lay out the file with big writes first
+    mksfs(1);
+    int fd = sfs_fopen("/bench_rand");
+    fill_pattern(buf, o->file_size, 0);
+    sfs_fwrite(fd, buf, o->file_size);
+
+    srand(o->seed);
+
+    // random read
+    result_init(&r, o->ops);
+    begin = stats_now();
+    for (i = 0; i < o->ops; i++) {
+        int offset = (rand() % slots) * io_size;
+        start = stats_now();
+        sfs_fseek(fd, offset);
+        ret = sfs_fread(fd, buf, io_size);
+        r.samples[r.count++] = stats_now() - start;
+        if (ret != io_size) {
+            fprintf(stderr, "ERROR: Requested %d bytes, read %d\n", io_size, ret);
+            break;
+        }
+        r.bytes += ret;
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("rand_read", io_size, &r);
+
+    // random overwrite
+    result_init(&r, o->ops);
+    begin = stats_now();
+    for (i = 0; i < o->ops; i++) {
+        int offset = (rand() % slots) * io_size;
+        fill_pattern(buf, io_size, offset);
+        start = stats_now();
+        sfs_fseek(fd, offset);
+        ret = sfs_fwrite(fd, buf, io_size);
+        r.samples[r.count++] = stats_now() - start;
+        if (ret != io_size) {
+            fprintf(stderr, "ERROR: Tried to write %d bytes, but wrote %d\n", io_size, ret);
+            break;
+        }
+        r.bytes += ret;
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("rand_write", io_size, &r);
+
+    sfs_fclose(fd);
+    free(buf);
+}
+
+
+
+/**
+ * @brief Time random reads submitted with sfs_submit_read, queue_depth at a time
+ * @long The completions are reaped when the eventfd wakes poll up, like an
+ *       event loop would. The latency is measured from submission to reaping.
+ * @param bench_opts_t* Options of the benchmark
+ * @param int Size of every call
+ * @retval None
+ */
+static void bench_async(const bench_opts_t *o, int io_size) {
+    int slots = o->file_size / io_size;
+    int depth = o->queue_depth > 0 ? o->queue_depth : AIO_DEFAULT_DEPTH;
+    char *buf = malloc(o->file_size > io_size ? o->file_size : io_size);
+    char *bufs = malloc((size_t) depth * io_size);
+    uint64_t *started = calloc(depth, sizeof(uint64_t));
+    sfs_completion_t *done = malloc(sizeof(sfs_completion_t) * depth);
+    bench_result_t r;
+    uint64_t begin, counter;
+    int i, submitted = 0, failed = 0;
+
+    if (slots == 0 || sfs_async_init(depth) != 0) {
+        free(buf);
+        free(bufs);
+        free(started);
+        free(done);
+        return;
+    }
+
+    mksfs(1);
+    int fd = sfs_fopen("/bench_async");
+    fill_pattern(buf, o->file_size, 0);
+    sfs_fwrite(fd, buf, o->file_size);
+
+    srand(o->seed);
+    struct pollfd pfd = { sfs_async_eventfd(), POLLIN, 0 };
+
+    result_init(&r, o->ops);
+    begin = stats_now();
+    while (r.count < o->ops && !failed) {
+        // keep the queue full, the slot of a request is its user data
+        for (i = 0; i < depth && submitted < o->ops; i++) {
+            if (started[i] != 0) {
+                continue;
+            }
+            started[i] = stats_now();
+            int offset = (rand() % slots) * io_size;
+            if (sfs_submit_read(fd, bufs + (size_t) i * io_size, io_size, offset, i) != 0) {
+                fprintf(stderr, "ERROR: Could not submit a read\n");
+                failed = 1;
+                break;
+            }
+            submitted++;
+        }
+
+        if (poll(&pfd, 1, -1) < 0 || read(pfd.fd, &counter, sizeof(counter)) < 0) {
+            continue;
+        }
+        int n = sfs_reap(done, depth, 0);
+        for (i = 0; i < n; i++) {
+            r.samples[r.count++] = stats_now() - started[done[i].user_data];
+            started[done[i].user_data] = 0;
+            if (done[i].result != io_size) {
+                fprintf(stderr, "ERROR: Requested %d bytes, read %d\n", io_size, done[i].result);
+                failed = 1;
+            }
+            r.bytes += done[i].result > 0 ? done[i].result : 0;
+        }
+    }
+    r.elapsed = stats_now() - begin;
+    result_print("async_read", io_size, &r);
+
+    sfs_async_shutdown();
+    sfs_fclose(fd);
+    free(buf);
+    free(bufs);
+    free(started);
+    free(done);
+}
+
+
+
+/**
+ * @brief Time file creation, reopening, directory scans and removal
+ * @param bench_opts_t* Options of the benchmark
+ * @retval None
+ */
+static void bench_metadata(const bench_opts_t *o) {
+    bench_result_t create, open, scan, plus, rm;
+    char (*names)[MAXFILENAME + 1] = malloc(sizeof(*names) * o->num_inodes);
+    char fname[MAXFILENAME + 1];
+    sfs_dirent_t ents[BENCH_DIRENTS];
+    uint64_t start, t_create = 0, t_open = 0, t_scan = 0, t_plus = 0, t_rm = 0;
+    int round, i, nfiles = 0;
+
+    mksfs(1);
+
+    result_init(&create, o->rounds * o->num_inodes);
+    result_init(&open, o->rounds * o->num_inodes);
+    result_init(&scan, o->rounds);
+    result_init(&plus, o->rounds);
+    result_init(&rm, o->rounds * o->num_inodes);
+
+    for (round = 0; round < o->rounds; round++) {
+
+        // create files until one of the tables is full
+        for (nfiles = 0; nfiles < o->num_inodes; nfiles++) {
+            snprintf(names[nfiles], sizeof(names[nfiles]), "/bench_%d_%d", round % 10000,
+                     nfiles % 100000);
+            start = stats_now();
+            int fd = sfs_fopen(names[nfiles]);
+            uint64_t t = stats_now() - start;
+            if (fd < 0) {
+                break;
+            }
+            create.samples[create.count++] = t;
+            t_create += t;
+            sfs_fclose(fd);
+        }
+
+        // open the existing files
+        for (i = 0; i < nfiles; i++) {
+            start = stats_now();
+            int fd = sfs_fopen(names[i]);
+            uint64_t t = stats_now() - start;
+            open.samples[open.count++] = t;
+            t_open += t;
+            sfs_fclose(fd);
+        }
+
+        // list the whole directory
+        start = stats_now();
+        while (sfs_getnextfilename(fname)) {
+        }
+        uint64_t t = stats_now() - start;
+        scan.samples[scan.count++] = t;
+        t_scan += t;
+
+        // list it again with the attributes of the files
+        int cursor = 0;
+        start = stats_now();
+        while (sfs_readdirplus("/", &cursor, ents, BENCH_DIRENTS) > 0) {
+        }
+        t = stats_now() - start;
+        plus.samples[plus.count++] = t;
+        t_plus += t;
+
+        // remove everything
+        for (i = 0; i < nfiles; i++) {
+            start = stats_now();
+            sfs_remove(names[i]);
+            t = stats_now() - start;
+            rm.samples[rm.count++] = t;
+            t_rm += t;
+        }
+    }
+
+    create.elapsed = t_create;
+    open.elapsed = t_open;
+    scan.elapsed = t_scan;
+    plus.elapsed = t_plus;
+    rm.elapsed = t_rm;
+    result_print("create", 0, &create);
+    result_print("open", 0, &open);
+    result_print("getnextfilename", nfiles, &scan);
+    result_print("readdirplus", nfiles, &plus);
+    result_print("remove", 0, &rm);
+
+    free(names);
+}
+
+
+
+/**
+ * @brief Print how to use the benchmark
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s file_size] [-n ops] [-r rounds] [-S seed] [-B block_size]\n"
+            "       [-N num_blocks] [-I num_inodes] [-C cache_kb] [-b backend] [-q queue_depth]\n"
+            "       [-a readahead_kb] [-d dirty_pct] [-D device] [-L request_us] [-K seek_us]\n"
+            "       [-F fail_p] [-z] [-u] [tests...]\n", prog);
+    fprintf(stderr, "devices: none hdd sata_ssd nvme (default: none)\n");
+    fprintf(stderr, "tests: mount seq rand async meta (default: all)\n");
+}
+
+
+
+/* The main benchmark program
+ */
+int main(int argc, char **argv) {
+    bench_opts_t o;
+    int run_mount = 0, run_seq = 0, run_rand = 0, run_async = 0, run_meta = 0;
+    int opt;
+    unsigned int k;
+
+    o.file_size = 256 * 1024;
+    o.ops = 1000;
+    o.rounds = 20;
+    o.seed = 427;
+    o.block_size = DEFAULT_BLOCK_SIZE;
+    o.num_blocks = DEFAULT_NUM_BLOCKS;
+    o.num_inodes = DEFAULT_NUM_INODES;
+    o.cache_kb = CACHE_DEFAULT_SIZE / 1024;
+    o.backend = AIO_DEFAULT_BACKEND;
+    o.queue_depth = AIO_DEFAULT_DEPTH;
+    o.readahead_kb = DEFAULT_READAHEAD_KB;
+    o.dirty_pct = CACHE_DIRTY_PCT;
+    o.device = "none";
+    o.request_us = -1;
+    o.seek_us = -1;
+    o.fail_p = -1;
+    o.compress = 0;
+    o.dedup = 0;
+
+    while ((opt = getopt(argc, argv, "s:n:r:S:B:N:I:C:b:q:a:d:D:L:K:F:zuh")) != -1) {
+        switch (opt) {
+            case 's': o.file_size = atoi(optarg); break;
+            case 'n': o.ops = atoi(optarg); break;
+            case 'r': o.rounds = atoi(optarg); break;
+            case 'S': o.seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'B': o.block_size = atoi(optarg); break;
+            case 'N': o.num_blocks = atoi(optarg); break;
+            case 'I': o.num_inodes = atoi(optarg); break;
+            case 'C': o.cache_kb = atoi(optarg); break;
+            case 'b': o.backend = optarg; break;
+            case 'q': o.queue_depth = atoi(optarg); break;
+            case 'a': o.readahead_kb = atoi(optarg); break;
+            case 'd': o.dirty_pct = atoi(optarg); break;
+            case 'D': o.device = optarg; break;
+            case 'L': o.request_us = atof(optarg); break;
+            case 'K': o.seek_us = atof(optarg); break;
+            case 'F': o.fail_p = atof(optarg); break;
+            case 'z': o.compress = 1; break;
+            case 'u': o.dedup = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (sfs_set_geometry(o.block_size, o.num_blocks, o.num_inodes) != 0) {
+        return 1;
+    }
+    sfs_set_cache_size((uint64_t) o.cache_kb * 1024);
+    sfs_set_compression(o.compress);
+    sfs_set_dedup(o.dedup);
+    if (sfs_set_io(o.backend, o.queue_depth, o.readahead_kb) != 0) {
+        return 1;
+    }
+    if (sfs_set_writeback(o.dirty_pct < CACHE_DIRTY_BACKGROUND_PCT ? o.dirty_pct
+                          : CACHE_DIRTY_BACKGROUND_PCT, o.dirty_pct, CACHE_DIRTY_EXPIRE_MS) != 0) {
+        return 1;
+    }
+    if (disk_set_profile(o.device) != 0) {
+        return 1;
+    }
+    disk_model_t model = *disk_get_model();
+    if (o.request_us >= 0) model.request_us = o.request_us;
+    if (o.seek_us >= 0) model.seek_us = o.seek_us;
+    if (o.fail_p >= 0) model.fail_p = o.fail_p;
+    if (disk_set_model(&model) != 0) {
+        return 1;
+    }
+
+    if (optind == argc) {
+        run_mount = run_seq = run_rand = run_async = run_meta = 1;
+    }
+    for (; optind < argc; optind++) {
+        if (strcmp(argv[optind], "mount") == 0) run_mount = 1;
+        else if (strcmp(argv[optind], "seq") == 0) run_seq = 1;
+        else if (strcmp(argv[optind], "rand") == 0) run_rand = 1;
+        else if (strcmp(argv[optind], "async") == 0) run_async = 1;
+        else if (strcmp(argv[optind], "meta") == 0) run_meta = 1;
+        else { usage(argv[0]); return 1; }
+    }
+
+    // keep the file system chatter out of the report
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "ABORT: cannot redirect the output\n");
+        return 1;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+
+    fprintf(report, "%-16s %8s %8s %12s %12s %12s %12s\n", "test", "io_size", "ops", "MiB/s",
+            "ops/s", "p50_us", "p99_us");
+
+    if (run_mount) {
+        bench_mount(&o);
+    }
+    for (k = 0; run_seq && k < NUM_IO_SIZES; k++) {
+        bench_sequential(&o, io_sizes[k]);
+    }
+    for (k = 0; run_rand && k < NUM_IO_SIZES; k++) {
+        bench_random(&o, io_sizes[k]);
+    }
+    for (k = 0; run_async && k < NUM_IO_SIZES; k++) {
+        bench_async(&o, io_sizes[k]);
+    }
+    if (run_meta) {
+        bench_metadata(&o);
+    }
+
+    fclose(report);
+    return 0;
+}
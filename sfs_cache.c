@@ -0,0 +1,969 @@
+
+// LRU write-back block cache in front of disk_emu
+
+#include "sfs_cache.h"
+#include "disk_emu.h"
+#include "disk_aio.h"
+#include "sfs_stats.h"
+#include "sfs_api.h"
+#include "sfs_csum.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+ * block    disk block held by the entry
+ * hnext    next entry in the same hash bucket
+ * prev     more recently used entry
+ * next     less recently used entry
+ * data     content of the block
+ * dirty    if data is newer than the disk
+ * dirtied  when the block became dirty, in nanoseconds
+ */
+typedef struct cache_entry {
+    uint32_t block;
+    struct cache_entry *hnext;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    char *data;
+    int dirty;
+    uint64_t dirtied;
+} cache_entry_t;
+
+
+/*
+ * start        first block of the run
+ * nblocks      number of blocks
+ * buf          where the blocks are read
+ * gen          write_gen when the read started
+ * prefetch     if this is a background read, buf is then owned by the run
+ */
+typedef struct {
+    int start;
+    int nblocks;
+    char *buf;
+    uint64_t gen;
+    int prefetch;
+} cache_io_t;
+
+
+/*
+ * Block cache of a volume
+ * entries          the entries, capacity of them
+ * buckets          hash table of the entries holding a block
+ * cache_data       content of the entries
+ * bucket_mask      buckets - 1, a power of two minus one
+ * capacity         number of entries
+ * used             entries holding a block
+ * cache_block_size size of a block
+ * write_gen        bumped by every write, reads started before a write do not fill the cache
+ * prefetching      background reads in flight
+ * pending_error    first error of the requests since the last cache_wait
+ * lru              head of the LRU list, lru.next is the most recently used entry
+ * background_pct   write-back settings, in percent of the cache and milliseconds
+ * dirty_pct
+ * expire_ms
+ * dirty            dirty blocks, and the thresholds derived from the settings
+ * dirty_background
+ * dirty_limit
+ * flush_list       dirty entries picked by a writeback, sorted by block
+ * writeback_error  first error of the writebacks since the last cache_flush
+ * flusher_lock     flusher thread, it takes the API lock before touching the cache
+ * flusher_cond
+ * flusher
+ * flusher_running
+ * flusher_stop
+ * sums             checksum of every block, see cache_sums_attach
+ * sums_loaded
+ * sums_dirty
+ * sums_start
+ * sums_len
+ * sums_shift
+ */
+struct block_cache {
+    cache_entry_t *entries;
+    cache_entry_t **buckets;
+    char *cache_data;
+    uint32_t bucket_mask;
+    int capacity;
+    int used;
+    int cache_block_size;
+    uint64_t write_gen;
+    int prefetching;
+    int pending_error;
+    cache_entry_t lru;
+    int background_pct;
+    int dirty_pct;
+    int expire_ms;
+    int dirty;
+    int dirty_background;
+    int dirty_limit;
+    cache_entry_t **flush_list;
+    int writeback_error;
+    pthread_mutex_t flusher_lock;
+    pthread_cond_t flusher_cond;
+    pthread_t flusher;
+    int flusher_running;
+    int flusher_stop;
+    uint32_t *sums;
+    uint8_t *sums_loaded;
+    uint8_t *sums_dirty;
+    int sums_start;
+    int sums_len;
+    int sums_shift;
+};
+
+#define CACHE_EMPTY(_c) \
+    { NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, { 0, NULL, &(_c).lru, &(_c).lru, NULL, 0, 0 }, \
+      CACHE_DIRTY_BACKGROUND_PCT, CACHE_DIRTY_PCT, CACHE_DIRTY_EXPIRE_MS, 0, 0, 0, NULL, 0, \
+      PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+
+/* globals */
+static cache_t default_cache = CACHE_EMPTY(default_cache);
+
+/* cache of the volume the calling thread works on */
+static __thread cache_t *bc = &default_cache;
+
+/* data held back above the cache, written by the flusher, see cache_set_writeback_hook */
+static void (*writeback_hook)(uint64_t dirtied_before) = NULL;
+
+/* macros */
+#define BUCKET(_block) \
+    (&bc->buckets[((_block) * 2654435761u) & bc->bucket_mask])
+
+
+
+static void lru_unlink(cache_entry_t *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+
+
+static void lru_push(cache_entry_t *e) {
+    e->prev = &bc->lru;
+    e->next = bc->lru.next;
+    bc->lru.next->prev = e;
+    bc->lru.next = e;
+}
+
+
+
+static cache_entry_t *lookup(uint32_t block) {
+    cache_entry_t *e = *BUCKET(block);
+    while (e != NULL && e->block != block) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+
+
+static void hash_unlink(cache_entry_t *e) {
+    cache_entry_t **p = BUCKET(e->block);
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+}
+
+
+
+static void set_dirty(cache_entry_t *e, int is_dirty) {
+    if (is_dirty && !e->dirty) {
+        e->dirtied = stats_now();
+        bc->dirty++;
+    } else if (!is_dirty && e->dirty) {
+        bc->dirty--;
+    }
+    e->dirty = is_dirty;
+}
+
+
+
+/**
+ * @brief Copy a block into the cache, evicting the least recently used clean one if it is full
+ * @param uint32_t Disk block
+ * @param const char* Content of the block
+ * @param int State of the copy: 1 for dirty, 0 for clean, -1 for read from the disk,
+ *            which does not replace a dirty copy
+ * @retval int Return -1 if every entry is dirty and the block could not be cached
+ */
+static int insert(uint32_t block, const char *data, int state) {
+    cache_entry_t *e = lookup(block);
+
+    if (e != NULL) {
+        if (state < 0 && e->dirty) {
+            return 0;
+        }
+        lru_unlink(e);
+    } else {
+        if (bc->used < bc->capacity) {
+            e = &bc->entries[bc->used++];
+            e->dirty = 0;
+        } else {
+            // dirty blocks leave the cache through a writeback only
+            e = bc->lru.prev;
+            while (e != &bc->lru && e->dirty) {
+                e = e->prev;
+            }
+            if (e == &bc->lru) {
+                return -1;
+            }
+            lru_unlink(e);
+            hash_unlink(e);
+        }
+        e->block = block;
+        e->hnext = *BUCKET(block);
+        *BUCKET(block) = e;
+    }
+
+    memcpy(e->data, data, bc->cache_block_size);
+    set_dirty(e, state > 0);
+    lru_push(e);
+    return 0;
+}
+
+
+
+/**
+ * @brief Tell if a block has a checksum, the super block and the table do not
+ * @param uint32_t Disk block
+ * @retval int Return one if it has
+ */
+static int has_sum(uint32_t block) {
+    return bc->sums != NULL && block > 0 && block < ((uint32_t) bc->sums_len << bc->sums_shift)
+        && (block < (uint32_t) bc->sums_start
+            || block >= (uint32_t) (bc->sums_start + bc->sums_len));
+}
+
+
+
+/**
+ * @brief Make sure the checksums of some blocks are in memory
+ * @long A block of the table that cannot be read starts over with every
+ *       checksum unknown, and is written back as such.
+ * @param int First block
+ * @param int Number of blocks
+ * @retval None
+ */
+static void load_sums(int start_address, int nblocks) {
+    int b, last;
+
+    if (bc->sums == NULL || nblocks <= 0) {
+        return;
+    }
+    last = (start_address + nblocks - 1) >> bc->sums_shift;
+    for (b = start_address >> bc->sums_shift; b <= last && b < bc->sums_len; b++) {
+        if (bc->sums_loaded[b]) {
+            continue;
+        }
+        uint32_t *table = bc->sums + ((size_t) b << bc->sums_shift);
+        if (read_blocks(bc->sums_start + b, 1, table) != 1) {
+            printf("SFS > Could not read the checksums of blocks %d to %d!\n",
+                   b << bc->sums_shift, ((b + 1) << bc->sums_shift) - 1);
+            memset(table, 0, bc->cache_block_size);
+            bc->sums_dirty[b] = 1;
+        }
+        bc->sums_loaded[b] = 1;
+    }
+}
+
+
+
+/**
+ * @brief Record the checksums of blocks about to be written
+ * @param int First block
+ * @param int Number of blocks
+ * @param const char* Content of the blocks
+ * @retval None
+ */
+static void update_sums(int start_address, int nblocks, const char *buf) {
+    int i;
+
+    load_sums(start_address, nblocks);
+    for (i = 0; i < nblocks; i++) {
+        uint32_t block = (uint32_t) (start_address + i);
+        if (has_sum(block)) {
+            bc->sums[block] = csum_block(buf + (size_t) i * bc->cache_block_size,
+                                         bc->cache_block_size);
+            bc->sums_dirty[block >> bc->sums_shift] = 1;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Check blocks read from the disk against their checksums
+ * @long load_sums ran before the read.
+ * @param int First block
+ * @param int Number of blocks
+ * @param const char* Content of the blocks
+ * @param uint8_t* Set for each block that does not match, may be NULL
+ * @retval int Number of blocks that do not match
+ */
+static int verify_sums(int start_address, int nblocks, const char *buf, uint8_t *bad) {
+    int i, errors = 0;
+
+    for (i = 0; i < nblocks; i++) {
+        uint32_t block = (uint32_t) (start_address + i);
+        int wrong = has_sum(block) && bc->sums[block] != CSUM_NONE
+                 && bc->sums[block] != csum_block(buf + (size_t) i * bc->cache_block_size,
+                                                  bc->cache_block_size);
+        if (wrong) {
+            printf("SFS > Checksum mismatch on block %u!\n", block);
+            errors++;
+        }
+        if (bad != NULL) {
+            bad[i] = (uint8_t) wrong;
+        }
+    }
+    if (bc->sums != NULL) {
+        stats_checksums(nblocks, errors);
+    }
+    return errors;
+}
+
+
+
+static void read_done(void *arg, int result) {
+    cache_io_t *io = arg;
+    int i;
+
+    // blocks written since the read started may not match their new checksum
+    uint8_t *bad = NULL;
+    if (result >= 0 && io->gen == bc->write_gen && bc->sums != NULL) {
+        bad = calloc(io->nblocks, 1);
+        if (verify_sums(io->start, io->nblocks, io->buf, bad) > 0 && !io->prefetch) {
+            result = -1;
+        }
+    }
+
+    if (result < 0) {
+        if (!io->prefetch && bc->pending_error == 0) {
+            bc->pending_error = result;
+        }
+    } else if (io->gen == bc->write_gen && bc->capacity > 0) {
+        for (i = 0; i < io->nblocks; i++) {
+            if (bad == NULL || !bad[i]) {
+                insert(io->start + i, io->buf + (size_t) i * bc->cache_block_size, -1);
+            }
+        }
+    }
+    free(bad);
+
+    if (io->prefetch) {
+        bc->prefetching--;
+        free(io->buf);
+    }
+    free(io);
+}
+
+
+
+static void write_done(void *arg, int result) {
+    if (result < 0 && bc->pending_error == 0) {
+        bc->pending_error = result;
+    }
+}
+
+
+
+static void writeback_done(void *arg, int result) {
+    if (result < 0 && bc->writeback_error == 0) {
+        bc->writeback_error = result;
+    }
+    free(arg);
+}
+
+
+
+/**
+ * @brief Write blocks, on the asynchronous I/O engine when it runs
+ * @long Every write to the disk goes through here and records the checksums.
+ * @param int First block
+ * @param int Number of blocks
+ * @param const void* Content of the blocks
+ * @param aio_callback_t Called once written
+ * @param void* Handed to the callback
+ * @retval int Return zero if the write was started
+ */
+static int io_write(int start_address, int nblocks, const void *buffer,
+                    aio_callback_t cb, void *arg) {
+    update_sums(start_address, nblocks, buffer);
+    if (strcmp(aio_backend(), "none") == 0) {
+        cb(arg, write_blocks(start_address, nblocks, (void *) buffer));
+        return 0;
+    }
+    if (aio_submit_write(start_address, nblocks, buffer, cb, arg) != 0) {
+        cb(arg, -1);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+static int cmp_block(const void *a, const void *b) {
+    uint32_t x = (*(cache_entry_t * const *) a)->block;
+    uint32_t y = (*(cache_entry_t * const *) b)->block;
+    return x < y ? -1 : x > y;
+}
+
+
+
+/**
+ * @brief Write dirty blocks to the disk in block order and wait for them
+ * @long Blocks that follow each other on the disk are written as one run.
+ *       Every dirty block is written when all is set or when there are more
+ *       than the background threshold, otherwise only the expired ones are.
+ * @param int Boolean, write every dirty block
+ * @retval None
+ */
+static void writeback(int all) {
+    uint64_t now = stats_now();
+    uint64_t expire_ns = (uint64_t) bc->expire_ms * 1000000;
+    int i, n = 0;
+
+    if (bc->dirty == 0) {
+        return;
+    }
+    all = all || bc->dirty > bc->dirty_background;
+
+    for (i = 0; i < bc->used; i++) {
+        cache_entry_t *e = &bc->entries[i];
+        if (e->dirty && (all || now - e->dirtied >= expire_ns)) {
+            bc->flush_list[n++] = e;
+        }
+    }
+    qsort(bc->flush_list, n, sizeof(cache_entry_t *), cmp_block);
+
+    aio_batch_begin();
+    for (i = 0; i < n;) {
+        int run = 1, k;
+        while (i + run < n && bc->flush_list[i + run]->block == bc->flush_list[i]->block + run) {
+            run++;
+        }
+
+        // copy the run, the entries may change before the write completes
+        char *buf = malloc((size_t) run * bc->cache_block_size);
+        if (buf == NULL) {
+            break;
+        }
+        for (k = 0; k < run; k++) {
+            memcpy(buf + (size_t) k * bc->cache_block_size, bc->flush_list[i + k]->data,
+                   bc->cache_block_size);
+            set_dirty(bc->flush_list[i + k], 0);
+        }
+        io_write(bc->flush_list[i]->block, run, buf, writeback_done, buf);
+        i += run;
+    }
+    aio_batch_end();
+    aio_drain();
+
+    stats_writeback(n, 0);
+    stats_dirty(bc->dirty);
+}
+
+
+
+static void *flush_dirty(void *vol) {
+    struct timespec deadline;
+
+    sfs_use(vol);
+    pthread_mutex_lock(&bc->flusher_lock);
+    while (!bc->flusher_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CACHE_WRITEBACK_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&bc->flusher_cond, &bc->flusher_lock, &deadline);
+        if (bc->flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&bc->flusher_lock);
+
+        sfs_lock();
+        if (writeback_hook != NULL) {
+            uint64_t now = stats_now();
+            uint64_t expire_ns = (uint64_t) bc->expire_ms * 1000000;
+            writeback_hook(now > expire_ns ? now - expire_ns : 0);
+        }
+        writeback(0);
+        sfs_unlock();
+
+        pthread_mutex_lock(&bc->flusher_lock);
+    }
+    pthread_mutex_unlock(&bc->flusher_lock);
+    return NULL;
+}
+
+
+
+static void wake_flusher(void) {
+    pthread_mutex_lock(&bc->flusher_lock);
+    pthread_cond_signal(&bc->flusher_cond);
+    pthread_mutex_unlock(&bc->flusher_lock);
+}
+
+
+
+/**
+ * @brief Derive the thresholds from the settings and start the flusher if needed
+ * @retval None
+ */
+static void writeback_setup(void) {
+    bc->dirty_background = (int) ((int64_t) bc->capacity * bc->background_pct / 100);
+    bc->dirty_limit = (int) ((int64_t) bc->capacity * bc->dirty_pct / 100);
+    if (bc->dirty_pct > 0 && bc->dirty_limit == 0 && bc->capacity > 1) {
+        bc->dirty_limit = 1;
+    }
+
+    if (bc->dirty_limit > 0 && !bc->flusher_running) {
+        if (pthread_create(&bc->flusher, NULL, flush_dirty, sfs_current()) != 0) {
+            printf("SFS > Could not start the flusher, writing through\n");
+            bc->dirty_limit = 0;
+            return;
+        }
+        bc->flusher_running = 1;
+    }
+}
+
+
+
+int cache_init(int nblocks, int block_size) {
+    int i;
+
+    free(bc->entries);
+    free(bc->buckets);
+    free(bc->cache_data);
+    free(bc->flush_list);
+    bc->entries = NULL;
+    bc->buckets = NULL;
+    bc->cache_data = NULL;
+    bc->flush_list = NULL;
+    bc->capacity = 0;
+    bc->used = 0;
+    bc->dirty = 0;
+    bc->dirty_limit = 0;
+    bc->lru.prev = bc->lru.next = &bc->lru;
+    bc->cache_block_size = block_size;
+    free(bc->sums);
+    free(bc->sums_loaded);
+    free(bc->sums_dirty);
+    bc->sums = NULL;
+    bc->sums_loaded = NULL;
+    bc->sums_dirty = NULL;
+
+    if (nblocks <= 0) {
+        return 0;
+    }
+
+    // at least one bucket per entry, as a power of two
+    uint32_t nbuckets = 1;
+    while (nbuckets < (uint32_t) nblocks) {
+        nbuckets <<= 1;
+    }
+
+    bc->entries = calloc(nblocks, sizeof(cache_entry_t));
+    bc->buckets = calloc(nbuckets, sizeof(cache_entry_t *));
+    bc->cache_data = malloc((size_t) nblocks * block_size);
+    bc->flush_list = malloc(nblocks * sizeof(cache_entry_t *));
+    if (bc->entries == NULL || bc->buckets == NULL || bc->cache_data == NULL
+        || bc->flush_list == NULL) {
+        cache_init(0, block_size);
+        return -1;
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        bc->entries[i].data = bc->cache_data + (size_t) i * block_size;
+    }
+    bc->bucket_mask = nbuckets - 1;
+    bc->capacity = nblocks;
+    writeback_setup();
+    return 0;
+}
+
+
+
+void cache_set_writeback(int background, int limit, int expire) {
+    bc->background_pct = background;
+    bc->dirty_pct = limit;
+    bc->expire_ms = expire;
+}
+
+
+
+void cache_set_writeback_hook(void (*hook)(uint64_t dirtied_before)) {
+    writeback_hook = hook;
+}
+
+
+
+void cache_stop(void) {
+    if (!bc->flusher_running) {
+        return;
+    }
+    pthread_mutex_lock(&bc->flusher_lock);
+    bc->flusher_stop = 1;
+    pthread_cond_signal(&bc->flusher_cond);
+    pthread_mutex_unlock(&bc->flusher_lock);
+    pthread_join(bc->flusher, NULL);
+    bc->flusher_running = 0;
+    bc->flusher_stop = 0;
+
+    sfs_lock();
+    if (writeback_hook != NULL) {
+        writeback_hook(UINT64_MAX);
+    }
+    writeback(1);
+    sfs_unlock();
+}
+
+
+
+/**
+ * @brief Read a run of blocks, on the asynchronous I/O engine when it runs
+ * @param cache_io_t* The run, freed once it is read
+ * @retval int Return zero if the read was started
+ */
+static int io_read(cache_io_t *io) {
+    load_sums(io->start, io->nblocks);
+    if (strcmp(aio_backend(), "none") == 0) {
+        read_done(io, read_blocks(io->start, io->nblocks, io->buf));
+        return 0;
+    }
+    int ret = io->prefetch ? aio_submit_readahead(io->start, io->nblocks, io->buf, read_done, io)
+                           : aio_submit_read(io->start, io->nblocks, io->buf, read_done, io);
+    if (ret != 0) {
+        read_done(io, -1);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+static cache_io_t *new_io(int start_address, int nblocks, char *buf, int prefetch) {
+    cache_io_t *io = malloc(sizeof(cache_io_t));
+    if (io == NULL) {
+        return NULL;
+    }
+    io->start = start_address;
+    io->nblocks = nblocks;
+    io->buf = buf;
+    io->gen = bc->write_gen;
+    io->prefetch = prefetch;
+    return io;
+}
+
+
+
+int cache_read(int start_address, int nblocks, void *buffer) {
+    int ret = cache_read_submit(start_address, nblocks, buffer);
+    int err = cache_wait();
+    if (ret < 0 || err < 0) {
+        return -1;
+    }
+    return nblocks;
+}
+
+
+
+int cache_write(int start_address, int nblocks, void *buffer) {
+    int ret = cache_write_submit(start_address, nblocks, buffer);
+    int err = cache_wait();
+    if (ret < 0 || err < 0) {
+        return -1;
+    }
+    return nblocks;
+}
+
+
+
+int cache_read_submit(int start_address, int nblocks, void *buffer) {
+    char *buf = buffer;
+    int i = 0;
+
+    if (start_address < 0 || start_address + nblocks > disk_num_blocks()) {
+        printf("out of bound error while reading %d\n", start_address);
+        return -1;
+    }
+
+    // pick up the blocks read in the background
+    aio_poll(0);
+
+    while (i < nblocks) {
+        cache_entry_t *e = bc->capacity > 0 ? lookup(start_address + i) : NULL;
+
+        // the block may be on its way, wait for the background reads
+        if (e == NULL && bc->prefetching > 0) {
+            while (bc->prefetching > 0) {
+                aio_poll(1);
+            }
+            e = lookup(start_address + i);
+        }
+        if (bc->capacity > 0) {
+            stats_cache(e != NULL);
+        }
+
+        if (e != NULL) {
+            memcpy(buf + (size_t) i * bc->cache_block_size, e->data, bc->cache_block_size);
+            lru_unlink(e);
+            lru_push(e);
+            i++;
+            continue;
+        }
+
+        // read the missing blocks that follow each other at once
+        int run = 1;
+        while (i + run < nblocks && bc->capacity > 0 && lookup(start_address + i + run) == NULL) {
+            stats_cache(0);
+            run++;
+        }
+        if (bc->capacity == 0) {
+            run = nblocks - i;
+        }
+
+        cache_io_t *io = new_io(start_address + i, run, buf + (size_t) i * bc->cache_block_size, 0);
+        if (io == NULL || io_read(io) != 0) {
+            return -1;
+        }
+        i += run;
+    }
+
+    return 0;
+}
+
+
+
+int cache_write_submit(int start_address, int nblocks, void *buffer) {
+    const char *buf = buffer;
+    int i;
+
+    if (start_address < 0 || start_address + nblocks > disk_num_blocks()) {
+        printf("out of bound error while writing %d\n", start_address);
+        return -1;
+    }
+
+    // the reads in flight may hold older data, keep them out of the cache
+    bc->write_gen++;
+
+    // big writes go straight to the disk, they would flush the whole cache
+    if (nblocks > bc->dirty_limit) {
+        for (i = 0; i < nblocks && bc->capacity > 0; i++) {
+            insert(start_address + i, buf + (size_t) i * bc->cache_block_size, 0);
+        }
+        return io_write(start_address, nblocks, buffer, write_done, NULL);
+    }
+
+    // throttle the writer until the flusher catches up
+    if (bc->dirty + nblocks > bc->dirty_limit) {
+        writeback(1);
+        stats_writeback(0, 1);
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        const char *data = buf + (size_t) i * bc->cache_block_size;
+        if (insert(start_address + i, data, 1) != 0
+            && io_write(start_address + i, 1, data, write_done, NULL) != 0) {
+            return -1;
+        }
+    }
+    stats_dirty(bc->dirty);
+
+    if (bc->dirty > bc->dirty_background) {
+        wake_flusher();
+    }
+    return 0;
+}
+
+
+
+int cache_wait(void) {
+    aio_drain();
+    int err = bc->pending_error;
+    bc->pending_error = 0;
+    return err;
+}
+
+
+
+void cache_prefetch(int start_address, int nblocks) {
+    int i = 0;
+
+    // only worth it when the reads run in the background
+    const char *backend = aio_backend();
+    if (bc->capacity == 0 || (strcmp(backend, "uring") != 0 && strcmp(backend, "threads") != 0)) {
+        return;
+    }
+    if (nblocks > bc->capacity / 2) {
+        nblocks = bc->capacity / 2;
+    }
+    if (start_address < 0 || start_address + nblocks > disk_num_blocks()) {
+        return;
+    }
+
+    while (i < nblocks) {
+        if (lookup(start_address + i) != NULL) {
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < nblocks && lookup(start_address + i + run) == NULL) {
+            run++;
+        }
+
+        char *buf = malloc((size_t) run * bc->cache_block_size);
+        cache_io_t *io = buf != NULL ? new_io(start_address + i, run, buf, 1) : NULL;
+        if (io == NULL) {
+            free(buf);
+            return;
+        }
+        bc->prefetching++;
+        io_read(io);
+        i += run;
+    }
+}
+
+
+
+int cache_flush(void) {
+    writeback(1);
+
+    // then make the image durable
+    if (strcmp(aio_backend(), "none") == 0) {
+        if (fdatasync(disk_fd()) != 0 && bc->writeback_error == 0) {
+            bc->writeback_error = -1;
+        }
+    } else if (aio_submit_flush(writeback_done, NULL) != 0) {
+        bc->writeback_error = -1;
+    }
+    aio_drain();
+
+    int err = bc->writeback_error;
+    bc->writeback_error = 0;
+    return err;
+}
+
+
+
+void cache_invalidate(void) {
+    writeback(1);
+    cache_wait();
+    bc->write_gen++;
+    if (bc->capacity > 0) {
+        memset(bc->buckets, 0, (bc->bucket_mask + 1) * sizeof(cache_entry_t *));
+    }
+    bc->used = 0;
+    bc->dirty = 0;
+    bc->lru.prev = bc->lru.next = &bc->lru;
+}
+
+
+
+int cache_capacity(void) {
+    return bc->capacity;
+}
+
+
+
+int cache_sums_attach(int start, int nblocks, int trusted) {
+    bc->sums = calloc(nblocks, bc->cache_block_size);
+    bc->sums_loaded = malloc(nblocks);
+    bc->sums_dirty = malloc(nblocks);
+    if (bc->sums == NULL || bc->sums_loaded == NULL || bc->sums_dirty == NULL) {
+        free(bc->sums);
+        free(bc->sums_loaded);
+        free(bc->sums_dirty);
+        bc->sums = NULL;
+        bc->sums_loaded = NULL;
+        bc->sums_dirty = NULL;
+        return -1;
+    }
+
+    // a stale table starts with every checksum unknown, and goes to the disk as such
+    memset(bc->sums_loaded, !trusted, nblocks);
+    memset(bc->sums_dirty, !trusted, nblocks);
+    bc->sums_start = start;
+    bc->sums_len = nblocks;
+    bc->sums_shift = __builtin_ctz(bc->cache_block_size / sizeof(uint32_t));
+    return 0;
+}
+
+
+
+int cache_sums_flush(void) {
+    int b = 0;
+    int err = 0;
+
+    if (bc->sums == NULL) {
+        return 0;
+    }
+    while (b < bc->sums_len) {
+        if (!bc->sums_dirty[b]) {
+            b++;
+            continue;
+        }
+        int run = 1;
+        while (b + run < bc->sums_len && bc->sums_dirty[b + run]) {
+            run++;
+        }
+        if (write_blocks(bc->sums_start + b, run,
+                         bc->sums + ((size_t) b << bc->sums_shift)) != run) {
+            err = -1;
+        } else {
+            memset(bc->sums_dirty + b, 0, run);
+        }
+        b += run;
+    }
+    if (fdatasync(disk_fd()) != 0) {
+        err = -1;
+    }
+    return err;
+}
+
+
+
+cache_t *cache_new(void) {
+    cache_t *c = malloc(sizeof(cache_t));
+
+    if (c != NULL) {
+        cache_t empty = CACHE_EMPTY(*c);
+        *c = empty;
+        pthread_mutex_init(&c->flusher_lock, NULL);
+        pthread_cond_init(&c->flusher_cond, NULL);
+    }
+    return c;
+}
+
+
+
+void cache_destroy(cache_t *c) {
+    if (c == NULL || c == &default_cache) {
+        return;
+    }
+    free(c->entries);
+    free(c->buckets);
+    free(c->cache_data);
+    free(c->flush_list);
+    free(c->sums);
+    free(c->sums_loaded);
+    free(c->sums_dirty);
+    pthread_mutex_destroy(&c->flusher_lock);
+    pthread_cond_destroy(&c->flusher_cond);
+    free(c);
+}
+
+
+
+void cache_use(cache_t *c) {
+    bc = c != NULL ? c : &default_cache;
+}
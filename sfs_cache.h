@@ -0,0 +1,169 @@
+#ifndef _INCLUDE_SFS_CACHE_H_
+#define _INCLUDE_SFS_CACHE_H_
+
+#include <stdint.h>
+
+/* default size of the block cache, in bytes */
+#define CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+/* dirty blocks, in percent of the cache, above which the flusher writes them all */
+#define CACHE_DIRTY_BACKGROUND_PCT 10
+
+/* dirty blocks, in percent of the cache, above which writers wait for a writeback */
+#define CACHE_DIRTY_PCT 30
+
+/* age of a dirty block, in milliseconds, after which the flusher writes it */
+#define CACHE_DIRTY_EXPIRE_MS 1000
+
+/* how often the flusher wakes up, in milliseconds */
+#define CACHE_WRITEBACK_INTERVAL_MS 100
+
+/* block cache of a volume, see sfs_new */
+typedef struct block_cache cache_t;
+
+/*
+ * @short make the block cache of a new volume, sized by cache_init
+ * @return the cache, NULL if out of memory
+ */
+cache_t *cache_new(void);
+
+/*
+ * @short free the block cache of a volume, stopped with cache_stop first
+ */
+void cache_destroy(cache_t *c);
+
+/*
+ * @short make the calling thread work on the block cache of a volume
+ * @long Every thread starts on the cache of the default volume, NULL goes
+ *       back to it. The other calls work on the cache of the thread.
+ */
+void cache_use(cache_t *c);
+
+/*
+ * @short size the block cache for the mounted disk and empty it
+ * @long The cache keeps the most recently used blocks of the disk in memory.
+ *       Written blocks stay dirty in the cache, and a flusher thread writes
+ *       them back in block order once they expire or once there are more than
+ *       the background threshold. Writers that would go over the dirty limit
+ *       write the dirty blocks back themselves first. Dirty blocks left when
+ *       the program exits are written back. A size of zero disables the
+ *       cache, and every write goes through to the disk.
+ *
+ * @param nblocks     number of blocks the cache can hold
+ * @param block_size  block size of the disk
+ * @return 0 on success, -1 if the memory cannot be allocated
+ */
+int cache_init(int nblocks, int block_size);
+
+/*
+ * @short choose the write-back thresholds of the next cache_init
+ * @param background  dirty blocks, in percent of the cache, the flusher lets accumulate
+ * @param limit       dirty blocks, in percent of the cache, at which writers are
+ *                    throttled, zero to write through
+ * @param expire      age in milliseconds after which a dirty block is written
+ */
+void cache_set_writeback(int background, int limit, int expire);
+
+/*
+ * @short let the flusher write back data held above the cache
+ * @long Before each writeback, under the API lock, the flusher calls the
+ *       hook with the time, on the stats_now clock, before which data that
+ *       changed is expired; UINT64_MAX when the program exits. The hook
+ *       writes that data into the cache, to be written back with the rest.
+ */
+void cache_set_writeback_hook(void (*hook)(uint64_t dirtied_before));
+
+/*
+ * @short stop the flusher and write every dirty block back, with the hook
+ * @long Called when the program exits and before the volume is freed. It
+ *       takes the API lock, which the caller must not hold.
+ */
+void cache_stop(void);
+
+/*
+ * @short read blocks through the cache
+ * @long Same contract as read_blocks. The blocks missing from the cache are
+ *       read from the disk, in runs, and kept in the cache.
+ */
+int cache_read(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short write blocks into the cache, see cache_write_submit
+ * @long Same contract as write_blocks.
+ */
+int cache_write(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short start reading blocks through the cache, without waiting
+ * @long The hits are copied at once, the runs of missing blocks are queued on
+ *       the asynchronous I/O engine, so that several runs are read in
+ *       parallel. The buffer must not be used before cache_wait returns.
+ * @return 0 if the reads were queued, -1 otherwise
+ */
+int cache_read_submit(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short write blocks into the cache, without waiting
+ * @long The blocks become dirty in the cache. Runs longer than the dirty
+ *       limit, or every run when the cache is off, go to the disk at once,
+ *       and their buffer must not change before cache_wait returns.
+ * @return 0 if the write was queued, -1 otherwise
+ */
+int cache_write_submit(int start_address, int nblocks, void *buffer);
+
+/*
+ * @short wait for the reads and writes started with the *_submit calls
+ * @return 0 on success, or the first error of the requests
+ */
+int cache_wait(void);
+
+/*
+ * @short read blocks into the cache in the background
+ * @long Blocks already cached are skipped. Does nothing when the cache or
+ *       the asynchronous I/O engine is off.
+ */
+void cache_prefetch(int start_address, int nblocks);
+
+/*
+ * @short write every dirty block back and flush the image to stable storage
+ * @return 0 on success, or the first writeback error since the last call
+ */
+int cache_flush(void);
+
+/*
+ * @short write back the dirty blocks, wait for the background reads and drop
+ *        every block from the cache
+ */
+void cache_invalidate(void);
+
+/*
+ * @short number of blocks the cache can hold
+ */
+int cache_capacity(void);
+
+/*
+ * @short keep a checksum of every block of the open disk, checked when read
+ * @long The checksums are the CRC32C of the blocks, four bytes per block in
+ *       a table on the disk, of which a block is read the first time it is
+ *       needed. Every write to the disk records the checksums of the blocks
+ *       written, and every block read from the disk is checked against its
+ *       own: a mismatch fails the read like a disk error, and the block stays
+ *       out of the cache. The super block and the table have no checksum.
+ *       cache_init drops the table.
+ *
+ * @param start    first block of the table
+ * @param nblocks  blocks of the table
+ * @param trusted  zero if the table on the disk may be stale, for instance
+ *                 after a crash: every checksum is then unknown until its
+ *                 block is written again
+ * @return 0 on success, -1 if out of memory
+ */
+int cache_sums_attach(int start, int nblocks, int trusted);
+
+/*
+ * @short write the checksums that changed back to their table, and flush the image
+ * @return 0 on success, -1 if the disk failed
+ */
+int cache_sums_flush(void);
+
+#endif //_INCLUDE_SFS_CACHE_H_
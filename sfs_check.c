@@ -0,0 +1,1114 @@
+
+// consistency checker and scrubber, walking the block maps with worker threads
+
+#include "sfs_check.h"
+#include "sfs_pack.h"
+#include "sfs_csum.h"
+#include "sfs_dedup.h"
+#include "sfs_stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* inodes or bitmap bytes a worker takes at a time */
+#define CHECK_CHUNK 64
+
+/* owner of a block no pointer claimed */
+#define NO_OWNER UINT32_MAX
+
+/* claim key of the shared blocks of packed files, any other pointer wins over it */
+#define PACK_KEY (UINT32_MAX - 1)
+
+#define ATOMIC_ADD(_v, _n) __atomic_add_fetch(&(_v), (_n), __ATOMIC_RELAXED)
+
+
+/*
+ * State shared by the workers of a check
+ * v            volume checked
+ * o            options
+ * r            report, updated with atomics
+ * bs           block size
+ * ppb          block pointers in an indirect block
+ * stride       claim keys of an inode, see key
+ * first_data   first block of the data area
+ * data_end     first block past the data area, where the share count table starts
+ * num_blocks   blocks of the volume
+ * num_inodes   inodes of the volume
+ * owner        one per block: smallest key of the pointers to it
+ * pointers     one per block: data pointers that kept it
+ * referenced   one per inode: if an entry points to it
+ * valid        one per entry: if it is used and points to its own inode in use
+ * reached      one per inode: if the root directory reaches it
+ * indirect     one per inode: its indirect block, NULL if it has none
+ * next         next item to hand out in a phase
+ * rate_lock    protects rate_next
+ * rate_next    when the next read of the image may start, in ns
+ */
+typedef struct {
+    check_volume_t *v;
+    const sfs_check_opts_t *o;
+    sfs_check_report_t *r;
+    uint32_t bs;
+    uint32_t ppb;
+    uint32_t stride;
+    uint32_t first_data;
+    uint32_t data_end;
+    uint32_t num_blocks;
+    uint32_t num_inodes;
+    uint32_t *owner;
+    uint32_t *pointers;
+    uint8_t *referenced;
+    uint8_t *valid;
+    uint8_t *reached;
+    unsigned int **indirect;
+    uint32_t next;
+    pthread_mutex_t rate_lock;
+    uint64_t rate_next;
+} check_ctx_t;
+
+typedef void (*check_phase_t)(check_ctx_t *c, uint32_t first, uint32_t last);
+
+/*
+ * c        shared state
+ * phase    what to do with each chunk
+ * count    items of the phase
+ */
+typedef struct {
+    check_ctx_t *c;
+    check_phase_t phase;
+    uint32_t count;
+} check_job_t;
+
+
+
+int check_geometry(const superblock_t *sb) {
+    if (sb->magic != SFS_MAGIC) {
+        return -1;
+    }
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE
+        || (sb->block_size & (sb->block_size - 1)) != 0
+        || sb->num_inodes < 2 || sb->num_inodes > INT16_MAX || sb->num_blocks > INT32_MAX
+        || sb->csum_len * sb->block_size < sb->num_blocks * sizeof(uint32_t)
+        || sb->refs_len * sb->block_size < sb->num_blocks
+        || 1 + sb->inode_table_len + sb->dir_table_len + sb->refs_len + sb->csum_len + sb->bitmap_len
+           >= sb->num_blocks) {
+        return -2;
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Wait for the turn of a read under the bandwidth limit
+ * @param check_ctx_t* Check
+ * @param uint64_t Bytes about to be read
+ * @retval None
+ */
+static void throttle(check_ctx_t *c, uint64_t bytes) {
+    if (c->o->bandwidth_mbps <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->rate_lock);
+    uint64_t now = stats_now();
+    if (c->rate_next < now) {
+        c->rate_next = now;
+    }
+    uint64_t start = c->rate_next;
+    c->rate_next += bytes * 1000 / (uint64_t) c->o->bandwidth_mbps;
+    pthread_mutex_unlock(&c->rate_lock);
+
+    if (start > now) {
+        struct timespec ts = { (time_t) ((start - now) / 1000000000),
+                               (long) ((start - now) % 1000000000) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+
+/**
+ * @brief Read blocks of the image
+ * @param check_ctx_t* Check
+ * @param uint32_t First block
+ * @param uint32_t Number of blocks
+ * @param void* Buffer for the blocks
+ * @retval int Return zero on success, -1 if the blocks could not be read
+ */
+static int read_image(check_ctx_t *c, uint32_t start, uint32_t nblocks, void *buf) {
+    size_t len = (size_t) nblocks * c->bs;
+    off_t off = (off_t) start * c->bs;
+    size_t done = 0;
+
+    throttle(c, len);
+    while (done < len) {
+        ssize_t n = pread(c->v->fd, (char*) buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    ATOMIC_ADD(c->r->bytes_read, len);
+    return 0;
+}
+
+
+
+/**
+ * @brief Claim key of a block pointer, smaller keys win the block
+ * @param check_ctx_t* Check
+ * @param uint32_t Inode
+ * @param uint32_t Pointer: 0 to 11 direct, 12 the indirect block, then the indirect pointers
+ * @retval uint32_t The key
+ */
+static uint32_t key(check_ctx_t *c, uint32_t inode, uint32_t pos) {
+    return inode * c->stride + pos;
+}
+
+
+
+/**
+ * @brief Tell if a claim key is the one of a data pointer
+ * @param check_ctx_t* Check
+ * @param uint32_t Claim key
+ * @retval int Return one for a data pointer, zero for an indirect block or a shared block of packed files
+ */
+static int data_key(check_ctx_t *c, uint32_t k) {
+    return k != PACK_KEY && k != NO_OWNER && k % c->stride != 12;
+}
+
+
+
+/**
+ * @brief Flag bits a data pointer of an inode may carry besides its block
+ * @param inode_t* Inode
+ * @retval unsigned int SFS_CHUNK_COMPRESSED for a compressed file, SFS_BLOCK_UNWRITTEN otherwise
+ */
+static unsigned int ptr_flags(const inode_t *n) {
+    return (n->flags & SFS_INODE_COMPRESSED) ? SFS_CHUNK_COMPRESSED : SFS_BLOCK_UNWRITTEN;
+}
+
+
+
+/**
+ * @brief Claim the block of a pointer
+ * @param check_ctx_t* Check
+ * @param unsigned int* Pointer, cut on repair if it is out of the data area
+ * @param uint32_t Claim key of the pointer
+ * @param unsigned int Flag bits of the pointer that are not part of the block
+ * @retval int Return zero if the pointer is valid
+ */
+static int claim(check_ctx_t *c, unsigned int *ptr, uint32_t k, unsigned int flags) {
+    uint32_t block = *ptr & ~flags;
+
+    if (block < c->first_data || block >= c->data_end) {
+        ATOMIC_ADD(c->r->bad_pointers, 1);
+        if (c->o->repair) {
+            *ptr = NO_BLOCK;
+        }
+        return -1;
+    }
+
+    uint32_t cur = __atomic_load_n(&c->owner[block], __ATOMIC_RELAXED);
+    while (k < cur && !__atomic_compare_exchange_n(&c->owner[block], &cur, k, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Empty a packed file whose fragments cannot be trusted
+ * @param check_ctx_t* Check
+ * @param uint32_t Inode
+ * @retval None
+ */
+static void drop_packed(check_ctx_t *c, uint32_t i) {
+    inode_t *n = &c->v->inodes[i];
+
+    n->flags = (n->flags & ~SFS_INODE_PACKED) | SFS_INODE_INLINE;
+    n->size = 0;
+    memset(n->inline_data, 0, SFS_INLINE_MAX);
+    c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+}
+
+
+
+/**
+ * @brief First pass over the inodes: read the indirect blocks and claim every block
+ * @retval None
+ */
+static void claim_inodes(check_ctx_t *c, uint32_t first, uint32_t last) {
+    uint32_t i, j;
+
+    for (i = first; i < last; i++) {
+        inode_t *n = &c->v->inodes[i];
+        if (!c->referenced[i]) {
+            continue;
+        }
+
+        // data kept in the inode cannot be longer than the room for it
+        if (n->flags & SFS_INODE_INLINE) {
+            if (n->size > SFS_INLINE_MAX) {
+                ATOMIC_ADD(c->r->bad_pointers, 1);
+                if (c->o->repair) {
+                    n->size = SFS_INLINE_MAX;
+                    c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+                }
+            }
+            continue;
+        }
+
+        // packed files claim their shared block together, their fragments are checked later
+        if (n->flags & SFS_INODE_PACKED) {
+            uint32_t frags = n->data_ptrs[2];
+            if (n->data_ptrs[1] < PACK_HEADER_FRAGS(c->bs) || frags == 0
+                || n->data_ptrs[1] + frags > PACK_FRAGS(c->bs) || n->data_ptrs[1] + frags < frags) {
+                ATOMIC_ADD(c->r->bad_pointers, 1);
+                if (c->o->repair) {
+                    drop_packed(c, i);
+                }
+            } else if (claim(c, &n->data_ptrs[0], PACK_KEY, 0) != 0) {
+                if (c->o->repair) {
+                    drop_packed(c, i);
+                }
+            } else if (n->size > frags * PACK_FRAG_SIZE || n->size > PACK_MAX(c->bs)) {
+                ATOMIC_ADD(c->r->bad_pointers, 1);
+                if (c->o->repair) {
+                    n->size = frags * PACK_FRAG_SIZE < PACK_MAX(c->bs) ? frags * PACK_FRAG_SIZE : PACK_MAX(c->bs);
+                    c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+                }
+            }
+            continue;
+        }
+
+        int changed = 0;
+        for (j = 0; j < 12; j++) {
+            if (n->data_ptrs[j] != NO_BLOCK && claim(c, &n->data_ptrs[j], key(c, i, j), ptr_flags(n)) != 0) {
+                changed = 1;
+            }
+        }
+
+        if (n->indirect_ptrs == NO_BLOCK) {
+            // nothing more to walk
+        } else if (claim(c, &n->indirect_ptrs, key(c, i, 12), 0) != 0) {
+            changed = 1;
+        } else {
+            unsigned int *ptrs = malloc(c->bs);
+            if (ptrs == NULL || read_image(c, n->indirect_ptrs, 1, ptrs) != 0) {
+                // the block map cannot be walked, drop it
+                ATOMIC_ADD(c->r->unreadable, 1);
+                free(ptrs);
+                if (c->o->repair) {
+                    n->indirect_ptrs = NO_BLOCK;
+                    changed = 1;
+                }
+            } else {
+                int cut = 0;
+                for (j = 0; j < c->ppb; j++) {
+                    if (ptrs[j] != NO_BLOCK && claim(c, &ptrs[j], key(c, i, 13 + j), ptr_flags(n)) != 0) {
+                        cut = 1;
+                    }
+                }
+                c->indirect[i] = ptrs;
+                if (cut && c->o->repair) {
+                    c->v->inode_changed[i] |= CHECK_INDIRECT_CHANGED;
+                }
+            }
+        }
+
+        if (changed && c->o->repair) {
+            c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Check that a pointer won its block, cut it on repair otherwise
+ * @param check_ctx_t* Check
+ * @param unsigned int* Pointer
+ * @param uint32_t Claim key of the pointer
+ * @param unsigned int Flag bits of the pointer that are not part of the block
+ * @retval int Return one if the pointer was a double
+ */
+static int resolve(check_ctx_t *c, unsigned int *ptr, uint32_t k, unsigned int flags) {
+    uint32_t block = *ptr & ~flags;
+
+    // bad pointers were counted by claim
+    if (*ptr == NO_BLOCK || block < c->first_data || block >= c->data_end) {
+        return 0;
+    }
+    if (c->owner[block] == k) {
+        ATOMIC_ADD(c->r->blocks, 1);
+        if (data_key(c, k)) {
+            ATOMIC_ADD(c->pointers[block], 1);
+        }
+        return 0;
+    }
+
+    // the data pointers to a block with a share count all keep it
+    if (c->v->refs != NULL && c->v->refs[block] != 0 && data_key(c, k) && data_key(c, c->owner[block])) {
+        ATOMIC_ADD(c->pointers[block], 1);
+        return 0;
+    }
+    ATOMIC_ADD(c->r->doubles, 1);
+    if (c->o->repair) {
+        *ptr = NO_BLOCK;
+    }
+    return 1;
+}
+
+
+
+/**
+ * @brief Second pass over the inodes: find the pointers that lost their block to another
+ * @retval None
+ */
+static void resolve_inodes(check_ctx_t *c, uint32_t first, uint32_t last) {
+    uint32_t i, j;
+
+    for (i = first; i < last; i++) {
+        inode_t *n = &c->v->inodes[i];
+        if (!c->referenced[i] || (n->flags & SFS_INODE_INLINE)) {
+            continue;
+        }
+
+        // a shared block any other pointer uses is lost to the packed files
+        if (n->flags & SFS_INODE_PACKED) {
+            if (n->data_ptrs[0] >= c->first_data && n->data_ptrs[0] < c->data_end
+                && c->owner[n->data_ptrs[0]] != PACK_KEY) {
+                ATOMIC_ADD(c->r->doubles, 1);
+                if (c->o->repair) {
+                    drop_packed(c, i);
+                }
+            }
+            continue;
+        }
+
+        int changed = 0;
+        for (j = 0; j < 12; j++) {
+            changed |= resolve(c, &n->data_ptrs[j], key(c, i, j), ptr_flags(n));
+        }
+
+        unsigned int *ptrs = c->indirect[i];
+        if (ptrs != NULL && resolve(c, &n->indirect_ptrs, key(c, i, 12), 0)) {
+            // the indirect block belongs to another file, its pointers are not this file's
+            changed = 1;
+        } else if (ptrs != NULL) {
+            int cut = 0;
+            for (j = 0; j < c->ppb; j++) {
+                cut |= resolve(c, &ptrs[j], key(c, i, 13 + j), ptr_flags(n));
+            }
+            if (cut && c->o->repair) {
+                c->v->inode_changed[i] |= CHECK_INDIRECT_CHANGED;
+            }
+        }
+        if (changed && c->o->repair) {
+            c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+        }
+    }
+}
+
+
+
+static int cmp_packed(const void *a, const void *b) {
+    const inode_t *x = *(inode_t * const *) a;
+    const inode_t *y = *(inode_t * const *) b;
+    if (x->data_ptrs[0] != y->data_ptrs[0]) {
+        return x->data_ptrs[0] < y->data_ptrs[0] ? -1 : 1;
+    }
+    return x->data_ptrs[1] < y->data_ptrs[1] ? -1 : x->data_ptrs[1] > y->data_ptrs[1];
+}
+
+
+
+/**
+ * @brief Check the fragments of the shared blocks against their headers
+ * @long Runs on the calling thread, with the packed files sorted by block.
+ *       Fragments two files use are doubles, the later file is emptied on
+ *       repair. The header of each block must mark exactly the fragments the
+ *       files use, on repair it is rewritten to do so.
+ * @retval None
+ */
+static void check_packs(check_ctx_t *c) {
+    uint32_t i, k, count = 0;
+    inode_t **packed = malloc(sizeof(inode_t*) * c->num_inodes);
+    char *expected = malloc(c->bs);
+    char *block = malloc(c->bs);
+
+    if (packed == NULL || expected == NULL || block == NULL) {
+        free(packed);
+        free(expected);
+        free(block);
+        return;
+    }
+    for (i = 0; i < c->num_inodes; i++) {
+        inode_t *n = &c->v->inodes[i];
+        if (c->referenced[i] && (n->flags & SFS_INODE_PACKED) && !(n->flags & SFS_INODE_INLINE)
+            && n->data_ptrs[0] >= c->first_data && n->data_ptrs[0] < c->data_end
+            && c->owner[n->data_ptrs[0]] == PACK_KEY) {
+            packed[count++] = n;
+        }
+    }
+    qsort(packed, count, sizeof(inode_t*), cmp_packed);
+
+    pack_header_t *want = (pack_header_t*) expected;
+    pack_header_t *have = (pack_header_t*) block;
+    uint32_t start = 0;
+    while (start < count) {
+        uint32_t b = packed[start]->data_ptrs[0];
+        uint32_t end;
+        uint32_t kept = 0;
+
+        memset(expected, 0, c->bs);
+        want->magic = PACK_MAGIC;
+        want->used = PACK_HEADER_FRAGS(c->bs);
+        for (k = 0; k < want->used; k++) {
+            PACK_USE(want->map, k);
+        }
+        for (end = start; end < count && packed[end]->data_ptrs[0] == b; end++) {
+            inode_t *n = packed[end];
+            int overlap = 0;
+            for (k = n->data_ptrs[1]; k < n->data_ptrs[1] + n->data_ptrs[2]; k++) {
+                overlap |= PACK_IS_USED(want->map, k);
+            }
+            if (overlap) {
+                c->r->doubles++;
+                if (c->o->repair) {
+                    drop_packed(c, (uint32_t) (n - c->v->inodes));
+                }
+                continue;
+            }
+            for (k = n->data_ptrs[1]; k < n->data_ptrs[1] + n->data_ptrs[2]; k++) {
+                PACK_USE(want->map, k);
+            }
+            want->used += n->data_ptrs[2];
+            kept++;
+        }
+
+        if (read_image(c, b, 1, block) != 0) {
+            c->r->unreadable++;
+        } else {
+            // fragments marked in use that no file uses, and the other way around
+            uint64_t wrong = 0;
+            for (k = 0; k < PACK_FRAGS(c->bs); k++) {
+                int on_disk = have->magic == PACK_MAGIC && PACK_IS_USED(have->map, k);
+                if (on_disk && !PACK_IS_USED(want->map, k)) {
+                    c->r->leaked++;
+                    wrong++;
+                } else if (!on_disk && PACK_IS_USED(want->map, k)) {
+                    c->r->unmarked++;
+                    wrong++;
+                }
+            }
+            if (wrong == 0 && have->used != want->used) {
+                // only the count of the header is off
+                c->r->leaked++;
+                wrong++;
+            }
+            if (wrong > 0) {
+                check_fix_t *fix = malloc(sizeof(check_fix_t));
+                if (c->o->repair && fix != NULL && kept > 0) {
+                    memcpy(block, expected, sizeof(pack_header_t) + PACK_FRAGS(c->bs) / 8);
+                    fix->block = b;
+                    fix->ptrs = (unsigned int*) block;
+                    fix->next = c->v->fixes;
+                    c->v->fixes = fix;
+                    block = malloc(c->bs);
+                    have = (pack_header_t*) block;
+                } else {
+                    free(fix);
+                }
+            }
+        }
+
+        // a block no packed file is left in goes back to the bitmap
+        if (kept == 0 && c->o->repair) {
+            c->owner[b] = NO_OWNER;
+        } else {
+            c->r->blocks++;
+        }
+        if (block == NULL) {
+            break;
+        }
+        start = end;
+    }
+    free(packed);
+    free(expected);
+    free(block);
+}
+
+
+
+/**
+ * @brief Check the share count of a block against the data pointers to it
+ * @long A block pinned at DEDUP_PINNED is right as long as pointers are left.
+ * @param check_ctx_t* Check
+ * @param uint32_t Block
+ * @retval int Return one if the count is wrong
+ */
+static int compare_refs(check_ctx_t *c, uint32_t block) {
+    uint32_t p = c->pointers[block];
+    uint8_t want = p <= 1 ? 0 : (p - 1 > DEDUP_PINNED ? DEDUP_PINNED : (uint8_t) (p - 1));
+    uint8_t have = c->v->refs[block];
+
+    if (have == want || (have == DEDUP_PINNED && p > 0)) {
+        return 0;
+    }
+    if (c->o->repair) {
+        c->v->refs[block] = want;
+    }
+    return 1;
+}
+
+
+
+/**
+ * @brief Build the expected bitmap and compare it and the share counts with those of the volume
+ * @retval None
+ */
+static void compare_bitmap(check_ctx_t *c, uint32_t first, uint32_t last) {
+    uint32_t i, bit;
+    uint64_t leaked = 0, unmarked = 0, bad_refs = 0;
+
+    for (i = first; i < last; i++) {
+        uint8_t free_bits = 0;
+        for (bit = 0; bit < 8; bit++) {
+            uint32_t block = i * 8 + bit;
+            if (block >= c->first_data && block < c->data_end && c->owner[block] == NO_OWNER) {
+                free_bits |= 1 << bit;
+            }
+            if (c->v->refs != NULL && block < c->num_blocks) {
+                bad_refs += compare_refs(c, block);
+            }
+        }
+        c->v->expected[i] = free_bits;
+        leaked += __builtin_popcount((uint8_t) (~c->v->bitmap[i] & free_bits));
+        unmarked += __builtin_popcount((uint8_t) (c->v->bitmap[i] & ~free_bits));
+    }
+    ATOMIC_ADD(c->r->leaked, leaked);
+    ATOMIC_ADD(c->r->unmarked, unmarked);
+    ATOMIC_ADD(c->r->bad_refs, bad_refs);
+}
+
+
+
+/**
+ * @brief Check a block read by the scrub against its checksum
+ * @param check_ctx_t* Check
+ * @param uint32_t Block
+ * @param const char* Its content
+ * @retval None
+ */
+static void check_sum(check_ctx_t *c, uint32_t block, const char *data) {
+    uint32_t *sums = c->v->sums;
+
+    if (sums == NULL || block == 0 || sums[block] == CSUM_NONE) {
+        return;
+    }
+    uint32_t sum = csum_block(data, c->bs);
+    if (sum != sums[block]) {
+        ATOMIC_ADD(c->r->bad_sums, 1);
+        if (c->o->repair) {
+            sums[block] = sum;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Read every block in use, in runs, and count those that cannot be read
+ * @long Items are runs of CHECK_SCRUB_RUN blocks.
+ * @retval None
+ */
+static void scrub(check_ctx_t *c, uint32_t first, uint32_t last) {
+    char *buf = malloc((size_t) CHECK_SCRUB_RUN * c->bs);
+    uint32_t run;
+
+    if (buf == NULL) {
+        return;
+    }
+    for (run = first; run < last; run++) {
+        uint32_t start = run * CHECK_SCRUB_RUN;
+        uint32_t end = start + CHECK_SCRUB_RUN;
+        if (end > c->num_blocks) {
+            end = c->num_blocks;
+        }
+
+        uint32_t b = start;
+        while (b < end) {
+            // blocks in use on the disk or by a file
+            uint32_t len = 0;
+            while (b + len < end
+                   && (!((c->v->bitmap[(b + len) / 8] >> ((b + len) % 8)) & 1)
+                       || !((c->v->expected[(b + len) / 8] >> ((b + len) % 8)) & 1))) {
+                len++;
+            }
+            uint32_t k;
+            if (len > 0 && read_image(c, b, len, buf) != 0) {
+                // find which blocks of the run fail
+                for (k = b; k < b + len; k++) {
+                    if (read_image(c, k, 1, buf) != 0) {
+                        ATOMIC_ADD(c->r->unreadable, 1);
+                    } else {
+                        check_sum(c, k, buf);
+                    }
+                }
+            } else {
+                for (k = b; k < b + len; k++) {
+                    check_sum(c, k, buf + (size_t) (k - b) * c->bs);
+                }
+            }
+            b += len + 1;
+        }
+    }
+    free(buf);
+}
+
+
+
+static void *check_worker(void *arg) {
+    check_job_t *job = arg;
+    check_ctx_t *c = job->c;
+
+    while (1) {
+        uint32_t first = __atomic_fetch_add(&c->next, CHECK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= job->count) {
+            break;
+        }
+        uint32_t last = first + CHECK_CHUNK;
+        if (last > job->count) {
+            last = job->count;
+        }
+        job->phase(c, first, last);
+    }
+    return NULL;
+}
+
+
+
+/**
+ * @brief Run a phase of the check on worker threads, and on the calling thread
+ * @param check_ctx_t* Check
+ * @param check_phase_t What to do with each chunk of items
+ * @param uint32_t Number of items
+ * @retval None
+ */
+static void run_phase(check_ctx_t *c, check_phase_t phase, uint32_t count) {
+    int nthreads = c->o->threads;
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    check_job_t job = { c, phase, count };
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    int started = 0;
+    c->next = 0;
+    while (threads != NULL && started < nthreads - 1
+           && pthread_create(&threads[started], NULL, check_worker, &job) == 0) {
+        started++;
+    }
+    check_worker(&job);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    free(threads);
+}
+
+
+
+/**
+ * @brief Tell if the name of an entry is valid
+ * @long It cannot be empty nor hold a '/', but the first byte may be one in
+ *       images made before subdirectories.
+ * @param entry_t* Entry
+ * @retval int 1 if it is valid, 0 otherwise
+ */
+static int valid_name(const entry_t *e) {
+    const char *name = e->name[0] == '/' ? e->name + 1 : e->name;
+
+    return memchr(e->name, '\0', sizeof(e->name)) != NULL && name[0] != '\0' && strchr(name, '/') == NULL;
+}
+
+
+
+/**
+ * @brief Check the directory: every entry points to its own inode in use,
+ *        from a directory the root directory can reach
+ * @retval None
+ */
+static void check_entries(check_ctx_t *c) {
+    uint32_t i;
+    uint32_t root = c->v->sb->root_dir_inode < c->num_inodes ? (uint32_t) c->v->sb->root_dir_inode : 0;
+
+    for (i = 0; i < c->num_inodes - 1; i++) {
+        entry_t *e = &c->v->entries[i];
+        if (e->used == 0) {
+            continue;
+        }
+        if (e->used != 1 || e->inode < 1 || e->inode >= c->num_inodes || e->parent >= c->num_inodes
+            || c->v->inodes[e->inode].used != 1 || c->referenced[e->inode] || !valid_name(e)) {
+            c->r->bad_entries++;
+            if (c->o->repair) {
+                e->used = 0;
+                c->v->entry_changed[i] = 1;
+            }
+            continue;
+        }
+        c->referenced[e->inode] = 1;
+        c->valid[i] = 1;
+    }
+
+    // walk down from the root directory, a level more on each pass
+    uint8_t *valid = c->valid;
+    uint8_t *reached = c->reached;
+    int more = 1;
+    reached[root] = 1;
+    while (more) {
+        more = 0;
+        for (i = 0; i < c->num_inodes - 1; i++) {
+            entry_t *e = &c->v->entries[i];
+            if (valid[i] && !reached[e->inode] && reached[e->parent]
+                && (e->parent == root || (c->v->inodes[e->parent].flags & SFS_INODE_DIR))) {
+                reached[e->inode] = 1;
+                more = 1;
+            }
+        }
+    }
+
+    // entries of a directory that is gone, or in a loop of directories
+    for (i = 0; i < c->num_inodes - 1; i++) {
+        entry_t *e = &c->v->entries[i];
+        if (!valid[i]) {
+            continue;
+        }
+        if (!reached[e->inode]) {
+            c->referenced[e->inode] = 0;
+            c->r->bad_entries++;
+            if (c->o->repair) {
+                e->used = 0;
+                c->v->entry_changed[i] = 1;
+            }
+            continue;
+        }
+        c->r->files++;
+    }
+
+    // inodes in use nobody can reach
+    for (i = 1; i < c->num_inodes; i++) {
+        if (c->v->inodes[i].used != 0 && !c->referenced[i]) {
+            c->r->orphans++;
+            if (c->o->repair) {
+                c->v->inodes[i].used = 0;
+                c->v->inode_changed[i] |= CHECK_INODE_CHANGED;
+            }
+        }
+    }
+}
+
+
+
+int check_run(check_volume_t *v, const sfs_check_opts_t *opts, sfs_check_report_t *report) {
+    check_ctx_t c;
+    uint32_t i;
+    uint64_t start = stats_now();
+    uint64_t bitmap_bytes = v->sb->bitmap_len * v->sb->block_size;
+
+    memset(report, 0, sizeof(*report));
+    memset(&c, 0, sizeof(c));
+    c.v = v;
+    c.o = opts;
+    c.r = report;
+    c.bs = (uint32_t) v->sb->block_size;
+    c.ppb = c.bs / sizeof(unsigned int);
+    c.stride = 13 + c.ppb;
+    c.num_blocks = (uint32_t) v->sb->num_blocks;
+    c.num_inodes = (uint32_t) v->sb->num_inodes;
+    c.first_data = 1 + (uint32_t) (v->sb->inode_table_len + v->sb->dir_table_len);
+    c.data_end = c.num_blocks - (uint32_t) (v->sb->bitmap_len + v->sb->csum_len + v->sb->refs_len);
+    pthread_mutex_init(&c.rate_lock, NULL);
+
+    c.owner = malloc(sizeof(uint32_t) * c.num_blocks);
+    c.pointers = calloc(c.num_blocks, sizeof(uint32_t));
+    c.referenced = calloc(c.num_inodes, 1);
+    c.valid = calloc(c.num_inodes, 1);
+    c.reached = calloc(c.num_inodes, 1);
+    c.indirect = calloc(c.num_inodes, sizeof(unsigned int *));
+    v->expected = malloc(bitmap_bytes);
+    v->inode_changed = calloc(c.num_inodes, 1);
+    v->entry_changed = calloc(c.num_inodes, 1);
+    v->fixes = NULL;
+    if (c.owner == NULL || c.pointers == NULL || c.referenced == NULL || c.valid == NULL || c.reached == NULL
+        || c.indirect == NULL || v->expected == NULL || v->inode_changed == NULL || v->entry_changed == NULL) {
+        free(c.owner);
+        free(c.pointers);
+        free(c.referenced);
+        free(c.valid);
+        free(c.reached);
+        free(c.indirect);
+        check_release(v);
+        return -1;
+    }
+    for (i = 0; i < c.num_blocks; i++) {
+        c.owner[i] = NO_OWNER;
+    }
+
+    check_entries(&c);
+    run_phase(&c, claim_inodes, c.num_inodes);
+    run_phase(&c, resolve_inodes, c.num_inodes);
+    check_packs(&c);
+    run_phase(&c, compare_bitmap, (uint32_t) bitmap_bytes);
+    if (opts->scrub) {
+        run_phase(&c, scrub, (c.num_blocks + CHECK_SCRUB_RUN - 1) / CHECK_SCRUB_RUN);
+    }
+
+    // hand the repaired indirect blocks over to the caller
+    for (i = 0; i < c.num_inodes; i++) {
+        if (c.indirect[i] != NULL && (v->inode_changed[i] & CHECK_INDIRECT_CHANGED) && v->inodes[i].indirect_ptrs != NO_BLOCK) {
+            check_fix_t *fix = malloc(sizeof(check_fix_t));
+            if (fix != NULL) {
+                fix->block = v->inodes[i].indirect_ptrs;
+                fix->ptrs = c.indirect[i];
+                fix->next = v->fixes;
+                v->fixes = fix;
+                c.indirect[i] = NULL;
+            }
+        }
+        free(c.indirect[i]);
+    }
+
+    report->repaired = opts->repair && check_problems(report) > 0;
+    report->elapsed_ns = stats_now() - start;
+    v->refs_changed = opts->repair && report->bad_refs > 0;
+    free(c.owner);
+    free(c.pointers);
+    free(c.referenced);
+    free(c.valid);
+    free(c.reached);
+    free(c.indirect);
+    pthread_mutex_destroy(&c.rate_lock);
+    return 0;
+}
+
+
+
+void check_release(check_volume_t *v) {
+    while (v->fixes != NULL) {
+        check_fix_t *next = v->fixes->next;
+        free(v->fixes->ptrs);
+        free(v->fixes);
+        v->fixes = next;
+    }
+    free(v->expected);
+    free(v->inode_changed);
+    free(v->entry_changed);
+    v->expected = NULL;
+    v->inode_changed = NULL;
+    v->entry_changed = NULL;
+}
+
+
+
+uint64_t check_problems(const sfs_check_report_t *report) {
+    return report->bad_entries + report->orphans + report->bad_pointers + report->doubles
+         + report->leaked + report->unmarked + report->unreadable + report->bad_sums
+         + report->bad_refs;
+}
+
+
+
+/**
+ * @brief Read or write bytes of an image
+ * @param int Image
+ * @param int Boolean deciding on writing instead of reading
+ * @param void* Data
+ * @param size_t Number of bytes
+ * @param off_t Where in the image
+ * @retval int Return zero on success
+ */
+static int image_io(int fd, int write, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write ? pwrite(fd, (char*) buf + done, len - done, off + done)
+                          : pread(fd, (char*) buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Write blocks to an image and record their checksums
+ * @param int Image
+ * @param uint32_t* Checksum table
+ * @param const void* Content of the blocks
+ * @param uint64_t First block
+ * @param uint64_t Number of blocks
+ * @param uint64_t Block size
+ * @retval int Return zero on success
+ */
+static int write_summed(int fd, uint32_t *sums, const void *data, uint64_t first, uint64_t nblocks,
+                        uint64_t bs) {
+    uint64_t i;
+
+    for (i = 0; i < nblocks; i++) {
+        sums[first + i] = csum_block((const char*) data + i * bs, bs);
+    }
+    return image_io(fd, 1, (void*) data, nblocks * bs, (off_t) (first * bs));
+}
+
+
+
+/**
+ * @brief Write the repairs of an offline check and a clean super block to the image
+ * @param uint32_t* Checksum table to write back, updated with the repairs
+ * @retval int Return zero on success
+ */
+static int write_repairs(check_volume_t *v, superblock_t *sb, uint32_t *sums, size_t itable,
+                         size_t dtable, size_t bitmap_bytes) {
+    uint64_t bs = sb->block_size;
+    uint64_t bitmap_start = sb->num_blocks - sb->bitmap_len;
+    uint64_t i;
+    int err = 0;
+    check_fix_t *fix;
+
+    err |= write_summed(v->fd, sums, v->inodes, 1, itable / bs, bs);
+    err |= write_summed(v->fd, sums, v->entries, 1 + sb->inode_table_len, dtable / bs, bs);
+    for (fix = v->fixes; fix != NULL; fix = fix->next) {
+        err |= write_summed(v->fd, sums, fix->ptrs, fix->block, 1, bs);
+    }
+    err |= write_summed(v->fd, sums, v->expected, bitmap_start, bitmap_bytes / bs, bs);
+    if (v->refs_changed) {
+        err |= write_summed(v->fd, sums, v->refs, bitmap_start - sb->csum_len - sb->refs_len, sb->refs_len, bs);
+    }
+    err |= image_io(v->fd, 1, sums, sb->csum_len * bs, (off_t) ((bitmap_start - sb->csum_len) * bs));
+    if (err != 0 || fsync(v->fd) != 0) {
+        return -1;
+    }
+
+    // the checkpoint of a clean volume
+    sb->free_blocks = 0;
+    sb->first_free_byte = bitmap_bytes - 1;
+    for (i = bitmap_bytes; i-- > 0; ) {
+        sb->free_blocks += __builtin_popcount(v->expected[i]);
+        if (v->expected[i] != 0) {
+            sb->first_free_byte = i;
+        }
+    }
+    sb->free_inodes = 0;
+    for (i = 1; i < sb->num_inodes; i++) {
+        sb->free_inodes += v->inodes[i].used == 0;
+    }
+    sb->state = SFS_STATE_CLEAN;
+
+    char *block = calloc(1, bs);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(block, sb, sizeof(*sb));
+    err = image_io(v->fd, 1, block, bs, 0);
+    free(block);
+    if (err != 0 || fsync(v->fd) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int sfs_check_image(const char *path, const sfs_check_opts_t *opts, sfs_check_report_t *report) {
+    superblock_t sb;
+    char probe[MIN_BLOCK_SIZE];
+    int ret = -1;
+
+    int fd = open(path, opts->repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        printf("SFS > Could not open %s!\n", path);
+        return -1;
+    }
+    if (image_io(fd, 0, probe, sizeof(probe), 0) != 0) {
+        printf("SFS > Could not read the super block of %s!\n", path);
+        close(fd);
+        return -1;
+    }
+    memcpy(&sb, probe, sizeof(sb));
+    if (check_geometry(&sb) != 0) {
+        printf("SFS > No valid file system found on %s!\n", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t itable = sb.inode_table_len * sb.block_size;
+    size_t dtable = sb.dir_table_len * sb.block_size;
+    size_t bitmap_bytes = sb.bitmap_len * sb.block_size;
+    check_volume_t v;
+    memset(&v, 0, sizeof(v));
+    v.sb = &sb;
+    v.fd = fd;
+    v.inodes = malloc(itable);
+    v.entries = malloc(dtable);
+    uint8_t *bitmap = malloc(bitmap_bytes);
+    v.bitmap = bitmap;
+    size_t refs_bytes = sb.refs_len * sb.block_size;
+    v.refs = malloc(refs_bytes);
+
+    // the checksums of a volume that was not unmounted cleanly may be stale
+    size_t sums_bytes = sb.csum_len * sb.block_size;
+    uint32_t *sums = calloc(1, sums_bytes);
+    int clean = sb.state == SFS_STATE_CLEAN;
+    v.sums = clean ? sums : NULL;
+
+    if (v.inodes == NULL || v.entries == NULL || bitmap == NULL || v.refs == NULL || sums == NULL) {
+        printf("SFS > Out of memory!\n");
+    } else if (image_io(fd, 0, v.inodes, itable, (off_t) sb.block_size) != 0
+               || image_io(fd, 0, v.entries, dtable, (off_t) (1 + sb.inode_table_len) * sb.block_size) != 0
+               || image_io(fd, 0, bitmap, bitmap_bytes,
+                           (off_t) (sb.num_blocks - sb.bitmap_len) * sb.block_size) != 0
+               || image_io(fd, 0, v.refs, refs_bytes,
+                           (off_t) (sb.num_blocks - sb.bitmap_len - sb.csum_len - sb.refs_len) * sb.block_size) != 0
+               || (clean && image_io(fd, 0, sums, sums_bytes,
+                                     (off_t) (sb.num_blocks - sb.bitmap_len - sb.csum_len) * sb.block_size) != 0)) {
+        printf("SFS > Could not read the tables of %s!\n", path);
+    } else if (check_run(&v, opts, report) != 0) {
+        printf("SFS > Out of memory!\n");
+    } else {
+        ret = 0;
+        if (opts->repair && (report->repaired || sb.state != SFS_STATE_CLEAN)
+            && write_repairs(&v, &sb, sums, itable, dtable, bitmap_bytes) != 0) {
+            printf("SFS > Could not write the repairs to %s!\n", path);
+            ret = -1;
+        }
+        check_release(&v);
+    }
+
+    free(v.inodes);
+    free(v.entries);
+    free(bitmap);
+    free(v.refs);
+    free(sums);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,170 @@
+#ifndef _INCLUDE_SFS_CHECK_H_
+#define _INCLUDE_SFS_CHECK_H_
+
+#include <stdint.h>
+#include "sfs_api.h"
+
+/* blocks read from the image at a time by the scrub */
+#define CHECK_SCRUB_RUN 64
+
+/* flags of check_volume_t.inode_changed */
+#define CHECK_INODE_CHANGED 1
+#define CHECK_INDIRECT_CHANGED 2
+
+/*
+ * threads          worker threads, 0 for one per core
+ * bandwidth_mbps   most MB per second read from the image, 0 for no limit
+ * scrub            also read every block in use, to find the unreadable ones
+ * repair           fix what is found, otherwise only report it
+ */
+typedef struct {
+    int threads;
+    int bandwidth_mbps;
+    int scrub;
+    int repair;
+} sfs_check_opts_t;
+
+/*
+ * files            files found in the directory
+ * blocks           blocks the files use, their indirect and shared blocks included
+ * bad_entries      directory entries pointing to no file or to the file of another entry
+ * orphans          inodes in use that no entry points to
+ * bad_pointers     block pointers out of the data area, or inline data longer than its room
+ * doubles          block pointers to a block another pointer already uses, or
+ *                  packed files on fragments another one already uses
+ * leaked           blocks used in the bitmap that nothing points to, or fragments
+ *                  used in the header of a shared block that no file uses
+ * unmarked         blocks free in the bitmap that a file uses, or fragments
+ *                  free in the header of a shared block that a file uses
+ * unreadable       blocks the scrub could not read
+ * bad_sums         blocks the scrub read that do not match their checksum
+ * bad_refs         blocks whose share count is not the number of pointers to them but one
+ * bytes_read       bytes read from the image
+ * elapsed_ns       duration of the check
+ * repaired         non zero if the problems were fixed
+ */
+typedef struct {
+    uint64_t files;
+    uint64_t blocks;
+    uint64_t bad_entries;
+    uint64_t orphans;
+    uint64_t bad_pointers;
+    uint64_t doubles;
+    uint64_t leaked;
+    uint64_t unmarked;
+    uint64_t unreadable;
+    uint64_t bad_sums;
+    uint64_t bad_refs;
+    uint64_t bytes_read;
+    uint64_t elapsed_ns;
+    int repaired;
+} sfs_check_report_t;
+
+/*
+ * A block the repair changed, an indirect block or a shared block with its header fixed
+ * block    where it goes on the disk
+ * ptrs     its new content
+ * next     next changed indirect block
+ */
+typedef struct check_fix {
+    uint32_t block;
+    unsigned int *ptrs;
+    struct check_fix *next;
+} check_fix_t;
+
+/*
+ * A consistent view of the metadata of a volume, and what the check makes of it
+ * sb               super block
+ * inodes           inode table, repaired in place
+ * entries          directory table, repaired in place
+ * bitmap           free bitmap, only read
+ * refs             share count of each block, see sfs_dedup.h, repaired in place;
+ *                  NULL lets no two pointers share a block
+ * fd               image, the indirect blocks and the scrub are read from it
+ * sums             checksum of each block, CSUM_NONE if unknown, NULL for the scrub
+ *                  not to check them; on repair the scrub takes the content of
+ *                  the blocks that do not match for good
+ * expected         filled by check_run: the bitmap the files call for
+ * inode_changed    filled by check_run: CHECK_*_CHANGED flags of each inode
+ * entry_changed    filled by check_run: one flag per repaired entry
+ * fixes            filled by check_run: repaired indirect blocks and shared block headers
+ * refs_changed     filled by check_run: if share counts were repaired
+ */
+typedef struct {
+    const superblock_t *sb;
+    inode_t *inodes;
+    entry_t *entries;
+    const uint8_t *bitmap;
+    uint8_t *refs;
+    int fd;
+    uint32_t *sums;
+    uint8_t *expected;
+    uint8_t *inode_changed;
+    uint8_t *entry_changed;
+    check_fix_t *fixes;
+    int refs_changed;
+} check_volume_t;
+
+/*
+ * @short check the mounted file system while it is in use
+ * @long The dirty blocks are written back and the tables copied under the
+ *       API lock, the copy is checked without it. If the metadata changed
+ *       in the meantime, the check starts over, and the last attempt keeps
+ *       the lock throughout. Repairs are made through the block cache.
+ *
+ * @param opts    how to check
+ * @param report  what was found
+ * @return 0 on success, -1 if nothing is mounted or out of memory
+ */
+int sfs_check(const sfs_check_opts_t *opts, sfs_check_report_t *report);
+
+/*
+ * @short tell if a super block describes a file system sfs can mount
+ * @return 0 if it does, -1 if the magic is wrong, -2 if the geometry is
+ */
+int check_geometry(const superblock_t *sb);
+
+/*
+ * @short check a volume, and repair its copy in memory if asked to
+ * @long The inodes and their block maps are walked by worker threads, every
+ *       block is claimed by the first pointer to it in inode order, and the
+ *       claims are compared with the bitmap. Data pointers to a block with a
+ *       share count all keep it, and the count must match them. Reads from
+ *       the image share the bandwidth limit. Repairs drop bad entries and
+ *       orphan inodes, cut bad and double pointers and fix share counts.
+ *       Writing them and the expected bitmap back is up to the caller, see
+ *       check_release to free the results.
+ *
+ * @param v       volume, its results are filled
+ * @param opts    how to check
+ * @param report  what was found
+ * @return 0 on success, -1 if out of memory
+ */
+int check_run(check_volume_t *v, const sfs_check_opts_t *opts, sfs_check_report_t *report);
+
+/*
+ * @short free what check_run filled in a volume
+ */
+void check_release(check_volume_t *v);
+
+/*
+ * @short check a volume that is not mounted, straight from its image
+ * @long The scrub checks the blocks against their checksums if the volume
+ *       was unmounted cleanly. With opts->repair, the fixes are written to
+ *       the image, with their checksums, and the super block is marked clean
+ *       with a fresh checkpoint. The checksums of a volume that was not
+ *       unmounted cleanly are then all forgotten but those of the fixes.
+ *
+ * @param path    disk image
+ * @param opts    how to check
+ * @param report  what was found
+ * @return 0 on success, -1 if the image holds no file system or cannot be read
+ */
+int sfs_check_image(const char *path, const sfs_check_opts_t *opts, sfs_check_report_t *report);
+
+/*
+ * @short number of problems in a report
+ */
+uint64_t check_problems(const sfs_check_report_t *report);
+
+#endif //_INCLUDE_SFS_CHECK_H_
@@ -0,0 +1,187 @@
+// CRC32C checksums of blocks, on the SSE4.2 crc32 instruction when the CPU has it
+
+#include "sfs_csum.h"
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* reversed Castagnoli polynomial */
+#define POLY 0x82F63B78
+
+/* bytes of each of the three streams of a round of the hardware kernel */
+#define LANE 128
+
+
+/* globals */
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+// slicing by 8 tables of the scalar kernel
+static uint32_t slice[8][256];
+
+// shift of a CRC register over LANE zero bytes, a byte of the register at a time
+static uint32_t lane_shift[4][256];
+
+// kernel picked for this CPU
+static uint32_t (*kernel)(uint32_t crc, const uint8_t *p, size_t len) = NULL;
+static const char *kernel_name = "scalar";
+
+
+
+/**
+ * @brief Update a CRC register, eight bytes at a time with the sliced tables
+ * @param uint32_t Register
+ * @param const uint8_t* Data
+ * @param size_t Number of bytes
+ * @retval uint32_t The new register
+ */
+static uint32_t crc_scalar(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = slice[7][v & 0xff] ^ slice[6][(v >> 8) & 0xff]
+            ^ slice[5][(v >> 16) & 0xff] ^ slice[4][(v >> 24) & 0xff]
+            ^ slice[3][(v >> 32) & 0xff] ^ slice[2][(v >> 40) & 0xff]
+            ^ slice[1][(v >> 48) & 0xff] ^ slice[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+
+/**
+ * @brief Move a CRC register over LANE zero bytes
+ * @param uint32_t Register
+ * @retval uint32_t The register as if LANE zero bytes followed
+ */
+static uint32_t shift_lane(uint32_t crc) {
+    return lane_shift[0][crc & 0xff] ^ lane_shift[1][(crc >> 8) & 0xff]
+         ^ lane_shift[2][(crc >> 16) & 0xff] ^ lane_shift[3][crc >> 24];
+}
+
+
+
+#if defined(__x86_64__)
+/**
+ * @brief Update a CRC register with the crc32 instruction
+ * @long The instruction has a latency of three cycles but starts one per
+ *       cycle, so three streams of LANE bytes run side by side and their
+ *       registers are then combined: the register of a stream is moved past
+ *       the bytes of the streams that follow it.
+ * @param uint32_t Register
+ * @param const uint8_t* Data
+ * @param size_t Number of bytes
+ * @retval uint32_t The new register
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t a = crc;
+
+    while (len >= 3 * LANE) {
+        uint64_t b = 0, c = 0;
+        const uint8_t *end = p + LANE;
+        while (p < end) {
+            uint64_t x, y, z;
+            memcpy(&x, p, 8);
+            memcpy(&y, p + LANE, 8);
+            memcpy(&z, p + 2 * LANE, 8);
+            a = _mm_crc32_u64(a, x);
+            b = _mm_crc32_u64(b, y);
+            c = _mm_crc32_u64(c, z);
+            p += 8;
+        }
+        a = shift_lane(shift_lane((uint32_t) a) ^ (uint32_t) b) ^ (uint32_t) c;
+        p += 2 * LANE;
+        len -= 3 * LANE;
+    }
+    while (len >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        a = _mm_crc32_u64(a, x);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        a = _mm_crc32_u8((uint32_t) a, *p++);
+    }
+    return (uint32_t) a;
+}
+#endif
+
+
+
+/**
+ * @brief Build the tables and pick the kernel, once
+ * @retval None
+ */
+static void setup(void) {
+    uint32_t i, k;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (POLY & -(crc & 1));
+        }
+        slice[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            slice[k][i] = slice[0][slice[k - 1][i] & 0xff] ^ (slice[k - 1][i] >> 8);
+        }
+    }
+
+    // the shift is linear: find where each bit of the register goes, then sum the bits of each byte
+    static const uint8_t zeros[LANE];
+    uint32_t bit_shift[32];
+    for (k = 0; k < 32; k++) {
+        bit_shift[k] = crc_scalar(1u << k, zeros, LANE);
+    }
+    for (k = 0; k < 4; k++) {
+        for (i = 0; i < 256; i++) {
+            uint32_t v = 0, bit;
+            for (bit = 0; bit < 8; bit++) {
+                if ((i >> bit) & 1) {
+                    v ^= bit_shift[k * 8 + bit];
+                }
+            }
+            lane_shift[k][i] = v;
+        }
+    }
+
+    kernel = crc_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernel = crc_sse42;
+        kernel_name = "sse4.2";
+    }
+#endif
+}
+
+
+
+uint32_t csum_crc32c(const void *data, size_t len) {
+    pthread_once(&setup_once, setup);
+    return ~kernel(~0u, data, len);
+}
+
+
+
+uint32_t csum_block(const void *data, size_t len) {
+    uint32_t crc = csum_crc32c(data, len);
+    return crc == CSUM_NONE ? 1 : crc;
+}
+
+
+
+const char *csum_kernel(void) {
+    pthread_once(&setup_once, setup);
+    return kernel_name;
+}
@@ -0,0 +1,30 @@
+#ifndef _INCLUDE_SFS_CSUM_H_
+#define _INCLUDE_SFS_CSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* checksum of a block whose content is not known, it matches any content */
+#define CSUM_NONE 0
+
+/*
+ * @short CRC32C (Castagnoli) of some bytes
+ * @long Computed with the SSE4.2 crc32 instruction on three interleaved
+ *       streams when the CPU has it, with a sliced table lookup otherwise.
+ *       Both give the same result.
+ */
+uint32_t csum_crc32c(const void *data, size_t len);
+
+/*
+ * @short checksum of a block, the CRC32C of its content
+ * @long A CRC of CSUM_NONE reads as 1, so that a stored checksum of
+ *       CSUM_NONE always means unknown.
+ */
+uint32_t csum_block(const void *data, size_t len);
+
+/*
+ * @short name of the kernel csum_crc32c runs on: "sse4.2" or "scalar"
+ */
+const char *csum_kernel(void);
+
+#endif //_INCLUDE_SFS_CSUM_H_
@@ -0,0 +1,199 @@
+// cache of the names looked up in directories, those that exist and those that do not,
+// and a Bloom filter of the names that exist
+
+#include "sfs_dcache.h"
+#include "sfs_api.h"
+#include "sfs_stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * A slot of the cache
+ * used     if the slot holds a name
+ * dir      inode of the directory of the name
+ * entry    directory entry of the name, DCACHE_MISSING if there is none
+ * name     the name
+ */
+typedef struct {
+    uint32_t used;
+    uint32_t dir;
+    int entry;
+    char name[MAXFILENAME + 1];
+} dcache_slot_t;
+
+
+/*
+ * Dentry cache of a volume
+ * slots            the cache
+ * filter           Bloom filter of the names that exist
+ * filter_bits      its size in bits, a power of two
+ * filter_names     names the directory holds at most
+ * filter_added     names added since it was filled
+ * filter_ready     if it was filled
+ */
+struct dcache {
+    dcache_slot_t slots[DCACHE_SLOTS];
+    uint8_t *filter;
+    uint32_t filter_bits;
+    uint32_t filter_names;
+    uint32_t filter_added;
+    int filter_ready;
+};
+
+
+/* globals */
+static dcache_t default_dcache;
+
+// cache of the volume the calling thread works on
+static __thread dcache_t *dc = &default_dcache;
+
+
+
+/**
+ * @brief Hash of a name of a directory, FNV-1a of the name and the directory
+ * @param uint32_t Inode of the directory
+ * @param const char* Name
+ * @retval uint32_t The hash
+ */
+static uint32_t hash(uint32_t dir, const char *name) {
+    uint32_t h = 2166136261u;
+    int i;
+
+    while (*name != '\0') {
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    }
+    for (i = 0; i < 4; i++) {
+        h = (h ^ (uint8_t) (dir >> (8 * i))) * 16777619u;
+    }
+    return h ^ (h >> 16);
+}
+
+
+
+/**
+ * @brief Bit of the filter a name sets, for each of its DCACHE_FILTER_HASHES hashes
+ * @long The hashes are h1 + i * h2, from two halves of the hash of the name.
+ * @param uint32_t Hash of the name
+ * @param int Which hash
+ * @retval uint32_t The bit
+ */
+static uint32_t filter_bit(uint32_t h, int i) {
+    uint32_t h2 = ((h >> 15) | (h << 17)) | 1;
+    return (h + (uint32_t) i * h2) & (dc->filter_bits - 1);
+}
+
+
+
+void dcache_reset(uint32_t names) {
+    memset(dc->slots, 0, sizeof(dc->slots));
+
+    free(dc->filter);
+    dc->filter_bits = 4096;
+    while (dc->filter_bits < names * DCACHE_FILTER_BITS) {
+        dc->filter_bits <<= 1;
+    }
+    dc->filter = calloc(dc->filter_bits / 8, 1);
+    dc->filter_names = names;
+    dc->filter_added = 0;
+    dc->filter_ready = 0;
+}
+
+
+
+int dcache_lookup(uint32_t dir, const char *name, int *entry) {
+    uint32_t h = hash(dir, name);
+    dcache_slot_t *s = &dc->slots[h & (DCACHE_SLOTS - 1)];
+    int i;
+
+    if (s->used && s->dir == dir && strcmp(s->name, name) == 0) {
+        stats_dcache(1);
+        *entry = s->entry;
+        return 1;
+    }
+
+    // a name the filter does not know does not exist
+    for (i = 0; dc->filter_ready && i < DCACHE_FILTER_HASHES; i++) {
+        uint32_t bit = filter_bit(h, i);
+        if (!((dc->filter[bit / 8] >> (bit % 8)) & 1)) {
+            stats_dcache(1);
+            *entry = DCACHE_MISSING;
+            return 1;
+        }
+    }
+    stats_dcache(0);
+    return 0;
+}
+
+
+
+int dcache_filled(void) {
+    return dc->filter_ready;
+}
+
+
+
+void dcache_add(uint32_t dir, const char *name) {
+    uint32_t h = hash(dir, name);
+    int i;
+
+    if (dc->filter == NULL) {
+        return;
+    }
+    for (i = 0; i < DCACHE_FILTER_HASHES; i++) {
+        uint32_t bit = filter_bit(h, i);
+        dc->filter[bit / 8] |= 1 << (bit % 8);
+    }
+
+    // removed names keep their bits, past twice the names the table holds
+    // the filter is filled again from the directory
+    if (dc->filter_ready && ++dc->filter_added > 2 * dc->filter_names) {
+        memset(dc->filter, 0, dc->filter_bits / 8);
+        dc->filter_added = 0;
+        dc->filter_ready = 0;
+    }
+}
+
+
+
+void dcache_fill_done(void) {
+    dc->filter_ready = dc->filter != NULL;
+    dc->filter_added = 0;
+}
+
+
+
+void dcache_set(uint32_t dir, const char *name, int entry) {
+    dcache_slot_t *s = &dc->slots[hash(dir, name) & (DCACHE_SLOTS - 1)];
+
+    if (entry != DCACHE_MISSING) {
+        dcache_add(dir, name);
+    }
+    s->used = 1;
+    s->dir = dir;
+    s->entry = entry;
+    strncpy(s->name, name, MAXFILENAME);
+    s->name[MAXFILENAME] = '\0';
+}
+
+
+
+dcache_t *dcache_new(void) {
+    return calloc(1, sizeof(dcache_t));
+}
+
+
+
+void dcache_destroy(dcache_t *d) {
+    if (d == NULL || d == &default_dcache) {
+        return;
+    }
+    free(d->filter);
+    free(d);
+}
+
+
+
+void dcache_use(dcache_t *d) {
+    dc = d != NULL ? d : &default_dcache;
+}
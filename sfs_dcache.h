@@ -0,0 +1,86 @@
+#ifndef _INCLUDE_SFS_DCACHE_H_
+#define _INCLUDE_SFS_DCACHE_H_
+
+#include <stdint.h>
+
+/* names the cache remembers, a power of two */
+#define DCACHE_SLOTS (1 << 12)
+
+/* entry of a name the cache knows is missing */
+#define DCACHE_MISSING -1
+
+/* bits of the filter of the names that exist per name of the directory, and bits a name sets */
+#define DCACHE_FILTER_BITS 16
+#define DCACHE_FILTER_HASHES 4
+
+/* dentry cache of a volume, see sfs_new */
+typedef struct dcache dcache_t;
+
+/*
+ * @short make the cache of a new volume, empty
+ * @return the cache, NULL if out of memory
+ */
+dcache_t *dcache_new(void);
+
+/*
+ * @short free the cache of a volume
+ */
+void dcache_destroy(dcache_t *d);
+
+/*
+ * @short make the calling thread work on the cache of a volume
+ * @long Every thread starts on the cache of the default volume, NULL goes
+ *       back to it.
+ */
+void dcache_use(dcache_t *d);
+
+/*
+ * @short forget every name, on mount and after the directory is repaired
+ * @param names  names the directory holds at most, sizes the filter
+ */
+void dcache_reset(uint32_t names);
+
+/*
+ * @short look a name of a directory up in the cache
+ * @long The cache is direct mapped: a name takes the slot of its hash and
+ *       pushes out the name that had it.
+ *
+ *       A name it does not hold is missing if the filter of the names
+ *       that exist, once filled, does not know it.
+ *
+ * @param dir    inode of the directory
+ * @param name   name in the directory
+ * @param entry  set to the directory entry of the name, DCACHE_MISSING if
+ *               the directory is known to have none
+ * @return 1 if the cache knows the name, 0 if the directory must be searched
+ */
+int dcache_lookup(uint32_t dir, const char *name, int *entry);
+
+/*
+ * @short tell if the filter of the names that exist is filled
+ * @long It is not after dcache_reset, nor once the names removed since it
+ *       was filled may make it answer too often that a name exists. The
+ *       caller then hands it every name of the directory with dcache_add
+ *       and calls dcache_fill_done.
+ */
+int dcache_filled(void);
+
+/*
+ * @short add a name of a directory to the filter of the names that exist
+ */
+void dcache_add(uint32_t dir, const char *name);
+
+/*
+ * @short start answering from the filter, see dcache_filled
+ */
+void dcache_fill_done(void);
+
+/*
+ * @short remember the entry of a name of a directory, DCACHE_MISSING if it has none
+ * @long Every change of the directory must go through it, so that the cache
+ *       never contradicts the directory. A name that exists is added to the
+ *       filter.
+ */
+void dcache_set(uint32_t dir, const char *name, int entry);
+
+#endif //_INCLUDE_SFS_DCACHE_H_
@@ -0,0 +1,280 @@
+// deduplication of data blocks: a fingerprint index and the share count of every block
+
+#include "sfs_dedup.h"
+#include "sfs_api.h"
+#include "sfs_cache.h"
+#include "sfs_csum.h"
+#include "bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * A slot of the index
+ * crc      CRC32C of the content of the block
+ * block    data block, NO_BLOCK if the slot is empty
+ */
+typedef struct {
+    uint32_t crc;
+    uint32_t block;
+} dedup_slot_t;
+
+
+/*
+ * Deduplication state of a volume
+ * block_size           block size of the mounted disk
+ * num_blocks           blocks of the disk
+ * refs                 share count table
+ * refs_start           where it lies on the disk
+ * refs_len             its length in blocks
+ * refs_loaded          if it was read from the disk
+ * refs_first_dirty     range of its blocks that changed, -1 if none
+ * refs_last_dirty
+ * slots                index
+ * indexed              one bit per block that tells if the index may point to it
+ * buf                  a block, to compare candidates with
+ */
+struct dedup_state {
+    int block_size;
+    uint32_t num_blocks;
+    uint8_t *refs;
+    int refs_start;
+    int refs_len;
+    int refs_loaded;
+    int refs_first_dirty;
+    int refs_last_dirty;
+    dedup_slot_t *slots;
+    uint8_t *indexed;
+    char *buf;
+};
+
+#define DEDUP_EMPTY { 0, 0, NULL, 0, 0, 0, -1, -1, NULL, NULL, NULL }
+
+
+/* globals */
+static dedup_state_t default_dedup = DEDUP_EMPTY;
+
+// state of the volume the calling thread works on
+static __thread dedup_state_t *dd = &default_dedup;
+
+
+
+void dedup_reset(int start, int nblocks, uint32_t num_blocks, int block_size) {
+    free(dd->refs);
+    free(dd->slots);
+    free(dd->indexed);
+    free(dd->buf);
+    dd->refs = NULL;
+    dd->slots = NULL;
+    dd->indexed = NULL;
+    dd->buf = NULL;
+    dd->refs_start = start;
+    dd->refs_len = nblocks;
+    dd->refs_loaded = 0;
+    dd->refs_first_dirty = -1;
+    dd->refs_last_dirty = -1;
+    dd->num_blocks = num_blocks;
+    dd->block_size = block_size;
+}
+
+
+
+uint8_t *dedup_table(void) {
+    if (dd->refs_loaded) {
+        return dd->refs;
+    }
+    if (dd->refs == NULL) {
+        dd->refs = malloc((size_t) dd->refs_len * dd->block_size);
+        if (dd->refs == NULL) {
+            printf("SFS > Out of memory!\n");
+            return NULL;
+        }
+    }
+    if (cache_read(dd->refs_start, dd->refs_len, dd->refs) < 0) {
+        printf("SFS > Could not read the share count table!\n");
+        return NULL;
+    }
+    dd->refs_loaded = 1;
+    return dd->refs;
+}
+
+
+
+/**
+ * @brief Forget what the index knows
+ * @retval None
+ */
+static void forget_index(void) {
+    uint32_t i;
+
+    if (dd->slots != NULL) {
+        for (i = 0; i < DEDUP_INDEX_SLOTS; i++) {
+            dd->slots[i].block = NO_BLOCK;
+        }
+        memset(dd->indexed, 0, (dd->num_blocks + 7) / 8);
+    }
+}
+
+
+
+void dedup_table_changed(void) {
+    dd->refs_first_dirty = 0;
+    dd->refs_last_dirty = dd->refs_len - 1;
+    forget_index();
+}
+
+
+
+/**
+ * @brief Account for a change of the share count of a block
+ * @param uint32_t Block
+ * @retval None
+ */
+static void refs_changed(uint32_t block) {
+    int b = (int) (block / dd->block_size);
+
+    if (dd->refs_first_dirty == -1 || b < dd->refs_first_dirty) {
+        dd->refs_first_dirty = b;
+    }
+    if (b > dd->refs_last_dirty) {
+        dd->refs_last_dirty = b;
+    }
+}
+
+
+
+/**
+ * @brief Allocate the index, the first time deduplication is used
+ * @retval int Return zero on success, -1 if out of memory
+ */
+static int index_alloc(void) {
+    if (dd->slots != NULL) {
+        return 0;
+    }
+    dd->slots = malloc(sizeof(dedup_slot_t) * DEDUP_INDEX_SLOTS);
+    dd->indexed = malloc((dd->num_blocks + 7) / 8);
+    dd->buf = malloc(dd->block_size);
+    if (dd->slots == NULL || dd->indexed == NULL || dd->buf == NULL) {
+        free(dd->slots);
+        free(dd->indexed);
+        free(dd->buf);
+        dd->slots = NULL;
+        dd->indexed = NULL;
+        dd->buf = NULL;
+        return -1;
+    }
+    forget_index();
+    return 0;
+}
+
+
+
+uint32_t dedup_find(const char *data) {
+    if (index_alloc() != 0 || dedup_table() == NULL) {
+        return NO_BLOCK;
+    }
+
+    uint32_t crc = csum_crc32c(data, dd->block_size);
+    dedup_slot_t *s = &dd->slots[crc & (DEDUP_INDEX_SLOTS - 1)];
+    uint32_t block = s->block;
+
+    // the block may have been freed or overwritten since it was indexed
+    if (block == NO_BLOCK || s->crc != crc || !((dd->indexed[block / 8] >> (block % 8)) & 1)
+        || cache_read((int) block, 1, dd->buf) < 0
+        || memcmp(dd->buf, data, dd->block_size) != 0) {
+        return NO_BLOCK;
+    }
+    if (dd->refs[block] != DEDUP_PINNED) {
+        dd->refs[block]++;
+        refs_changed(block);
+    }
+    return block;
+}
+
+
+
+void dedup_insert(const char *data, uint32_t block) {
+    if (index_alloc() != 0) {
+        return;
+    }
+
+    uint32_t crc = csum_crc32c(data, dd->block_size);
+    dedup_slot_t *s = &dd->slots[crc & (DEDUP_INDEX_SLOTS - 1)];
+    s->crc = crc;
+    s->block = block;
+    dd->indexed[block / 8] |= 1 << (block % 8);
+}
+
+
+
+int dedup_shared(uint32_t block) {
+    if (dedup_table() == NULL) {
+        return 1;
+    }
+    return dd->refs[block] != 0;
+}
+
+
+
+void dedup_put(uint32_t block) {
+    if (dedup_table() == NULL) {
+        return;
+    }
+    if (dd->refs[block] == DEDUP_PINNED) {
+        return;
+    }
+    if (dd->refs[block] > 0) {
+        dd->refs[block]--;
+        refs_changed(block);
+        return;
+    }
+    if (dd->indexed != NULL) {
+        dd->indexed[block / 8] &= ~(1 << (block % 8));
+    }
+    rm_index(block);
+}
+
+
+
+void dedup_write(void) {
+    if (dd->refs_first_dirty == -1 || !dd->refs_loaded) {
+        return;
+    }
+    cache_write_submit(dd->refs_start + dd->refs_first_dirty,
+                       dd->refs_last_dirty - dd->refs_first_dirty + 1,
+                       dd->refs + (size_t) dd->refs_first_dirty * dd->block_size);
+    dd->refs_first_dirty = -1;
+    dd->refs_last_dirty = -1;
+}
+
+
+
+dedup_state_t *dedup_new(void) {
+    dedup_state_t *d = malloc(sizeof(dedup_state_t));
+    dedup_state_t empty = DEDUP_EMPTY;
+
+    if (d != NULL) {
+        *d = empty;
+    }
+    return d;
+}
+
+
+
+void dedup_destroy(dedup_state_t *d) {
+    if (d == NULL || d == &default_dedup) {
+        return;
+    }
+    free(d->refs);
+    free(d->slots);
+    free(d->indexed);
+    free(d->buf);
+    free(d);
+}
+
+
+
+void dedup_use(dedup_state_t *d) {
+    dd = d != NULL ? d : &default_dedup;
+}
@@ -0,0 +1,93 @@
+#ifndef _INCLUDE_SFS_DEDUP_H_
+#define _INCLUDE_SFS_DEDUP_H_
+
+#include <stdint.h>
+
+/* share count of a block shared too often to keep count, it is never freed */
+#define DEDUP_PINNED 255
+
+/* fingerprints the index remembers, a power of two */
+#define DEDUP_INDEX_SLOTS (1 << 16)
+
+/* share counts and index of a volume, see sfs_new */
+typedef struct dedup_state dedup_state_t;
+
+/*
+ * @short make the state of a new volume, sized by dedup_reset
+ * @return the state, NULL if out of memory
+ */
+dedup_state_t *dedup_new(void);
+
+/*
+ * @short free the state of a volume
+ */
+void dedup_destroy(dedup_state_t *d);
+
+/*
+ * @short make the calling thread work on the state of a volume
+ * @long Every thread starts on the state of the default volume, NULL goes
+ *       back to it.
+ */
+void dedup_use(dedup_state_t *d);
+
+/*
+ * @short forget the share counts and the index, on mount
+ * @long The share count table holds a byte per block of the disk: how many
+ *       pointers to the block there are beyond the first. It is read the
+ *       first time it is needed.
+ *
+ * @param start       first block of the share count table
+ * @param nblocks     length of the table
+ * @param num_blocks  blocks of the disk
+ * @param block_size  block size of the disk
+ */
+void dedup_reset(int start, int nblocks, uint32_t num_blocks, int block_size);
+
+/*
+ * @short the share count table, read from the disk if it was not yet
+ * @return the table, NULL if it cannot be read
+ */
+uint8_t *dedup_table(void);
+
+/*
+ * @short write the whole share count table on the next dedup_write, after a repair
+ * @long The index is forgotten too, the repair may have freed blocks it knows.
+ */
+void dedup_table_changed(void);
+
+/*
+ * @short find a data block holding some bytes
+ * @long The block is looked up by the CRC32C of the bytes in the index, then
+ *       compared byte for byte. On a hit its share count goes up, the caller
+ *       points to it.
+ *
+ * @param data  a block of data
+ * @return the block, NO_BLOCK if the index knows none
+ */
+uint32_t dedup_find(const char *data);
+
+/*
+ * @short remember the data block holding some bytes, see dedup_find
+ */
+void dedup_insert(const char *data, uint32_t block);
+
+/*
+ * @short tell if other pointers point to a block, it must then be copied before it changes
+ * @return 1 if they do or if the table cannot be read, 0 otherwise
+ */
+int dedup_shared(uint32_t block);
+
+/*
+ * @short let go of a pointer to a data block
+ * @long The share count goes down, a block no other pointer uses goes back
+ *       to the free bitmap. Blocks of a table that cannot be read are kept.
+ */
+void dedup_put(uint32_t block);
+
+/*
+ * @short queue the writes of the blocks of the share count table that changed
+ * @long Like write_bitmap, the caller waits for them with cache_wait.
+ */
+void dedup_write(void);
+
+#endif //_INCLUDE_SFS_DEDUP_H_
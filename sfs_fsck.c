@@ -0,0 +1,70 @@
+/* sfs_fsck.c
+ *
+ * Check an sfs image that is not mounted, and repair it with -y. The
+ * inodes and block maps are walked by worker threads, and -s also reads
+ * every block in use to find the unreadable ones and those that do not
+ * match their checksum.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_check.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-y] [-s] [-j threads] [-b mbps] image\n", prog);
+    fprintf(stderr, "  -y          repair the problems found and mark the image clean\n");
+    fprintf(stderr, "  -s          scrub: read every block in use and check its checksum\n");
+    fprintf(stderr, "  -j threads  worker threads (default: one per core)\n");
+    fprintf(stderr, "  -b mbps     most MB per second read from the image (default: no limit)\n");
+    fprintf(stderr, "exit status: 0 clean, 1 problems repaired, 4 problems left, 8 error\n");
+}
+
+
+
+int main(int argc, char **argv) {
+    sfs_check_opts_t opts = { 0, 0, 0, 0 };
+    sfs_check_report_t r;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ysj:b:h")) != -1) {
+        switch (opt) {
+            case 'y': opts.repair = 1; break;
+            case 's': opts.scrub = 1; break;
+            case 'j': opts.threads = atoi(optarg); break;
+            case 'b': opts.bandwidth_mbps = atoi(optarg); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 8;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 8;
+    }
+
+    if (sfs_check_image(argv[optind], &opts, &r) != 0) {
+        return 8;
+    }
+
+    printf("files         %llu\n", (unsigned long long) r.files);
+    printf("blocks        %llu\n", (unsigned long long) r.blocks);
+    printf("bad entries   %llu\n", (unsigned long long) r.bad_entries);
+    printf("orphans       %llu\n", (unsigned long long) r.orphans);
+    printf("bad pointers  %llu\n", (unsigned long long) r.bad_pointers);
+    printf("doubles       %llu\n", (unsigned long long) r.doubles);
+    printf("leaked        %llu\n", (unsigned long long) r.leaked);
+    printf("unmarked      %llu\n", (unsigned long long) r.unmarked);
+    printf("unreadable    %llu\n", (unsigned long long) r.unreadable);
+    printf("bad checksums %llu\n", (unsigned long long) r.bad_sums);
+    printf("bad shares    %llu\n", (unsigned long long) r.bad_refs);
+    printf("read          %.1f MB in %.3f s\n", r.bytes_read / 1e6, r.elapsed_ns / 1e9);
+
+    if (check_problems(&r) == 0) {
+        return 0;
+    }
+    printf("%llu problems %s\n", (unsigned long long) check_problems(&r),
+           r.repaired ? "repaired" : "found, run with -y to repair them");
+    return r.repaired ? 1 : 4;
+}
@@ -0,0 +1,319 @@
+// LZ77 compression of the chunks of compressed files, and the threads running it
+
+#include "sfs_lz.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* shortest match worth a sequence */
+#define MIN_MATCH 4
+
+/* farthest a match reaches back, the offset takes two bytes */
+#define MAX_OFFSET 65535
+
+/* positions remembered by the match finder */
+#define HASH_BITS 12
+
+/* literal and match lengths from which more length bytes follow the token */
+#define RUN_MASK 15
+
+
+/* globals */
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// batch being compressed, one at a time
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static lz_job_t *batch = NULL;
+static int batch_count = 0;
+static int batch_next = 0;
+static int batch_done = 0;
+
+
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+
+static uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+
+/**
+ * @brief Write a length past the RUN_MASK of its token
+ * @param uint8_t* Output
+ * @param int* Where in the output, moves
+ * @param int Room in the output
+ * @param int Length minus RUN_MASK
+ * @retval int Return zero, -1 if the output is full
+ */
+static int put_length(uint8_t *dst, int *op, int cap, int len) {
+    while (len >= 255) {
+        if (*op >= cap) {
+            return -1;
+        }
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap) {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t) len;
+    return 0;
+}
+
+
+
+/**
+ * @brief Write a sequence: its token, its literals and its match
+ * @param uint8_t* Output
+ * @param int* Where in the output, moves
+ * @param int Room in the output
+ * @param const uint8_t* Literals
+ * @param int Number of literals
+ * @param int Offset of the match, zero for the last sequence, which has none
+ * @param int Length of the match
+ * @retval int Return zero, -1 if the output is full
+ */
+static int put_sequence(uint8_t *dst, int *op, int cap, const uint8_t *lit, int nlit,
+                        int offset, int match) {
+    int mcode = offset == 0 ? 0 : match - MIN_MATCH;
+
+    if (*op >= cap) {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t) (((nlit < RUN_MASK ? nlit : RUN_MASK) << 4)
+                              | (mcode < RUN_MASK ? mcode : RUN_MASK));
+    if (nlit >= RUN_MASK && put_length(dst, op, cap, nlit - RUN_MASK) != 0) {
+        return -1;
+    }
+    if (nlit > cap - *op) {
+        return -1;
+    }
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+
+    if (offset == 0) {
+        return 0;
+    }
+    if (cap - *op < 2) {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t) offset;
+    dst[(*op)++] = (uint8_t) (offset >> 8);
+    if (mcode >= RUN_MASK && put_length(dst, op, cap, mcode - RUN_MASK) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int lz_compress(const char *src_, int len, char *dst_, int cap) {
+    const uint8_t *src = (const uint8_t*) src_;
+    uint8_t *dst = (uint8_t*) dst_;
+    int table[1 << HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    // positions are stored plus one, zero means none
+    memset(table, 0, sizeof(table));
+
+    while (ip + MIN_MATCH <= len) {
+        uint32_t h = hash(read32(src + ip));
+        int ref = table[h] - 1;
+        table[h] = ip + 1;
+
+        if (ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != read32(src + ip)) {
+            // the longer nothing matches, the faster it is skipped
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        int match = MIN_MATCH;
+        while (ip + match < len && src[ref + match] == src[ip + match]) {
+            match++;
+        }
+        if (put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, match) != 0) {
+            return -1;
+        }
+        ip += match;
+        anchor = ip;
+    }
+
+    if (put_sequence(dst, &op, cap, src + anchor, len - anchor, 0, 0) != 0) {
+        return -1;
+    }
+    return op;
+}
+
+
+
+/**
+ * @brief Read a length past the RUN_MASK of its token
+ * @param const uint8_t* Input
+ * @param int* Where in the input, moves
+ * @param int Length of the input
+ * @retval int The length to add, -1 if the input ends
+ */
+static int get_length(const uint8_t *src, int *ip, int len) {
+    int total = 0;
+    uint8_t b;
+
+    do {
+        if (*ip >= len || total > (1 << 30)) {
+            return -1;
+        }
+        b = src[(*ip)++];
+        total += b;
+    } while (b == 255);
+    return total;
+}
+
+
+
+int lz_decompress(const char *src_, int len, char *dst_, int cap) {
+    const uint8_t *src = (const uint8_t*) src_;
+    uint8_t *dst = (uint8_t*) dst_;
+    int ip = 0, op = 0;
+
+    while (ip < len) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == RUN_MASK) {
+            int more = get_length(src, &ip, len);
+            if (more < 0) {
+                return -1;
+            }
+            nlit += more;
+        }
+        if (nlit > len - ip || nlit > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // the last sequence has no match
+        if (ip == len) {
+            break;
+        }
+        if (len - ip < 2) {
+            return -1;
+        }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int match = (token & RUN_MASK) + MIN_MATCH;
+        if ((token & RUN_MASK) == RUN_MASK) {
+            int more = get_length(src, &ip, len);
+            if (more < 0) {
+                return -1;
+            }
+            match += more;
+        }
+        if (offset == 0 || offset > op || match > cap - op) {
+            return -1;
+        }
+
+        // a match can overlap the bytes it produces: they repeat every offset
+        // bytes, so the copy doubles what it can take at once each time
+        int from = op - offset;
+        while (match > 0) {
+            int n = op - from < match ? op - from : match;
+            memcpy(dst + op, dst + from, n);
+            op += n;
+            match -= n;
+        }
+    }
+    return op;
+}
+
+
+
+/**
+ * @brief Compress the buffers of the batch nobody took yet
+ * @long Called with pool_lock held, returns with it held.
+ * @retval None
+ */
+static void work(void) {
+    while (batch != NULL && batch_next < batch_count) {
+        lz_job_t *j = &batch[batch_next++];
+        pthread_mutex_unlock(&pool_lock);
+        j->out = lz_compress(j->src, j->len, j->dst, j->cap);
+        pthread_mutex_lock(&pool_lock);
+        if (++batch_done == batch_count) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+}
+
+
+
+static void *worker(void *unused) {
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        work();
+        pthread_cond_wait(&pool_work, &pool_lock);
+    }
+    return NULL;
+}
+
+
+
+/**
+ * @brief Start the workers, once
+ * @retval None
+ */
+static void start_pool(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (cores > LZ_MAX_THREADS) {
+        cores = LZ_MAX_THREADS;
+    }
+
+    // the caller is one of the threads
+    for (i = 1; i < cores; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(t);
+    }
+}
+
+
+
+void lz_compress_all(lz_job_t *jobs, int count) {
+    if (count == 1) {
+        jobs[0].out = lz_compress(jobs[0].src, jobs[0].len, jobs[0].dst, jobs[0].cap);
+        return;
+    }
+    if (count <= 0) {
+        return;
+    }
+    pthread_once(&pool_once, start_pool);
+
+    pthread_mutex_lock(&batch_lock);
+    pthread_mutex_lock(&pool_lock);
+    batch = jobs;
+    batch_count = count;
+    batch_next = 0;
+    batch_done = 0;
+    pthread_cond_broadcast(&pool_work);
+    work();
+    while (batch_done < batch_count) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    batch = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&batch_lock);
+}
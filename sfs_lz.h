@@ -0,0 +1,53 @@
+#ifndef _INCLUDE_SFS_LZ_H_
+#define _INCLUDE_SFS_LZ_H_
+
+/* most threads compressing at once, the caller of lz_compress_all included */
+#define LZ_MAX_THREADS 8
+
+/*
+ * One buffer to compress
+ * src      data
+ * len      bytes of data
+ * dst      buffer for the compressed data
+ * cap      room in dst
+ * out      filled by lz_compress_all: what lz_compress returned
+ */
+typedef struct {
+    const char *src;
+    int len;
+    char *dst;
+    int cap;
+    int out;
+} lz_job_t;
+
+/*
+ * @short compress bytes with a fast LZ77 codec
+ * @long Sequences of literals and matches of at least four bytes up to 64 KB
+ *       back, found through a hash table of the last position of every four
+ *       bytes seen, in the layout of LZ4 blocks. Gives up as soon as the
+ *       output would not fit, so that incompressible data costs little.
+ *
+ * @param src  data
+ * @param len  bytes of data
+ * @param dst  buffer for the compressed data
+ * @param cap  room in dst
+ * @return bytes of compressed data, -1 if they do not fit in cap
+ */
+int lz_compress(const char *src, int len, char *dst, int cap);
+
+/*
+ * @short decompress what lz_compress made
+ * @long Corrupt input is caught, nothing is read or written out of bounds.
+ * @return bytes of data, -1 if the input is corrupt or does not fit in cap
+ */
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+/*
+ * @short compress several buffers at once on a pool of worker threads
+ * @long The workers start on the first call, one per core up to
+ *       LZ_MAX_THREADS, and the caller works with them until every buffer
+ *       is done. A single buffer is compressed by the caller alone.
+ */
+void lz_compress_all(lz_job_t *jobs, int count);
+
+#endif //_INCLUDE_SFS_LZ_H_
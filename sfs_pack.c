@@ -0,0 +1,240 @@
+// packing of small files into the fragments of shared blocks
+
+#include "sfs_pack.h"
+#include "sfs_api.h"
+#include "sfs_cache.h"
+#include "bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Blocks with free fragments of a volume
+ * block_size       block size of the mounted disk
+ * buf              a block, to read headers into
+ * candidates       blocks that had free fragments last time they were looked at, most recent first
+ * num_candidates   number of them
+ */
+struct pack_state {
+    uint32_t block_size;
+    char *buf;
+    uint32_t candidates[PACK_CANDIDATES];
+    int num_candidates;
+};
+
+
+/* globals */
+static pack_state_t default_pack;
+
+// state of the volume the calling thread works on
+static __thread pack_state_t *pk = &default_pack;
+
+
+
+/**
+ * @brief Forget a block
+ * @param uint32_t Block
+ * @retval None
+ */
+static void forget(uint32_t block) {
+    int i;
+
+    for (i = 0; i < pk->num_candidates; i++) {
+        if (pk->candidates[i] == block) {
+            memmove(&pk->candidates[i], &pk->candidates[i + 1],
+                    sizeof(uint32_t) * (pk->num_candidates - i - 1));
+            pk->num_candidates--;
+            return;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Remember a block with free fragments, ahead of the others
+ * @param uint32_t Block
+ * @retval None
+ */
+static void remember(uint32_t block) {
+    forget(block);
+    if (pk->num_candidates == PACK_CANDIDATES) {
+        pk->num_candidates--;
+    }
+    memmove(&pk->candidates[1], &pk->candidates[0], sizeof(uint32_t) * pk->num_candidates);
+    pk->candidates[0] = block;
+    pk->num_candidates++;
+}
+
+
+
+/**
+ * @brief Fill a block buffer with the header of an empty shared block
+ * @param void* Buffer of a block
+ * @param int Block size
+ * @retval None
+ */
+static void pack_format(void *block, int block_size) {
+    pack_header_t *h = block;
+    uint32_t frag;
+
+    memset(block, 0, block_size);
+    h->magic = PACK_MAGIC;
+    h->used = PACK_HEADER_FRAGS(block_size);
+    for (frag = 0; frag < h->used; frag++) {
+        PACK_USE(h->map, frag);
+    }
+}
+
+
+
+/**
+ * @brief Find free fragments following each other in a shared block
+ * @param pack_header_t* Header of the block
+ * @param uint32_t Number of fragments
+ * @retval uint32_t The first of them, 0 if there is no such run
+ */
+static uint32_t find_run(pack_header_t *h, uint32_t count) {
+    uint32_t frag, run = 0;
+
+    for (frag = PACK_HEADER_FRAGS(pk->block_size); frag < PACK_FRAGS(pk->block_size); frag++) {
+        run = PACK_IS_USED(h->map, frag) ? 0 : run + 1;
+        if (run == count) {
+            return frag + 1 - count;
+        }
+    }
+    return 0;
+}
+
+
+
+void pack_reset(int block_size) {
+    free(pk->buf);
+    pk->buf = malloc(block_size);
+    if (pk->buf == NULL) {
+        printf("SFS > Out of memory!\n");
+        exit(-1);
+    }
+    pk->block_size = (uint32_t) block_size;
+    pk->num_candidates = 0;
+}
+
+
+
+int pack_alloc(const char *data, uint32_t len, uint32_t *block, uint32_t *first) {
+    pack_header_t *h = (pack_header_t*) pk->buf;
+    uint32_t count = PACK_FRAGS_FOR(len);
+    uint32_t frag = 0;
+    int i = 0;
+
+    // the most recently used blocks first, those that cannot fit the data any more are forgotten
+    while (i < pk->num_candidates) {
+        *block = pk->candidates[i];
+        if (cache_read((int) *block, 1, pk->buf) < 0) {
+            return -1;
+        }
+        frag = h->magic == PACK_MAGIC ? find_run(h, count) : 0;
+        if (frag != 0) {
+            break;
+        }
+        if (h->magic != PACK_MAGIC || PACK_FRAGS(pk->block_size) - h->used < count) {
+            forget(*block);
+        } else {
+            i++;
+        }
+    }
+
+    // start a new block
+    if (frag == 0) {
+        *block = get_index();
+        if (*block == NO_BLOCK) {
+            return -1;
+        }
+        pack_format(pk->buf, pk->block_size);
+        frag = PACK_HEADER_FRAGS(pk->block_size);
+    }
+
+    uint32_t k;
+    for (k = frag; k < frag + count; k++) {
+        PACK_USE(h->map, k);
+    }
+    h->used += count;
+    memset(pk->buf + (uint64_t) frag * PACK_FRAG_SIZE, 0, (uint64_t) count * PACK_FRAG_SIZE);
+    memcpy(pk->buf + (uint64_t) frag * PACK_FRAG_SIZE, data, len);
+    if (h->used < PACK_FRAGS(pk->block_size)) {
+        remember(*block);
+    } else {
+        forget(*block);
+    }
+    *first = frag;
+    return cache_write((int) *block, 1, pk->buf) < 0 ? -1 : 0;
+}
+
+
+
+int pack_free(uint32_t block, uint32_t first, uint32_t count) {
+    pack_header_t *h = (pack_header_t*) pk->buf;
+    uint32_t k;
+
+    if (cache_read((int) block, 1, pk->buf) < 0) {
+        return -1;
+    }
+    for (k = first; k < first + count && k < PACK_FRAGS(pk->block_size); k++) {
+        if (PACK_IS_USED(h->map, k)) {
+            PACK_RELEASE(h->map, k);
+            h->used--;
+        }
+    }
+
+    // an empty block goes back to the bitmap, its content does not matter any more
+    if (h->used <= PACK_HEADER_FRAGS(pk->block_size)) {
+        forget(block);
+        rm_index(block);
+        return 0;
+    }
+    remember(block);
+    return cache_write((int) block, 1, pk->buf) < 0 ? -1 : 0;
+}
+
+
+
+int pack_read(uint32_t block, uint32_t first, uint32_t offset, char *buf, uint32_t len) {
+    if (cache_read((int) block, 1, pk->buf) < 0) {
+        return -1;
+    }
+    memcpy(buf, pk->buf + (uint64_t) first * PACK_FRAG_SIZE + offset, len);
+    return 0;
+}
+
+
+
+int pack_write(uint32_t block, uint32_t first, uint32_t offset, const char *buf, uint32_t len) {
+    if (cache_read((int) block, 1, pk->buf) < 0) {
+        return -1;
+    }
+    memcpy(pk->buf + (uint64_t) first * PACK_FRAG_SIZE + offset, buf, len);
+    return cache_write((int) block, 1, pk->buf) < 0 ? -1 : 0;
+}
+
+
+
+pack_state_t *pack_new(void) {
+    return calloc(1, sizeof(pack_state_t));
+}
+
+
+
+void pack_destroy(pack_state_t *p) {
+    if (p == NULL || p == &default_pack) {
+        return;
+    }
+    free(p->buf);
+    free(p);
+}
+
+
+
+void pack_use(pack_state_t *p) {
+    pk = p != NULL ? p : &default_pack;
+}
@@ -0,0 +1,109 @@
+#ifndef _INCLUDE_SFS_PACK_H_
+#define _INCLUDE_SFS_PACK_H_
+
+#include <stdint.h>
+
+/* magic number at the start of a block holding packed files */
+#define PACK_MAGIC 0x5041434B
+
+/* unit in which the room of a block is handed out to files, in bytes */
+#define PACK_FRAG_SIZE 64
+
+/* blocks with free fragments the allocator remembers */
+#define PACK_CANDIDATES 8
+
+/* fragments in a block */
+#define PACK_FRAGS(_block_size) ((uint32_t) (_block_size) / PACK_FRAG_SIZE)
+
+/* fragments taken by the header at the start of a block */
+#define PACK_HEADER_FRAGS(_block_size) \
+    ((uint32_t) (sizeof(pack_header_t) + PACK_FRAGS(_block_size) / 8 + PACK_FRAG_SIZE - 1) / PACK_FRAG_SIZE)
+
+/* largest file packed, bigger files get blocks of their own */
+#define PACK_MAX(_block_size) ((uint32_t) (_block_size) / 2)
+
+/* fragments needed for some bytes */
+#define PACK_FRAGS_FOR(_bytes) (((uint32_t) (_bytes) + PACK_FRAG_SIZE - 1) / PACK_FRAG_SIZE)
+
+#define PACK_IS_USED(_map, _frag) (((_map)[(_frag) / 8] >> ((_frag) % 8)) & 1)
+#define PACK_USE(_map, _frag) ((_map)[(_frag) / 8] |= 1 << ((_frag) % 8))
+#define PACK_RELEASE(_map, _frag) ((_map)[(_frag) / 8] &= ~(1 << ((_frag) % 8)))
+
+/*
+ * Start of a block shared by packed files, the fragments follow
+ * magic    PACK_MAGIC
+ * used     fragments in use, those of the header included
+ * map      one bit per fragment, set if it is in use
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t used;
+    uint8_t map[];
+} pack_header_t;
+
+/* blocks with free fragments of a volume, see sfs_new */
+typedef struct pack_state pack_state_t;
+
+/*
+ * @short make the state of a new volume
+ * @return the state, NULL if out of memory
+ */
+pack_state_t *pack_new(void);
+
+/*
+ * @short free the state of a volume
+ */
+void pack_destroy(pack_state_t *p);
+
+/*
+ * @short make the calling thread work on the state of a volume
+ * @long Every thread starts on the state of the default volume, NULL goes
+ *       back to it.
+ */
+void pack_use(pack_state_t *p);
+
+/*
+ * @short forget the blocks with free fragments, on mount or after a repair
+ * @param block_size  block size of the mounted disk
+ */
+void pack_reset(int block_size);
+
+/*
+ * @short store the data of a file in free fragments of a shared block
+ * @long The fragments come from a block the allocator remembers, or from a
+ *       new block taken from the free bitmap. The fragment past the end of
+ *       the data is zeroed. The block goes through the block cache, the
+ *       caller writes the bitmap back.
+ *
+ * @param data   data of the file
+ * @param len    bytes of data, at most PACK_MAX
+ * @param block  set to the shared block
+ * @param first  set to the first fragment
+ * @return 0 on success, -1 if the disk is full or failed
+ */
+int pack_alloc(const char *data, uint32_t len, uint32_t *block, uint32_t *first);
+
+/*
+ * @short give fragments back to their block
+ * @long A block left with no fragment in use goes back to the free bitmap.
+ * @return 0 on success, -1 if the disk failed
+ */
+int pack_free(uint32_t block, uint32_t first, uint32_t count);
+
+/*
+ * @short read bytes of packed data
+ * @param block   shared block
+ * @param first   first fragment of the file
+ * @param offset  where in the file
+ * @param buf     buffer for the data
+ * @param len     bytes to read, within the fragments of the file
+ * @return 0 on success, -1 if the disk failed
+ */
+int pack_read(uint32_t block, uint32_t first, uint32_t offset, char *buf, uint32_t len);
+
+/*
+ * @short overwrite bytes of packed data in place, see pack_read
+ */
+int pack_write(uint32_t block, uint32_t first, uint32_t offset, const char *buf, uint32_t len);
+
+#endif //_INCLUDE_SFS_PACK_H_
@@ -0,0 +1,708 @@
+/* sfs_preload.c
+ *
+ * LD_PRELOAD shim that serves the files under a path prefix from an sfs
+ * image, without going through FUSE. open, openat, fopen, read, write,
+ * lseek, close and stat of a path under SFS_PRELOAD_PREFIX go to sfs_fopen,
+ * sfs_fread and the others, every other call goes to the C library as it is.
+ * The C library opens the files of fopen with calls of its own that cannot
+ * be seen from here, so fopen is served whole, by a stream over the
+ * descriptors of the shim.
+ *
+ *     SFS_PRELOAD_PREFIX=/sfs SFS_PRELOAD_IMAGE=disk.img \
+ *         LD_PRELOAD=./libsfs_preload.so ./job
+ *
+ * The image is mounted by the first call under the prefix, and unmounted
+ * cleanly at exit. As with the FUSE mount, a new file system is made only
+ * on an image that is missing or empty: if the image fails to mount, every
+ * call under the prefix fails with EIO and the image is left untouched. The
+ * messages of the file system go to stderr, see sfs_preload.h.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+/* descriptors the shim can hand out, those above are refused with EMFILE */
+#define PRELOAD_FDS 4096
+
+/* the sfs sources are built with hidden symbols, only these are exported */
+#define SHIM __attribute__((visibility("default")))
+
+/*
+ * A descriptor of a file under the prefix
+ * file     sfs file ID + 1, 0 if the descriptor is not one of the shim
+ * flags    flags it was opened with
+ * pos      its offset, the sfs file ID is shared by every open of the file
+ * path     path of the file in the file system
+ */
+typedef struct {
+    int file;
+    int flags;
+    off_t pos;
+    char *path;
+} preload_fd_t;
+
+/*
+ * An open sfs file
+ * refs     descriptors of the shim on it
+ * rwptr    where its sfs read/write pointer is, so that reads that follow
+ *          each other do not seek
+ */
+typedef struct {
+    int refs;
+    off_t rwptr;
+} preload_file_t;
+
+/* globals, changed under sfs_lock */
+static preload_fd_t fds[PRELOAD_FDS];
+static preload_file_t *files = NULL;
+static int files_len = 0;
+
+static const char *prefix = NULL;
+static size_t prefix_len = 0;
+static pthread_once_t mount_once = PTHREAD_ONCE_INIT;
+
+/* the C library calls */
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static off_t (*real_lseek)(int, off_t, int);
+static int (*real_close)(int);
+static int (*real_stat)(const char *, struct stat *);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_stat64)(const char *, struct stat64 *);
+static int (*real_fstat64)(int, struct stat64 *);
+static int (*real_xstat)(int, const char *, struct stat *);
+static int (*real_fxstat)(int, int, struct stat *);
+
+/* how binaries built against a C library older than 2.33 call stat, which
+ * only exports stat and fstat from 2.33 on */
+int __xstat(int ver, const char *path, struct stat *buf);
+int __fxstat(int ver, int fd, struct stat *buf);
+
+
+
+/**
+ * @brief Find the C library calls the shim stands in front of
+ * @retval None
+ */
+__attribute__((constructor))
+static void resolve(void) {
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_openat = dlsym(RTLD_NEXT, "openat");
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_lseek = dlsym(RTLD_NEXT, "lseek");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_stat = dlsym(RTLD_NEXT, "stat");
+    real_fstat = dlsym(RTLD_NEXT, "fstat");
+    real_stat64 = dlsym(RTLD_NEXT, "stat64");
+    real_fstat64 = dlsym(RTLD_NEXT, "fstat64");
+    real_xstat = dlsym(RTLD_NEXT, "__xstat");
+    real_fxstat = dlsym(RTLD_NEXT, "__fxstat");
+
+    prefix = getenv("SFS_PRELOAD_PREFIX");
+    if (prefix != NULL) {
+        prefix_len = strlen(prefix);
+        while (prefix_len > 0 && prefix[prefix_len - 1] == '/') {
+            prefix_len--;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Mount the image, or make a new file system on it if it is missing or empty
+ * @retval None
+ */
+static void preload_mount(void) {
+    const char *image = getenv("SFS_PRELOAD_IMAGE");
+
+    if (image != NULL) {
+        sfs_set_image(image);
+    }
+    if (sfs_image_blank()) {
+        mksfs(1);
+        return;
+    }
+    mksfs(0);
+    if (!sfs_is_mounted()) {
+        printf("SFS > Cannot mount %s, the files under %s are not available\n",
+               image != NULL ? image : DEFAULT_DISK_FILE, prefix);
+    }
+}
+
+
+
+/**
+ * @brief Tell if a path is under the prefix, and mount the image the first time
+ * @param const char* Path given to the call
+ * @retval const char* The path in the file system, NULL if it is not under the prefix
+ */
+static const char *sfs_path(const char *path) {
+    if (prefix == NULL || path == NULL || path[0] != '/'
+        || strncmp(path, prefix, prefix_len) != 0
+        || (path[prefix_len] != '/' && path[prefix_len] != '\0')) {
+        return NULL;
+    }
+    pthread_once(&mount_once, preload_mount);
+    return path[prefix_len] != '\0' ? path + prefix_len : "/";
+}
+
+
+
+/**
+ * @brief Descriptor of the shim
+ * @param int Descriptor
+ * @retval preload_fd_t* The descriptor, NULL if it belongs to the C library
+ */
+static preload_fd_t *shim_fd(int fd) {
+    if (fd < 0 || fd >= PRELOAD_FDS || __atomic_load_n(&fds[fd].file, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+    return &fds[fd];
+}
+
+
+
+/**
+ * @brief Fill a struct stat with what sfs_stat tells about a path
+ * @param const char* Path in the file system
+ * @param struct stat* Filled
+ * @retval int Return zero on success, -1 with errno set
+ */
+static int fill_stat(const char *path, struct stat *buf) {
+    sfs_stat_t attr;
+
+    if (!sfs_is_mounted()) {
+        errno = EIO;
+        return -1;
+    }
+    if (sfs_stat(path, &attr) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    memset(buf, 0, sizeof(struct stat));
+    if (attr.dir) {
+        buf->st_mode = S_IFDIR | 0755;
+        buf->st_nlink = 2;
+    } else {
+        buf->st_mode = S_IFREG | 0666;
+        buf->st_nlink = 1;
+        buf->st_size = attr.size;
+        buf->st_blocks = ((blkcnt_t) attr.size + 511) / 512;
+    }
+    buf->st_ino = attr.inode + 1;
+    buf->st_blksize = 4096;
+    return 0;
+}
+
+
+
+/**
+ * @brief Copy what fill_stat sets to a struct stat64
+ * @param struct stat* Filled by fill_stat
+ * @param struct stat64* Filled
+ * @retval None
+ */
+static void copy_stat64(const struct stat *st, struct stat64 *buf) {
+    memset(buf, 0, sizeof(struct stat64));
+    buf->st_mode = st->st_mode;
+    buf->st_nlink = st->st_nlink;
+    buf->st_size = st->st_size;
+    buf->st_blocks = st->st_blocks;
+    buf->st_ino = st->st_ino;
+    buf->st_blksize = st->st_blksize;
+}
+
+
+
+/**
+ * @brief Open a file of the file system
+ * @long The descriptor handed out is one of /dev/null, so that it cannot be
+ *       confused with a descriptor of the C library.
+ * @param const char* Path in the file system
+ * @param int Flags of open
+ * @retval int The descriptor, -1 with errno set
+ */
+static int shim_open(const char *path, int flags) {
+    int accmode = flags & O_ACCMODE;
+    sfs_stat_t attr;
+    int exists;
+    int id;
+    int fd;
+    preload_file_t *grown;
+
+    sfs_lock();
+    if (!sfs_is_mounted()) {
+        sfs_unlock();
+        errno = EIO;
+        return -1;
+    }
+    exists = sfs_stat(path, &attr) == 0;
+    if (!exists && !(flags & O_CREAT)) {
+        sfs_unlock();
+        errno = ENOENT;
+        return -1;
+    }
+    if (exists && (flags & O_CREAT) && (flags & O_EXCL)) {
+        sfs_unlock();
+        errno = EEXIST;
+        return -1;
+    }
+    if (exists && attr.dir) {
+        sfs_unlock();
+        errno = EISDIR;
+        return -1;
+    }
+
+    id = sfs_fopen((char *) path);
+    if (id < 0) {
+        errno = exists ? EIO : sfs_create_error(path);
+        sfs_unlock();
+        return -1;
+    }
+    if (id >= files_len) {
+        grown = realloc(files, (size_t) (id + 1) * sizeof(preload_file_t));
+        if (grown == NULL) {
+            sfs_fclose(id);
+            sfs_unlock();
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + files_len, 0, (size_t) (id + 1 - files_len) * sizeof(preload_file_t));
+        files = grown;
+        files_len = id + 1;
+    }
+    if (files[id].refs == 0) {
+        // sfs_fopen leaves the pointer at the end of the file
+        files[id].rwptr = exists ? (off_t) attr.size : 0;
+    }
+
+    fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+    if (fd < 0 || fd >= PRELOAD_FDS) {
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        if (files[id].refs == 0) {
+            sfs_fclose(id);
+        }
+        sfs_unlock();
+        errno = fd < 0 ? errno : EMFILE;
+        return -1;
+    }
+
+    if ((flags & O_TRUNC) && accmode != O_RDONLY && exists && attr.size > 0) {
+        sfs_ftruncate(id, 0);
+    }
+    files[id].refs++;
+    fds[fd].flags = flags;
+    fds[fd].pos = 0;
+    fds[fd].path = strdup(path);
+    __atomic_store_n(&fds[fd].file, id + 1, __ATOMIC_RELEASE);
+    sfs_unlock();
+    return fd;
+}
+
+
+
+/**
+ * @brief Move the sfs pointer of a file to the offset of a descriptor
+ * @param preload_fd_t* Descriptor
+ * @retval int Return zero on success, -1 if the offset is past the largest file
+ */
+static int shim_seek(preload_fd_t *f) {
+    int id = f->file - 1;
+
+    if (files[id].rwptr == f->pos) {
+        return 0;
+    }
+    if (f->pos > INT_MAX || sfs_fseek(id, (int) f->pos) != 0) {
+        return -1;
+    }
+    files[id].rwptr = f->pos;
+    return 0;
+}
+
+
+
+SHIM int open(const char *path, int flags, ...) {
+    const char *p = sfs_path(path);
+    mode_t mode = 0;
+    va_list ap;
+
+    if (p != NULL) {
+        return shim_open(p, flags);
+    }
+    if (flags & (O_CREAT | __O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real_open(path, flags, mode);
+}
+
+
+
+SHIM int open64(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    va_list ap;
+
+    if (flags & (O_CREAT | __O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return open(path, flags | O_LARGEFILE, mode);
+}
+
+
+
+/* a relative path is left to the C library, even under a directory of the prefix */
+SHIM int openat(int dirfd, const char *path, int flags, ...) {
+    const char *p = sfs_path(path);
+    mode_t mode = 0;
+    va_list ap;
+
+    if (p != NULL) {
+        return shim_open(p, flags);
+    }
+    if (flags & (O_CREAT | __O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real_openat(dirfd, path, flags, mode);
+}
+
+
+
+SHIM int openat64(int dirfd, const char *path, int flags, ...) {
+    mode_t mode = 0;
+    va_list ap;
+
+    if (flags & (O_CREAT | __O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return openat(dirfd, path, flags | O_LARGEFILE, mode);
+}
+
+
+
+static ssize_t stream_read(void *cookie, char *buf, size_t size) {
+    return read((int) (intptr_t) cookie, buf, size);
+}
+
+
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+    ssize_t n = write((int) (intptr_t) cookie, buf, size);
+
+    // a stream takes 0 for an error
+    return n < 0 ? 0 : n;
+}
+
+
+
+static int stream_seek(void *cookie, off64_t *offset, int whence) {
+    off_t pos = lseek((int) (intptr_t) cookie, (off_t) *offset, whence);
+
+    if (pos < 0) {
+        return -1;
+    }
+    *offset = pos;
+    return 0;
+}
+
+
+
+static int stream_close(void *cookie) {
+    return close((int) (intptr_t) cookie);
+}
+
+
+
+/**
+ * @brief Flags of open for a mode of fopen
+ * @param const char* Mode of fopen
+ * @retval int The flags, -1 if the mode is wrong
+ */
+static int mode_flags(const char *mode) {
+    int flags;
+    const char *c;
+
+    if (mode[0] == 'r') {
+        flags = O_RDONLY;
+    } else if (mode[0] == 'w') {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (mode[0] == 'a') {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        return -1;
+    }
+    for (c = mode + 1; *c != '\0' && *c != ','; c++) {
+        if (*c == '+') {
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        } else if (*c == 'x') {
+            flags |= O_EXCL;
+        } else if (*c == 'e') {
+            flags |= O_CLOEXEC;
+        }
+    }
+    return flags;
+}
+
+
+
+SHIM FILE *fopen(const char *path, const char *mode) {
+    const char *p = sfs_path(path);
+    cookie_io_functions_t io = { stream_read, stream_write, stream_seek, stream_close };
+    int flags;
+    int fd;
+    FILE *stream;
+
+    if (p == NULL) {
+        return real_fopen(path, mode);
+    }
+    if ((flags = mode_flags(mode)) == -1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((fd = shim_open(p, flags)) == -1) {
+        return NULL;
+    }
+    stream = fopencookie((void *) (intptr_t) fd, mode, io);
+    if (stream == NULL) {
+        close(fd);
+    }
+    return stream;
+}
+
+
+
+SHIM FILE *fopen64(const char *path, const char *mode) {
+    return fopen(path, mode);
+}
+
+
+
+SHIM ssize_t read(int fd, void *buf, size_t count) {
+    preload_fd_t *f = shim_fd(fd);
+    int n;
+
+    if (f == NULL) {
+        return real_read(fd, buf, count);
+    }
+    if ((f->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    sfs_lock();
+    if (shim_seek(f) != 0) {
+        sfs_unlock();
+        return 0;
+    }
+    n = sfs_fread(f->file - 1, buf, count > INT_MAX ? INT_MAX : (int) count);
+    if (n < 0) {
+        files[f->file - 1].rwptr = -1;
+        sfs_unlock();
+        errno = EIO;
+        return -1;
+    }
+    f->pos += n;
+    files[f->file - 1].rwptr = f->pos;
+    sfs_unlock();
+    return n;
+}
+
+
+
+SHIM ssize_t write(int fd, const void *buf, size_t count) {
+    preload_fd_t *f = shim_fd(fd);
+    struct stat st;
+    int n;
+
+    if (f == NULL) {
+        return real_write(fd, buf, count);
+    }
+    if ((f->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    sfs_lock();
+    if ((f->flags & O_APPEND) && fill_stat(f->path, &st) == 0) {
+        f->pos = st.st_size;
+    }
+    if (shim_seek(f) != 0) {
+        sfs_unlock();
+        errno = EFBIG;
+        return -1;
+    }
+    n = sfs_fwrite(f->file - 1, buf, count > INT_MAX ? INT_MAX : (int) count);
+    if (n < 0 || (n == 0 && count > 0)) {
+        files[f->file - 1].rwptr = -1;
+        sfs_unlock();
+        errno = n < 0 ? EIO : ENOSPC;
+        return -1;
+    }
+    f->pos += n;
+    files[f->file - 1].rwptr = f->pos;
+    sfs_unlock();
+    return n;
+}
+
+
+
+SHIM off_t lseek(int fd, off_t offset, int whence) {
+    preload_fd_t *f = shim_fd(fd);
+    struct stat st;
+    off_t pos;
+
+    if (f == NULL) {
+        return real_lseek(fd, offset, whence);
+    }
+
+    sfs_lock();
+    if (whence == SEEK_SET) {
+        pos = offset;
+    } else if (whence == SEEK_CUR) {
+        pos = f->pos + offset;
+    } else if (whence == SEEK_END && fill_stat(f->path, &st) == 0) {
+        pos = st.st_size + offset;
+    } else {
+        pos = -1;
+    }
+    if (pos < 0) {
+        sfs_unlock();
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    sfs_unlock();
+    return pos;
+}
+
+
+
+SHIM off_t lseek64(int fd, off_t offset, int whence) {
+    return lseek(fd, offset, whence);
+}
+
+
+
+SHIM int close(int fd) {
+    preload_fd_t *f = shim_fd(fd);
+    int id;
+
+    if (f == NULL) {
+        return real_close(fd);
+    }
+
+    sfs_lock();
+    id = f->file - 1;
+    __atomic_store_n(&f->file, 0, __ATOMIC_RELEASE);
+    free(f->path);
+    f->path = NULL;
+    if (--files[id].refs == 0) {
+        sfs_fclose(id);
+    }
+    sfs_unlock();
+    return real_close(fd);
+}
+
+
+
+SHIM int stat(const char *path, struct stat *buf) {
+    const char *p = sfs_path(path);
+
+    if (p != NULL) {
+        return fill_stat(p, buf);
+    }
+    return real_stat(path, buf);
+}
+
+
+
+SHIM int fstat(int fd, struct stat *buf) {
+    preload_fd_t *f = shim_fd(fd);
+    int res;
+
+    if (f == NULL) {
+        return real_fstat(fd, buf);
+    }
+    sfs_lock();
+    res = fill_stat(f->path, buf);
+    sfs_unlock();
+    return res;
+}
+
+
+
+SHIM int stat64(const char *path, struct stat64 *buf) {
+    struct stat st;
+
+    if (sfs_path(path) == NULL) {
+        return real_stat64(path, buf);
+    }
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    copy_stat64(&st, buf);
+    return 0;
+}
+
+
+
+SHIM int fstat64(int fd, struct stat64 *buf) {
+    struct stat st;
+
+    if (shim_fd(fd) == NULL) {
+        return real_fstat64(fd, buf);
+    }
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    copy_stat64(&st, buf);
+    return 0;
+}
+
+
+
+SHIM int __xstat(int ver, const char *path, struct stat *buf) {
+    const char *p = sfs_path(path);
+
+    if (p != NULL) {
+        return fill_stat(p, buf);
+    }
+    return real_xstat(ver, path, buf);
+}
+
+
+
+SHIM int __fxstat(int ver, int fd, struct stat *buf) {
+    if (shim_fd(fd) != NULL) {
+        return fstat(fd, buf);
+    }
+    return real_fxstat(ver, fd, buf);
+}
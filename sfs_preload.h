@@ -0,0 +1,17 @@
+#ifndef _INCLUDE_SFS_PRELOAD_H_
+#define _INCLUDE_SFS_PRELOAD_H_
+
+/*
+ * Included first into every source of libsfs_preload.so (-include). The
+ * messages of the file system go to stderr, so that they never mix with
+ * the output of the program the shim runs in.
+ *
+ * stdio.h must be read before printf becomes a macro, and the shim needs
+ * the GNU declarations, so they are chosen here for every source.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+
+#define printf(...) fprintf(stderr, __VA_ARGS__)
+
+#endif //_INCLUDE_SFS_PRELOAD_H_
@@ -0,0 +1,306 @@
+/* sfs_replay.c
+ *
+ * Replay a trace recorded with SFS_TRACE=<file> against a fresh file
+ * system, either as fast as possible or with the timing of the original
+ * run, and report the throughput and latency distribution of every call.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "sfs_stats.h"
+#include "sfs_trace.h"
+
+/*
+ * samples  latency of every call, in nanoseconds
+ * count    number of samples
+ * room     number of samples that fit in the array
+ * bytes    bytes moved by all the calls
+ */
+typedef struct {
+    uint64_t *samples;
+    int count;
+    int room;
+    uint64_t bytes;
+} op_result_t;
+
+/* where the results go, the file system writes its messages to stdout */
+static FILE *report;
+
+
+
+/**
+ * @brief Compare two latency samples for qsort
+ */
+static int cmp_sample(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * @brief Add a latency sample to the result of an operation
+ * @param op_result_t* Result of the operation
+ * @param uint64_t Latency in nanoseconds
+ * @retval None
+ */
+static void result_add(op_result_t *r, uint64_t latency) {
+    if (r->count == r->room) {
+        r->room = r->room ? r->room * 2 : 1024;
+        r->samples = realloc(r->samples, sizeof(uint64_t) * r->room);
+        if (r->samples == NULL) {
+            fprintf(stderr, "ABORT: Out of memory!\n");
+            exit(-1);
+        }
+    }
+    r->samples[r->count++] = latency;
+}
+
+
+
+/**
+ * @brief Latency at a given percentile of sorted samples, in microseconds
+ */
+static double percentile(op_result_t *r, int pct) {
+    return r->samples[(r->count - 1) * pct / 100] / 1e3;
+}
+
+
+
+/**
+ * @brief Sleep until a point in time of the monotonic clock
+ * @param uint64_t Time to wake up, in nanoseconds
+ * @retval None
+ */
+static void sleep_until(uint64_t when) {
+    struct timespec ts;
+    ts.tv_sec = when / 1000000000ULL;
+    ts.tv_nsec = when % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+
+/**
+ * @brief Print how to use the replayer
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t] [-x speed] [-D device] trace_file\n", prog);
+    fprintf(stderr, "  -t        keep the timing of the original run\n");
+    fprintf(stderr, "  -x speed  with -t, replay this many times faster\n");
+    fprintf(stderr, "  -D device emulate a none, hdd, sata_ssd or nvme device\n");
+}
+
+
+
+/* The main replay program
+ */
+int main(int argc, char **argv) {
+    op_result_t results[STAT_NUM_OPS];
+    static int fd_map[INT16_MAX + 1];
+    char name[UINT8_MAX + 1];
+    char *buf = NULL;
+    uint32_t buf_len = 0;
+    sfs_dirent_t *ents = NULL;
+    uint32_t ents_len = 0;
+    int timed = 0;
+    double speed = 1.0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "tx:D:h")) != -1) {
+        switch (opt) {
+            case 't': timed = 1; break;
+            case 'x': speed = atof(optarg); break;
+            case 'D':
+                if (disk_set_profile(optarg) != 0) {
+                    return 1;
+                }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (fp == NULL || trace_read_header(fp) != 0) {
+        fprintf(stderr, "ABORT: %s is not a trace file\n", argv[optind]);
+        return 1;
+    }
+
+    // keep the file system chatter out of the report
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "ABORT: cannot redirect the output\n");
+        return 1;
+    }
+
+    memset(results, 0, sizeof(results));
+    for (i = 0; i <= INT16_MAX; i++) {
+        fd_map[i] = -1;
+    }
+
+    trace_rec_t rec;
+    uint64_t records = 0, mismatches = 0, skipped = 0;
+    uint64_t begin = stats_now();
+    int mounted = 0;
+
+    while (trace_read(fp, &rec, name)) {
+        records++;
+
+        // replay against a fresh file system if the trace does not make one
+        if (!mounted && rec.op != STAT_MKSFS) {
+            mksfs(1);
+            begin = stats_now();
+        }
+        mounted = 1;
+
+        if (timed) {
+            sleep_until(begin + (uint64_t) (rec.time_ns / speed));
+        }
+
+        if (rec.length > buf_len) {
+            buf = realloc(buf, rec.length);
+            if (buf == NULL) {
+                fprintf(stderr, "ABORT: Out of memory!\n");
+                return -1;
+            }
+            memset(buf + buf_len, 'x', rec.length - buf_len);
+            buf_len = rec.length;
+        }
+
+        int fd = rec.fd >= 0 && rec.fd <= INT16_MAX ? fd_map[rec.fd] : -1;
+        uint64_t start = stats_now();
+        int ret;
+
+        switch (rec.op) {
+            case STAT_MKSFS:
+                mksfs((int) rec.offset);
+                for (i = 0; i <= INT16_MAX; i++) {
+                    fd_map[i] = -1;
+                }
+                ret = 0;
+                break;
+            case STAT_GETNEXTFILENAME:
+                ret = sfs_getnextfilename(name);
+                break;
+            case STAT_GETFILESIZE:
+                ret = sfs_getfilesize(name);
+                break;
+            case STAT_FOPEN:
+                ret = sfs_fopen(name);
+                if (rec.ret >= 0 && rec.ret <= INT16_MAX) {
+                    fd_map[rec.ret] = ret;
+                }
+                break;
+            case STAT_FCLOSE:
+                ret = sfs_fclose(fd);
+                break;
+            case STAT_FREAD:
+                ret = sfs_fread(fd, buf, rec.length);
+                break;
+            case STAT_FWRITE:
+                ret = sfs_fwrite(fd, buf, rec.length);
+                break;
+            case STAT_FSEEK:
+                ret = sfs_fseek(fd, (int) rec.offset);
+                break;
+            case STAT_REMOVE:
+                ret = sfs_remove(name);
+                break;
+            case STAT_FSYNC:
+                ret = sfs_fsync(fd);
+                break;
+            case STAT_FTRUNCATE:
+                ret = sfs_ftruncate(fd, (int) rec.offset);
+                break;
+            case STAT_FALLOCATE:
+                ret = sfs_fallocate(fd, (int) rec.offset, rec.length);
+                break;
+            case STAT_MKDIR:
+                ret = sfs_mkdir(name);
+                break;
+            case STAT_RMDIR:
+                ret = sfs_rmdir(name);
+                break;
+            case STAT_STAT: {
+                sfs_stat_t attr;
+                ret = sfs_stat(name, &attr);
+                break;
+            }
+            case STAT_READDIR: {
+                char fname[MAXFILENAME + 1];
+                int cursor = (int) rec.offset;
+                ret = sfs_readdir(name, &cursor, fname);
+                break;
+            }
+            case STAT_READDIRPLUS: {
+                int cursor = (int) rec.offset;
+                if (rec.length > ents_len) {
+                    ents = realloc(ents, rec.length * sizeof(sfs_dirent_t));
+                    if (ents == NULL) {
+                        fprintf(stderr, "ABORT: Out of memory!\n");
+                        return -1;
+                    }
+                    ents_len = rec.length;
+                }
+                ret = sfs_readdirplus(name, &cursor, ents, (int) rec.length);
+                break;
+            }
+            default:
+                skipped++;
+                continue;
+        }
+
+        op_result_t *r = &results[rec.op];
+        result_add(r, stats_now() - start);
+        if ((rec.op == STAT_FREAD || rec.op == STAT_FWRITE) && ret > 0) {
+            r->bytes += ret;
+        }
+
+        // file IDs may differ from the original run, the other results may not
+        if (rec.op != STAT_FOPEN && ret != rec.ret) {
+            mismatches++;
+        } else if (rec.op == STAT_FOPEN && (ret < 0) != (rec.ret < 0)) {
+            mismatches++;
+        }
+    }
+
+    double seconds = (stats_now() - begin) / 1e9;
+    uint64_t total_ops = 0, total_bytes = 0;
+
+    fprintf(report, "%-16s %10s %12s %12s %10s %10s %10s %10s\n", "op", "ops", "ops/s",
+            "MiB/s", "p50_us", "p90_us", "p99_us", "max_us");
+    for (i = 0; i < STAT_NUM_OPS; i++) {
+        op_result_t *r = &results[i];
+        if (r->count == 0) {
+            continue;
+        }
+        qsort(r->samples, r->count, sizeof(uint64_t), cmp_sample);
+        fprintf(report, "%-16s %10d %12.1f %12.2f %10.1f %10.1f %10.1f %10.1f\n", stats_op_name(i),
+                r->count, r->count / seconds, r->bytes / seconds / (1024 * 1024),
+                percentile(r, 50), percentile(r, 90), percentile(r, 99), percentile(r, 100));
+        total_ops += r->count;
+        total_bytes += r->bytes;
+        free(r->samples);
+    }
+    fprintf(report, "%-16s %10llu %12.1f %12.2f\n", "total", (unsigned long long) total_ops,
+            total_ops / seconds, total_bytes / seconds / (1024 * 1024));
+    fprintf(report, "records %llu, replayed in %.3f s, %llu results differ from the trace, "
+            "%llu skipped\n", (unsigned long long) records, seconds,
+            (unsigned long long) mismatches, (unsigned long long) skipped);
+
+    fclose(fp);
+    fclose(report);
+    free(buf);
+    free(ents);
+    return 0;
+}
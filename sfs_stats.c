@@ -0,0 +1,423 @@
+
+// counters and latency histograms for the simple file system
+
+#include "sfs_stats.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/*
+ * count    number of samples
+ * sum      sum of all the samples
+ * buckets  bucket i counts the samples v with 2^i <= v+1 < 2^(i+1)
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_BUCKETS];
+} histogram_t;
+
+/*
+ * calls    number of calls
+ * errors   number of calls that returned a negative value
+ * bytes    bytes moved by the calls
+ * latency  latency of the calls in nanoseconds
+ * blocks   blocks read or written per call
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    histogram_t latency;
+    histogram_t blocks;
+} op_stats_t;
+
+
+/* globals */
+static op_stats_t op_stats[STAT_NUM_OPS];
+static histogram_t bitmap_scan;
+static histogram_t seek_distance;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+static uint64_t dcache_hits;
+static uint64_t dcache_misses;
+static uint64_t writeback_blocks;
+static uint64_t write_throttles;
+static uint64_t dirty_blocks;
+static uint64_t disk_retries;
+static uint64_t disk_errors;
+static uint64_t metadata_faults;
+static uint64_t mount_checks;
+static uint64_t mount_repairs;
+static uint64_t checksum_checks;
+static uint64_t checksum_errors;
+static uint64_t compress_raw_bytes;
+static uint64_t compress_stored_bytes;
+
+// blocks read or written by the current thread, see stats_begin
+static __thread uint64_t thread_blocks;
+
+static const char *stats_op_names[STAT_NUM_OPS] = {
+    "mksfs",
+    "getnextfilename",
+    "getfilesize",
+    "fopen",
+    "fclose",
+    "fread",
+    "fwrite",
+    "fseek",
+    "remove",
+    "fsync",
+    "ftruncate",
+    "fallocate",
+    "mkdir",
+    "rmdir",
+    "stat",
+    "readdir",
+    "readdirplus",
+    "read_blocks",
+    "write_blocks",
+};
+
+/* macros */
+#define STAT_ADD(_counter, _value) \
+    __atomic_fetch_add(&(_counter), (_value), __ATOMIC_RELAXED)
+
+#define STAT_GET(_counter) \
+    __atomic_load_n(&(_counter), __ATOMIC_RELAXED)
+
+
+
+/**
+ * @brief Add a sample to a histogram
+ * @param histogram_t* Histogram to update
+ * @param uint64_t Value of the sample
+ * @retval None
+ */
+static void histogram_add(histogram_t *h, uint64_t value) {
+
+    // bucket of value+1 so that a zero sample lands in the first bucket
+    int bucket = 63 - __builtin_clzll(value + 1);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, value);
+    STAT_ADD(h->buckets[bucket], 1);
+}
+
+
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+
+stats_ctx_t stats_begin(void) {
+    stats_ctx_t ctx;
+    ctx.start_ns = stats_now();
+    ctx.blocks = thread_blocks;
+    return ctx;
+}
+
+
+
+void stats_end(stat_op_t op, const stats_ctx_t *ctx, int ret, uint64_t bytes) {
+    op_stats_t *s = &op_stats[op];
+
+    STAT_ADD(s->calls, 1);
+    if (ret < 0) {
+        STAT_ADD(s->errors, 1);
+    }
+    STAT_ADD(s->bytes, bytes);
+    histogram_add(&s->latency, stats_now() - ctx->start_ns);
+    histogram_add(&s->blocks, thread_blocks - ctx->blocks);
+}
+
+
+
+void stats_blocks(int nblocks) {
+    if (nblocks > 0) {
+        thread_blocks += nblocks;
+    }
+}
+
+
+
+void stats_bitmap_scan(uint64_t len) {
+    histogram_add(&bitmap_scan, len);
+}
+
+
+
+void stats_seek(uint64_t distance) {
+    histogram_add(&seek_distance, distance);
+}
+
+
+
+void stats_disk_failures(int failures, int gave_up) {
+    if (gave_up) {
+        STAT_ADD(disk_errors, 1);
+        failures--;
+    }
+    STAT_ADD(disk_retries, failures);
+}
+
+
+
+void stats_metadata_faults(int nblocks) {
+    STAT_ADD(metadata_faults, nblocks);
+}
+
+
+
+void stats_mount_check(int repairs) {
+    STAT_ADD(mount_checks, 1);
+    STAT_ADD(mount_repairs, repairs);
+}
+
+
+
+void stats_checksums(int nblocks, int errors) {
+    STAT_ADD(checksum_checks, nblocks);
+    STAT_ADD(checksum_errors, errors);
+}
+
+
+
+void stats_compression(uint64_t raw, uint64_t stored) {
+    STAT_ADD(compress_raw_bytes, raw);
+    STAT_ADD(compress_stored_bytes, stored);
+}
+
+
+
+void stats_dcache(int hit) {
+    if (hit) {
+        STAT_ADD(dcache_hits, 1);
+    } else {
+        STAT_ADD(dcache_misses, 1);
+    }
+}
+
+
+
+void stats_cache(int hit) {
+    if (hit) {
+        STAT_ADD(cache_hits, 1);
+    } else {
+        STAT_ADD(cache_misses, 1);
+    }
+}
+
+
+
+void stats_writeback(int nblocks, int throttled) {
+    STAT_ADD(writeback_blocks, nblocks);
+    if (throttled) {
+        STAT_ADD(write_throttles, 1);
+    }
+}
+
+
+
+void stats_dirty(uint64_t nblocks) {
+    __atomic_store_n(&dirty_blocks, nblocks, __ATOMIC_RELAXED);
+}
+
+
+
+const char *stats_op_name(stat_op_t op) {
+    return stats_op_names[op];
+}
+
+
+
+void stats_reset(void) {
+    memset(op_stats, 0, sizeof(op_stats));
+    memset(&bitmap_scan, 0, sizeof(bitmap_scan));
+    memset(&seek_distance, 0, sizeof(seek_distance));
+    cache_hits = 0;
+    cache_misses = 0;
+    dcache_hits = 0;
+    dcache_misses = 0;
+    writeback_blocks = 0;
+    write_throttles = 0;
+    disk_retries = 0;
+    disk_errors = 0;
+    metadata_faults = 0;
+    mount_checks = 0;
+    mount_repairs = 0;
+    checksum_checks = 0;
+    checksum_errors = 0;
+    compress_raw_bytes = 0;
+    compress_stored_bytes = 0;
+}
+
+
+
+/**
+ * @brief snprintf at the end of a report, keeping track of the full length
+ * @param char* Output buffer
+ * @param size_t Size of the output buffer
+ * @param int* Length of the report so far, updated
+ * @retval None
+ */
+static void render_append(char *buf, size_t len, int *off, const char *fmt, ...) {
+    va_list ap;
+    char *dst = NULL;
+    size_t room = 0;
+
+    if (buf != NULL && (size_t) *off < len) {
+        dst = buf + *off;
+        room = len - *off;
+    }
+
+    va_start(ap, fmt);
+    int n = vsnprintf(dst, room, fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        *off += n;
+    }
+}
+
+
+
+/**
+ * @brief Render a histogram as cumulative Prometheus buckets
+ * @param char* Output buffer
+ * @param size_t Size of the output buffer
+ * @param int* Length of the report so far, updated
+ * @param const char* Metric name
+ * @param const char* Labels of the metric, may be empty
+ * @param histogram_t* Histogram to render
+ * @retval None
+ */
+static void render_histogram(char *buf, size_t len, int *off, const char *name,
+                             const char *labels, histogram_t *h) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+        cumulative += STAT_GET(h->buckets[i]);
+        render_append(buf, len, off, "%s_bucket{%s%sle=\"%llu\"} %llu\n", name, labels, sep,
+                      (unsigned long long) ((2ULL << i) - 2), (unsigned long long) cumulative);
+    }
+    cumulative += STAT_GET(h->buckets[STATS_BUCKETS - 1]);
+    render_append(buf, len, off, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+                  (unsigned long long) cumulative);
+    render_append(buf, len, off, "%s_sum%s%s%s %llu\n", name, sep[0] ? "{" : "", labels,
+                  sep[0] ? "}" : "", (unsigned long long) STAT_GET(h->sum));
+    render_append(buf, len, off, "%s_count%s%s%s %llu\n", name, sep[0] ? "{" : "", labels,
+                  sep[0] ? "}" : "", (unsigned long long) STAT_GET(h->count));
+}
+
+
+
+int stats_render(char *buf, size_t len) {
+    char labels[64];
+    int off = 0;
+    int op;
+
+    if (buf != NULL && len > 0) {
+        buf[0] = '\0';
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_op_calls_total counter\n");
+    for (op = 0; op < STAT_NUM_OPS; op++) {
+        render_append(buf, len, &off, "sfs_op_calls_total{op=\"%s\"} %llu\n", stats_op_names[op],
+                      (unsigned long long) STAT_GET(op_stats[op].calls));
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_op_errors_total counter\n");
+    for (op = 0; op < STAT_NUM_OPS; op++) {
+        render_append(buf, len, &off, "sfs_op_errors_total{op=\"%s\"} %llu\n", stats_op_names[op],
+                      (unsigned long long) STAT_GET(op_stats[op].errors));
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_op_bytes_total counter\n");
+    for (op = 0; op < STAT_NUM_OPS; op++) {
+        render_append(buf, len, &off, "sfs_op_bytes_total{op=\"%s\"} %llu\n", stats_op_names[op],
+                      (unsigned long long) STAT_GET(op_stats[op].bytes));
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_op_latency_ns histogram\n");
+    for (op = 0; op < STAT_NUM_OPS; op++) {
+        snprintf(labels, sizeof(labels), "op=\"%s\"", stats_op_names[op]);
+        render_histogram(buf, len, &off, "sfs_op_latency_ns", labels, &op_stats[op].latency);
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_op_blocks histogram\n");
+    for (op = 0; op < STAT_NUM_OPS; op++) {
+        snprintf(labels, sizeof(labels), "op=\"%s\"", stats_op_names[op]);
+        render_histogram(buf, len, &off, "sfs_op_blocks", labels, &op_stats[op].blocks);
+    }
+
+    render_append(buf, len, &off, "# TYPE sfs_bitmap_scan_bytes histogram\n");
+    render_histogram(buf, len, &off, "sfs_bitmap_scan_bytes", "", &bitmap_scan);
+
+    render_append(buf, len, &off, "# TYPE sfs_seek_blocks histogram\n");
+    render_histogram(buf, len, &off, "sfs_seek_blocks", "", &seek_distance);
+
+    render_append(buf, len, &off, "# TYPE sfs_disk_retries_total counter\n");
+    render_append(buf, len, &off, "sfs_disk_retries_total %llu\n",
+                  (unsigned long long) STAT_GET(disk_retries));
+    render_append(buf, len, &off, "# TYPE sfs_disk_errors_total counter\n");
+    render_append(buf, len, &off, "sfs_disk_errors_total %llu\n",
+                  (unsigned long long) STAT_GET(disk_errors));
+
+    render_append(buf, len, &off, "# TYPE sfs_metadata_faults_total counter\n");
+    render_append(buf, len, &off, "sfs_metadata_faults_total %llu\n",
+                  (unsigned long long) STAT_GET(metadata_faults));
+    render_append(buf, len, &off, "# TYPE sfs_mount_checks_total counter\n");
+    render_append(buf, len, &off, "sfs_mount_checks_total %llu\n",
+                  (unsigned long long) STAT_GET(mount_checks));
+    render_append(buf, len, &off, "# TYPE sfs_mount_repairs_total counter\n");
+    render_append(buf, len, &off, "sfs_mount_repairs_total %llu\n",
+                  (unsigned long long) STAT_GET(mount_repairs));
+    render_append(buf, len, &off, "# TYPE sfs_checksum_checks_total counter\n");
+    render_append(buf, len, &off, "sfs_checksum_checks_total %llu\n",
+                  (unsigned long long) STAT_GET(checksum_checks));
+    render_append(buf, len, &off, "# TYPE sfs_checksum_errors_total counter\n");
+    render_append(buf, len, &off, "sfs_checksum_errors_total %llu\n",
+                  (unsigned long long) STAT_GET(checksum_errors));
+    render_append(buf, len, &off, "# TYPE sfs_compress_raw_bytes_total counter\n");
+    render_append(buf, len, &off, "sfs_compress_raw_bytes_total %llu\n",
+                  (unsigned long long) STAT_GET(compress_raw_bytes));
+    render_append(buf, len, &off, "# TYPE sfs_compress_stored_bytes_total counter\n");
+    render_append(buf, len, &off, "sfs_compress_stored_bytes_total %llu\n",
+                  (unsigned long long) STAT_GET(compress_stored_bytes));
+
+    render_append(buf, len, &off, "# TYPE sfs_cache_hits_total counter\n");
+    render_append(buf, len, &off, "sfs_cache_hits_total %llu\n",
+                  (unsigned long long) STAT_GET(cache_hits));
+    render_append(buf, len, &off, "# TYPE sfs_cache_misses_total counter\n");
+    render_append(buf, len, &off, "sfs_cache_misses_total %llu\n",
+                  (unsigned long long) STAT_GET(cache_misses));
+    render_append(buf, len, &off, "# TYPE sfs_dcache_hits_total counter\n");
+    render_append(buf, len, &off, "sfs_dcache_hits_total %llu\n",
+                  (unsigned long long) STAT_GET(dcache_hits));
+    render_append(buf, len, &off, "# TYPE sfs_dcache_misses_total counter\n");
+    render_append(buf, len, &off, "sfs_dcache_misses_total %llu\n",
+                  (unsigned long long) STAT_GET(dcache_misses));
+    render_append(buf, len, &off, "# TYPE sfs_writeback_blocks_total counter\n");
+    render_append(buf, len, &off, "sfs_writeback_blocks_total %llu\n",
+                  (unsigned long long) STAT_GET(writeback_blocks));
+    render_append(buf, len, &off, "# TYPE sfs_write_throttles_total counter\n");
+    render_append(buf, len, &off, "sfs_write_throttles_total %llu\n",
+                  (unsigned long long) STAT_GET(write_throttles));
+    render_append(buf, len, &off, "# TYPE sfs_cache_dirty_blocks gauge\n");
+    render_append(buf, len, &off, "sfs_cache_dirty_blocks %llu\n",
+                  (unsigned long long) STAT_GET(dirty_blocks));
+
+    return off;
+}
@@ -0,0 +1,168 @@
+#ifndef _INCLUDE_SFS_STATS_H_
+#define _INCLUDE_SFS_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* name of the virtual file serving the statistics through FUSE */
+#define SFS_STATS_PATH "/.sfs_stats"
+
+/* number of log2 buckets in every histogram */
+#define STATS_BUCKETS 32
+
+/*
+ * Operations that are timed and counted.
+ * Keep stats_op_names in sfs_stats.c in the same order.
+ */
+typedef enum {
+    STAT_MKSFS,
+    STAT_GETNEXTFILENAME,
+    STAT_GETFILESIZE,
+    STAT_FOPEN,
+    STAT_FCLOSE,
+    STAT_FREAD,
+    STAT_FWRITE,
+    STAT_FSEEK,
+    STAT_REMOVE,
+    STAT_FSYNC,
+    STAT_FTRUNCATE,
+    STAT_FALLOCATE,
+    STAT_MKDIR,
+    STAT_RMDIR,
+    STAT_STAT,
+    STAT_READDIR,
+    STAT_READDIRPLUS,
+    STAT_READ_BLOCKS,
+    STAT_WRITE_BLOCKS,
+    STAT_NUM_OPS
+} stat_op_t;
+
+/*
+ * start_ns     when the operation started
+ * blocks       blocks touched by this thread when the operation started
+ */
+typedef struct {
+    uint64_t start_ns;
+    uint64_t blocks;
+} stats_ctx_t;
+
+/*
+ * @short current time of the monotonic clock in nanoseconds
+ */
+uint64_t stats_now(void);
+
+/*
+ * @short start timing an operation
+ * @return context to hand back to stats_end
+ */
+stats_ctx_t stats_begin(void);
+
+/*
+ * @short account for a finished operation
+ * @long Records the latency, the number of blocks read or written since
+ *       stats_begin and, when ret is negative, an error.
+ *
+ * @param op     which operation finished
+ * @param ctx    context returned by stats_begin
+ * @param ret    return value of the operation
+ * @param bytes  bytes moved by the operation
+ */
+void stats_end(stat_op_t op, const stats_ctx_t *ctx, int ret, uint64_t bytes);
+
+/*
+ * @short count blocks read or written by the calling thread
+ * @param nblocks number of blocks
+ */
+void stats_blocks(int nblocks);
+
+/*
+ * @short record how many bitmap bytes get_index had to scan
+ * @param len number of bytes scanned
+ */
+void stats_bitmap_scan(uint64_t len);
+
+/*
+ * @short record how far the emulated disk head moved for a request
+ * @param distance number of blocks between the head and the request
+ */
+void stats_seek(uint64_t distance);
+
+/*
+ * @short record the transient failures the emulated disk injected in a request
+ * @param failures  failed attempts
+ * @param gave_up   non zero if the request failed after its retries
+ */
+void stats_disk_failures(int failures, int gave_up);
+
+/*
+ * @short record a lookup of a name in the dentry cache
+ * @param hit non zero if the cache knew the name, or knew it is missing
+ */
+void stats_dcache(int hit);
+
+/*
+ * @short record a block cache lookup
+ * @param hit non zero if the block was found in the cache
+ */
+void stats_cache(int hit);
+
+/*
+ * @short record a writeback of dirty cache blocks
+ * @param nblocks    blocks written back
+ * @param throttled  non zero if a writer had to wait for it
+ */
+void stats_writeback(int nblocks, int throttled);
+
+/*
+ * @short record the number of dirty blocks in the cache
+ */
+void stats_dirty(uint64_t nblocks);
+
+/*
+ * @short record blocks of the inode, directory or bitmap tables read on first use
+ * @param nblocks number of blocks
+ */
+void stats_metadata_faults(int nblocks);
+
+/*
+ * @short record the check of a volume that was not unmounted cleanly
+ * @param repairs number of problems fixed
+ */
+void stats_mount_check(int repairs);
+
+/*
+ * @short record blocks read from the disk and checked against their checksums
+ * @param nblocks number of blocks
+ * @param errors  number of them that did not match
+ */
+void stats_checksums(int nblocks, int errors);
+
+/*
+ * @short record a chunk of a compressed file stored on the disk
+ * @param raw     bytes of the chunk
+ * @param stored  bytes of the blocks it takes
+ */
+void stats_compression(uint64_t raw, uint64_t stored);
+
+/*
+ * @short name of an operation, as it appears in the report
+ */
+const char *stats_op_name(stat_op_t op);
+
+/*
+ * @short reset every counter and histogram to zero
+ */
+void stats_reset(void);
+
+/*
+ * @short render the statistics in the Prometheus text format
+ * @long Behaves like snprintf: at most len bytes are written to buf and the
+ *       full length of the report is returned. Pass a NULL buffer to size it.
+ *
+ * @param buf  output buffer
+ * @param len  size of the output buffer
+ * @return length of the full report
+ */
+int stats_render(char *buf, size_t len);
+
+#endif //_INCLUDE_SFS_STATS_H_
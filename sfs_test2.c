@@ -5,8 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "sfs_api.h"
+#include "sfs_stats.h"
 
 /* The maximum file name length. We assume that filenames can contain
  * upper-case letters and periods ('.') characters. Feel free to
@@ -59,6 +61,186 @@ char *rand_name()
   return (strdup(fname));
 }
 
+/* fill_pattern() - fill a buffer with bytes that depend on their offset
+ * and on a seed, so that two files or two writes never look alike.
+ */
+
+void fill_pattern(char *buf, int len, int offset, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (char) ((offset + i) * 7 + seed);
+  }
+}
+
+/* write_at() - write a buffer to a file at an offset, counting the
+ * errors.
+ */
+
+int write_at(int fd, int offset, char *buf, int len)
+{
+  int tmp;
+
+  if (sfs_fseek(fd, offset) != 0) {
+    fprintf(stderr, "ERROR: seeking to %d\n", offset);
+    return 1;
+  }
+  tmp = sfs_fwrite(fd, buf, len);
+  if (tmp != len) {
+    fprintf(stderr, "ERROR: Tried to write %d bytes at %d, but wrote %d\n",
+            len, offset, tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/* check_file() - check the size and the whole content of a file against
+ * what was written to it, returning the number of errors.
+ */
+
+int check_file(char *name, char *expect, int size)
+{
+  char *buf;
+  int fd, tmp, i;
+  int errors = 0;
+
+  tmp = sfs_getfilesize(name);
+  if (tmp != size) {
+    fprintf(stderr, "ERROR: mismatch file size of %s %d, %d\n", name, size, tmp);
+    return 1;
+  }
+  fd = sfs_fopen(name);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: can't re-open file %s\n", name);
+    return 1;
+  }
+  if ((buf = malloc(size + 1)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  sfs_fseek(fd, 0);
+  tmp = sfs_fread(fd, buf, size + 1);
+  if (tmp != size) {
+    fprintf(stderr, "ERROR: Requested %d bytes of %s, read %d\n", size + 1, name, tmp);
+    errors++;
+  }
+  for (i = 0; i < size && i < tmp; i++) {
+    if (buf[i] != expect[i]) {
+      fprintf(stderr, "ERROR: Wrong byte in %s at %d (%d,%d)\n",
+              name, i, buf[i], expect[i]);
+      errors++;
+      break;
+    }
+  }
+  free(buf);
+  sfs_fclose(fd);
+  return errors;
+}
+
+/* read_superblock() - read the super block of an image as it is on the
+ * disk, returning the number of errors.
+ */
+
+int read_superblock(char *image, superblock_t *sb)
+{
+  FILE *f = fopen(image, "rb");
+  int ok = f != NULL && fread(sb, sizeof(superblock_t), 1, f) == 1;
+
+  if (f != NULL) {
+    fclose(f);
+  }
+  if (!ok) {
+    fprintf(stderr, "ERROR: reading the super block of %s\n", image);
+    return 1;
+  }
+  return 0;
+}
+
+/* copy_image() - copy an image as it is on the disk, as a crash would
+ * leave it, returning the number of errors.
+ */
+
+int copy_image(char *from, char *to)
+{
+  FILE *in = fopen(from, "rb");
+  FILE *out = fopen(to, "wb");
+  char buf[4096];
+  size_t len;
+  int errors = in == NULL || out == NULL;
+
+  while (!errors && (len = fread(buf, 1, sizeof(buf), in)) > 0) {
+    errors = fwrite(buf, 1, len, out) != len;
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL && fclose(out) != 0) {
+    errors = 1;
+  }
+  if (errors) {
+    fprintf(stderr, "ERROR: copying %s to %s\n", from, to);
+  }
+  return errors;
+}
+
+/* mount_checks() - number of mounts that checked their whole volume so
+ * far, as the stats report tells.
+ */
+
+long mount_checks()
+{
+  int len = stats_render(NULL, 0) + 4096;
+  char *report = malloc(len);
+  char *line;
+  long checks = -1;
+
+  if (report == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  stats_render(report, len);
+  line = strstr(report, "\nsfs_mount_checks_total ");
+  if (line != NULL) {
+    sscanf(line, "\nsfs_mount_checks_total %ld", &checks);
+  }
+  free(report);
+  return checks;
+}
+
+/* volume_writer() - make a file system on the image of a volume from a
+ * thread of its own and write files there that no other volume has.
+ */
+
+struct volume_job {
+  sfs_t *vol;
+  char *image;
+  int seed;
+  int errors;
+};
+
+void *volume_writer(void *arg)
+{
+  struct volume_job *job = arg;
+  char data[6000];
+  int fd, i;
+
+  sfs_use(job->vol);
+  sfs_set_image(job->image);
+  mksfs(1);
+  fill_pattern(data, sizeof(data), 0, job->seed);
+  fd = sfs_fopen("/shared");
+  for (i = 0; i < 6; i++) {
+    job->errors += write_at(fd, i * 1000, data + i * 1000, 1000);
+  }
+  sfs_fclose(fd);
+  fd = sfs_fopen(job->seed == 1 ? "/only.one" : "/only.two");
+  job->errors += write_at(fd, 0, data, 500);
+  sfs_fclose(fd);
+  sfs_use(NULL);
+  return NULL;
+}
+
 /* The main testing program
  */
 int
@@ -428,6 +610,480 @@ main(int argc, char **argv)
 	  error_count++;
   }
  
+
+  /* Files of up to 100 bytes live in their inode: check both sides of
+   * the limit, and a file growing past it, across a remount.
+   */
+  {
+  char data[200];
+
+  fill_pattern(data, sizeof(data), 0, 1);
+  fds[0] = sfs_fopen("inline.100");
+  fds[1] = sfs_fopen("inline.101");
+  fds[2] = sfs_fopen("inline.grow");
+  error_count += write_at(fds[0], 0, data, 100);
+  error_count += write_at(fds[1], 0, data, 101);
+  error_count += write_at(fds[2], 0, data, 100);
+  for (i = 0; i < 3; i++) {
+    sfs_fclose(fds[i]);
+  }
+  mksfs(0);
+  error_count += check_file("inline.100", data, 100);
+  error_count += check_file("inline.101", data, 101);
+  error_count += check_file("inline.grow", data, 100);
+
+  fds[2] = sfs_fopen("inline.grow");
+  error_count += write_at(fds[2], 100, data + 100, 60);
+  sfs_fclose(fds[2]);
+  mksfs(0);
+  error_count += check_file("inline.grow", data, 160);
+  sfs_remove("inline.100");
+  sfs_remove("inline.101");
+  sfs_remove("inline.grow");
+  }
+
+
+  /* Files of up to half a block share packed blocks: grow the middle one
+   * out of the shared block and check that its neighbours are untouched.
+   */
+  {
+  char data[3][3000];
+
+  for (i = 0; i < 3; i++) {
+    fill_pattern(data[i], sizeof(data[i]), 0, 10 + i);
+  }
+  fds[0] = sfs_fopen("packed.a");
+  fds[1] = sfs_fopen("packed.b");
+  fds[2] = sfs_fopen("packed.c");
+  for (i = 0; i < 3; i++) {
+    error_count += write_at(fds[i], 0, data[i], 300);
+    sfs_fclose(fds[i]);
+  }
+  mksfs(0);
+  error_count += check_file("packed.a", data[0], 300);
+  error_count += check_file("packed.b", data[1], 300);
+  error_count += check_file("packed.c", data[2], 300);
+
+  fds[1] = sfs_fopen("packed.b");
+  error_count += write_at(fds[1], 300, data[1] + 300, 200);
+  error_count += write_at(fds[1], 500, data[1] + 500, 2500);
+  sfs_fclose(fds[1]);
+  mksfs(0);
+  error_count += check_file("packed.a", data[0], 300);
+  error_count += check_file("packed.b", data[1], 3000);
+  error_count += check_file("packed.c", data[2], 300);
+  sfs_remove("packed.a");
+  sfs_remove("packed.b");
+  sfs_remove("packed.c");
+  }
+
+
+  /* Compressed files are stored a chunk of 8 blocks at a time: rewrite
+   * the middle of a chunk already on the disk and read it all back.
+   */
+  {
+  char *data;
+
+  if ((data = malloc(24576)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  fill_pattern(data, 24576, 0, 20);
+  sfs_set_compression(1);
+  fds[0] = sfs_fopen("compressed");
+  error_count += write_at(fds[0], 0, data, 24576);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("compressed", data, 24576);
+
+  for (i = 10000; i < 13000; i++) {
+    data[i] = (char) rand();
+  }
+  fds[0] = sfs_fopen("compressed");
+  error_count += write_at(fds[0], 10000, data + 10000, 3000);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("compressed", data, 24576);
+  sfs_set_compression(0);
+  sfs_remove("compressed");
+  free(data);
+  }
+
+
+  /* Deduplicated files point to the same blocks: write a shared block
+   * through one of its files, the other one must keep its content.
+   */
+  {
+  char first[4096], second[4096];
+
+  fill_pattern(first, sizeof(first), 0, 30);
+  memcpy(second, first, sizeof(second));
+  sfs_set_dedup(1);
+  fds[0] = sfs_fopen("dedup.a");
+  fds[1] = sfs_fopen("dedup.b");
+  error_count += write_at(fds[0], 0, first, 4096);
+  error_count += write_at(fds[1], 0, second, 4096);
+  sfs_fclose(fds[0]);
+  sfs_fclose(fds[1]);
+  mksfs(0);
+  error_count += check_file("dedup.a", first, 4096);
+  error_count += check_file("dedup.b", second, 4096);
+
+  fill_pattern(second + 1124, 50, 0, 31);
+  fds[1] = sfs_fopen("dedup.b");
+  error_count += write_at(fds[1], 1124, second + 1124, 50);
+  sfs_fclose(fds[1]);
+  mksfs(0);
+  error_count += check_file("dedup.a", first, 4096);
+  error_count += check_file("dedup.b", second, 4096);
+  sfs_set_dedup(0);
+  sfs_remove("dedup.a");
+  error_count += check_file("dedup.b", second, 4096);
+  sfs_remove("dedup.b");
+  }
+
+
+  /* Holes read back as zeros: a write far past the end, and a whole
+   * block of zeros written over data with sparse writes on.
+   */
+  {
+  char *data;
+
+  if ((data = calloc(21 * 1024, 1)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  fill_pattern(data, 6 * 1024, 0, 40);
+  fill_pattern(data + 20 * 1024, 1024, 20 * 1024, 40);
+  sfs_set_sparse(1);
+  fds[0] = sfs_fopen("sparse");
+  error_count += write_at(fds[0], 0, data, 6 * 1024);
+  error_count += write_at(fds[0], 20 * 1024, data + 20 * 1024, 1024);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("sparse", data, 21 * 1024);
+
+  memset(data + 2 * 1024, 0, 1024);
+  fds[0] = sfs_fopen("sparse");
+  error_count += write_at(fds[0], 2 * 1024, data + 2 * 1024, 1024);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("sparse", data, 21 * 1024);
+  sfs_set_sparse(0);
+  sfs_remove("sparse");
+  free(data);
+  }
+
+
+  /* Truncate a file into a hole, then extend it again: the part cut off
+   * must read back as zeros.
+   */
+  {
+  char *data;
+
+  if ((data = calloc(16 * 1024, 1)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  fill_pattern(data, 4 * 1024, 0, 50);
+  fill_pattern(data + 10 * 1024, 5 * 1024, 10 * 1024, 50);
+  fds[0] = sfs_fopen("truncated");
+  error_count += write_at(fds[0], 0, data, 4 * 1024);
+  error_count += write_at(fds[0], 10 * 1024, data + 10 * 1024, 5 * 1024);
+  if (sfs_ftruncate(fds[0], 6 * 1024 + 300) != 0) {
+    fprintf(stderr, "ERROR: truncating into a hole\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("truncated", data, 6 * 1024 + 300);
+
+  memset(data + 6 * 1024 + 300, 0, 10 * 1024 - 300);
+  fill_pattern(data + 14000, 200, 14000, 51);
+  fds[0] = sfs_fopen("truncated");
+  if (sfs_ftruncate(fds[0], 12000) != 0) {
+    fprintf(stderr, "ERROR: extending a file\n");
+    error_count++;
+  }
+  error_count += write_at(fds[0], 14000, data + 14000, 200);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("truncated", data, 14200);
+  sfs_remove("truncated");
+  free(data);
+  }
+
+
+  /* Preallocated blocks read as zeros until they are written, and a
+   * partial write into one of them leaves zeros around it.
+   */
+  {
+  char data[10000];
+
+  memset(data, 0, sizeof(data));
+  fill_pattern(data, 50, 0, 60);
+  fds[0] = sfs_fopen("allocated");
+  error_count += write_at(fds[0], 0, data, 50);
+  if (sfs_fallocate(fds[0], 0, 10000) != 0) {
+    fprintf(stderr, "ERROR: preallocating 10000 bytes\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("allocated", data, 10000);
+
+  fill_pattern(data + 5000, 10, 5000, 61);
+  fds[0] = sfs_fopen("allocated");
+  error_count += write_at(fds[0], 5000, data + 5000, 10);
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  error_count += check_file("allocated", data, 10000);
+  sfs_remove("allocated");
+  }
+
+
+  /* Directories: a file two levels down survives a remount, and a
+   * directory that is not empty cannot be removed.
+   */
+  {
+  char data[2000];
+  sfs_stat_t attr;
+
+  fill_pattern(data, sizeof(data), 0, 70);
+  if (sfs_mkdir("/outer") != 0 || sfs_mkdir("/outer/inner") != 0) {
+    fprintf(stderr, "ERROR: making directories\n");
+    error_count++;
+  }
+  fds[0] = sfs_fopen("/outer/inner/file");
+  error_count += write_at(fds[0], 0, data, 2000);
+  sfs_fclose(fds[0]);
+  if (sfs_rmdir("/outer") == 0 || sfs_rmdir("/outer/inner") == 0) {
+    fprintf(stderr, "ERROR: removed a directory that is not empty\n");
+    error_count++;
+  }
+  mksfs(0);
+  error_count += check_file("/outer/inner/file", data, 2000);
+  if (sfs_stat("/outer/inner", &attr) != 0 || !attr.dir) {
+    fprintf(stderr, "ERROR: /outer/inner is not a directory after remount\n");
+    error_count++;
+  }
+  if (sfs_rmdir("/outer/inner") == 0) {
+    fprintf(stderr, "ERROR: removed a directory that is not empty\n");
+    error_count++;
+  }
+
+  sfs_remove("/outer/inner/file");
+  if (sfs_rmdir("/outer/inner") != 0 || sfs_rmdir("/outer") != 0) {
+    fprintf(stderr, "ERROR: removing empty directories\n");
+    error_count++;
+  }
+  mksfs(0);
+  if (sfs_stat("/outer", &attr) == 0) {
+    fprintf(stderr, "ERROR: /outer still exists after rmdir\n");
+    error_count++;
+  }
+  }
+
+
+  /* List a directory three entries at a time: the cursor must resume
+   * where the last batch stopped, with the attributes of every entry.
+   */
+  {
+  char data[200];
+  char path[64];
+  sfs_dirent_t ents[3];
+  int seen[11];
+  int cursor = 0;
+  int batches = 0;
+
+  fill_pattern(data, sizeof(data), 0, 80);
+  sfs_mkdir("/listed");
+  sfs_mkdir("/listed/sub");
+  for (i = 0; i < 10; i++) {
+    sprintf(path, "/listed/f%d", i);
+    fds[0] = sfs_fopen(path);
+    error_count += write_at(fds[0], 0, data, i * 13 + 1);
+    sfs_fclose(fds[0]);
+    seen[i] = 0;
+  }
+  seen[10] = 0;
+  mksfs(0);
+
+  while ((tmp = sfs_readdirplus("/listed", &cursor, ents, 3)) > 0) {
+    batches++;
+    for (j = 0; j < tmp; j++) {
+      if (strcmp(ents[j].name, "sub") == 0) {
+        seen[10]++;
+        if (!ents[j].attr.dir) {
+          fprintf(stderr, "ERROR: readdirplus lists sub as a file\n");
+          error_count++;
+        }
+      } else if (sscanf(ents[j].name, "f%d", &k) == 1 && k >= 0 && k < 10) {
+        seen[k]++;
+        if (ents[j].attr.dir || ents[j].attr.size != k * 13 + 1) {
+          fprintf(stderr, "ERROR: readdirplus attributes of %s (%d,%d)\n",
+                  ents[j].name, ents[j].attr.size, k * 13 + 1);
+          error_count++;
+        }
+      } else {
+        fprintf(stderr, "ERROR: readdirplus lists unknown entry %s\n", ents[j].name);
+        error_count++;
+      }
+    }
+  }
+  if (tmp != 0 || batches != 4) {
+    fprintf(stderr, "ERROR: readdirplus ended with %d after %d batches\n", tmp, batches);
+    error_count++;
+  }
+  for (i = 0; i < 11; i++) {
+    if (seen[i] != 1) {
+      fprintf(stderr, "ERROR: readdirplus listed entry %d %d times\n", i, seen[i]);
+      error_count++;
+    }
+  }
+
+  for (i = 0; i < 10; i++) {
+    sprintf(path, "/listed/f%d", i);
+    sfs_remove(path);
+  }
+  sfs_rmdir("/listed/sub");
+  sfs_rmdir("/listed");
+  }
+
+  /* Lazy mount: a clean unmount leaves the free counts in the super block,
+   * and the next mount trusts them and reads the tables only when they are
+   * used. An image copied while in use is not clean, and its mount falls
+   * back to checking the whole volume.
+   */
+  {
+  char data[5000];
+  superblock_t sb, sb2;
+  long checks;
+
+  fill_pattern(data, sizeof(data), 0, 110);
+  fds[0] = sfs_fopen("/lazy");
+  error_count += write_at(fds[0], 0, data, 5000);
+  sfs_fclose(fds[0]);
+  sfs_unmount();
+  error_count += read_superblock(DEFAULT_DISK_FILE, &sb);
+  if (sb.state != SFS_STATE_CLEAN) {
+    fprintf(stderr, "ERROR: the image is not clean after an unmount\n");
+    error_count++;
+  }
+
+  checks = mount_checks();
+  mksfs(0);
+  if (mount_checks() != checks) {
+    fprintf(stderr, "ERROR: a clean image was checked on mount\n");
+    error_count++;
+  }
+  error_count += check_file("/lazy", data, 5000);
+  fds[0] = sfs_fopen("/lazy.tmp");
+  error_count += write_at(fds[0], 0, data, 5000);
+  sfs_fclose(fds[0]);
+  sfs_remove("/lazy.tmp");
+  sfs_unmount();
+  error_count += read_superblock(DEFAULT_DISK_FILE, &sb2);
+  if (sb2.state != SFS_STATE_CLEAN || sb2.free_blocks != sb.free_blocks
+      || sb2.free_inodes != sb.free_inodes) {
+    fprintf(stderr, "ERROR: free counts after a lazy mount (%d,%d) (%d,%d)\n",
+            (int) sb2.free_blocks, (int) sb2.free_inodes,
+            (int) sb.free_blocks, (int) sb.free_inodes);
+    error_count++;
+  }
+
+  /* the copy is taken while the volume is in use, with its data synced */
+  mksfs(0);
+  fill_pattern(data, sizeof(data), 0, 111);
+  fds[0] = sfs_fopen("/lazy");
+  error_count += write_at(fds[0], 0, data, 5000);
+  sfs_fsync(fds[0]);
+  error_count += copy_image(DEFAULT_DISK_FILE, "sfs_unclean.disk");
+  sfs_fclose(fds[0]);
+  error_count += read_superblock("sfs_unclean.disk", &sb2);
+  if (sb2.state == SFS_STATE_CLEAN) {
+    fprintf(stderr, "ERROR: the image is clean while in use\n");
+    error_count++;
+  }
+
+  sfs_set_image("sfs_unclean.disk");
+  checks = mount_checks();
+  mksfs(0);
+  if (mount_checks() != checks + 1) {
+    fprintf(stderr, "ERROR: an unclean image was not checked on mount\n");
+    error_count++;
+  }
+  error_count += check_file("/lazy", data, 5000);
+  sfs_unmount();
+  error_count += read_superblock("sfs_unclean.disk", &sb2);
+  if (sb2.state != SFS_STATE_CLEAN || sb2.free_blocks != sb.free_blocks
+      || sb2.free_inodes != sb.free_inodes) {
+    fprintf(stderr, "ERROR: free counts after a full mount (%d,%d) (%d,%d)\n",
+            (int) sb2.free_blocks, (int) sb2.free_inodes,
+            (int) sb.free_blocks, (int) sb.free_inodes);
+    error_count++;
+  }
+  remove("sfs_unclean.disk");
+
+  sfs_set_image(NULL);
+  mksfs(0);
+  sfs_remove("/lazy");
+  }
+
+  /* Two volumes written at once from two threads, next to the default
+   * one: after a remount each image holds its own files only.
+   */
+  {
+  struct volume_job jobs[2] = {
+    { NULL, "sfs_vol_one.disk", 1, 0 },
+    { NULL, "sfs_vol_two.disk", 2, 0 }
+  };
+  pthread_t threads[2];
+  char data[6000];
+
+  fill_pattern(data, sizeof(data), 0, 100);
+  fds[0] = sfs_fopen("/default.vol");
+  error_count += write_at(fds[0], 0, data, 3000);
+  sfs_fclose(fds[0]);
+
+  for (i = 0; i < 2; i++) {
+    jobs[i].vol = sfs_new();
+    if (jobs[i].vol == NULL || pthread_create(&threads[i], NULL, volume_writer, &jobs[i]) != 0) {
+      fprintf(stderr, "ABORT: Cannot start volume %d\n", i);
+      exit(-1);
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    error_count += jobs[i].errors;
+  }
+
+  for (i = 0; i < 2; i++) {
+    sfs_use(jobs[i].vol);
+    mksfs(0);
+    fill_pattern(data, sizeof(data), 0, jobs[i].seed);
+    error_count += check_file("/shared", data, 6000);
+    error_count += check_file(i == 0 ? "/only.one" : "/only.two", data, 500);
+    if (sfs_getfilesize(i == 0 ? "/only.two" : "/only.one") != -1
+        || sfs_getfilesize("/default.vol") != -1) {
+      fprintf(stderr, "ERROR: volume %d holds a file of another volume\n", i);
+      error_count++;
+    }
+    sfs_free(jobs[i].vol);
+    remove(jobs[i].image);
+  }
+
+  sfs_use(NULL);
+  mksfs(0);
+  fill_pattern(data, sizeof(data), 0, 100);
+  error_count += check_file("/default.vol", data, 3000);
+  if (sfs_getfilesize("/shared") != -1) {
+    fprintf(stderr, "ERROR: the default volume holds a file of another volume\n");
+    error_count++;
+  }
+  sfs_remove("/default.vol");
+  }
+
   fprintf(stderr, "Test program exiting with %d errors\n", error_count);
   return (error_count);
 }
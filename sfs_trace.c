@@ -0,0 +1,146 @@
+
+// workload trace of the sfs_* calls
+
+#include "sfs_trace.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* globals */
+static FILE *trace_fp = NULL;
+static uint64_t trace_start_ns;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * @brief Start tracing if the environment asks for it
+ * @retval None
+ */
+static void trace_check_env(void) {
+    const char *path = getenv(SFS_TRACE_ENV);
+    if (path != NULL && path[0] != '\0') {
+        trace_start(path);
+    }
+}
+
+
+
+int trace_start(const char *path) {
+    trace_header_t header;
+    FILE *fp = fopen(path, "wb");
+
+    if (fp == NULL) {
+        printf("SFS > Could not create trace file %s\n", path);
+        return -1;
+    }
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.rec_size = sizeof(trace_rec_t);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp != NULL) {
+        fclose(trace_fp);
+    } else {
+        atexit(trace_stop);
+    }
+    trace_start_ns = stats_now();
+    trace_fp = fp;
+    pthread_mutex_unlock(&trace_lock);
+
+    return 0;
+}
+
+
+
+void trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp != NULL) {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+
+trace_ctx_t trace_begin(stat_op_t op, const char *name, int fd, uint64_t offset, uint32_t length) {
+    trace_ctx_t ctx;
+
+    pthread_once(&trace_env_once, trace_check_env);
+
+    ctx.active = __atomic_load_n(&trace_fp, __ATOMIC_RELAXED) != NULL;
+    if (!ctx.active) {
+        return ctx;
+    }
+
+    ctx.start_ns = stats_now();
+    ctx.name = name;
+    memset(&ctx.rec, 0, sizeof(ctx.rec));
+    ctx.rec.op = (uint8_t) op;
+    ctx.rec.fd = (int16_t) fd;
+    ctx.rec.offset = offset;
+    ctx.rec.length = length;
+
+    return ctx;
+}
+
+
+
+void trace_end(trace_ctx_t *ctx, int ret) {
+    if (!ctx->active) {
+        return;
+    }
+
+    uint64_t now = stats_now();
+    uint64_t latency = now - ctx->start_ns;
+    size_t name_len = ctx->name != NULL ? strlen(ctx->name) : 0;
+    if (name_len > UINT8_MAX) {
+        name_len = UINT8_MAX;
+    }
+
+    ctx->rec.latency_ns = latency > UINT32_MAX ? UINT32_MAX : (uint32_t) latency;
+    ctx->rec.ret = ret;
+    ctx->rec.name_len = (uint8_t) name_len;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp != NULL) {
+        ctx->rec.time_ns = ctx->start_ns > trace_start_ns ? ctx->start_ns - trace_start_ns : 0;
+        fwrite(&ctx->rec, sizeof(ctx->rec), 1, trace_fp);
+        if (name_len > 0) {
+            fwrite(ctx->name, 1, name_len, trace_fp);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+
+int trace_read_header(FILE *fp) {
+    trace_header_t header;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION
+        || header.rec_size != sizeof(trace_rec_t)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int trace_read(FILE *fp, trace_rec_t *rec, char *name) {
+    if (fread(rec, sizeof(*rec), 1, fp) != 1) {
+        return 0;
+    }
+    if (rec->name_len > 0 && fread(name, 1, rec->name_len, fp) != rec->name_len) {
+        return 0;
+    }
+    name[rec->name_len] = '\0';
+    return 1;
+}
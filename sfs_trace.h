@@ -0,0 +1,110 @@
+#ifndef _INCLUDE_SFS_TRACE_H_
+#define _INCLUDE_SFS_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sfs_stats.h"
+
+/* environment variable naming the file to record the trace to */
+#define SFS_TRACE_ENV "SFS_TRACE"
+
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 1
+
+/*
+ * magic        TRACE_MAGIC, not null terminated
+ * version      TRACE_VERSION
+ * rec_size     size of a trace_rec_t
+ */
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+} trace_header_t;
+
+/*
+ * One sfs_* call, followed in the file by name_len bytes of file name.
+ *
+ * time_ns      when the call started, since the trace started
+ * offset       rwptr for fread and fwrite, loc for fseek, fresh for mksfs
+ * length       length for fread and fwrite
+ * latency_ns   how long the call took, saturates at UINT32_MAX
+ * ret          return value of the call
+ * fd           file ID the call worked on, -1 if none
+ * op           stat_op_t of the call
+ * name_len     length of the file name following the record
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t time_ns;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t latency_ns;
+    int32_t ret;
+    int16_t fd;
+    uint8_t op;
+    uint8_t name_len;
+} trace_rec_t;
+
+/*
+ * active   if the call is being recorded
+ * rec      record being filled
+ * name     file name of the call, may be NULL
+ * start_ns when the call started
+ */
+typedef struct {
+    int active;
+    trace_rec_t rec;
+    const char *name;
+    uint64_t start_ns;
+} trace_ctx_t;
+
+/*
+ * @short start recording every sfs_* call to a file
+ * @long Tracing also starts by itself on the first sfs_* call when the
+ *       SFS_TRACE environment variable names a file.
+ *
+ * @param path file to write the trace to
+ * @return 0 on success, -1 if the file cannot be created
+ */
+int trace_start(const char *path);
+
+/*
+ * @short stop recording and close the trace file
+ */
+void trace_stop(void);
+
+/*
+ * @short start recording a call
+ * @param op      which sfs_* call
+ * @param name    file name the call works on, may be NULL
+ * @param fd      file ID the call works on, -1 if none
+ * @param offset  see trace_rec_t
+ * @param length  see trace_rec_t
+ * @return context to hand back to trace_end
+ */
+trace_ctx_t trace_begin(stat_op_t op, const char *name, int fd, uint64_t offset, uint32_t length);
+
+/*
+ * @short finish recording a call and append it to the trace
+ * @param ctx context returned by trace_begin
+ * @param ret return value of the call
+ */
+void trace_end(trace_ctx_t *ctx, int ret);
+
+/*
+ * @short read and check the header of a trace
+ * @param fp trace file
+ * @return 0 if this is a trace this code can read, -1 otherwise
+ */
+int trace_read_header(FILE *fp);
+
+/*
+ * @short read the next record of a trace
+ * @param fp    trace file
+ * @param rec   record read
+ * @param name  buffer of at least 256 bytes for the file name
+ * @return 1 if a record was read, 0 at the end of the trace
+ */
+int trace_read(FILE *fp, trace_rec_t *rec, char *name);
+
+#endif //_INCLUDE_SFS_TRACE_H_